@@ -0,0 +1,66 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/utils/anomaly.h"
+
+/*
+ * Cost of the --alert rules per event on one reader thread, with every rule on: a mix of
+ * modify, close-write, rename, delete and exec events from 64 processes over 1024 paths in 32
+ * directories, and events no rule looks at. The output of the alerts is left out.
+ *   make bench [BENCH_EVENTS=N]
+ */
+
+#define BENCH_EVENTS_DEFAULT 5000000
+#define BENCH_PROCESSES 64
+#define BENCH_PATHS 1024
+#define BENCH_DIRS 32
+
+static long bench_alerts = 0;
+
+static double bench_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_alert(const anomaly_alert_t* alert) {
+    (void)alert;
+    bench_alerts++;
+}
+
+static void bench_run(const char* name, const uint64_t* masks, int mask_count, char paths[][64], const uint64_t* hashes, long count) {
+    char comm[PROC_NAME_LEN] = "worker";
+    bench_alerts = 0;
+    double start = bench_seconds();
+    for (long i = 0; i < count; i++) {
+        int path = (i * 7) & (BENCH_PATHS - 1);
+        anomaly_observe(0, 1000 + (int)(i & (BENCH_PROCESSES - 1)), comm, paths[path], hashes[path], masks[i % mask_count], bench_alert);
+    }
+    double elapsed = bench_seconds() - start;
+    printf("%-28s %10.0f events/s %8.1f ns/event %ld alerts\n", name, count / elapsed, elapsed * 1e9 / count, bench_alerts);
+}
+
+int main(int argc, char* argv[]) {
+    long count = argc > 1 ? atol(argv[1]) : BENCH_EVENTS_DEFAULT;
+    char* rules[] = { "rename:1000/10", "delete:1000/10", "modify-dirs:100/60", "exec-new:60" };
+    static char paths[BENCH_PATHS][64];
+    static uint64_t hashes[BENCH_PATHS];
+    const uint64_t mix[] = { FAN_MODIFY, FAN_MODIFY, FAN_CLOSE_WRITE, FAN_MOVED_FROM, FAN_DELETE, ANOMALY_EXEC_MASK ? ANOMALY_EXEC_MASK : FAN_OPEN, FAN_ACCESS, FAN_OPEN };
+    const uint64_t unwatched[] = { FAN_ACCESS, FAN_OPEN, FAN_CLOSE_NOWRITE };
+
+    if (count <= 0) {
+        fprintf(stderr, "Usage: %s [EVENTS]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < BENCH_PATHS; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "/srv/data/project-%02d/file-%04d.dat", i % BENCH_DIRS, i);
+        hashes[i] = hash_string(paths[i]);
+    }
+    anomaly_init(rules, sizeof(rules) / sizeof(rules[0]));
+    bench_run("alerts (no rule event)", unwatched, sizeof(unwatched) / sizeof(unwatched[0]), paths, hashes, count);
+    bench_run("alerts (event mix)", mix, sizeof(mix) / sizeof(mix[0]), paths, hashes, count);
+    return EXIT_SUCCESS;
+}
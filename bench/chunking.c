@@ -0,0 +1,74 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/utils/chunking.h"
+
+/*
+ * Throughput of the --chunk chunker on one core: the gear rolling hash and the XXH64 of each
+ * chunk, fed in the 1MB pieces a hash worker reads. The manifest and the disk are left out.
+ *   make bench [BENCH_CHUNK_MB=N]
+ */
+
+#define BENCH_CHUNK_MB_DEFAULT 1024
+#define BENCH_DATA_SIZE (64 * 1024 * 1024)
+#define BENCH_PIECE_SIZE (1024 * 1024)
+
+typedef struct {
+    uint64_t chunks;
+    uint64_t hash;                 // Folds the chunk hashes, so the work is not optimized out
+} bench_chunks_t;
+
+static double bench_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_chunk(void* arg, uint64_t offset, uint32_t length, uint64_t hash) {
+    bench_chunks_t* chunks = (bench_chunks_t*)arg;
+    (void)offset;
+    (void)length;
+    chunks->chunks++;
+    chunks->hash ^= hash;
+}
+
+int main(int argc, char* argv[]) {
+    long megabytes = argc > 1 ? atol(argv[1]) : BENCH_CHUNK_MB_DEFAULT;
+    bench_chunks_t chunks = { 0 };
+    chunker_t chunker;
+    unsigned char* data;
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+
+    if (megabytes <= 0) {
+        fprintf(stderr, "Usage: %s [MB]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    data = malloc(BENCH_DATA_SIZE);
+    if (data == NULL) {
+        fprintf(stderr, "Failed to allocate %d bytes\n", BENCH_DATA_SIZE);
+        return EXIT_FAILURE;
+    }
+    // Random bytes, so the cuts fall as they would in compressed or binary files
+    for (size_t i = 0; i < BENCH_DATA_SIZE; i += sizeof(uint64_t)) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        memcpy(data + i, &state, sizeof(state));
+    }
+
+    uint64_t total = (uint64_t)megabytes * 1024 * 1024;
+    chunker_init(&chunker, bench_chunk, &chunks);
+    double start = bench_seconds();
+    for (uint64_t done = 0; done < total; done += BENCH_PIECE_SIZE) {
+        chunker_feed(&chunker, data + done % BENCH_DATA_SIZE, BENCH_PIECE_SIZE);
+    }
+    chunker_finish(&chunker);
+    double elapsed = bench_seconds() - start;
+    printf("%-28s %10.2f GB/s %8.0f bytes/chunk (%016lx)\n", "chunker", total / elapsed / 1e9,
+           (double)total / chunks.chunks, chunks.hash);
+    free(data);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,61 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/utils/output.h"
+
+/*
+ * Throughput of the --format jsonl/csv serializer on one core. Records go through output_event()
+ * and output_flush() into /dev/null, so this is the cost per event without the disk.
+ *   make bench [BENCH_EVENTS=N]
+ */
+
+#define BENCH_EVENTS_DEFAULT 5000000
+
+static double bench_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_run(const char* name, output_format_t format, const event_t* event, long count) {
+    output_init(format, "/dev/null");
+    double start = bench_seconds();
+    for (long i = 0; i < count; i++) {
+        output_event(event);
+    }
+    output_flush();
+    double elapsed = bench_seconds() - start;
+    printf("%-28s %10.0f events/s %8.1f ns/event\n", name, count / elapsed, elapsed * 1e9 / count);
+}
+
+int main(int argc, char* argv[]) {
+    long count = argc > 1 ? atol(argv[1]) : BENCH_EVENTS_DEFAULT;
+    event_t plain = {
+        .group = GROUP_READ_WRITE_EXECUTE,
+        .pid = 48213,
+        .mask = FAN_OPEN | FAN_CLOSE_WRITE,
+        .comm = "python3",
+        .path = "/var/lib/postgresql/16/main/base/16384/2619_fsm",
+    };
+    event_t escaped = {
+        .group = GROUP_CREATE_DELETE_MOVE,
+        .pid = 48213,
+        .mask = FAN_RENAME,
+        .comm = "mv",
+        .path = "/home/user/Documents/Q3 \"final\" == [v2]\\r\xc3\xa9sum\xc3\xa9.txt",
+        .old_path = "/home/user/Documents/draft\tcopy\xff.txt",
+    };
+
+    if (count <= 0) {
+        fprintf(stderr, "Usage: %s [EVENTS]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    bench_run("jsonl", OUTPUT_JSONL, &plain, count);
+    bench_run("jsonl (rename, escapes)", OUTPUT_JSONL, &escaped, count);
+    bench_run("csv", OUTPUT_CSV, &plain, count);
+    bench_run("csv (rename, escapes)", OUTPUT_CSV, &escaped, count);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,149 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/fanotify.h>
+
+#include <filemon_ring.h>
+
+/*
+ * Example consumer of the filemon event ring (filemon --ring NAME).
+ *   make ring-consumer
+ *   build/ring_consumer [-q] [-d MICROSECONDS] NAME
+ * Prints one line per event like filemon does, or with -q only the events and lost events per
+ * second. -d sleeps after every event to play a slow consumer.
+ */
+
+static volatile sig_atomic_t running = 1;
+
+static void stop(int signum) {
+    (void)signum;
+    running = 0;
+}
+
+static void sleep_us(long us) {
+    struct timespec ts = { .tv_sec = us / 1000000, .tv_nsec = (us % 1000000) * 1000 };
+    nanosleep(&ts, NULL);
+}
+
+static void print_record(const filemon_record_t* record) {
+    static const struct {
+        uint64_t mask;
+        const char* name;
+    } flags[] = {
+        {FAN_ACCESS, "FAN_ACCESS"}, {FAN_MODIFY, "FAN_MODIFY"}, {FAN_ATTRIB, "FAN_ATTRIB"},
+        {FAN_CLOSE_WRITE, "FAN_CLOSE_WRITE"}, {FAN_CLOSE_NOWRITE, "FAN_CLOSE_NOWRITE"},
+        {FAN_OPEN, "FAN_OPEN"}, {FAN_OPEN_EXEC, "FAN_OPEN_EXEC"}, {FAN_MOVED_FROM, "FAN_MOVED_FROM"},
+        {FAN_MOVED_TO, "FAN_MOVED_TO"}, {FAN_CREATE, "FAN_CREATE"}, {FAN_DELETE, "FAN_DELETE"},
+        {FAN_DELETE_SELF, "FAN_DELETE_SELF"}, {FAN_MOVE_SELF, "FAN_MOVE_SELF"},
+        #ifdef FAN_RENAME
+        {FAN_RENAME, "FAN_RENAME"},
+        #endif
+        {FAN_OPEN_PERM, "FAN_OPEN_PERM"}, {FAN_ACCESS_PERM, "FAN_ACCESS_PERM"},
+        #ifdef FAN_OPEN_EXEC_PERM
+        {FAN_OPEN_EXEC_PERM, "FAN_OPEN_EXEC_PERM"},
+        #endif
+        {FAN_ONDIR, "FAN_ONDIR"},
+    };
+    char names[512] = "";
+    time_t seconds = record->time_ns / 1000000000ULL;
+    struct tm tm;
+
+    for (size_t i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+        if (record->mask & flags[i].mask) {
+            if (names[0]) {
+                strcat(names, ", ");
+            }
+            strcat(names, flags[i].name);
+        }
+    }
+    localtime_r(&seconds, &tm);
+    if (filemon_record_old_path(record)) {
+        printf("%02d:%02d:%02d.%06lu #%lu %s (%d): %s → %s == [%s]\n", tm.tm_hour, tm.tm_min, tm.tm_sec,
+               (unsigned long)(record->time_ns % 1000000000ULL / 1000), (unsigned long)record->seq,
+               filemon_record_comm(record), record->pid, filemon_record_old_path(record), filemon_record_path(record), names);
+    } else {
+        printf("%02d:%02d:%02d.%06lu #%lu %s (%d): %s == [%s]\n", tm.tm_hour, tm.tm_min, tm.tm_sec,
+               (unsigned long)(record->time_ns % 1000000000ULL / 1000), (unsigned long)record->seq,
+               filemon_record_comm(record), record->pid, filemon_record_path(record), names);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    filemon_ring_consumer_t consumer;
+    const filemon_record_t* record;
+    unsigned long events = 0;
+    unsigned long reported_lost = 0;
+    time_t last_report = time(NULL);
+    long delay_us = 0;
+    int quiet = 0;
+    int idle = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "qd:")) != -1) {
+        switch (opt) {
+            case 'q':
+                quiet = 1;
+                break;
+            case 'd':
+                delay_us = atol(optarg);
+                break;
+            default:
+                optind = argc + 1;
+                break;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-q] [-d MICROSECONDS] NAME\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (filemon_ring_open(&consumer, argv[optind], "ring_consumer") == -1) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    if (consumer.slot == -1) {
+        fprintf(stderr, "No free consumer slot, filemon will not see this consumer\n");
+    }
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    while (running) {
+        record = filemon_ring_next(&consumer);
+        if (record == NULL) {
+            // Nothing new, back off up to 10ms so an idle consumer costs nothing
+            sleep_us(idle < 10 ? 100 : 10000);
+            idle++;
+        } else {
+            idle = 0;
+            // Copy out what is needed before done() says whether it is intact
+            if (quiet) {
+                events += filemon_ring_done(&consumer);
+            } else {
+                print_record(record);
+                if (!filemon_ring_done(&consumer)) {
+                    printf("(overwritten while printed, discard the line above)\n");
+                }
+            }
+            if (delay_us) {
+                sleep_us(delay_us);
+            }
+        }
+        if (time(NULL) != last_report) {
+            if (quiet) {
+                printf("%lu events/s, %lu lost\n", events, (unsigned long)consumer.lost);
+                fflush(stdout);
+            } else if (consumer.lost != reported_lost) {
+                fprintf(stderr, "Lapped by filemon, %lu events lost so far\n", (unsigned long)consumer.lost);
+            }
+            reported_lost = consumer.lost;
+            events = 0;
+            last_report = time(NULL);
+        }
+    }
+    printf("%lu events lost in total\n", (unsigned long)consumer.lost);
+    filemon_ring_close(&consumer);
+    return EXIT_SUCCESS;
+}
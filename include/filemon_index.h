@@ -0,0 +1,237 @@
+#ifndef FILEMON_INDEX_H
+#define FILEMON_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Index of a filemon log (--format jsonl|csv -o OUTPUT --index), and the library to read it.
+ *
+ * The index is written next to the log, OUTPUT.fmi. It is a header followed by blocks, each
+ * appended with a single write and never changed afterwards. A block covers the records filemon
+ * wrote in a span of time and holds:
+ *   - the offset, length and time of each record in the log, in log order,
+ *   - for paths, pids and process names: the sorted keys, each with the list of its records.
+ * A path is keyed by filemon_index_hash() of the path (the old path of a rename too), a process by
+ * the hash of its name and a pid by its value. Hashes can collide, a reader checks the record.
+ * The first and last time of a block are a sparse time index, so a query skips the blocks outside
+ * its range without reading them. Records written after the last block are not indexed yet, a
+ * reader scans the log from filemon_index_block_t.end_offset of the last block. A block that
+ * filemon could not write leaves a gap: a reader scans the log from the end_offset of the previous
+ * block (data_offset for the first) to the first_offset of the next one.
+ *
+ * The layout is versioned by FILEMON_INDEX_VERSION, a reader must check it before reading.
+ */
+
+#define FILEMON_INDEX_MAGIC 0x005845444e494d46ULL   // "FMINDEX"
+#define FILEMON_INDEX_VERSION 1
+#define FILEMON_INDEX_BLOCK_MAGIC 0x4b4c4249        // "IBLK"
+#define FILEMON_INDEX_SUFFIX ".fmi"
+
+#define FILEMON_INDEX_JSONL 1
+#define FILEMON_INDEX_CSV 2
+
+typedef enum {
+    FILEMON_INDEX_PATHS,
+    FILEMON_INDEX_PIDS,
+    FILEMON_INDEX_PROCESSES,
+    FILEMON_INDEX_KINDS
+} filemon_index_kind_t;
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t header_size;               // Offset of the first block
+    uint32_t format;                    // FILEMON_INDEX_JSONL or FILEMON_INDEX_CSV
+    uint32_t reserved;
+    uint64_t data_offset;               // Of the first record in the log, after the CSV header
+    uint64_t created_ns;
+    uint8_t reserved2[24];
+} filemon_index_file_t;
+
+/*
+ * A block is followed by records[records], then for each kind in filemon_index_kind_t order by
+ * keys[kind] filemon_index_key_t and postings[kind] uint32_t, padded to 8 bytes.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t size;                      // Bytes after this header, a multiple of 8
+    uint32_t records;
+    uint32_t reserved;
+    uint32_t keys[FILEMON_INDEX_KINDS];
+    uint32_t postings[FILEMON_INDEX_KINDS];
+    uint64_t first_offset;              // The records are in [first_offset, end_offset) of the log
+    uint64_t end_offset;
+    uint64_t first_ns;                  // Earliest and latest record, CLOCK_REALTIME
+    uint64_t last_ns;
+} filemon_index_block_t;
+
+typedef struct {
+    uint64_t offset;                    // In the log
+    uint32_t length;                    // With the '\n'
+    uint32_t time_ms;                   // After filemon_index_block_t.first_ns
+} filemon_index_record_t;
+
+typedef struct {
+    uint64_t key;
+    uint32_t first;                     // Index of its first record number in the postings
+    uint32_t count;
+} filemon_index_key_t;
+
+_Static_assert(sizeof(filemon_index_file_t) == 64, "filemon_index_file_t layout changed, bump FILEMON_INDEX_VERSION");
+_Static_assert(sizeof(filemon_index_block_t) == 72, "filemon_index_block_t layout changed, bump FILEMON_INDEX_VERSION");
+_Static_assert(sizeof(filemon_index_record_t) == 16, "filemon_index_record_t layout changed, bump FILEMON_INDEX_VERSION");
+_Static_assert(sizeof(filemon_index_key_t) == 16, "filemon_index_key_t layout changed, bump FILEMON_INDEX_VERSION");
+
+typedef struct {
+    const char* map;
+    size_t size;
+    const filemon_index_file_t* file;
+    size_t offset;                      // Of the next block
+} filemon_index_t;
+
+/**
+ * @brief 64-bit FNV-1a hash, the key of paths and process names. filemon keys the index with
+ *        hash_string() of src/utils/wrappers.h, the two must stay the same function.
+ *
+ * @param str A null terminated string.
+ * @return uint64_t
+ */
+static inline uint64_t filemon_index_hash(const char* str) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Bytes of the lists of a kind in a block, padded to 8
+static inline size_t filemon_index_kind_size(uint32_t keys, uint32_t postings) {
+    return keys * sizeof(filemon_index_key_t) + ((postings * sizeof(uint32_t) + 7) & ~(size_t)7);
+}
+
+/**
+ * @brief Maps an index read-only.
+ *
+ * @param index The index.
+ * @param path The index file, the log path with FILEMON_INDEX_SUFFIX appended.
+ * @return int 0 on success, otherwise -1 and errno is set (EPROTO for a file of another version).
+ */
+static inline int filemon_index_open(filemon_index_t* index, const char* path) {
+    struct stat st;
+    void* map;
+    int fd;
+
+    memset(index, 0, sizeof(*index));
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(filemon_index_file_t)) {
+        close(fd);
+        errno = EPROTO;
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    index->map = (const char*)map;
+    index->size = st.st_size;
+    index->file = (const filemon_index_file_t*)map;
+    if (index->file->magic != FILEMON_INDEX_MAGIC || index->file->version != FILEMON_INDEX_VERSION ||
+        index->file->header_size < sizeof(filemon_index_file_t) || index->file->header_size > index->size) {
+        munmap(map, st.st_size);
+        memset(index, 0, sizeof(*index));
+        errno = EPROTO;
+        return -1;
+    }
+    index->offset = index->file->header_size;
+    return 0;
+}
+
+/**
+ * @brief Returns the next block.
+ *
+ * @param index The index.
+ * @return const filemon_index_block_t* The block, or NULL at the end of the file or at a block
+ *         cut short, index->offset is then the end of the last good block.
+ */
+static inline const filemon_index_block_t* filemon_index_next(filemon_index_t* index) {
+    if (index->offset + sizeof(filemon_index_block_t) > index->size) {
+        return NULL;
+    }
+    const filemon_index_block_t* block = (const filemon_index_block_t*)(index->map + index->offset);
+    size_t size = block->records * sizeof(filemon_index_record_t);
+    for (int kind = 0; kind < FILEMON_INDEX_KINDS; kind++) {
+        size += filemon_index_kind_size(block->keys[kind], block->postings[kind]);
+    }
+    if (block->magic != FILEMON_INDEX_BLOCK_MAGIC || block->size != size ||
+        block->size > index->size - index->offset - sizeof(filemon_index_block_t)) {
+        return NULL;
+    }
+    index->offset += sizeof(filemon_index_block_t) + block->size;
+    return block;
+}
+
+static inline const filemon_index_record_t* filemon_index_records(const filemon_index_block_t* block) {
+    return (const filemon_index_record_t*)(block + 1);
+}
+
+/**
+ * @brief Looks up a key in a block.
+ *
+ * @param block The block.
+ * @param kind What the key is.
+ * @param key A filemon_index_hash() or a pid.
+ * @param count Set to the number of records of the key.
+ * @return const uint32_t* The record numbers in log order, NULL if the key has none.
+ */
+static inline const uint32_t* filemon_index_find(const filemon_index_block_t* block, filemon_index_kind_t kind, uint64_t key, uint32_t* count) {
+    const char* p = (const char*)(block + 1) + block->records * sizeof(filemon_index_record_t);
+    for (int k = 0; k < (int)kind; k++) {
+        p += filemon_index_kind_size(block->keys[k], block->postings[k]);
+    }
+    const filemon_index_key_t* keys = (const filemon_index_key_t*)p;
+    const uint32_t* postings = (const uint32_t*)(keys + block->keys[kind]);
+    uint32_t low = 0, high = block->keys[kind];
+
+    *count = 0;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        if (keys[middle].key < key) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low == block->keys[kind] || keys[low].key != key ||
+        keys[low].first > block->postings[kind] || keys[low].count > block->postings[kind] - keys[low].first) {
+        return NULL;
+    }
+    *count = keys[low].count;
+    return postings + keys[low].first;
+}
+
+/**
+ * @brief Unmaps the index.
+ *
+ * @param index The index.
+ */
+static inline void filemon_index_close(filemon_index_t* index) {
+    if (index->map != NULL) {
+        munmap((void*)index->map, index->size);
+    }
+    memset(index, 0, sizeof(*index));
+}
+
+#endif
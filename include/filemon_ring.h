@@ -0,0 +1,256 @@
+#ifndef FILEMON_RING_H
+#define FILEMON_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Shared-memory event ring of filemon (--ring NAME), and the library to read it.
+ *
+ * filemon is the only writer. It appends variable-length records to a power-of-two data area in
+ * /dev/shm/NAME and overwrites the oldest records when the ring is full, so a consumer can never
+ * block it. Every consumer keeps its own read position; any number of them can read the same ring.
+ * Records are read in place: filemon_ring_next() returns a pointer into the shared memory and
+ * filemon_ring_done() then checks that filemon did not overwrite the record in the meantime, the
+ * same way a seqlock reader does. Neither makes a syscall.
+ *
+ * A consumer that falls more than a ring behind loses the records it was lapped on. It notices
+ * from the gap in record sequence numbers (filemon_ring_consumer_t.lost), and filemon notices
+ * from the read position each consumer publishes in its slot of the header, see the ring metrics.
+ *
+ * The layout is versioned by FILEMON_RING_VERSION, a consumer must check it before reading.
+ */
+
+#define FILEMON_RING_MAGIC 0x474e49524d4c4946ULL    // "FILMRING"
+#define FILEMON_RING_VERSION 1
+#define FILEMON_RING_CONSUMERS_MAX 16
+#define FILEMON_RING_NAME_LEN 32
+
+#define FILEMON_RECORD_EVENT 1
+#define FILEMON_RECORD_PAD 2                        // Filler up to the end of the data area
+
+#define FILEMON_GROUP_READ_WRITE_EXECUTE 0
+#define FILEMON_GROUP_CREATE_DELETE_MOVE 1
+
+// Read position published by one consumer
+typedef struct {
+    uint32_t pid;                       // 0 if the slot is free
+    uint32_t reserved;
+    uint64_t position;
+    uint64_t lost;                      // Records the consumer was lapped on
+    char name[FILEMON_RING_NAME_LEN];
+} __attribute__((aligned(64))) filemon_ring_slot_t;
+
+typedef struct {
+    uint64_t magic;                     // Written last, once the header is complete
+    uint32_t version;
+    uint32_t header_size;               // Offset of the data area in the mapping
+    uint64_t capacity;                  // Size of the data area, a power of two
+    uint32_t producer_pid;
+    uint32_t reserved;
+    // Byte positions grow forever, the offset in the data area is position & (capacity - 1)
+    uint64_t head __attribute__((aligned(64)));   // End of the last complete record
+    uint64_t tail;                      // Start of the oldest record that is still intact
+    uint64_t records;                   // Records written since filemon started
+    filemon_ring_slot_t consumers[FILEMON_RING_CONSUMERS_MAX];
+} filemon_ring_header_t;
+
+/*
+ * An event. comm, path and old_path follow the header, each NUL terminated, and the record is
+ * padded to a multiple of 8 bytes.
+ */
+typedef struct {
+    uint32_t size;                      // Whole record, a multiple of 8
+    uint16_t type;                      // FILEMON_RECORD_*
+    uint16_t group;                     // FILEMON_GROUP_*
+    uint64_t seq;                       // Counts from 1, without gaps
+    uint64_t time_ns;                   // CLOCK_REALTIME
+    uint64_t mask;                      // FAN_* event mask
+    int32_t pid;
+    uint16_t comm_len;                  // Lengths without the NUL
+    uint16_t path_len;
+    uint16_t old_path_len;              // 0 unless the event is a FAN_RENAME
+    uint16_t reserved[3];
+} filemon_record_t;
+
+_Static_assert(sizeof(filemon_record_t) == 48, "filemon_record_t layout changed, bump FILEMON_RING_VERSION");
+_Static_assert(sizeof(filemon_ring_slot_t) == 64, "filemon_ring_slot_t layout changed, bump FILEMON_RING_VERSION");
+
+static inline const char* filemon_record_comm(const filemon_record_t* record) {
+    return (const char*)(record + 1);
+}
+
+static inline const char* filemon_record_path(const filemon_record_t* record) {
+    return filemon_record_comm(record) + record->comm_len + 1;
+}
+
+// NULL unless the event is a rename
+static inline const char* filemon_record_old_path(const filemon_record_t* record) {
+    return record->old_path_len ? filemon_record_path(record) + record->path_len + 1 : NULL;
+}
+
+typedef struct {
+    filemon_ring_header_t* header;
+    const char* data;
+    size_t map_size;
+    int slot;                           // Index in header->consumers, -1 if none was free
+    uint64_t position;
+    uint64_t next_seq;                  // 0 until the first record
+    uint64_t lost;
+    const filemon_record_t* current;    // Returned by filemon_ring_next(), not yet done
+} filemon_ring_consumer_t;
+
+/**
+ * @brief Maps the ring of a running filemon and starts reading at its newest record.
+ *
+ * @param consumer The consumer.
+ * @param name The --ring NAME of filemon.
+ * @param consumer_name Shown in the filemon metrics, may be NULL.
+ * @return int 0 on success, otherwise -1 and errno is set (EPROTO for a ring of another version).
+ */
+static inline int filemon_ring_open(filemon_ring_consumer_t* consumer, const char* name, const char* consumer_name) {
+    char path[256] = "/dev/shm/";
+    struct stat st;
+    void* map;
+    int fd;
+
+    memset(consumer, 0, sizeof(*consumer));
+    consumer->slot = -1;
+    strncat(path, name[0] == '/' ? name + 1 : name, sizeof(path) - strlen(path) - 1);
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(filemon_ring_header_t)) {
+        close(fd);
+        errno = EPROTO;
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    consumer->header = (filemon_ring_header_t*)map;
+    consumer->map_size = st.st_size;
+    if (__atomic_load_n(&consumer->header->magic, __ATOMIC_ACQUIRE) != FILEMON_RING_MAGIC ||
+        consumer->header->version != FILEMON_RING_VERSION ||
+        consumer->header->header_size + consumer->header->capacity > consumer->map_size) {
+        munmap(map, consumer->map_size);
+        consumer->header = NULL;
+        errno = EPROTO;
+        return -1;
+    }
+    consumer->data = (const char*)map + consumer->header->header_size;
+    consumer->position = __atomic_load_n(&consumer->header->head, __ATOMIC_ACQUIRE);
+
+    // Without a free slot the consumer still works, filemon just cannot report on it
+    for (int i = 0; i < FILEMON_RING_CONSUMERS_MAX; i++) {
+        filemon_ring_slot_t* slot = &consumer->header->consumers[i];
+        uint32_t expected = 0;
+        if (__atomic_compare_exchange_n(&slot->pid, &expected, (uint32_t)getpid(), 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            memset(slot->name, 0, sizeof(slot->name));
+            strncpy(slot->name, consumer_name ? consumer_name : "", sizeof(slot->name) - 1);
+            __atomic_store_n(&slot->lost, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&slot->position, consumer->position, __ATOMIC_RELEASE);
+            consumer->slot = i;
+            break;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Returns the next record, in place. Use it, then call filemon_ring_done().
+ *
+ * @param consumer The consumer.
+ * @return const filemon_record_t* The record, or NULL if filemon has not written a new one yet.
+ */
+static inline const filemon_record_t* filemon_ring_next(filemon_ring_consumer_t* consumer) {
+    filemon_ring_header_t* header = consumer->header;
+    uint64_t mask = header->capacity - 1;
+
+    while (1) {
+        uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+        if (consumer->position >= head) {
+            return NULL;
+        }
+        const filemon_record_t* record = (const filemon_record_t*)(consumer->data + (consumer->position & mask));
+        uint32_t size = record->size;
+        uint16_t type = record->type;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        uint64_t tail = __atomic_load_n(&header->tail, __ATOMIC_RELAXED);
+        if (consumer->position < tail) {
+            // Lapped, the records up to the tail were overwritten
+            consumer->position = tail;
+            continue;
+        }
+        // A pad is whatever is left at the end of the data area, it can be shorter than a record
+        if (type == FILEMON_RECORD_PAD && size >= 8 && size % 8 == 0 && size <= header->capacity) {
+            consumer->position += size;
+            continue;
+        }
+        if (size < sizeof(filemon_record_t) || size % 8 || size > header->capacity) {
+            // Not a record the producer wrote, never move back over records already read
+            return NULL;
+        }
+        consumer->current = record;
+        return record;
+    }
+}
+
+/**
+ * @brief Finishes the record returned by filemon_ring_next().
+ *
+ * @param consumer The consumer.
+ * @return int 1 if the record stayed intact while it was used, 0 if filemon overwrote it and
+ *             whatever was read from it must be thrown away.
+ */
+static inline int filemon_ring_done(filemon_ring_consumer_t* consumer) {
+    const filemon_record_t* record = consumer->current;
+    uint64_t seq = record->seq;
+    uint32_t size = record->size;
+    int intact;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    intact = consumer->position >= __atomic_load_n(&consumer->header->tail, __ATOMIC_RELAXED);
+    consumer->current = NULL;
+    if (!intact) {
+        return 0;
+    }
+    if (consumer->next_seq != 0 && seq > consumer->next_seq) {
+        consumer->lost += seq - consumer->next_seq;
+    }
+    consumer->next_seq = seq + 1;
+    consumer->position += size;
+    if (consumer->slot != -1) {
+        filemon_ring_slot_t* slot = &consumer->header->consumers[consumer->slot];
+        __atomic_store_n(&slot->lost, consumer->lost, __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->position, consumer->position, __ATOMIC_RELAXED);
+    }
+    return 1;
+}
+
+/**
+ * @brief Gives up the consumer slot and unmaps the ring.
+ *
+ * @param consumer The consumer.
+ */
+static inline void filemon_ring_close(filemon_ring_consumer_t* consumer) {
+    if (consumer->header == NULL) {
+        return;
+    }
+    if (consumer->slot != -1) {
+        __atomic_store_n(&consumer->header->consumers[consumer->slot].pid, 0, __ATOMIC_RELEASE);
+    }
+    munmap(consumer->header, consumer->map_size);
+    consumer->header = NULL;
+}
+
+#endif
@@ -0,0 +1,231 @@
+#ifndef FILEMON_ROLLUP_H
+#define FILEMON_ROLLUP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/fanotify.h>
+
+/*
+ * Per-minute rollup store of filemon (--rollup DIR), and the library to read it.
+ *
+ * Events are counted per (directory, process name, event type, minute) and appended to one file
+ * per UTC day, DIR/YYYY-MM-DD.fmr. A file is a header followed by blocks, each written with a
+ * single append and never changed afterwards:
+ *   - a strings block adds directory and process names to the dictionary of the file, their ids
+ *     count up from 0 in the order they appear in the file,
+ *   - a records block holds the counts of one minute, one record per key, with string ids.
+ * A name is stored once per day however often it is counted, so a busy minute costs 16 bytes per
+ * key instead of a text line per event. The blocks are 8-byte aligned and can be read in place
+ * from a read-only mapping; a block cut short by a crash ends the file for readers and is cut off
+ * by filemon when it opens the file again.
+ *
+ * The layout is versioned by FILEMON_ROLLUP_VERSION, a reader must check it before reading.
+ */
+
+#define FILEMON_ROLLUP_MAGIC 0x50554c4c4f524d46ULL  // "FMROLLUP"
+#define FILEMON_ROLLUP_VERSION 1
+#define FILEMON_ROLLUP_BLOCK_MAGIC 0x4b4c4252        // "RBLK"
+#define FILEMON_ROLLUP_SUFFIX ".fmr"
+
+#define FILEMON_ROLLUP_STRINGS 1
+#define FILEMON_ROLLUP_RECORDS 2
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t header_size;               // Offset of the first block
+    int64_t day;                        // Days since 1970-01-01 UTC
+    uint64_t created_ns;
+    uint8_t reserved[32];
+} filemon_rollup_file_t;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t type;                      // FILEMON_ROLLUP_STRINGS or FILEMON_ROLLUP_RECORDS
+    uint16_t minute;                    // Of the day, records blocks only
+    uint32_t count;                     // Strings or records in the block
+    uint32_t size;                      // Bytes after this header, a multiple of 8
+} filemon_rollup_block_t;
+
+// Strings are stored as a uint16_t length, the bytes and a NUL
+typedef struct {
+    uint32_t directory;                 // String ids
+    uint32_t process;
+    uint32_t count;
+    uint8_t type;                       // Bit number of the FAN_* event in the mask
+    uint8_t reserved[3];
+} filemon_rollup_record_t;
+
+_Static_assert(sizeof(filemon_rollup_file_t) == 64, "filemon_rollup_file_t layout changed, bump FILEMON_ROLLUP_VERSION");
+_Static_assert(sizeof(filemon_rollup_block_t) == 16, "filemon_rollup_block_t layout changed, bump FILEMON_ROLLUP_VERSION");
+_Static_assert(sizeof(filemon_rollup_record_t) == 16, "filemon_rollup_record_t layout changed, bump FILEMON_ROLLUP_VERSION");
+
+typedef struct {
+    const char* map;
+    size_t size;
+    const filemon_rollup_file_t* file;
+    size_t offset;                      // Of the next block
+    const char** strings;               // By id, pointing into the mapping
+    uint32_t string_count;
+    uint32_t string_capacity;
+} filemon_rollup_segment_t;
+
+/**
+ * @brief Name of an event type, e.g. "FAN_OPEN".
+ *
+ * @param type filemon_rollup_record_t.type.
+ * @return const char* The name, or NULL for a bit filemon does not report.
+ */
+static inline const char* filemon_rollup_type_name(int type) {
+    static const struct {
+        uint64_t mask;
+        const char* name;
+    } names[] = {
+        {FAN_ACCESS, "FAN_ACCESS"}, {FAN_MODIFY, "FAN_MODIFY"}, {FAN_ATTRIB, "FAN_ATTRIB"},
+        {FAN_CLOSE_WRITE, "FAN_CLOSE_WRITE"}, {FAN_CLOSE_NOWRITE, "FAN_CLOSE_NOWRITE"}, {FAN_OPEN, "FAN_OPEN"},
+        {FAN_MOVED_FROM, "FAN_MOVED_FROM"}, {FAN_MOVED_TO, "FAN_MOVED_TO"}, {FAN_CREATE, "FAN_CREATE"},
+        {FAN_DELETE, "FAN_DELETE"}, {FAN_DELETE_SELF, "FAN_DELETE_SELF"}, {FAN_MOVE_SELF, "FAN_MOVE_SELF"},
+        {FAN_OPEN_EXEC, "FAN_OPEN_EXEC"}, {FAN_OPEN_PERM, "FAN_OPEN_PERM"}, {FAN_ACCESS_PERM, "FAN_ACCESS_PERM"},
+        #ifdef FAN_OPEN_EXEC_PERM
+        {FAN_OPEN_EXEC_PERM, "FAN_OPEN_EXEC_PERM"},
+        #endif
+        #ifdef FAN_RENAME
+        {FAN_RENAME, "FAN_RENAME"},
+        #endif
+    };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (names[i].mask == 1ULL << type) {
+            return names[i].name;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Maps a day file read-only.
+ *
+ * @param segment The segment.
+ * @param path The file.
+ * @return int 0 on success, otherwise -1 and errno is set (EPROTO for a file of another version).
+ */
+static inline int filemon_rollup_open(filemon_rollup_segment_t* segment, const char* path) {
+    struct stat st;
+    void* map;
+    int fd;
+
+    memset(segment, 0, sizeof(*segment));
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(filemon_rollup_file_t)) {
+        close(fd);
+        errno = EPROTO;
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    segment->map = (const char*)map;
+    segment->size = st.st_size;
+    segment->file = (const filemon_rollup_file_t*)map;
+    if (segment->file->magic != FILEMON_ROLLUP_MAGIC || segment->file->version != FILEMON_ROLLUP_VERSION ||
+        segment->file->header_size < sizeof(filemon_rollup_file_t) || segment->file->header_size > segment->size) {
+        munmap(map, st.st_size);
+        memset(segment, 0, sizeof(*segment));
+        errno = EPROTO;
+        return -1;
+    }
+    segment->offset = segment->file->header_size;
+    return 0;
+}
+
+// Adds the strings of a block to the dictionary, 0 if the block is damaged
+static inline int filemon_rollup_add_strings(filemon_rollup_segment_t* segment, const filemon_rollup_block_t* block) {
+    const char* p = (const char*)(block + 1);
+    const char* end = p + block->size;
+
+    for (uint32_t i = 0; i < block->count; i++) {
+        uint16_t len;
+        if (p + sizeof(uint16_t) > end) {
+            return 0;
+        }
+        memcpy(&len, p, sizeof(len));
+        if (p + sizeof(uint16_t) + len + 1 > end || p[sizeof(uint16_t) + len] != '\0') {
+            return 0;
+        }
+        if (segment->string_count == segment->string_capacity) {
+            uint32_t capacity = segment->string_capacity ? segment->string_capacity * 2 : 1024;
+            const char** strings = (const char**)realloc(segment->strings, capacity * sizeof(char*));
+            if (strings == NULL) {
+                return 0;
+            }
+            segment->strings = strings;
+            segment->string_capacity = capacity;
+        }
+        segment->strings[segment->string_count++] = p + sizeof(uint16_t);
+        p += sizeof(uint16_t) + len + 1;
+    }
+    return 1;
+}
+
+/**
+ * @brief Returns the next records block. Strings blocks on the way are added to the dictionary.
+ *
+ * @param segment The segment.
+ * @return const filemon_rollup_block_t* The block, its records follow it, or NULL at the end of
+ *         the file or at a damaged block.
+ */
+static inline const filemon_rollup_block_t* filemon_rollup_next(filemon_rollup_segment_t* segment) {
+    while (segment->offset + sizeof(filemon_rollup_block_t) <= segment->size) {
+        const filemon_rollup_block_t* block = (const filemon_rollup_block_t*)(segment->map + segment->offset);
+        if (block->magic != FILEMON_ROLLUP_BLOCK_MAGIC || block->size % 8 ||
+            block->size > segment->size - segment->offset - sizeof(filemon_rollup_block_t)) {
+            return NULL;
+        }
+        if (block->type == FILEMON_ROLLUP_RECORDS && (uint64_t)block->count * sizeof(filemon_rollup_record_t) > block->size) {
+            return NULL;
+        }
+        if (block->type == FILEMON_ROLLUP_STRINGS && !filemon_rollup_add_strings(segment, block)) {
+            return NULL;
+        }
+        segment->offset += sizeof(filemon_rollup_block_t) + block->size;
+        if (block->type == FILEMON_ROLLUP_RECORDS) {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+static inline const filemon_rollup_record_t* filemon_rollup_records(const filemon_rollup_block_t* block) {
+    return (const filemon_rollup_record_t*)(block + 1);
+}
+
+// A string id of a record, "?" if the file does not define it
+static inline const char* filemon_rollup_string(const filemon_rollup_segment_t* segment, uint32_t id) {
+    return id < segment->string_count ? segment->strings[id] : "?";
+}
+
+/**
+ * @brief Unmaps the file.
+ *
+ * @param segment The segment.
+ */
+static inline void filemon_rollup_close(filemon_rollup_segment_t* segment) {
+    if (segment->map != NULL) {
+        munmap((void*)segment->map, segment->size);
+    }
+    free(segment->strings);
+    memset(segment, 0, sizeof(*segment));
+}
+
+#endif
@@ -0,0 +1,243 @@
+#ifndef FILEMON_STATS_H
+#define FILEMON_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/fanotify.h>
+
+/*
+ * Live statistics table of filemon (--stats NAME), and the library to read it.
+ *
+ * /dev/shm/NAME holds two fixed-size tables, one entry per path and one per process, with event
+ * counters by type and the time of the last event. filemon updates them for every event it
+ * emits. When a table is full an entry that had no event since the clock hand last passed it is
+ * reused (clock eviction), so the size never changes. Keys are identified by a 64-bit hash of the full path or
+ * of pid and comm, the stored name is only for display and keeps the tail of a long path.
+ *
+ * Each entry, and the header totals, is protected by a seqlock: the writer makes seq odd, changes
+ * the entry and makes seq even again. A reader copies the entry and retries if seq was odd or
+ * changed meanwhile. Readers map the file read-only and never write to it, so any number of them
+ * can read at any rate without filemon noticing.
+ *
+ * The layout is versioned by FILEMON_STATS_VERSION, a reader must check it before reading.
+ */
+
+#define FILEMON_STATS_MAGIC 0x5354415453464d46ULL   // "FMFSTATS"
+#define FILEMON_STATS_VERSION 1
+#define FILEMON_STATS_NAME_LEN 240
+#define FILEMON_STATS_SPIN_MAX 1000000
+
+// Flags of an entry
+#define FILEMON_STATS_USED 1
+#define FILEMON_STATS_TRUNCATED 2                   // name is the tail of a longer path
+
+typedef enum {
+    FILEMON_STAT_ACCESS,
+    FILEMON_STAT_MODIFY,
+    FILEMON_STAT_ATTRIB,
+    FILEMON_STAT_OPEN,
+    FILEMON_STAT_OPEN_EXEC,
+    FILEMON_STAT_CLOSE_WRITE,
+    FILEMON_STAT_CLOSE_NOWRITE,
+    FILEMON_STAT_CREATE,
+    FILEMON_STAT_DELETE,
+    FILEMON_STAT_MOVE,
+    FILEMON_STAT_PERMISSION,
+    FILEMON_STATS_COUNTERS
+} filemon_stat_t;
+
+typedef enum {
+    FILEMON_STATS_PATHS,
+    FILEMON_STATS_PROCESSES,
+    FILEMON_STATS_TABLES
+} filemon_stats_table_t;
+
+typedef struct {
+    uint32_t seq;                       // Odd while filemon changes the entry
+    uint32_t flags;                     // FILEMON_STATS_*, 0 for a free entry
+    int32_t pid;                        // Process table only
+    uint32_t reserved;
+    uint64_t hash;
+    uint64_t first_ns;                  // CLOCK_REALTIME of the first and the last event
+    uint64_t last_ns;
+    uint64_t events;                    // An event can count in several counters, or in none
+    uint64_t counters[FILEMON_STATS_COUNTERS];
+    uint64_t reserved2;
+    char name[FILEMON_STATS_NAME_LEN];  // Path, or comm of the process
+} filemon_stats_entry_t;
+
+typedef struct {
+    uint32_t seq;
+    uint32_t reserved;
+    uint64_t events;
+    uint64_t evictions[FILEMON_STATS_TABLES];
+    uint64_t updated_ns;
+} filemon_stats_totals_t;
+
+typedef struct {
+    uint64_t magic;                     // Written last, once the header is complete
+    uint32_t version;
+    uint32_t header_size;               // Offset of the path table in the mapping
+    uint32_t entry_size;
+    uint32_t capacity[FILEMON_STATS_TABLES];    // The process table follows the path table
+    uint32_t producer_pid;
+    uint64_t started_ns;
+    filemon_stats_totals_t totals __attribute__((aligned(64)));
+} filemon_stats_header_t;
+
+_Static_assert(sizeof(filemon_stats_entry_t) == 384, "filemon_stats_entry_t layout changed, bump FILEMON_STATS_VERSION");
+
+// Event types behind each counter, a mask counts in every counter it has a bit of
+static const uint64_t filemon_stat_masks[FILEMON_STATS_COUNTERS] = {
+    [FILEMON_STAT_ACCESS]        = FAN_ACCESS,
+    [FILEMON_STAT_MODIFY]        = FAN_MODIFY,
+    [FILEMON_STAT_ATTRIB]        = FAN_ATTRIB,
+    [FILEMON_STAT_OPEN]          = FAN_OPEN,
+    [FILEMON_STAT_OPEN_EXEC]     = FAN_OPEN_EXEC,
+    [FILEMON_STAT_CLOSE_WRITE]   = FAN_CLOSE_WRITE,
+    [FILEMON_STAT_CLOSE_NOWRITE] = FAN_CLOSE_NOWRITE,
+    [FILEMON_STAT_CREATE]        = FAN_CREATE,
+    [FILEMON_STAT_DELETE]        = FAN_DELETE | FAN_DELETE_SELF,
+    #ifdef FAN_RENAME
+    [FILEMON_STAT_MOVE]          = FAN_MOVED_FROM | FAN_MOVED_TO | FAN_MOVE_SELF | FAN_RENAME,
+    #else
+    [FILEMON_STAT_MOVE]          = FAN_MOVED_FROM | FAN_MOVED_TO | FAN_MOVE_SELF,
+    #endif
+    #ifdef FAN_OPEN_EXEC_PERM
+    [FILEMON_STAT_PERMISSION]    = FAN_OPEN_PERM | FAN_ACCESS_PERM | FAN_OPEN_EXEC_PERM,
+    #else
+    [FILEMON_STAT_PERMISSION]    = FAN_OPEN_PERM | FAN_ACCESS_PERM,
+    #endif
+};
+
+static const char* const filemon_stat_names[FILEMON_STATS_COUNTERS] = {
+    [FILEMON_STAT_ACCESS]        = "access",
+    [FILEMON_STAT_MODIFY]        = "modify",
+    [FILEMON_STAT_ATTRIB]        = "attrib",
+    [FILEMON_STAT_OPEN]          = "open",
+    [FILEMON_STAT_OPEN_EXEC]     = "exec",
+    [FILEMON_STAT_CLOSE_WRITE]   = "close_write",
+    [FILEMON_STAT_CLOSE_NOWRITE] = "close_nowrite",
+    [FILEMON_STAT_CREATE]        = "create",
+    [FILEMON_STAT_DELETE]        = "delete",
+    [FILEMON_STAT_MOVE]          = "move",
+    [FILEMON_STAT_PERMISSION]    = "permission",
+};
+
+typedef struct {
+    const filemon_stats_header_t* header;
+    size_t map_size;
+} filemon_stats_reader_t;
+
+/**
+ * @brief Maps the statistics table of a running filemon, read-only.
+ *
+ * @param reader The reader.
+ * @param name The --stats NAME of filemon.
+ * @return int 0 on success, otherwise -1 and errno is set (EPROTO for a table of another version).
+ */
+static inline int filemon_stats_open(filemon_stats_reader_t* reader, const char* name) {
+    char path[256] = "/dev/shm/";
+    const filemon_stats_header_t* header;
+    struct stat st;
+    void* map;
+    int fd;
+
+    reader->header = NULL;
+    strncat(path, name[0] == '/' ? name + 1 : name, sizeof(path) - strlen(path) - 1);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(filemon_stats_header_t)) {
+        close(fd);
+        errno = EPROTO;
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    header = (const filemon_stats_header_t*)map;
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != FILEMON_STATS_MAGIC ||
+        header->version != FILEMON_STATS_VERSION || header->entry_size != sizeof(filemon_stats_entry_t) ||
+        header->header_size + (size_t)header->entry_size * (header->capacity[0] + header->capacity[1]) > (size_t)st.st_size) {
+        munmap(map, st.st_size);
+        errno = EPROTO;
+        return -1;
+    }
+    reader->header = header;
+    reader->map_size = st.st_size;
+    return 0;
+}
+
+// Copies size bytes guarded by *seq, retrying until the copy is consistent. Gives up if seq stays
+// odd, which only happens when filemon died in the middle of an update.
+static inline int filemon_stats_copy(const uint32_t* seq, void* out, const void* in, size_t size) {
+    for (int spins = 0; spins < FILEMON_STATS_SPIN_MAX; spins++) {
+        uint32_t before = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            #if defined(__x86_64__) || defined(__i386__)
+            __builtin_ia32_pause();
+            #endif
+            continue;
+        }
+        memcpy(out, in, size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(seq, __ATOMIC_RELAXED) == before) {
+            return 1;
+        }
+    }
+    memset(out, 0, size);
+    return 0;
+}
+
+/**
+ * @brief Copies one entry of a table.
+ *
+ * @param reader The reader.
+ * @param table FILEMON_STATS_PATHS or FILEMON_STATS_PROCESSES.
+ * @param index From 0 to header->capacity[table] - 1.
+ * @param entry Receives a consistent copy of the entry.
+ * @return int 1 if the entry is in use, 0 if it is free (or filemon died while changing it).
+ */
+static inline int filemon_stats_read(const filemon_stats_reader_t* reader, filemon_stats_table_t table, uint32_t index, filemon_stats_entry_t* entry) {
+    const filemon_stats_header_t* header = reader->header;
+    const filemon_stats_entry_t* entries = (const filemon_stats_entry_t*)((const char*)header + header->header_size);
+
+    if (table == FILEMON_STATS_PROCESSES) {
+        entries += header->capacity[FILEMON_STATS_PATHS];
+    }
+    return filemon_stats_copy(&entries[index].seq, entry, &entries[index], sizeof(*entry)) && (entry->flags & FILEMON_STATS_USED);
+}
+
+/**
+ * @brief Copies the totals of the header.
+ *
+ * @param reader The reader.
+ * @param totals Receives a consistent copy of the totals.
+ */
+static inline void filemon_stats_read_totals(const filemon_stats_reader_t* reader, filemon_stats_totals_t* totals) {
+    filemon_stats_copy(&reader->header->totals.seq, totals, &reader->header->totals, sizeof(*totals));
+}
+
+/**
+ * @brief Unmaps the table.
+ *
+ * @param reader The reader.
+ */
+static inline void filemon_stats_close(filemon_stats_reader_t* reader) {
+    if (reader->header != NULL) {
+        munmap((void*)reader->header, reader->map_size);
+        reader->header = NULL;
+    }
+}
+
+#endif
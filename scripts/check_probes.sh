@@ -0,0 +1,33 @@
+#!/bin/bash
+# Checks that every filemon USDT probe is present in the built binary.
+# Usage: scripts/check_probes.sh [BINARY]   (default: build/filemon)
+
+BINARY="${1:-build/filemon}"
+PROBES="batch_read event_accept event_reject perm_response log_write"
+
+if [ ! -f "$BINARY" ]; then
+    echo "[-] Binary not found: $BINARY (run 'make' first)"
+    exit 1
+fi
+
+if ! command -v readelf > /dev/null 2>&1; then
+    echo "[-] readelf is required (binutils)"
+    exit 1
+fi
+
+NOTES=$(readelf -n "$BINARY" 2>/dev/null)
+if ! echo "$NOTES" | grep -q "NT_STAPSDT"; then
+    echo "[-] No USDT probes in $BINARY. Install systemtap-sdt-dev (Debian/Ubuntu) or systemtap-sdt-devel (RHEL/Fedora) and rebuild."
+    exit 1
+fi
+
+MISSING=0
+for probe in $PROBES; do
+    if echo "$NOTES" | grep -A1 "Provider: filemon" | grep -q "Name: $probe$"; then
+        echo "[+] filemon:$probe"
+    else
+        echo "[-] filemon:$probe is missing"
+        MISSING=1
+    fi
+done
+exit $MISSING
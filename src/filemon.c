@@ -14,14 +14,74 @@
 #include "utils/monitor.h"
 #include "utils/wrappers.h"
 #include "utils/logger.h"
+#include "utils/metrics.h"
+#include "utils/summary.h"
+#include "utils/session.h"
+#include "utils/shedding.h"
+#include "utils/process.h"
+#include "utils/descendants.h"
+#include "utils/cgroup.h"
+#include "utils/watchspec.h"
+#include "utils/output.h"
+#include "utils/logindex.h"
+#include "utils/rules.h"
+#include "utils/ring.h"
+#include "utils/stats.h"
+#include "utils/rollup.h"
+#include "utils/pathintern.h"
+#include "utils/contenthash.h"
+#include "utils/policy.h"
+#include "utils/anomaly.h"
+#include "utils/control.h"
+
+// Long options without a short equivalent
+enum {
+    OPT_METRICS = 256,
+    OPT_SUMMARY,
+    OPT_TOP,
+    OPT_SESSIONS,
+    OPT_SESSION_TIMEOUT,
+    OPT_SESSION_MAX,
+    OPT_SHED,
+    OPT_SHED_THRESHOLD,
+    OPT_ACCESS_SAMPLE,
+    OPT_LINEAGE,
+    OPT_PROCESS_TABLE_MAX,
+    OPT_FOLLOW_CHILDREN,
+    OPT_INCLUDE_CGROUP,
+    OPT_EXCLUDE_CGROUP,
+    OPT_SHOW_CGROUP,
+    OPT_CONTROL,
+    OPT_FILTER_CONFIG,
+    OPT_FORMAT,
+    OPT_RING,
+    OPT_RING_SIZE,
+    OPT_STATS,
+    OPT_STATS_MAX,
+    OPT_ROLLUP,
+    OPT_INDEX,
+    OPT_PATH_CACHE,
+    OPT_HASH,
+    OPT_HASH_WORKERS,
+    OPT_HASH_QUEUE,
+    OPT_HASH_MAX_SIZE,
+    OPT_CHUNK,
+    OPT_CHUNK_DIR,
+    OPT_POLICY,
+    OPT_POLICY_BUDGET,
+    OPT_ALERT,
+};
 
 void sigint_handler();
+void sighup_handler();
 void usage();
 
 monitor_box_t* m_box = NULL;
 
 int main(int argc, char* argv[]) {
 
+    uint64_t start_ns = probe_clock_ns();
+
     // Define long options
     struct option long_options[] = {
         {"help", no_argument, 0, 'h'},
@@ -34,38 +94,103 @@ int main(int argc, char* argv[]) {
         {"enclude-pids", required_argument, 0, 'E'},
         {"include-process", required_argument, 0, 'N'},
         {"exclude-process", required_argument, 0, 'X'},
+        {"metrics", required_argument, 0, OPT_METRICS},
+        {"summary", required_argument, 0, OPT_SUMMARY},
+        {"top", required_argument, 0, OPT_TOP},
+        {"sessions", no_argument, 0, OPT_SESSIONS},
+        {"session-timeout", required_argument, 0, OPT_SESSION_TIMEOUT},
+        {"session-max", required_argument, 0, OPT_SESSION_MAX},
+        {"shed", required_argument, 0, OPT_SHED},
+        {"shed-threshold", required_argument, 0, OPT_SHED_THRESHOLD},
+        {"access-sample", required_argument, 0, OPT_ACCESS_SAMPLE},
+        {"lineage", no_argument, 0, OPT_LINEAGE},
+        {"process-table-max", required_argument, 0, OPT_PROCESS_TABLE_MAX},
+        {"follow-children", no_argument, 0, OPT_FOLLOW_CHILDREN},
+        {"include-cgroup", required_argument, 0, OPT_INCLUDE_CGROUP},
+        {"exclude-cgroup", required_argument, 0, OPT_EXCLUDE_CGROUP},
+        {"show-cgroup", no_argument, 0, OPT_SHOW_CGROUP},
+        {"watch", required_argument, 0, 'W'},
+        {"control", required_argument, 0, OPT_CONTROL},
+        {"filter-config", required_argument, 0, OPT_FILTER_CONFIG},
+        {"format", required_argument, 0, OPT_FORMAT},
+        {"ring", required_argument, 0, OPT_RING},
+        {"ring-size", required_argument, 0, OPT_RING_SIZE},
+        {"stats", required_argument, 0, OPT_STATS},
+        {"stats-max", required_argument, 0, OPT_STATS_MAX},
+        {"rollup", required_argument, 0, OPT_ROLLUP},
+        {"index", no_argument, 0, OPT_INDEX},
+        {"path-cache", required_argument, 0, OPT_PATH_CACHE},
+        {"hash", no_argument, 0, OPT_HASH},
+        {"hash-workers", required_argument, 0, OPT_HASH_WORKERS},
+        {"hash-queue", required_argument, 0, OPT_HASH_QUEUE},
+        {"hash-max-size", required_argument, 0, OPT_HASH_MAX_SIZE},
+        {"chunk", required_argument, 0, OPT_CHUNK},
+        {"chunk-dir", required_argument, 0, OPT_CHUNK_DIR},
+        {"policy", required_argument, 0, OPT_POLICY},
+        {"policy-budget", required_argument, 0, OPT_POLICY_BUDGET},
+        {"alert", required_argument, 0, OPT_ALERT},
         {0, 0, 0, 0}
     };
 
     // Arguments Default Values
     int oopts_verbose = 1;
-    char* oopts_include_pattern = NULL;
-    char* oopts_exclude_pattern = NULL;
     char* oopts_output = NULL;
     char* oopts_mount = NULL;
+    char* oopts_metrics = NULL;
+    char* oopts_control = NULL;
+    char* oopts_filter_config = NULL;
+    int oopts_format = OUTPUT_TEXT;
+    char* oopts_ring = NULL;
+    int oopts_ring_size = RING_SIZE_DEFAULT;
+    char* oopts_stats = NULL;
+    int oopts_stats_max = STATS_PATHS_DEFAULT;
+    char* oopts_rollup = NULL;
+    int oopts_index = 0;
+    int oopts_path_cache = PATH_INTERN_SIZE_DEFAULT;
+    int oopts_hash = 0;
+    int oopts_hash_workers = HASH_WORKERS_DEFAULT;
+    int oopts_hash_queue = HASH_QUEUE_DEFAULT;
+    int oopts_hash_max_size = HASH_MAX_SIZE_DEFAULT;
+    char* oopts_chunk = NULL;
+    char* oopts_chunk_dir = NULL;
+    char* oopts_policy = NULL;
+    int oopts_policy_budget = POLICY_BUDGET_DEFAULT;
+    char* oopts_alerts[ANOMALY_RULES_MAX];
+    int oopts_alert_count = 0;
+    int oopts_summary = 0;
+    int oopts_top = SUMMARY_TOP_DEFAULT;
+    int oopts_sessions = 0;
+    int oopts_session_timeout = SESSION_TIMEOUT_DEFAULT;
+    int oopts_session_max = SESSION_MAX_DEFAULT;
+    int oopts_shed = 0;
+    int oopts_shed_threshold = SHED_THRESHOLD_DEFAULT;
+    int oopts_access_sample = SHED_ACCESS_SAMPLE_DEFAULT;
+    int oopts_lineage = 0;
+    int oopts_process_table_max = PROCTABLE_MAX_DEFAULT;
+    int oopts_follow_children = 0;
+    int oopts_show_cgroup = 0;
     
-    int oopts_include_pids[FILTER_MAX];
-    memset(oopts_include_pids, 0, sizeof(oopts_include_pids));
-    
-    int oopts_exclude_pids[FILTER_MAX];
-    memset(oopts_exclude_pids, 0, sizeof(oopts_exclude_pids));
-    
-    char** oopts_include_process = malloc(FILTER_MAX * sizeof(char *));
-    for (int i = 0; i < FILTER_MAX; i++) {
-        oopts_include_process[i] = NULL;
-    }
-    char** oopts_exclude_process = malloc(FILTER_MAX * sizeof(char *));
-    for (int i = 0; i < FILTER_MAX; i++) {
-        oopts_exclude_process[i] = NULL;
+    filter_options_t* oopts_filters = calloc(1, sizeof(filter_options_t));
+    if (oopts_filters == NULL) {
+        log_message(ERROR, 1, "Unable to malloc for filter options\n");
+        exit(EXIT_FAILURE);
     }
     
-    char *posarg_directory = NULL;
+    char* oopts_include_cgroup[CGROUP_FILTER_MAX + 1] = { NULL };
+    char* oopts_exclude_cgroup[CGROUP_FILTER_MAX + 1] = { NULL };
+
+    char* oopts_watch[WATCH_ROOTS_MAX];
+    int oopts_watch_count = 0;
+    
+    char **posarg_directories = NULL;
+    int posarg_directory_count = 0;
 
     int opt;
     int option_index = 0;
+    char error[PATH_MAX + 256];
     char* token;
     int i = 0;
-    while ((opt = getopt_long(argc, argv, "hvi:e:o:m:I:E:N:X:", long_options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "hvi:e:o:m:I:E:N:X:W:", long_options, &option_index)) != -1) {
         switch (opt) {
             case 'h':
                 usage();
@@ -74,136 +199,294 @@ int main(int argc, char* argv[]) {
             case 'v':
                 oopts_verbose = 2; 
                 break;
-            case 'i':
-                if (oopts_exclude_pattern){
-                    log_message(ERROR, 1, "-%c option: Cannot be used with -e option at the same time.\n", opt);
+            case 'o':
+                if (oopts_output) {
+                    log_message(ERROR, 1, "-%c option: Cannot be used more than once.\n", opt);
                     exit(EXIT_FAILURE);
                 }
-                if (oopts_include_pattern){
+                oopts_output = optarg;
+                break;
+            case 'm':
+                if (oopts_mount) {
                     log_message(ERROR, 1, "-%c option: Cannot be used more than once.\n", opt);
                     exit(EXIT_FAILURE);
                 }
-                oopts_include_pattern = optarg;
+                oopts_mount = optarg;
                 break;
+            case 'i':
             case 'e':
-                if (oopts_include_pattern){
-                    log_message(ERROR, 1, "-%c option: Cannot be used with -i option at the same time.\n", opt);
+            case 'I':
+            case 'E':
+            case 'N':
+            case 'X':
+                if (!parse_filter_option(opt, optarg, oopts_filters, error, sizeof(error))) {
+                    log_message(ERROR, 1, "%s\n", error);
                     exit(EXIT_FAILURE);
                 }
-                if (oopts_exclude_pattern){
-                    log_message(ERROR, 1, "-%c option: Cannot be used more than once.\n", opt);
+                break;
+            case 'W':
+                if (oopts_watch_count >= WATCH_ROOTS_MAX) {
+                    log_message(ERROR, 1, "-%c option: Cannot be used more than %d times.\n", opt, WATCH_ROOTS_MAX);
                     exit(EXIT_FAILURE);
                 }
-                oopts_exclude_pattern = optarg;
+                oopts_watch[oopts_watch_count++] = optarg;
                 break;
-            case 'o':
-                if (oopts_output) {
-                    log_message(ERROR, 1, "-%c option: Cannot be used more than once.\n", opt);
+            case OPT_METRICS:
+                if (oopts_metrics) {
+                    log_message(ERROR, 1, "--metrics option: Cannot be used more than once.\n");
                     exit(EXIT_FAILURE);
                 }
-                oopts_output = optarg;
+                oopts_metrics = optarg;
                 break;
-            case 'm':
-                if (oopts_mount) {
-                    log_message(ERROR, 1, "-%c option: Cannot be used more than once.\n", opt);
+            case OPT_SUMMARY:
+                if (!is_valid_integer(optarg) || atol(optarg) <= 0 || atol(optarg) > SUMMARY_INTERVAL_MAX) {
+                    log_message(ERROR, 1, "--summary option: '%s' is not a number of seconds from 1 to %d.\n", optarg, SUMMARY_INTERVAL_MAX);
                     exit(EXIT_FAILURE);
                 }
-                oopts_mount = optarg;
+                oopts_summary = atoi(optarg);
                 break;
-            case 'I':
-                token = strtok(optarg, " ");
-                i = 0;
-                if (oopts_exclude_pids[0] != 0) {
-                    log_message(ERROR, 1, "-%c option: Cannot be used with -E option at the same time.\n", opt);
+            case OPT_TOP:
+                if (!is_valid_integer(optarg) || atol(optarg) <= 0 || atol(optarg) > SUMMARY_TOP_MAX) {
+                    log_message(ERROR, 1, "--top option: '%s' is not a number of rows from 1 to %d.\n", optarg, SUMMARY_TOP_MAX);
                     exit(EXIT_FAILURE);
-                }             
-                if (oopts_include_pids[0] != 0) {
-                    log_message(ERROR, 1, "-%c option: Cannot be used more than once.\n", opt);
+                }
+                oopts_top = atoi(optarg);
+                break;
+            case OPT_SESSIONS:
+                oopts_sessions = 1;
+                break;
+            case OPT_SESSION_TIMEOUT:
+                if (!is_valid_integer(optarg) || atol(optarg) <= 0 || atol(optarg) > SESSION_TIMEOUT_MAX) {
+                    log_message(ERROR, 1, "--session-timeout option: '%s' is not a number of seconds from 1 to %d.\n", optarg, SESSION_TIMEOUT_MAX);
                     exit(EXIT_FAILURE);
-                } 
-                while (token != NULL) {
-                    if (!is_valid_integer(token)) {
-                        log_message(ERROR, 1, "-%c option: '%s' is not an integer.\n", opt, token);
-                        exit(EXIT_FAILURE);
-                    } 
-                    oopts_include_pids[i] = atoi(token);
-                    i++;
-                    token = strtok(NULL, " ");
                 }
+                oopts_session_timeout = atoi(optarg);
                 break;
-            case 'E':
-                token = strtok(optarg, " ");
-                i = 0;
-                if (oopts_include_pids[0] != 0) {
-                    log_message(ERROR, 1, "-%c option: Cannot be used with -I option at the same time.\n", opt, token);
-                    exit(EXIT_FAILURE);
-                } 
-                if (oopts_exclude_pids[0] != 0) {
-                    log_message(ERROR, 1, "-%c option: Cannot be used more than once.\n", opt, token);
-                    exit(EXIT_FAILURE);
-                } 
-                while (token != NULL) {
-                    if (!is_valid_integer(token)) {
-                        log_message(ERROR, 1, "%c option: '%s' is not an integer.\n", opt, token);
-                        exit(EXIT_FAILURE);
-                    } 
-                    oopts_exclude_pids[i] = atoi(token);
-                    i++;
-                    token = strtok(NULL, " ");
+            case OPT_SESSION_MAX:
+                if (!is_valid_integer(optarg) || atol(optarg) <= 0 || atol(optarg) > SESSION_MAX_MAX) {
+                    log_message(ERROR, 1, "--session-max option: '%s' is not a number of sessions from 1 to %d.\n", optarg, SESSION_MAX_MAX);
+                    exit(EXIT_FAILURE);
                 }
+                oopts_session_max = atoi(optarg);
                 break;
-            case 'N':
+            case OPT_SHED:
+                if (!is_valid_integer(optarg) || atol(optarg) <= 0 || atol(optarg) > SHED_RATE_MAX) {
+                    log_message(ERROR, 1, "--shed option: '%s' is not a number of events per second from 1 to %d.\n", optarg, SHED_RATE_MAX);
+                    exit(EXIT_FAILURE);
+                }
+                oopts_shed = atoi(optarg);
+                break;
+            case OPT_SHED_THRESHOLD:
+                if (!is_valid_integer(optarg) || atol(optarg) <= 0 || atol(optarg) > SHED_THRESHOLD_MAX) {
+                    log_message(ERROR, 1, "--shed-threshold option: '%s' is not a number of events from 1 to %d.\n", optarg, SHED_THRESHOLD_MAX);
+                    exit(EXIT_FAILURE);
+                }
+                oopts_shed_threshold = atoi(optarg);
+                break;
+            case OPT_ACCESS_SAMPLE:
+                if (!is_valid_integer(optarg) || atol(optarg) <= 0 || atol(optarg) > SHED_ACCESS_SAMPLE_MAX) {
+                    log_message(ERROR, 1, "--access-sample option: '%s' is not a number of events from 1 to %d.\n", optarg, SHED_ACCESS_SAMPLE_MAX);
+                    exit(EXIT_FAILURE);
+                }
+                oopts_access_sample = atoi(optarg);
+                break;
+            case OPT_LINEAGE:
+                oopts_lineage = 1;
+                break;
+            case OPT_PROCESS_TABLE_MAX:
+                if (!is_valid_integer(optarg) || atol(optarg) <= 0 || atol(optarg) > PROCTABLE_MAX_MAX) {
+                    log_message(ERROR, 1, "--process-table-max option: '%s' is not a number of processes from 1 to %d.\n", optarg, PROCTABLE_MAX_MAX);
+                    exit(EXIT_FAILURE);
+                }
+                oopts_process_table_max = atoi(optarg);
+                break;
+            case OPT_FOLLOW_CHILDREN:
+                oopts_follow_children = 1;
+                break;
+            case OPT_INCLUDE_CGROUP:
                 token = strtok(optarg, " ");
                 i = 0;
-                if (oopts_exclude_process[0]) {
-                    log_message(ERROR, 1, "-%c option: Cannot be used with -X option at the same time.\n", opt, token);
+                if (oopts_exclude_cgroup[0]) {
+                    log_message(ERROR, 1, "--include-cgroup option: Cannot be used with --exclude-cgroup option at the same time.\n");
                     exit(EXIT_FAILURE);
-                } 
-                if (oopts_include_process[0]) {
-                    log_message(ERROR, 1, "-%c option: Cannot be used more than once.\n", opt, token);
+                }
+                if (oopts_include_cgroup[0]) {
+                    log_message(ERROR, 1, "--include-cgroup option: Cannot be used more than once.\n");
                     exit(EXIT_FAILURE);
-                } 
-                while (token != NULL) {
-                    oopts_include_process[i] = token;
+                }
+                while (token != NULL && i < CGROUP_FILTER_MAX) {
+                    oopts_include_cgroup[i] = token;
                     i++;
                     token = strtok(NULL, " ");
                 }
                 break;
-            case 'X':
+            case OPT_EXCLUDE_CGROUP:
                 token = strtok(optarg, " ");
                 i = 0;
-                if (oopts_include_process[0]) {
-                    log_message(ERROR, 1, "-%c option: Cannot be used with -N option at the same time.\n", opt, token);
+                if (oopts_include_cgroup[0]) {
+                    log_message(ERROR, 1, "--exclude-cgroup option: Cannot be used with --include-cgroup option at the same time.\n");
                     exit(EXIT_FAILURE);
-                } 
-                if (oopts_exclude_process[0]) {
-                    log_message(ERROR, 1, "-%c option: Cannot be used more than once.\n", opt, token);
+                }
+                if (oopts_exclude_cgroup[0]) {
+                    log_message(ERROR, 1, "--exclude-cgroup option: Cannot be used more than once.\n");
                     exit(EXIT_FAILURE);
-                } 
-                while (token != NULL) {
-                    oopts_exclude_process[i] = token;
+                }
+                while (token != NULL && i < CGROUP_FILTER_MAX) {
+                    oopts_exclude_cgroup[i] = token;
                     i++;
                     token = strtok(NULL, " ");
                 }
                 break;
+            case OPT_SHOW_CGROUP:
+                oopts_show_cgroup = 1;
+                break;
+            case OPT_CONTROL:
+                if (oopts_control) {
+                    log_message(ERROR, 1, "--control option: Cannot be used more than once.\n");
+                    exit(EXIT_FAILURE);
+                }
+                oopts_control = optarg;
+                break;
+            case OPT_FILTER_CONFIG:
+                if (oopts_filter_config) {
+                    log_message(ERROR, 1, "--filter-config option: Cannot be used more than once.\n");
+                    exit(EXIT_FAILURE);
+                }
+                oopts_filter_config = optarg;
+                break;
+            case OPT_FORMAT:
+                oopts_format = output_parse_format(optarg);
+                if (oopts_format == -1) {
+                    log_message(ERROR, 1, "--format option: '%s' is not one of text, jsonl or csv.\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_RING:
+                if (oopts_ring) {
+                    log_message(ERROR, 1, "--ring option: Cannot be used more than once.\n");
+                    exit(EXIT_FAILURE);
+                }
+                oopts_ring = optarg;
+                break;
+            case OPT_RING_SIZE:
+                if (!is_valid_integer(optarg) || atoi(optarg) <= 0 || atoi(optarg) > RING_SIZE_MAX) {
+                    log_message(ERROR, 1, "--ring-size option: '%s' is not a number of MB from 1 to %d.\n", optarg, RING_SIZE_MAX);
+                    exit(EXIT_FAILURE);
+                }
+                oopts_ring_size = atoi(optarg);
+                break;
+            case OPT_STATS:
+                if (oopts_stats) {
+                    log_message(ERROR, 1, "--stats option: Cannot be used more than once.\n");
+                    exit(EXIT_FAILURE);
+                }
+                oopts_stats = optarg;
+                break;
+            case OPT_STATS_MAX:
+                if (!is_valid_integer(optarg) || atoi(optarg) <= 0 || atoi(optarg) > STATS_PATHS_MAX) {
+                    log_message(ERROR, 1, "--stats-max option: '%s' is not a number of paths from 1 to %d.\n", optarg, STATS_PATHS_MAX);
+                    exit(EXIT_FAILURE);
+                }
+                oopts_stats_max = atoi(optarg);
+                break;
+            case OPT_ROLLUP:
+                if (oopts_rollup) {
+                    log_message(ERROR, 1, "--rollup option: Cannot be used more than once.\n");
+                    exit(EXIT_FAILURE);
+                }
+                oopts_rollup = optarg;
+                break;
+            case OPT_INDEX:
+                oopts_index = 1;
+                break;
+            case OPT_PATH_CACHE:
+                if (!is_valid_integer(optarg) || atoi(optarg) < 0 || atoi(optarg) > PATH_INTERN_SIZE_MAX) {
+                    log_message(ERROR, 1, "--path-cache option: '%s' is not a number of MB from 0 to %d.\n", optarg, PATH_INTERN_SIZE_MAX);
+                    exit(EXIT_FAILURE);
+                }
+                oopts_path_cache = atoi(optarg);
+                break;
+            case OPT_HASH:
+                oopts_hash = 1;
+                break;
+            case OPT_HASH_WORKERS:
+                if (!is_valid_integer(optarg) || atoi(optarg) <= 0 || atoi(optarg) > HASH_WORKERS_MAX) {
+                    log_message(ERROR, 1, "--hash-workers option: '%s' is not a number of threads from 1 to %d.\n", optarg, HASH_WORKERS_MAX);
+                    exit(EXIT_FAILURE);
+                }
+                oopts_hash_workers = atoi(optarg);
+                break;
+            case OPT_HASH_QUEUE:
+                if (!is_valid_integer(optarg) || atoi(optarg) <= 0 || atoi(optarg) > HASH_QUEUE_MAX) {
+                    log_message(ERROR, 1, "--hash-queue option: '%s' is not a number of files from 1 to %d.\n", optarg, HASH_QUEUE_MAX);
+                    exit(EXIT_FAILURE);
+                }
+                oopts_hash_queue = atoi(optarg);
+                break;
+            case OPT_HASH_MAX_SIZE:
+                if (!is_valid_integer(optarg) || atoi(optarg) <= 0 || atoi(optarg) > HASH_MAX_SIZE_MAX) {
+                    log_message(ERROR, 1, "--hash-max-size option: '%s' is not a number of MB from 1 to %d.\n", optarg, HASH_MAX_SIZE_MAX);
+                    exit(EXIT_FAILURE);
+                }
+                oopts_hash_max_size = atoi(optarg);
+                break;
+            case OPT_CHUNK:
+                if (oopts_chunk) {
+                    log_message(ERROR, 1, "--chunk option: Cannot be used more than once.\n");
+                    exit(EXIT_FAILURE);
+                }
+                oopts_chunk = optarg;
+                break;
+            case OPT_CHUNK_DIR:
+                if (oopts_chunk_dir) {
+                    log_message(ERROR, 1, "--chunk-dir option: Cannot be used more than once.\n");
+                    exit(EXIT_FAILURE);
+                }
+                oopts_chunk_dir = optarg;
+                break;
+            case OPT_POLICY:
+                if (oopts_policy) {
+                    log_message(ERROR, 1, "--policy option: Cannot be used more than once.\n");
+                    exit(EXIT_FAILURE);
+                }
+                oopts_policy = optarg;
+                break;
+            case OPT_POLICY_BUDGET:
+                if (!is_valid_integer(optarg) || atoi(optarg) <= 0 || atoi(optarg) > POLICY_BUDGET_MAX) {
+                    log_message(ERROR, 1, "--policy-budget option: '%s' is not a number of microseconds from 1 to %d.\n", optarg, POLICY_BUDGET_MAX);
+                    exit(EXIT_FAILURE);
+                }
+                oopts_policy_budget = atoi(optarg);
+                break;
+            case OPT_ALERT:
+                if (oopts_alert_count >= ANOMALY_RULES_MAX) {
+                    log_message(ERROR, 1, "--alert option: Cannot be used more than %d times.\n", ANOMALY_RULES_MAX);
+                    exit(EXIT_FAILURE);
+                }
+                oopts_alerts[oopts_alert_count++] = optarg;
+                break;
             default:
                 usage();
                 exit(EXIT_FAILURE);
         }
     }
 
-    // Check if directory is provided
-    if (optind < argc) {
-        posarg_directory = argv[optind];
-    } else {
+    // Check if a directory is provided
+    posarg_directories = argv + optind;
+    posarg_directory_count = argc - optind;
+    if (posarg_directory_count + oopts_watch_count == 0) {
         usage();
         exit(EXIT_FAILURE);
     }
 
-    if (oopts_output)
+    if (oopts_output && oopts_format == OUTPUT_TEXT)
         logger_init(oopts_verbose, oopts_output); 
     else
         logger_init(oopts_verbose, NULL); 
+    // Keep stdout for the records
+    if (oopts_format != OUTPUT_TEXT) {
+        logger_console(stderr);
+    }
 
     if (oopts_output) {
         printf("[+] Starting filemon...\n");
@@ -217,17 +500,137 @@ int main(int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    if (oopts_follow_children && oopts_filters->include_pids[0] == 0) {
+        log_message(ERROR, 1, "--follow-children option: Requires the -I option.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (posarg_directory_count == 0 && (oopts_filters->include_pattern || oopts_filters->exclude_pattern ||
+        oopts_filters->include_pids[0] || oopts_filters->exclude_pids[0] ||
+        oopts_filters->include_process[0] || oopts_filters->exclude_process[0])) {
+        log_message(WARNING, 1, "-i, -e, -I, -E, -N and -X only apply to DIRECTORY arguments, not to -W directories.\n");
+    }
+
+    if (oopts_format != OUTPUT_TEXT && oopts_summary) {
+        log_message(ERROR, 1, "--format option: Cannot be used with --summary option.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (oopts_index && (oopts_format == OUTPUT_TEXT || oopts_output == NULL)) {
+        log_message(ERROR, 1, "--index option: Requires the -o option and --format jsonl or csv.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (oopts_hash && oopts_sessions) {
+        log_message(ERROR, 1, "--hash option: Cannot be used with --sessions option.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (oopts_chunk && oopts_sessions) {
+        log_message(ERROR, 1, "--chunk option: Cannot be used with --sessions option.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (oopts_chunk && oopts_chunk_dir == NULL) {
+        log_message(ERROR, 1, "--chunk option: Requires the --chunk-dir option.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (oopts_mount && posarg_directory_count + oopts_watch_count > 1) {
+        log_message(ERROR, 1, "-m option: Cannot be used with more than one directory.\n");
+        exit(EXIT_FAILURE);
+    }
+
     // Set up signal handler for SIGINT
     if (signal(SIGINT, sigint_handler) == SIG_ERR) {
         log_message(ERROR, 1, "Failed to set up signal handler\n");
         exit(EXIT_FAILURE);
     }
+    // SIGHUP reloads the filter config, without one it still ends filemon
+    if (oopts_filter_config && signal(SIGHUP, sighup_handler) == SIG_ERR) {
+        log_message(ERROR, 1, "Failed to set up signal handler\n");
+        exit(EXIT_FAILURE);
+    }
+
+    metrics_init(oopts_metrics);
+    if (oopts_summary) {
+        summary_init(oopts_summary, oopts_top);
+    }
+    if (oopts_sessions) {
+        sessions_init(oopts_session_max, oopts_session_timeout);
+    }
+    if (oopts_shed) {
+        shedding_init(oopts_shed, oopts_shed_threshold, oopts_access_sample);
+    }
+    if (oopts_lineage) {
+        proctable_init(oopts_process_table_max);
+    }
+    if (oopts_follow_children) {
+        descendants_init(oopts_filters->include_pids);
+    }
+    cgroups_init(oopts_include_cgroup, oopts_exclude_cgroup, oopts_show_cgroup);
+    path_intern_init(oopts_path_cache);
+    policy_init(oopts_policy, oopts_policy_budget);
+    anomaly_init(oopts_alerts, oopts_alert_count);
+    if (oopts_chunk) {
+        chunking_init(oopts_chunk, oopts_chunk_dir);
+    }
+    if (oopts_hash || oopts_chunk) {
+        hashing_init(oopts_hash_workers, oopts_hash_queue, oopts_hash_max_size, oopts_hash);
+    }
+    output_init(oopts_format, oopts_output);
+    logindex_init(oopts_index ? oopts_output : NULL, oopts_format == OUTPUT_CSV ? FILEMON_INDEX_CSV : FILEMON_INDEX_JSONL, g_output.offset);
+    ring_init(oopts_ring, oopts_ring_size);
+    stats_init(oopts_stats, oopts_stats_max);
+    rollup_init(oopts_rollup);
+
+    // Parse -W first, so that the features are probed on the first directory either way
+    char* watch_directories[WATCH_ROOTS_MAX];
+    filter_options_t* watch_options[WATCH_ROOTS_MAX];
+    for (i = 0; i < oopts_watch_count; i++) {
+        char* spec = strdup(oopts_watch[i]);
+        watch_options[i] = malloc(sizeof(filter_options_t));
+        if (spec == NULL || watch_options[i] == NULL) {
+            log_message(ERROR, 1, "Unable to malloc for -W option\n");
+            exit(EXIT_FAILURE);
+        }
+        if (!parse_watch_root(spec, watch_options[i], &watch_directories[i], error, sizeof(error))) {
+            log_message(ERROR, 1, "-W option: %s (\"%s\")\n", error, oopts_watch[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    m_box = init_monitor_box(posarg_directory_count > 0 ? posarg_directories[0] : watch_directories[0]);
+    m_box->start_ns = start_ns;
+
+    // DIRECTORY arguments share the filter options of the command line
+    filters_t* filters = malloc(sizeof(filters_t));
+    if (filters == NULL) {
+        log_message(ERROR, 1, "Unable to malloc for filters\n");
+        exit(EXIT_FAILURE);
+    }
+    init_filters(filters, oopts_filters->include_pids, oopts_filters->exclude_pids,
+                 oopts_filters->include_process, oopts_filters->exclude_process,
+                 oopts_filters->include_pattern, oopts_filters->exclude_pattern);
+    filters->follow_children = oopts_follow_children;
+    for (i = 0; i < posarg_directory_count; i++) {
+        if (add_watch_root(m_box, posarg_directories[i], oopts_mount, filters, NULL, 0) == -1) {
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    m_box = init_monitor_box(posarg_directory, oopts_mount, 
-                            oopts_include_pids, oopts_exclude_pids, 
-                            oopts_include_process, oopts_exclude_process,
-                            oopts_include_pattern, oopts_exclude_pattern);
+    // -W directories only have their own
+    for (i = 0; i < oopts_watch_count; i++) {
+        init_filters(filters, watch_options[i]->include_pids, watch_options[i]->exclude_pids,
+                     watch_options[i]->include_process, watch_options[i]->exclude_process,
+                     watch_options[i]->include_pattern, watch_options[i]->exclude_pattern);
+        if (add_watch_root(m_box, watch_directories[i], oopts_mount, filters, NULL, 0) == -1) {
+            exit(EXIT_FAILURE);
+        }
+        free(watch_options[i]);
+    }
+    free(filters);
+    free(oopts_filters);
+    rules_init(oopts_filter_config, m_box);
     print_box(m_box);    
+    control_init(oopts_control, m_box);
     begin_monitor(m_box);
 
     return 0;
@@ -243,10 +646,24 @@ void sigint_handler() {
         printf("[+] Stopping filemon...\n");
     }
     log_message(INFO, 1, "Stopping filemon...\n");
+    control_stop();
+    hashing_stop();
+    ring_stop();
+    stats_stop();
+    rollup_stop();
+    logindex_stop();
     stop_monitor(m_box);
     exit(EXIT_SUCCESS);
 }
 
+/**
+ * @brief SIGHUP handler, reloads the filter config.
+ * 
+ */
+void sighup_handler() {
+    rules_request_reload();
+}
+
 /**
  * @brief Prints the usage of the program
  * 
@@ -255,17 +672,64 @@ void usage(){
     printf("Usage: filemon [-h] [-v] [-o OUTPUT] [-m MOUNT]\n" 
     "%15s[-i INCLUDE_PATERN | -e EXCLUDE_PATTERN]\n"
     "%15s[-I INCLUDE_PIDS | -E EXCLUDE_PIDS]\n"
-    "%15s[-N INCLUDE_PROCESS | -X EXCLUDE_PROCESS] DIRECTORY\n", "", "", "");
+    "%15s[-N INCLUDE_PROCESS | -X EXCLUDE_PROCESS]\n"
+    "%15s[--metrics ADDRESS] [--summary INTERVAL [--top N]]\n"
+    "%15s[--sessions [--session-timeout SECONDS] [--session-max N]]\n"
+    "%15s[--shed RATE [--shed-threshold EVENTS] [--access-sample N]]\n"
+    "%15s[--lineage [--process-table-max N]] [--follow-children]\n"
+    "%15s[--include-cgroup CGROUPS | --exclude-cgroup CGROUPS] [--show-cgroup]\n"
+    "%15s[--format FORMAT] [--filter-config FILE] [--control SOCKET]\n"
+    "%15s[--ring NAME [--ring-size MB]] [--stats NAME [--stats-max N]]\n"
+    "%15s[--rollup DIRECTORY] [--index] [--path-cache MB]\n"
+    "%15s[--hash [--hash-workers N] [--hash-queue N] [--hash-max-size MB]]\n"
+    "%15s[--chunk PATTERN --chunk-dir DIRECTORY] [--policy FILE [--policy-budget MICROSECONDS]]\n"
+    "%15s[--alert RULE]...\n"
+    "%15s[-W \"DIRECTORY [FILTER OPTIONS]\"]... [DIRECTORY]...\n", "", "", "", "", "", "", "", "", "", "", "", "", "", "", "");
     printf("Options:\n");
     printf("  %-30s %s\n", "-h  | --help", "Show help");
     printf("  %-30s %s\n", "-v  | --verbose", "Enables debug logs.");
     printf("  %-30s %s\n", "-i  | --include-pattern", "Only show events when path matches regex pattern.");
     printf("  %-30s %s\n", "-e  | --exclude-pattern", "Ignore events when path matches regex pattern.");
     printf("  %-30s %s\n", "-o  | --output", "Output to file");
-    printf("  %-30s %s\n", "-m  | --mount", "The mount path. (Use this option to override auto search from fstab)");
+    printf("  %-30s %s\n", "-m  | --mount", "The mount path. (Use this option to override auto search from mountinfo)");
     printf("  %-30s %s\n", "-I  | --include-pids", "Only show events related to these pids. (Eg. -I \"4728 4279\")");
     printf("  %-30s %s\n", "-E  | --exclude-pids", "Ignore events related to these pids. (Eg. -E \"6728 6817\")");
     printf("  %-30s %s\n", "-N  | --include-process", "Only show events related to these process names. (Eg. -N \"python3 systemd\")");
     printf("  %-30s %s\n", "-X  | --exclude-process", "Ignore events related to these process names. (Eg. -X \"python3 systemd\")");
+    printf("  %-30s %s\n", "    | --metrics", "Serve Prometheus metrics on a localhost TCP port or a Unix socket path. (Eg. --metrics 9100)");
+    printf("  %-30s %s\n", "    | --summary", "Print a table of the busiest files, directories and processes every INTERVAL seconds instead of every event.");
+    printf("  %-30s %s\n", "    | --top", "Number of rows per table in summary mode. (Default: 10)");
+    printf("  %-30s %s\n", "    | --sessions", "Collapse open/access/modify/close of a file by a process into one line at close.");
+    printf("  %-30s %s\n", "    | --session-timeout", "Seconds without events before an unclosed session is printed. (Default: 30)");
+    printf("  %-30s %s\n", "    | --session-max", "Maximum number of open sessions kept in memory. (Default: 4096)");
+    printf("  %-30s %s\n", "    | --shed", "Shed read/write/execute events above RATE per second per process when the queue backs up.");
+    printf("  %-30s %s\n", "    | --shed-threshold", "Queued events at which shedding switches on. (Default: 4096)");
+    printf("  %-30s %s\n", "    | --access-sample", "Keep 1 in N FAN_ACCESS events of a process while shedding. (Default: 100)");
+    printf("  %-30s %s\n", "    | --lineage", "Append ppid, uid, exe, cgroup and cmdline of the process to each line.");
+    printf("  %-30s %s\n", "    | --process-table-max", "Maximum number of processes kept for --lineage. (Default: 4096)");
+    printf("  %-30s %s\n", "    | --follow-children", "Also include every process started by the -I PIDs, tracked through the proc connector.");
+    printf("  %-30s %s\n", "    | --include-cgroup", "Include only processes in these cgroups or below, e.g. \"/system.slice/docker.service\".");
+    printf("  %-30s %s\n", "    | --exclude-cgroup", "Exclude processes in these cgroups or below, e.g. \"/kubepods.slice\".");
+    printf("  %-30s %s\n", "    | --show-cgroup", "Append the cgroup, cgroup id and container id of the process to each line.");
+    printf("  %-30s %s\n", "    | --format", "Write events as text, jsonl (one JSON object per line) or csv. (Default: text)");
+    printf("  %-30s %s\n", "    | --filter-config", "Also apply the filter rules of FILE to every directory, reloaded on SIGHUP or when FILE changes.");
+    printf("  %-30s %s\n", "    | --ring", "Also publish every event to the shared-memory ring /dev/shm/NAME, see include/filemon_ring.h.");
+    printf("  %-30s %s\n", "    | --ring-size", "Size of the ring in MB, rounded up to a power of two. (Default: 16)");
+    printf("  %-30s %s\n", "    | --stats", "Keep live per-path and per-process counters in /dev/shm/NAME for filemon-top, see include/filemon_stats.h.");
+    printf("  %-30s %s\n", "    | --stats-max", "Number of paths the --stats table holds, the least active are evicted. (Default: 65536)");
+    printf("  %-30s %s\n", "    | --rollup", "Append event counts per directory, process, type and minute to a file per day in DIRECTORY.");
+    printf("  %-30s %s\n", "    | --index", "Index the -o file of --format jsonl or csv by path, pid, process and time in OUTPUT.fmi for filemon-query.");
+    printf("  %-30s %s\n", "    | --path-cache", "Memory in MB for the paths seen and their filter verdicts, 0 to filter every event from scratch. (Default: 16)");
+    printf("  %-30s %s\n", "    | --hash", "Add the XXH64 hash of the file to close-write and exec events, worked out by background threads.");
+    printf("  %-30s %s\n", "    | --hash-workers", "Threads that hash files. (Default: 2)");
+    printf("  %-30s %s\n", "    | --hash-queue", "Files waiting to be hashed before events go out with hash_skipped=busy. (Default: 256)");
+    printf("  %-30s %s\n", "    | --hash-max-size", "Larger files are not hashed, in MB. (Default: 256)");
+    printf("  %-30s %s\n", "    | --chunk", "Report which byte ranges changed when a file matching regex pattern is closed after writing.");
+    printf("  %-30s %s\n", "    | --chunk-dir", "Directory for the chunk manifests of --chunk, one per file.");
+    printf("  %-30s %s\n", "    | --policy", "Answer permission events with the allow, deny or audit rules of a policy file.");
+    printf("  %-30s %s\n", "    | --policy-budget", "Time for one policy decision before the on-timeout action is taken, in microseconds. (Default: 100)");
+    printf("  %-30s %s\n", "    | --alert", "Raise an alert on rename:N/S, delete:N/S, modify-dirs:N/S (more than N in S seconds by a process) or exec-new:S.");
+    printf("  %-30s %s\n", "    | --control", "Accept add, remove, roots, marks, stats and reload commands on a Unix socket. (Eg. --control /run/filemon.ctl)");
+    printf("  %-30s %s\n", "-W  | --watch", "Also watch DIRECTORY with its own -i/-e/-I/-E/-N/-X filters. (Eg. -W \"/etc -N 'vim nano'\")");
     return;
 } 
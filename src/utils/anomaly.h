@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/fanotify.h>
+#include "wrappers.h"
+#include "logger.h"
+#include "metrics.h"
+
+#ifndef ANOMALY_H
+#define ANOMALY_H
+
+#define ANOMALY_BUCKETS 16             // Per window, a power of two
+#define ANOMALY_PROCESSES 4096         // Per reader thread, a power of two
+#define ANOMALY_DIRS 16                // Directories remembered per process, a power of two
+#define ANOMALY_FRESH_ENTRIES 65536    // A power of two
+#define ANOMALY_WINDOW_MAX 3600        // Seconds
+#define ANOMALY_TABLES 2               // One per reader thread, indexed by event group
+#define ANOMALY_RULES_MAX 8            // --alert options
+
+#ifdef FAN_RENAME
+#define ANOMALY_RENAME_MASK (FAN_RENAME | FAN_MOVED_FROM)
+#define ANOMALY_FRESH_MASK (FAN_CREATE | FAN_MOVED_TO | FAN_RENAME | FAN_CLOSE_WRITE)
+#else
+#define ANOMALY_RENAME_MASK FAN_MOVED_FROM
+#define ANOMALY_FRESH_MASK (FAN_CREATE | FAN_MOVED_TO | FAN_CLOSE_WRITE)
+#endif
+
+#if defined(FAN_OPEN_EXEC_PERM)
+#define ANOMALY_EXEC_MASK (FAN_OPEN_EXEC | FAN_OPEN_EXEC_PERM)
+#elif defined(FAN_OPEN_EXEC)
+#define ANOMALY_EXEC_MASK FAN_OPEN_EXEC
+#else
+#define ANOMALY_EXEC_MASK 0
+#endif
+
+/*
+ * Anomaly alerts (--alert RULE, repeatable), raised as the events go by instead of by a log
+ * reader minutes later:
+ *   rename:N/S       a process renames or moves more than N files within S seconds
+ *   delete:N/S       a process deletes more than N files within S seconds
+ *   modify-dirs:N/S  a process modifies files in more than N directories within S seconds
+ *   exec-new:S       a file is executed less than S seconds after it was created, moved in or written
+ * Each process has a sliding window per rule: a ring of ANOMALY_BUCKETS counters of S/16 seconds
+ * and their total. An event adds to the current bucket, and moving to a later bucket clears the
+ * ones it skips, so an update is O(1) and the window slides in steps of S/16. A process alerts
+ * once per window while it stays above the threshold. Modified directories are counted when a
+ * process was not seen modifying them within the window, in a small direct-mapped set per
+ * process. Processes are kept in a direct-mapped table per reader thread, keyed by PID and
+ * name; a colliding process takes over the entry and starts from zero.
+ *
+ * exec-new remembers the paths of created and written files in a table shared by both threads.
+ * An entry is one 64-bit word, a tag of the path hash and the time, read and written atomically.
+ * Alerts go to the output as records of their own.
+ */
+typedef enum {
+    ANOMALY_RENAME,
+    ANOMALY_DELETE,
+    ANOMALY_MODIFY_DIRS,
+    ANOMALY_EXEC_NEW,
+    ANOMALY_KINDS
+} anomaly_kind_t;
+
+typedef struct {
+    anomaly_kind_t kind;
+    int pid;
+    const char* comm;
+    const char* path;              // Of the event that raised the alert
+    uint32_t count;                // In the window, or the age in seconds of the file for exec-new
+    uint32_t threshold;
+    uint32_t window_s;
+} anomaly_alert_t;
+
+typedef struct {
+    uint64_t tick;                 // Bucket of the last update, in units of the rule's bucket width
+    uint64_t alerted;              // Tick of the last alert + 1, 0 if none
+    uint32_t total;
+    uint32_t buckets[ANOMALY_BUCKETS];
+} anomaly_window_t;
+
+typedef struct {
+    int pid;                       // 0 if the entry is free
+    char comm[PROC_NAME_LEN];
+    anomaly_window_t windows[ANOMALY_EXEC_NEW];
+    uint64_t dirs[ANOMALY_DIRS];   // Directory hash tag | tick of the last modify in it
+} anomaly_process_t;
+
+typedef struct {
+    int enabled;
+    uint64_t mask;                 // Events any rule looks at
+    uint32_t thresholds[ANOMALY_KINDS];      // 0 if the rule is off
+    uint32_t windows_s[ANOMALY_KINDS];
+    uint64_t bucket_ms[ANOMALY_KINDS];
+    anomaly_process_t* tables[ANOMALY_TABLES];
+    uint64_t* fresh;               // Path hash tag | seconds, for exec-new
+} anomaly_t;
+
+typedef void (*anomaly_emit_fn)(const anomaly_alert_t* alert);
+
+static const char* const anomaly_kind_names[ANOMALY_KINDS] = {
+    [ANOMALY_RENAME] = "rename",
+    [ANOMALY_DELETE] = "delete",
+    [ANOMALY_MODIFY_DIRS] = "modify-dirs",
+    [ANOMALY_EXEC_NEW] = "exec-new",
+};
+
+static const metric_t anomaly_metrics[ANOMALY_KINDS] = {
+    [ANOMALY_RENAME] = METRIC_ALERTS_RENAME,
+    [ANOMALY_DELETE] = METRIC_ALERTS_DELETE,
+    [ANOMALY_MODIFY_DIRS] = METRIC_ALERTS_MODIFY_DIRS,
+    [ANOMALY_EXEC_NEW] = METRIC_ALERTS_EXEC_NEW,
+};
+
+void anomaly_init(char** rules, int count);
+void anomaly_observe(int table, int pid, const char* comm, const char* path, uint64_t path_hash, uint64_t mask, anomaly_emit_fn emit);
+const char* anomaly_kind_name(anomaly_kind_t kind);
+
+anomaly_t g_anomaly = { .enabled = 0 };
+
+static inline uint64_t anomaly_clock_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Parses KIND:COUNT/SECONDS, or exec-new:SECONDS
+static int anomaly_parse_rule(char* rule) {
+    char* value = strchr(rule, ':');
+    char* window = NULL;
+    int kind = 0;
+
+    if (value == NULL) {
+        return 0;
+    }
+    *value++ = '\0';
+    while (kind < ANOMALY_KINDS && strcmp(anomaly_kind_names[kind], rule) != 0) {
+        kind++;
+    }
+    if (kind == ANOMALY_KINDS) {
+        return 0;
+    }
+    if (kind != ANOMALY_EXEC_NEW) {
+        window = strchr(value, '/');
+        if (window == NULL) {
+            return 0;
+        }
+        *window++ = '\0';
+        if (!is_valid_integer(value) || atoi(value) <= 0) {
+            return 0;
+        }
+    } else {
+        window = value;
+    }
+    if (!is_valid_integer(window) || atoi(window) <= 0 || atoi(window) > ANOMALY_WINDOW_MAX) {
+        return 0;
+    }
+    g_anomaly.thresholds[kind] = kind == ANOMALY_EXEC_NEW ? 1 : (uint32_t)atoi(value);
+    g_anomaly.windows_s[kind] = atoi(window);
+    g_anomaly.bucket_ms[kind] = (uint64_t)g_anomaly.windows_s[kind] * 1000 / ANOMALY_BUCKETS;
+    return 1;
+}
+
+/**
+ * @brief Turns on the alert rules, exits on error.
+ *
+ * @param rules The rules of the --alert options, a later rule of a kind replaces an earlier one.
+ * @param count Number of rules.
+ */
+void anomaly_init(char** rules, int count) {
+    if (count == 0) {
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        char rule[64];
+        snprintf(rule, sizeof(rule), "%s", rules[i]);
+        if (!anomaly_parse_rule(rule)) {
+            log_message(ERROR, 1, "--alert option: '%s' is not rename:N/S, delete:N/S, modify-dirs:N/S or exec-new:S with S from 1 to %d seconds.\n", rules[i], ANOMALY_WINDOW_MAX);
+            exit(EXIT_FAILURE);
+        }
+    }
+    g_anomaly.mask = (g_anomaly.thresholds[ANOMALY_RENAME] ? ANOMALY_RENAME_MASK : 0) |
+                     (g_anomaly.thresholds[ANOMALY_DELETE] ? FAN_DELETE : 0) |
+                     (g_anomaly.thresholds[ANOMALY_MODIFY_DIRS] ? FAN_MODIFY : 0) |
+                     (g_anomaly.thresholds[ANOMALY_EXEC_NEW] ? ANOMALY_FRESH_MASK | ANOMALY_EXEC_MASK : 0);
+    for (int i = 0; i < ANOMALY_TABLES; i++) {
+        g_anomaly.tables[i] = calloc(ANOMALY_PROCESSES, sizeof(anomaly_process_t));
+        if (g_anomaly.tables[i] == NULL) {
+            log_message(ERROR, 1, "Unable to malloc for the alert rules\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (g_anomaly.thresholds[ANOMALY_EXEC_NEW]) {
+        g_anomaly.fresh = calloc(ANOMALY_FRESH_ENTRIES, sizeof(uint64_t));
+        if (g_anomaly.fresh == NULL) {
+            log_message(ERROR, 1, "Unable to malloc for the alert rules\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    g_anomaly.enabled = 1;
+}
+
+// Moves a window to tick and adds n, returns the total over the window
+static inline uint32_t anomaly_window_add(anomaly_window_t* window, uint64_t tick, uint32_t n) {
+    if (tick != window->tick) {
+        uint64_t gap = tick - window->tick;
+        if (gap >= ANOMALY_BUCKETS) {
+            memset(window->buckets, 0, sizeof(window->buckets));
+            window->total = 0;
+        } else {
+            // Each skipped bucket left the window
+            for (uint64_t t = window->tick + 1; t <= tick; t++) {
+                uint32_t* bucket = &window->buckets[t & (ANOMALY_BUCKETS - 1)];
+                window->total -= *bucket;
+                *bucket = 0;
+            }
+        }
+        window->tick = tick;
+    }
+    window->buckets[tick & (ANOMALY_BUCKETS - 1)] += n;
+    window->total += n;
+    return window->total;
+}
+
+// Counts one event of a rate rule, and alerts once per window while the total is above the threshold
+static inline void anomaly_count(anomaly_process_t* process, anomaly_kind_t kind, uint64_t now_ms, const char* path, anomaly_emit_fn emit) {
+    anomaly_window_t* window = &process->windows[kind];
+    uint64_t tick = now_ms / g_anomaly.bucket_ms[kind];
+    uint32_t total = anomaly_window_add(window, tick, 1);
+
+    if (total > g_anomaly.thresholds[kind] && (window->alerted == 0 || tick >= window->alerted - 1 + ANOMALY_BUCKETS)) {
+        anomaly_alert_t alert = {
+            .kind = kind,
+            .pid = process->pid,
+            .comm = process->comm,
+            .path = path,
+            .count = total,
+            .threshold = g_anomaly.thresholds[kind],
+            .window_s = g_anomaly.windows_s[kind],
+        };
+        window->alerted = tick + 1;
+        metrics_inc(anomaly_metrics[kind]);
+        emit(&alert);
+    }
+}
+
+// Hash of the directory part of a path, 8 bytes at a time
+static inline uint64_t anomaly_dir_hash(const char* path) {
+    const char* slash = strrchr(path, '/');
+    size_t len = slash ? (size_t)(slash - path) : 0;
+    uint64_t hash = len * 0x9E3779B97F4A7C15ULL;
+    uint64_t word;
+
+    for (; len >= 8; len -= 8, path += 8) {
+        memcpy(&word, path, 8);
+        hash = (hash ^ word) * 0xBF58476D1CE4E5B9ULL;
+        hash ^= hash >> 31;
+    }
+    word = 0;
+    memcpy(&word, path, len);
+    hash = (hash ^ word) * 0x94D049BB133111EBULL;
+    return hash ^ (hash >> 29);
+}
+
+// Finds the process in the table of the calling thread, taking over the entry of another one
+static inline anomaly_process_t* anomaly_process(int table, int pid, const char* comm) {
+    anomaly_process_t* process = &g_anomaly.tables[table][(unsigned int)pid & (ANOMALY_PROCESSES - 1)];
+    if (process->pid != pid || strncmp(process->comm, comm, PROC_NAME_LEN) != 0) {
+        memset(process, 0, sizeof(*process));
+        process->pid = pid;
+        strncpy(process->comm, comm, PROC_NAME_LEN - 1);
+    }
+    return process;
+}
+
+/**
+ * @brief Runs an event through the alert rules. Each reader thread passes its own table.
+ *
+ * @param table The event group of the calling thread.
+ * @param pid The PID of the event.
+ * @param comm The process name of the PID.
+ * @param path The path of the event, the new path of a rename.
+ * @param path_hash hash_string() of path, or 0.
+ * @param mask The event mask.
+ * @param emit Called with each alert the event raises.
+ */
+void anomaly_observe(int table, int pid, const char* comm, const char* path, uint64_t path_hash, uint64_t mask, anomaly_emit_fn emit) {
+    if (!(mask & g_anomaly.mask) || path == NULL) {
+        return;
+    }
+    uint64_t now_ms = anomaly_clock_ms();
+    anomaly_process_t* process = anomaly_process(table, pid, comm);
+
+    if ((mask & ANOMALY_RENAME_MASK) && g_anomaly.thresholds[ANOMALY_RENAME]) {
+        anomaly_count(process, ANOMALY_RENAME, now_ms, path, emit);
+    }
+    if ((mask & FAN_DELETE) && g_anomaly.thresholds[ANOMALY_DELETE]) {
+        anomaly_count(process, ANOMALY_DELETE, now_ms, path, emit);
+    }
+    if ((mask & FAN_MODIFY) && g_anomaly.thresholds[ANOMALY_MODIFY_DIRS]) {
+        uint64_t hash = anomaly_dir_hash(path);
+        uint64_t tick = now_ms / g_anomaly.bucket_ms[ANOMALY_MODIFY_DIRS];
+        uint64_t* dir = &process->dirs[hash & (ANOMALY_DIRS - 1)];
+        uint64_t tag = hash & ~0xffffffffULL;
+        // A directory counts again once it has not been modified for a whole window
+        if ((*dir & ~0xffffffffULL) != tag || ((tick - *dir) & 0xffffffffULL) >= ANOMALY_BUCKETS) {
+            *dir = tag | (tick & 0xffffffffULL);
+            anomaly_count(process, ANOMALY_MODIFY_DIRS, now_ms, path, emit);
+        } else {
+            *dir = tag | (tick & 0xffffffffULL);
+        }
+    }
+    if (g_anomaly.fresh != NULL && (mask & (ANOMALY_FRESH_MASK | ANOMALY_EXEC_MASK)) && !(mask & FAN_ONDIR)) {
+        uint64_t hash = path_hash ? path_hash : hash_string(path);
+        uint64_t* slot = &g_anomaly.fresh[hash & (ANOMALY_FRESH_ENTRIES - 1)];
+        uint64_t tag = hash & ~0xffffffULL;
+        uint64_t now_s = now_ms / 1000;
+        if (mask & ANOMALY_EXEC_MASK) {
+            uint64_t entry = __atomic_load_n(slot, __ATOMIC_RELAXED);
+            uint64_t age = (now_s - (entry & 0xffffff)) & 0xffffff;
+            if (entry != 0 && (entry & ~0xffffffULL) == tag && age < g_anomaly.windows_s[ANOMALY_EXEC_NEW]) {
+                anomaly_alert_t alert = {
+                    .kind = ANOMALY_EXEC_NEW,
+                    .pid = pid,
+                    .comm = comm,
+                    .path = path,
+                    .count = age,
+                    .threshold = g_anomaly.windows_s[ANOMALY_EXEC_NEW],
+                    .window_s = g_anomaly.windows_s[ANOMALY_EXEC_NEW],
+                };
+                // One alert per write of the file, not per exec
+                __atomic_store_n(slot, 0, __ATOMIC_RELAXED);
+                metrics_inc(METRIC_ALERTS_EXEC_NEW);
+                emit(&alert);
+            }
+        } else {
+            __atomic_store_n(slot, tag | (now_s & 0xffffff), __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * @brief Name of an alert in the output.
+ *
+ * @param kind The rule.
+ * @return const char* "rename", "delete", "modify-dirs" or "exec-new".
+ */
+const char* anomaly_kind_name(anomaly_kind_t kind) {
+    return kind < ANOMALY_KINDS ? anomaly_kind_names[kind] : "unknown";
+}
+
+#endif
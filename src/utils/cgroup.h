@@ -0,0 +1,385 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include "wrappers.h"
+#include "logger.h"
+
+#ifndef CGROUP_H
+#define CGROUP_H
+
+#define CGROUP_FILTER_MAX 64
+#define CGROUP_PATH_LEN 256
+#define CGROUP_CACHE_SIZE 1024
+#define CGROUP_RECHECK_NS 1000000000ULL  // Age of a cached PID after which its cgroup is read again
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define CONTAINER_ID_LEN 64
+#define CONTAINER_ID_SHORT 12
+
+/*
+ * Cgroup filters and attribution. A process is mapped to its cgroup id once, through a per-thread
+ * PID cache, and the include/exclude verdict is worked out once per cgroup id and cached as well.
+ * Per event that is two hash lookups, /proc/<pid>/cgroup is only read for a PID not seen before
+ * and once every CGROUP_RECHECK_NS after that, as a process can be moved to another cgroup without
+ * an exec that would change its comm.
+ * On cgroup v2 the id is the kernel cgroup id from name_to_handle_at(), as used by bpf and systemd;
+ * on v1 hosts it falls back to a hash of the cgroup path.
+ * A filter path matches that cgroup and everything below it.
+ */
+typedef struct {
+    int pid;
+    char comm[PROC_NAME_LEN];      // Guards against PID reuse
+    uint64_t cgroup_id;
+    uint64_t checked_ns;           // cgroup_clock_ns() when /proc/<pid>/cgroup was last read
+} cgroup_pid_entry_t;
+
+typedef struct {
+    uint64_t cgroup_id;            // 0 if the slot is free
+    int allowed;
+    uint64_t rules_version;        // Version rules_allowed was worked out for, 0 if none
+    int rules_allowed;
+    char path[CGROUP_PATH_LEN];
+} cgroup_id_entry_t;
+
+typedef struct {
+    cgroup_pid_entry_t pids[CGROUP_CACHE_SIZE];
+    cgroup_id_entry_t ids[CGROUP_CACHE_SIZE];
+} cgroup_cache_t;
+
+typedef struct Cgroups {
+    int filtering;
+    int show;
+    int include_count;
+    int exclude_count;
+    char include[CGROUP_FILTER_MAX][CGROUP_PATH_LEN];
+    char exclude[CGROUP_FILTER_MAX][CGROUP_PATH_LEN];
+} cgroups_t;
+
+// Cgroup rules of a filter config, they replace each other on reload so the verdicts are cached per version
+typedef struct {
+    uint64_t version;              // Never 0
+    int include_count;
+    int exclude_count;
+    char include[CGROUP_FILTER_MAX][CGROUP_PATH_LEN];
+    char exclude[CGROUP_FILTER_MAX][CGROUP_PATH_LEN];
+} cgroup_rules_t;
+
+void cgroups_init(char** include, char** exclude, int show);
+int cgroup_filter_add(char filters[][CGROUP_PATH_LEN], int* count, const char* path);
+int cgroup_allowed(int pid, const char* comm);
+int cgroup_rules_allowed(int pid, const char* comm, const cgroup_rules_t* rules);
+int cgroup_format(int pid, const char* comm, char* out, size_t size);
+const cgroup_id_entry_t* cgroup_of(int pid, const char* comm);
+const char* cgroup_container(const char* path);
+char* strcat_cgroups(char array[][CGROUP_PATH_LEN], int count);
+
+cgroups_t g_cgroups = { .filtering = 0, .show = 0 };
+__thread cgroup_cache_t* t_cgroup_cache = NULL;
+
+/**
+ * @brief Sets up the cgroup filters.
+ *
+ * @param include Cgroup paths to include, NULL terminated, or NULL.
+ * @param exclude Cgroup paths to exclude, NULL terminated, or NULL.
+ * @param show Add the cgroup and container id to every line.
+ */
+void cgroups_init(char** include, char** exclude, int show) {
+    for (int i = 0; include && include[i]; i++) {
+        cgroup_filter_add(g_cgroups.include, &g_cgroups.include_count, include[i]);
+    }
+    for (int i = 0; exclude && exclude[i]; i++) {
+        cgroup_filter_add(g_cgroups.exclude, &g_cgroups.exclude_count, exclude[i]);
+    }
+    g_cgroups.filtering = g_cgroups.include_count > 0 || g_cgroups.exclude_count > 0;
+    g_cgroups.show = show;
+}
+
+/**
+ * @brief Appends a path to a list of cgroup filters.
+ *
+ * @param filters The list.
+ * @param count Number of paths in the list, incremented.
+ * @param path The cgroup path.
+ * @return int 1 on success, 0 if the list is full.
+ */
+int cgroup_filter_add(char filters[][CGROUP_PATH_LEN], int* count, const char* path) {
+    if (*count >= CGROUP_FILTER_MAX) {
+        return 0;
+    }
+    char* filter = filters[*count];
+    strncpy(filter, path, CGROUP_PATH_LEN - 1);
+    filter[CGROUP_PATH_LEN - 1] = '\0';
+    // "/a/b/" and "/a/b" are the same cgroup
+    size_t len = strlen(filter);
+    if (len > 1 && filter[len - 1] == '/') {
+        filter[len - 1] = '\0';
+    }
+    (*count)++;
+    return 1;
+}
+
+static int cgroup_path_matches(const char* path, const char filters[][CGROUP_PATH_LEN], int count) {
+    for (int i = 0; i < count; i++) {
+        size_t len = strlen(filters[i]);
+        if (strcmp(filters[i], "/") == 0) {
+            return 1;
+        }
+        if (strncmp(path, filters[i], len) == 0 && (path[len] == '\0' || path[len] == '/')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int read_cgroup_path(int pid, char* path, size_t size) {
+    char proc_path[32];
+    char line[CGROUP_PATH_LEN + 64];
+    char first[CGROUP_PATH_LEN] = "";
+    int found = 0;
+    FILE* file;
+
+    snprintf(proc_path, sizeof(proc_path), "/proc/%d/cgroup", pid);
+    file = fopen(proc_path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        char* cgroup = strchr(line, ':');
+        cgroup = cgroup ? strchr(cgroup + 1, ':') : NULL;
+        if (cgroup == NULL) {
+            continue;
+        }
+        cgroup++;
+        cgroup[strcspn(cgroup, "\n")] = '\0';
+        // The unified hierarchy is "0::/path", with v1 only take the first controller
+        if (strncmp(line, "0::", 3) == 0) {
+            strncpy(path, cgroup, size - 1);
+            path[size - 1] = '\0';
+            found = 1;
+            break;
+        }
+        if (first[0] == '\0') {
+            strncpy(first, cgroup, sizeof(first) - 1);
+        }
+    }
+    fclose(file);
+    if (!found && first[0] != '\0') {
+        strncpy(path, first, size - 1);
+        path[size - 1] = '\0';
+        found = 1;
+    }
+    return found;
+}
+
+static uint64_t cgroup_id_from_path(const char* path) {
+    char full_path[PATH_MAX];
+    struct {
+        struct file_handle handle;
+        unsigned char bytes[sizeof(uint64_t)];
+    } fh;
+    uint64_t id;
+    int mount_id;
+
+    snprintf(full_path, sizeof(full_path), "%s%s", CGROUP_ROOT, path);
+    fh.handle.handle_bytes = sizeof(id);
+    if (name_to_handle_at(AT_FDCWD, full_path, &fh.handle, &mount_id, 0) == 0 && fh.handle.handle_bytes == sizeof(id)) {
+        memcpy(&id, fh.handle.f_handle, sizeof(id));
+        return id;
+    }
+    return hash_string(path) | 1;
+}
+
+static inline uint64_t cgroup_clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static cgroup_cache_t* cgroup_cache() {
+    if (t_cgroup_cache == NULL) {
+        t_cgroup_cache = (cgroup_cache_t*)calloc(1, sizeof(cgroup_cache_t));
+        if (t_cgroup_cache == NULL) {
+            log_message(ERROR, 1, "Failed to allocate memory to cgroup cache\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return t_cgroup_cache;
+}
+
+/**
+ * @brief Finds the cached cgroup of a process, reading /proc/<pid>/cgroup on a miss or when the
+ *        cached PID is older than CGROUP_RECHECK_NS.
+ *
+ * @return cgroup_id_entry_t* The cgroup, or NULL if the process is gone.
+ */
+static cgroup_id_entry_t* cgroup_lookup(int pid, const char* comm) {
+    cgroup_cache_t* cache = cgroup_cache();
+    cgroup_pid_entry_t* pid_entry = &cache->pids[(unsigned int)pid % CGROUP_CACHE_SIZE];
+    cgroup_id_entry_t* cached = NULL;
+    char path[CGROUP_PATH_LEN];
+    uint64_t now = cgroup_clock_ns();
+    uint64_t id;
+
+    if (pid_entry->pid == pid && strcmp(pid_entry->comm, comm) == 0) {
+        cgroup_id_entry_t* id_entry = &cache->ids[pid_entry->cgroup_id % CGROUP_CACHE_SIZE];
+        if (id_entry->cgroup_id == pid_entry->cgroup_id) {
+            if (now - pid_entry->checked_ns < CGROUP_RECHECK_NS) {
+                return id_entry;
+            }
+            cached = id_entry;
+        }
+    }
+
+    if (!read_cgroup_path(pid, path, sizeof(path))) {
+        return NULL;
+    }
+    pid_entry->checked_ns = now;
+    // Still in the same cgroup, which is the common case of a recheck
+    if (cached != NULL && strcmp(cached->path, path) == 0) {
+        return cached;
+    }
+    id = cgroup_id_from_path(path);
+    pid_entry->pid = pid;
+    strncpy(pid_entry->comm, comm, PROC_NAME_LEN - 1);
+    pid_entry->cgroup_id = id;
+
+    cgroup_id_entry_t* id_entry = &cache->ids[id % CGROUP_CACHE_SIZE];
+    if (id_entry->cgroup_id != id) {
+        id_entry->cgroup_id = id;
+        id_entry->rules_version = 0;
+        strncpy(id_entry->path, path, CGROUP_PATH_LEN - 1);
+        if (g_cgroups.include_count > 0) {
+            id_entry->allowed = cgroup_path_matches(path, g_cgroups.include, g_cgroups.include_count);
+        } else {
+            id_entry->allowed = !cgroup_path_matches(path, g_cgroups.exclude, g_cgroups.exclude_count);
+        }
+    }
+    return id_entry;
+}
+
+/**
+ * @brief Checks a process against the cgroup filters.
+ *
+ * @param pid The PID.
+ * @param comm The process name.
+ * @return int 1 if events of this process pass, 0 otherwise.
+ */
+int cgroup_allowed(int pid, const char* comm) {
+    cgroup_id_entry_t* entry = cgroup_lookup(pid, comm);
+    if (entry == NULL) {
+        // Unknown cgroup can only pass an exclude filter
+        return g_cgroups.include_count == 0;
+    }
+    return entry->allowed;
+}
+
+/**
+ * @brief Checks a process against the cgroup rules of a filter config.
+ *
+ * @param pid The PID.
+ * @param comm The process name.
+ * @param rules The cgroup rules.
+ * @return int 1 if events of this process pass, 0 otherwise.
+ */
+int cgroup_rules_allowed(int pid, const char* comm, const cgroup_rules_t* rules) {
+    if (rules->include_count == 0 && rules->exclude_count == 0) {
+        return 1;
+    }
+    cgroup_id_entry_t* entry = cgroup_lookup(pid, comm);
+    if (entry == NULL) {
+        return rules->include_count == 0;
+    }
+    if (entry->rules_version != rules->version) {
+        if (rules->include_count > 0) {
+            entry->rules_allowed = cgroup_path_matches(entry->path, rules->include, rules->include_count);
+        } else {
+            entry->rules_allowed = !cgroup_path_matches(entry->path, rules->exclude, rules->exclude_count);
+        }
+        entry->rules_version = rules->version;
+    }
+    return entry->rules_allowed;
+}
+
+/**
+ * @brief Formats the cgroup and container id of a process for the log line.
+ *
+ * @param pid The PID.
+ * @param comm The process name.
+ * @param out The output buffer.
+ * @param size Size of the output buffer.
+ * @return int Number of characters written.
+ */
+int cgroup_format(int pid, const char* comm, char* out, size_t size) {
+    cgroup_id_entry_t* entry = cgroup_lookup(pid, comm);
+    const char* container;
+    int len;
+
+    if (entry == NULL) {
+        len = snprintf(out, size, " {cgroup=unknown}");
+        return len < (int)size ? len : (int)size - 1;
+    }
+    container = cgroup_container(entry->path);
+    if (container) {
+        len = snprintf(out, size, " {cgroup=%s cgroup_id=%lu container=%.*s}", entry->path, (unsigned long)entry->cgroup_id, CONTAINER_ID_SHORT, container);
+    } else {
+        len = snprintf(out, size, " {cgroup=%s cgroup_id=%lu}", entry->path, (unsigned long)entry->cgroup_id);
+    }
+    return len < (int)size ? len : (int)size - 1;
+}
+
+/**
+ * @brief Finds the cgroup of a process. The entry stays valid until the thread looks up another process.
+ *
+ * @param pid The PID.
+ * @param comm The process name.
+ * @return const cgroup_id_entry_t* The cgroup, or NULL if the process is gone.
+ */
+const cgroup_id_entry_t* cgroup_of(int pid, const char* comm) {
+    return cgroup_lookup(pid, comm);
+}
+
+/**
+ * @brief Finds the container id in a cgroup path.
+ *
+ * @param path The cgroup path.
+ * @return const char* Start of the CONTAINER_ID_LEN hex digits, or NULL if there are none.
+ */
+const char* cgroup_container(const char* path) {
+    // Container runtimes name the cgroup after the 64 hex digit container id
+    for (const char* p = path; *p; p++) {
+        int run = 0;
+        while (isxdigit((unsigned char)p[run]) && !isupper((unsigned char)p[run])) {
+            run++;
+        }
+        if (run == CONTAINER_ID_LEN) {
+            return p;
+        }
+        p += run ? run - 1 : 0;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Joins cgroup filter paths for print_box().
+ *
+ * @param array The cgroup paths.
+ * @param count Number of paths.
+ * @return char* The joined string.
+ */
+char* strcat_cgroups(char array[][CGROUP_PATH_LEN], int count) {
+    static char joined[CGROUP_FILTER_MAX * (CGROUP_PATH_LEN + 1)];
+    joined[0] = '\0';
+    for (int i = 0; i < count; i++) {
+        if (i > 0) {
+            strcat(joined, " ");
+        }
+        strcat(joined, array[i]);
+    }
+    return joined;
+}
+
+#endif
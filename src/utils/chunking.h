@@ -0,0 +1,483 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <regex.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "logger.h"
+#include "xxh64.h"
+
+#ifndef CHUNKING_H
+#define CHUNKING_H
+
+#define CHUNK_MIN (16 * 1024)
+#define CHUNK_AVG (64 * 1024)
+#define CHUNK_MAX (256 * 1024)
+#define CHUNK_MASK_SMALL 0xffffc00000000000ULL   // 18 bits, cuts are rare below CHUNK_AVG
+#define CHUNK_MASK_LARGE 0xfffc000000000000ULL   // 14 bits, and likely above it
+#define CHUNK_RANGES_MAX 16
+#define CHUNK_MANIFEST_MAGIC 0x004b4e5548434d46ULL   // "FMCHUNK"
+#define CHUNK_MANIFEST_VERSION 1
+#define CHUNK_MANIFEST_SUFFIX ".fcm"
+#define CHUNK_MANIFEST_BUFFER (64 * 1024)
+
+/*
+ * Changed-region tracking (--chunk PATTERN --chunk-dir DIRECTORY). On FAN_CLOSE_WRITE of a path
+ * matching PATTERN, a hash worker cuts the file into chunks where a gear rolling hash hits a mask
+ * (FastCDC with normalized chunking: 16KB to 256KB, 64KB on average), so an edit only moves the
+ * cuts next to it. The XXH64 of each chunk is looked up in the chunks of the previous close, and
+ * the chunks that are not there are reported as the changed byte ranges. The file is read once in
+ * the worker's buffer, only the chunk hashes of the previous close are held in memory (8 bytes per
+ * chunk), and the new manifest is written as the chunks are cut.
+ *
+ * A manifest is DIRECTORY/<hash_string(path) in hex>.fcm: chunk_manifest_header_t, the path, then
+ * per chunk its XXH64 (8 bytes, little endian) and its length as a LEB128 varint, about 11 bytes
+ * per 64KB of file. It is written to a temporary file and renamed over the previous one.
+ */
+typedef enum {
+    CHUNKS_NONE,                   // The path is not tracked
+    CHUNKS_NEW,                    // No manifest of a previous close to compare with
+    CHUNKS_CHANGED,
+    CHUNKS_SKIPPED_BUSY,           // The hash queue was full
+    CHUNKS_FAILED                  // The file could not be read or the manifest written
+} chunk_status_t;
+
+typedef struct {
+    uint64_t start;
+    uint64_t end;                  // Exclusive
+} chunk_range_t;
+
+typedef struct {
+    chunk_status_t status;
+    uint64_t changed_bytes;
+    uint32_t range_count;          // All changed ranges, only the first CHUNK_RANGES_MAX are kept
+    chunk_range_t ranges[CHUNK_RANGES_MAX];
+} chunk_diff_t;
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t path_len;             // Bytes of the path after the header, without '\0'
+    uint32_t min_size;             // The chunker the manifest was cut with
+    uint32_t avg_size;
+    uint32_t max_size;
+    uint32_t reserved;
+    uint64_t chunks;
+    uint64_t size;                 // Of the file
+    uint64_t mtime_ns;
+} chunk_manifest_header_t;
+
+_Static_assert(sizeof(chunk_manifest_header_t) == 56, "chunk_manifest_header_t layout changed, bump CHUNK_MANIFEST_VERSION");
+
+typedef void (*chunk_fn)(void* arg, uint64_t offset, uint32_t length, uint64_t hash);
+
+typedef struct {
+    uint64_t fp;                   // Gear hash since CHUNK_MIN bytes into the chunk
+    uint64_t offset;               // Of the current chunk in the file
+    uint32_t length;               // Bytes of the current chunk so far
+    xxh64_state_t state;           // Of the current chunk
+    chunk_fn fn;
+    void* arg;
+} chunker_t;
+
+typedef struct {
+    chunker_t chunker;
+    uint64_t* previous;            // Sorted chunk hashes of the previous close, NULL if none
+    uint64_t previous_count;
+    FILE* manifest;
+    char path[PATH_MAX + 32];      // Of the manifest
+    char tmp[PATH_MAX + 64];
+    uint32_t path_len;
+    uint64_t chunks;
+    uint64_t changed_end;          // End of the last changed chunk, it grows the last range
+    chunk_diff_t* diff;
+} chunk_job_t;
+
+typedef struct Chunking {
+    int enabled;
+    regex_t pattern;
+    char directory[PATH_MAX];
+    int gear_ready;
+    uint64_t gear[256];
+} chunking_t;
+
+void chunking_init(const char* pattern, const char* directory);
+int chunking_match(const char* path);
+void chunker_init(chunker_t* chunker, chunk_fn fn, void* arg);
+void chunker_feed(chunker_t* chunker, const unsigned char* data, size_t len);
+void chunker_finish(chunker_t* chunker);
+int chunking_begin(chunk_job_t* job, const char* path, uint64_t path_hash, chunk_diff_t* diff);
+int chunking_end(chunk_job_t* job, uint64_t size, uint64_t mtime_ns);
+void chunking_abort(chunk_job_t* job);
+const char* chunking_status_name(chunk_status_t status);
+int chunking_format(const chunk_diff_t* diff, char* out, size_t size);
+
+chunking_t g_chunking = { .enabled = 0 };
+
+// Fixed seed, the cuts must not change between runs or the manifests are worthless
+static void chunking_gear_init() {
+    uint64_t seed = 0x66696c656d6f6e21ULL;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        g_chunking.gear[i] = z ^ (z >> 31);
+    }
+    g_chunking.gear_ready = 1;
+}
+
+/**
+ * @brief Turns on changed-region tracking.
+ *
+ * @param pattern Regex of the paths to track, NULL to leave it off.
+ * @param directory Where the manifests are kept.
+ */
+void chunking_init(const char* pattern, const char* directory) {
+    struct stat st;
+
+    if (pattern == NULL) {
+        return;
+    }
+    if (directory == NULL || stat(directory, &st) == -1 || !S_ISDIR(st.st_mode) || realpath(directory, g_chunking.directory) == NULL) {
+        log_message(ERROR, 1, "--chunk-dir option: \"%s\" is not a directory.\n", directory ? directory : "");
+        exit(EXIT_FAILURE);
+    }
+    if (regcomp(&g_chunking.pattern, pattern, REG_EXTENDED | REG_NOSUB)) {
+        log_message(ERROR, 1, "--chunk option: \"%s\" is not a valid regex.\n", pattern);
+        exit(EXIT_FAILURE);
+    }
+    chunking_gear_init();
+    g_chunking.enabled = 1;
+}
+
+/**
+ * @brief Tells whether the changed regions of a path are tracked.
+ *
+ * @param path The path.
+ * @return int 1 if it matches --chunk.
+ */
+int chunking_match(const char* path) {
+    return regexec(&g_chunking.pattern, path, 0, NULL, 0) == 0;
+}
+
+/**
+ * @brief Starts cutting a file.
+ *
+ * @param chunker The chunker.
+ * @param fn Called with each chunk, in file order.
+ * @param arg Passed back to fn.
+ */
+void chunker_init(chunker_t* chunker, chunk_fn fn, void* arg) {
+    if (!g_chunking.gear_ready) {
+        chunking_gear_init();
+    }
+    chunker->fp = 0;
+    chunker->offset = 0;
+    chunker->length = 0;
+    chunker->fn = fn;
+    chunker->arg = arg;
+    xxh64_init(&chunker->state);
+}
+
+static inline void chunker_cut(chunker_t* chunker) {
+    chunker->fn(chunker->arg, chunker->offset, chunker->length, xxh64_digest(&chunker->state));
+    chunker->offset += chunker->length;
+    chunker->length = 0;
+    chunker->fp = 0;
+    xxh64_init(&chunker->state);
+}
+
+/**
+ * @brief Cuts the next bytes of the file. The cuts do not depend on how the file is split in calls.
+ *
+ * @param chunker The chunker.
+ * @param data The bytes.
+ * @param len The number of bytes.
+ */
+void chunker_feed(chunker_t* chunker, const unsigned char* data, size_t len) {
+    const uint64_t* gear = g_chunking.gear;
+
+    while (len > 0) {
+        size_t i = 0;
+        uint64_t fp = chunker->fp;
+        uint32_t length = chunker->length;
+        int cut = 0;
+
+        // No cut can fall in the first CHUNK_MIN bytes, skip the rolling hash over them
+        if (length < CHUNK_MIN) {
+            i = CHUNK_MIN - length < len ? CHUNK_MIN - length : len;
+            length += i;
+        }
+        for (; !cut && i < len && length < CHUNK_AVG; i++, length++) {
+            fp = (fp << 1) + gear[data[i]];
+            cut = !(fp & CHUNK_MASK_SMALL);
+        }
+        for (; !cut && i < len && length < CHUNK_MAX; i++, length++) {
+            fp = (fp << 1) + gear[data[i]];
+            cut = !(fp & CHUNK_MASK_LARGE);
+        }
+        cut |= length == CHUNK_MAX;
+        xxh64_update(&chunker->state, data, i);
+        chunker->fp = fp;
+        chunker->length = length;
+        if (cut) {
+            chunker_cut(chunker);
+        }
+        data += i;
+        len -= i;
+    }
+}
+
+/**
+ * @brief Cuts the last chunk at the end of the file.
+ *
+ * @param chunker The chunker.
+ */
+void chunker_finish(chunker_t* chunker) {
+    if (chunker->length > 0) {
+        chunker_cut(chunker);
+    }
+}
+
+static int chunking_compare(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int chunking_read_varint(FILE* file, uint64_t* value) {
+    int c;
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if ((c = getc(file)) == EOF) {
+            return 0;
+        }
+        *value |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Loads the sorted chunk hashes of the previous close, a missing or unusable manifest gives none
+static void chunking_load(chunk_job_t* job, const char* path) {
+    chunk_manifest_header_t header;
+    char stored[PATH_MAX];
+    FILE* file = fopen(job->path, "rb");
+
+    if (file == NULL) {
+        return;
+    }
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != CHUNK_MANIFEST_MAGIC ||
+        header.version != CHUNK_MANIFEST_VERSION || header.min_size != CHUNK_MIN ||
+        header.avg_size != CHUNK_AVG || header.max_size != CHUNK_MAX ||
+        header.path_len >= sizeof(stored) || header.chunks > header.size / CHUNK_MIN + 1 ||
+        fread(stored, 1, header.path_len, file) != header.path_len) {
+        fclose(file);
+        return;
+    }
+    // Two paths with the same hash share the file name, the path tells them apart
+    stored[header.path_len] = '\0';
+    if (strcmp(stored, path) != 0 || (job->previous = malloc((header.chunks + 1) * sizeof(uint64_t))) == NULL) {
+        fclose(file);
+        return;
+    }
+    for (uint64_t i = 0; i < header.chunks; i++) {
+        unsigned char hash[8];
+        uint64_t length;
+        if (fread(hash, sizeof(hash), 1, file) != 1 || !chunking_read_varint(file, &length)) {
+            log_message(DEBUG, 1, "Chunk manifest \"%s\" is cut short, comparing with nothing\n", job->path);
+            free(job->previous);
+            job->previous = NULL;
+            fclose(file);
+            return;
+        }
+        job->previous[i] = xxh64_read64(hash);
+    }
+    fclose(file);
+    job->previous_count = header.chunks;
+    qsort(job->previous, job->previous_count, sizeof(uint64_t), chunking_compare);
+}
+
+static void chunking_chunk(void* arg, uint64_t offset, uint32_t length, uint64_t hash) {
+    chunk_job_t* job = (chunk_job_t*)arg;
+    chunk_diff_t* diff = job->diff;
+    unsigned char entry[8 + 10];
+    size_t len = 0;
+
+    for (int i = 0; i < 8; i++) {
+        entry[len++] = hash >> (8 * i);
+    }
+    for (uint64_t value = length; ; value >>= 7) {
+        entry[len++] = (value & 0x7f) | (value >= 0x80 ? 0x80 : 0);
+        if (value < 0x80) {
+            break;
+        }
+    }
+    fwrite(entry, 1, len, job->manifest);
+    job->chunks++;
+
+    if (job->previous == NULL || bsearch(&hash, job->previous, job->previous_count, sizeof(uint64_t), chunking_compare)) {
+        return;
+    }
+    diff->changed_bytes += length;
+    if (diff->range_count > 0 && job->changed_end == offset) {
+        if (diff->range_count <= CHUNK_RANGES_MAX) {
+            diff->ranges[diff->range_count - 1].end = offset + length;
+        }
+    } else {
+        if (diff->range_count < CHUNK_RANGES_MAX) {
+            diff->ranges[diff->range_count] = (chunk_range_t){ .start = offset, .end = offset + length };
+        }
+        diff->range_count++;
+    }
+    job->changed_end = offset + length;
+}
+
+/**
+ * @brief Loads the manifest of the previous close of a path and starts the new one.
+ *
+ * @param job The chunking of the file, fed with chunker_feed(&job->chunker, ...).
+ * @param path The path of the file.
+ * @param path_hash hash_string() of path.
+ * @param diff Filled by chunking_end().
+ * @return int 1 on success, 0 if the new manifest cannot be written.
+ */
+int chunking_begin(chunk_job_t* job, const char* path, uint64_t path_hash, chunk_diff_t* diff) {
+    chunk_manifest_header_t header = { 0 };
+
+    memset(diff, 0, sizeof(*diff));
+    job->previous = NULL;
+    job->previous_count = 0;
+    job->chunks = 0;
+    job->changed_end = 0;
+    job->diff = diff;
+    snprintf(job->path, sizeof(job->path), "%s/%016lx" CHUNK_MANIFEST_SUFFIX, g_chunking.directory, path_hash);
+    snprintf(job->tmp, sizeof(job->tmp), "%s.%lx.tmp", job->path, (unsigned long)pthread_self());
+    chunking_load(job, path);
+
+    job->manifest = fopen(job->tmp, "wb");
+    if (job->manifest == NULL) {
+        log_message(WARNING, 1, "Failed to write chunk manifest \"%s\" (%s)\n", job->tmp, strerror(errno));
+        free(job->previous);
+        return 0;
+    }
+    setvbuf(job->manifest, NULL, _IOFBF, CHUNK_MANIFEST_BUFFER);
+    job->path_len = strlen(path);
+    fwrite(&header, sizeof(header), 1, job->manifest);
+    fwrite(path, 1, job->path_len, job->manifest);
+    chunker_init(&job->chunker, chunking_chunk, job);
+    return 1;
+}
+
+/**
+ * @brief Cuts the last chunk and puts the new manifest in place of the previous one.
+ *
+ * @param job The chunking of the file.
+ * @param size Bytes read from the file.
+ * @param mtime_ns Modification time of the file.
+ * @return int 1 on success, the diff is then CHUNKS_NEW or CHUNKS_CHANGED.
+ */
+int chunking_end(chunk_job_t* job, uint64_t size, uint64_t mtime_ns) {
+    chunk_manifest_header_t header = {
+        .magic = CHUNK_MANIFEST_MAGIC,
+        .version = CHUNK_MANIFEST_VERSION,
+        .path_len = job->path_len,
+        .min_size = CHUNK_MIN,
+        .avg_size = CHUNK_AVG,
+        .max_size = CHUNK_MAX,
+        .size = size,
+        .mtime_ns = mtime_ns,
+    };
+
+    chunker_finish(&job->chunker);
+    header.chunks = job->chunks;
+    job->diff->status = job->previous ? CHUNKS_CHANGED : CHUNKS_NEW;
+    free(job->previous);
+    job->previous = NULL;
+
+    // The header goes in last, so a manifest cut short never has the magic
+    if (fseek(job->manifest, 0, SEEK_SET) == -1 || fwrite(&header, sizeof(header), 1, job->manifest) != 1) {
+        chunking_abort(job);
+        return 0;
+    }
+    if (fclose(job->manifest) != 0 || rename(job->tmp, job->path) == -1) {
+        log_message(WARNING, 1, "Failed to write chunk manifest \"%s\" (%s)\n", job->path, strerror(errno));
+        job->manifest = NULL;
+        unlink(job->tmp);
+        job->diff->status = CHUNKS_FAILED;
+        return 0;
+    }
+    job->manifest = NULL;
+    return 1;
+}
+
+/**
+ * @brief Drops the new manifest, the previous one stays.
+ *
+ * @param job The chunking of the file.
+ */
+void chunking_abort(chunk_job_t* job) {
+    if (job->manifest) {
+        fclose(job->manifest);
+        job->manifest = NULL;
+        unlink(job->tmp);
+    }
+    free(job->previous);
+    job->previous = NULL;
+    memset(job->diff, 0, sizeof(*job->diff));
+    job->diff->status = CHUNKS_FAILED;
+}
+
+/**
+ * @brief Name of a chunk status in the output.
+ *
+ * @param status The status.
+ * @return const char* "new", "changed", "busy" or "error", NULL for CHUNKS_NONE.
+ */
+const char* chunking_status_name(chunk_status_t status) {
+    switch (status) {
+        case CHUNKS_NEW: return "new";
+        case CHUNKS_CHANGED: return "changed";
+        case CHUNKS_SKIPPED_BUSY: return "busy";
+        case CHUNKS_FAILED: return "error";
+        default: return NULL;
+    }
+}
+
+/**
+ * @brief Formats the changed regions for the text log, as " {chunks=changed changed_bytes=N ranges=START-END,...}".
+ *
+ * @param diff The changed regions.
+ * @param out The buffer.
+ * @param size The size of out.
+ * @return int The length written, as snprintf().
+ */
+int chunking_format(const chunk_diff_t* diff, char* out, size_t size) {
+    const char* name = chunking_status_name(diff->status);
+    int len;
+
+    if (name == NULL) {
+        return 0;
+    }
+    if (diff->status != CHUNKS_CHANGED) {
+        return snprintf(out, size, " {chunks=%s}", name);
+    }
+    len = snprintf(out, size, " {chunks=changed changed_bytes=%lu ranges=", diff->changed_bytes);
+    for (uint32_t i = 0; i < diff->range_count && i < CHUNK_RANGES_MAX && len < (int)size; i++) {
+        len += snprintf(out + len, size - len, "%s%lu-%lu", i ? "," : "", diff->ranges[i].start, diff->ranges[i].end);
+    }
+    if (diff->range_count > CHUNK_RANGES_MAX && len < (int)size) {
+        len += snprintf(out + len, size - len, ",+%u more", diff->range_count - CHUNK_RANGES_MAX);
+    }
+    if (len < (int)size) {
+        len += snprintf(out + len, size - len, "}");
+    }
+    return len;
+}
+
+#endif
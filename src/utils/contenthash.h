@@ -0,0 +1,458 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/fanotify.h>
+#include "wrappers.h"
+#include "logger.h"
+#include "metrics.h"
+#include "xxh64.h"
+#include "chunking.h"
+
+#ifndef CONTENTHASH_H
+#define CONTENTHASH_H
+
+#define HASH_WORKERS_DEFAULT 2
+#define HASH_WORKERS_MAX 64
+#define HASH_QUEUE_DEFAULT 256
+#define HASH_QUEUE_MAX 65536
+#define HASH_MAX_SIZE_DEFAULT 256      // MB
+#define HASH_MAX_SIZE_MAX (1024 * 1024)
+#define HASH_CACHE_ENTRIES 16384       // A power of two
+#define HASH_READ_SIZE (1024 * 1024)
+#define HASH_REPORT_INTERVAL_NS 1000000000ULL
+
+#ifdef FAN_OPEN_EXEC
+#define HASH_EVENTS_MASK (FAN_CLOSE_WRITE | FAN_OPEN_EXEC)
+#else
+#define HASH_EVENTS_MASK FAN_CLOSE_WRITE
+#endif
+
+/*
+ * Content hashing (--hash). The file of every FAN_CLOSE_WRITE and FAN_OPEN_EXEC event is hashed
+ * with XXH64 through the fd fanotify hands over, so the read does not raise events of its own.
+ * The read/write/execute thread only does an fstat(): a file whose (dev, ino, mtime, size) is in
+ * the cache is emitted at once with the hash it had, any other one is queued with its fd for the
+ * worker threads and emitted once it is hashed. The queue is a ring of --hash-queue jobs, emitted
+ * in the order they were queued. When it is full, or the file is larger than --hash-max-size,
+ * the event is emitted without waiting and says why it has no hash. The workers read with large
+ * pread() calls rather than mmap(), a file truncated while it is hashed would raise SIGBUS.
+ * The same workers cut the files of --chunk into chunks (chunking.h). Those jobs also hash the
+ * file, but skip the cache and --hash-max-size: their manifest has to follow every close.
+ */
+typedef enum {
+    HASH_NONE,                     // The event is not hashed, not a regular file
+    HASH_DONE,
+    HASH_SKIPPED_BUSY,             // The queue was full
+    HASH_SKIPPED_SIZE,             // Larger than --hash-max-size
+    HASH_FAILED                    // The file could not be read
+} content_hash_status_t;
+
+typedef struct {
+    content_hash_status_t status;
+    uint64_t value;                // XXH64 of the content when status is HASH_DONE
+} content_hash_t;
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;                  // 0 if the entry is free
+    uint64_t mtime_ns;
+    uint64_t size;
+} hash_file_key_t;
+
+typedef struct {
+    hash_file_key_t key;
+    uint64_t value;
+} hash_cache_entry_t;
+
+typedef struct {
+    int fd;                        // The fanotify event fd, closed by the worker
+    int pid;
+    uint64_t mask;
+    char comm[PROC_NAME_LEN];
+    char path[PATH_MAX];
+    uint64_t path_hash;
+    hash_file_key_t key;
+    int want_hash;                 // --hash applies to the event
+    int chunk;                     // --chunk applies to the event
+    content_hash_t hash;
+    chunk_diff_t changes;
+    int done;
+} hash_job_t;
+
+typedef struct ContentHashing {
+    int enabled;                   // The workers run, for --hash or --chunk
+    int hash_all;                  // --hash
+    int workers;
+    uint64_t max_size;             // Bytes
+    uint32_t capacity;             // Jobs in the ring
+    hash_job_t* jobs;
+    uint64_t head;                 // Next job to emit
+    uint64_t next;                 // Next job for a worker
+    uint64_t tail;                 // Next job to queue
+    int stopping;
+    int wake_fd;                   // eventfd, the read/write/execute thread polls it for done jobs
+    pthread_mutex_t lock;          // Guards the cursors, the done flags and the cache
+    pthread_cond_t work;
+    pthread_t threads[HASH_WORKERS_MAX];
+    uint64_t skipped;              // Busy skips since the last report, read/write/execute thread only
+    uint64_t last_report_ns;
+    hash_cache_entry_t cache[HASH_CACHE_ENTRIES];
+} content_hashing_t;
+
+typedef void (*hashing_emit_fn)(hash_job_t* job);
+
+void hashing_init(int workers, int queue, int max_size_mb, int hash_all);
+int hashing_submit(int fd, int pid, const char* comm, const char* path, uint64_t path_hash, uint64_t mask, content_hash_t* hash, chunk_diff_t* changes);
+void hashing_drain(hashing_emit_fn emit);
+void hashing_report(int force);
+int hashing_format(const content_hash_t* hash, char* out, size_t size);
+const char* hashing_skip_reason(content_hash_status_t status);
+void hashing_stop();
+void collect_hashing(FILE* out, void* arg);
+
+content_hashing_t g_hashing = { .enabled = 0, .wake_fd = -1 };
+
+static inline uint64_t hashing_clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline hash_file_key_t hashing_key(const struct stat* st) {
+    return (hash_file_key_t){
+        .dev = st->st_dev,
+        .ino = st->st_ino,
+        .mtime_ns = (uint64_t)st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec,
+        .size = st->st_size,
+    };
+}
+
+static inline hash_cache_entry_t* hashing_cache_slot(const hash_file_key_t* key) {
+    uint64_t mix = (key->ino ^ (key->dev << 32) ^ (key->dev >> 32)) * XXH_PRIME64_1;
+    return &g_hashing.cache[(mix >> 32) & (HASH_CACHE_ENTRIES - 1)];
+}
+
+/**
+ * @brief Hashes the file of a job.
+ *
+ * @param job The job, its fd is left open.
+ * @param buffer HASH_READ_SIZE bytes.
+ * @return int 1 if the file did not change while it was read, so the hash can be cached.
+ */
+static int hashing_file(hash_job_t* job, unsigned char* buffer) {
+    xxh64_state_t state;
+    chunk_job_t chunks;
+    struct stat st;
+    off_t offset = 0;
+    ssize_t ret;
+    int chunking = job->chunk;
+
+    posix_fadvise(job->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    xxh64_init(&state);
+    // A tracked file is cut into chunks in the same pass, whatever its size
+    if (chunking && !chunking_begin(&chunks, job->path, job->path_hash, &job->changes)) {
+        job->changes.status = CHUNKS_FAILED;
+        chunking = 0;
+    }
+    while ((ret = pread(job->fd, buffer, HASH_READ_SIZE, offset)) != 0) {
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            job->hash.status = HASH_FAILED;
+            if (chunking) {
+                chunking_abort(&chunks);
+            }
+            return 0;
+        }
+        offset += ret;
+        if (!job->chunk && (uint64_t)offset > g_hashing.max_size) {
+            job->hash.status = HASH_SKIPPED_SIZE;
+            return 0;
+        }
+        xxh64_update(&state, buffer, ret);
+        if (chunking) {
+            chunker_feed(&chunks.chunker, buffer, ret);
+        }
+    }
+    metrics_add(METRIC_HASH_BYTES, offset);
+    job->hash.status = HASH_DONE;
+    job->hash.value = xxh64_digest(&state);
+    if (chunking && chunking_end(&chunks, offset, job->key.mtime_ns)) {
+        metrics_inc(METRIC_CHUNKED_FILES);
+        metrics_add(METRIC_CHANGED_BYTES, job->changes.changed_bytes);
+    }
+    if (fstat(job->fd, &st) == -1) {
+        return 0;
+    }
+    hash_file_key_t after = hashing_key(&st);
+    return memcmp(&after, &job->key, sizeof(after)) == 0 && (uint64_t)offset == job->key.size;
+}
+
+static void* hashing_worker(void* arg) {
+    unsigned char* buffer = malloc(HASH_READ_SIZE);
+    (void)arg;
+
+    if (buffer == NULL) {
+        log_message(ERROR, 1, "Failed to allocate memory to a hash worker\n");
+        exit(EXIT_FAILURE);
+    }
+    metrics_register_thread();
+    pthread_mutex_lock(&g_hashing.lock);
+    while (1) {
+        while (!g_hashing.stopping && g_hashing.next == g_hashing.tail) {
+            pthread_cond_wait(&g_hashing.work, &g_hashing.lock);
+        }
+        if (g_hashing.stopping) {
+            break;
+        }
+        // The job is not reused before it is emitted, so it is read and filled without the lock
+        hash_job_t* job = &g_hashing.jobs[g_hashing.next++ % g_hashing.capacity];
+        pthread_mutex_unlock(&g_hashing.lock);
+
+        int unchanged = hashing_file(job, buffer);
+        close(job->fd);
+        job->fd = -1;
+        if (job->want_hash) {
+            metrics_inc(job->hash.status == HASH_DONE ? METRIC_HASH_DONE : (job->hash.status == HASH_SKIPPED_SIZE ? METRIC_HASH_TOO_LARGE : METRIC_HASH_ERRORS));
+        } else {
+            job->hash.status = HASH_NONE;
+        }
+
+        pthread_mutex_lock(&g_hashing.lock);
+        if (unchanged) {
+            hash_cache_entry_t* entry = hashing_cache_slot(&job->key);
+            entry->key = job->key;
+            entry->value = job->hash.value;
+        }
+        job->done = 1;
+        pthread_mutex_unlock(&g_hashing.lock);
+        uint64_t one = 1;
+        if (write(g_hashing.wake_fd, &one, sizeof(one)) == -1) {
+            log_message(DEBUG, 1, "Failed to wake the read/write/execute thread (%s)\n", strerror(errno));
+        }
+        pthread_mutex_lock(&g_hashing.lock);
+    }
+    pthread_mutex_unlock(&g_hashing.lock);
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * @brief Starts the hash workers.
+ *
+ * @param workers Number of worker threads.
+ * @param queue Jobs that can wait or be hashed at once, beyond that events are not hashed.
+ * @param max_size_mb Larger files are not hashed.
+ * @param hash_all Hash every close-write and exec event (--hash), otherwise only the files of --chunk.
+ */
+void hashing_init(int workers, int queue, int max_size_mb, int hash_all) {
+    g_hashing.hash_all = hash_all;
+    g_hashing.workers = workers;
+    g_hashing.capacity = queue;
+    g_hashing.max_size = (uint64_t)max_size_mb * 1024 * 1024;
+    g_hashing.head = g_hashing.next = g_hashing.tail = 0;
+    g_hashing.stopping = 0;
+    g_hashing.last_report_ns = hashing_clock_ns();
+    memset(g_hashing.cache, 0, sizeof(g_hashing.cache));
+    g_hashing.jobs = (hash_job_t*)calloc(queue, sizeof(hash_job_t));
+    if (g_hashing.jobs == NULL) {
+        log_message(ERROR, 1, "Unable to malloc for the hash queue\n");
+        exit(EXIT_FAILURE);
+    }
+    g_hashing.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (g_hashing.wake_fd == -1) {
+        log_message(ERROR, 1, "Failed to create eventfd for hashing (%s)\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&g_hashing.lock, NULL);
+    pthread_cond_init(&g_hashing.work, NULL);
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&g_hashing.threads[i], NULL, hashing_worker, NULL) != 0) {
+            log_message(ERROR, 1, "Failed to create thread for hashing\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    g_hashing.enabled = 1;
+    metrics_add_collector(collect_hashing, NULL);
+}
+
+/**
+ * @brief Hashes the file of an event, or tells why it is not hashed. Called by the read/write/execute thread.
+ *
+ * @param fd The event fd.
+ * @param pid The PID of the event.
+ * @param comm The process name of the PID.
+ * @param path The path of the event.
+ * @param path_hash hash_string() of path, or 0.
+ * @param mask The event mask.
+ * @param hash Set when the event is to be emitted now: the cached hash, or why there is none.
+ * @param changes Set when the event is to be emitted now, CHUNKS_SKIPPED_BUSY for a tracked file.
+ * @return int 1 if the event was queued, it then owns fd and is emitted by hashing_drain().
+ */
+int hashing_submit(int fd, int pid, const char* comm, const char* path, uint64_t path_hash, uint64_t mask, content_hash_t* hash, chunk_diff_t* changes) {
+    int want_hash = g_hashing.hash_all && (mask & HASH_EVENTS_MASK);
+    int chunk = g_chunking.enabled && (mask & FAN_CLOSE_WRITE) && chunking_match(path);
+    struct stat st;
+
+    hash->status = HASH_NONE;
+    changes->status = CHUNKS_NONE;
+    if ((!want_hash && !chunk) || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    if (!chunk && (uint64_t)st.st_size > g_hashing.max_size) {
+        hash->status = HASH_SKIPPED_SIZE;
+        metrics_inc(METRIC_HASH_TOO_LARGE);
+        return 0;
+    }
+
+    hash_file_key_t key = hashing_key(&st);
+    pthread_mutex_lock(&g_hashing.lock);
+    // A tracked file is always cut again, its manifest has to follow the file
+    hash_cache_entry_t* entry = hashing_cache_slot(&key);
+    if (!chunk && memcmp(&entry->key, &key, sizeof(key)) == 0) {
+        hash->status = HASH_DONE;
+        hash->value = entry->value;
+        pthread_mutex_unlock(&g_hashing.lock);
+        metrics_inc(METRIC_HASH_CACHED);
+        return 0;
+    }
+    if (g_hashing.tail - g_hashing.head == g_hashing.capacity) {
+        pthread_mutex_unlock(&g_hashing.lock);
+        hash->status = want_hash ? HASH_SKIPPED_BUSY : HASH_NONE;
+        changes->status = chunk ? CHUNKS_SKIPPED_BUSY : CHUNKS_NONE;
+        g_hashing.skipped++;
+        metrics_inc(METRIC_HASH_BUSY);
+        return 0;
+    }
+    hash_job_t* job = &g_hashing.jobs[g_hashing.tail % g_hashing.capacity];
+    job->fd = fd;
+    job->pid = pid;
+    job->mask = mask;
+    snprintf(job->comm, sizeof(job->comm), "%s", comm);
+    snprintf(job->path, sizeof(job->path), "%s", path);
+    job->path_hash = path_hash ? path_hash : hash_string(path);
+    job->key = key;
+    job->want_hash = want_hash;
+    job->chunk = chunk;
+    job->hash.status = HASH_NONE;
+    job->changes.status = CHUNKS_NONE;
+    job->done = 0;
+    g_hashing.tail++;
+    pthread_cond_signal(&g_hashing.work);
+    pthread_mutex_unlock(&g_hashing.lock);
+    return 1;
+}
+
+/**
+ * @brief Emits the hashed jobs, in the order they were queued. Called by the read/write/execute thread.
+ *
+ * @param emit Called for each job.
+ */
+void hashing_drain(hashing_emit_fn emit) {
+    uint64_t count;
+
+    if (read(g_hashing.wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        log_message(DEBUG, 1, "Failed to read the hash eventfd (%s)\n", strerror(errno));
+    }
+    pthread_mutex_lock(&g_hashing.lock);
+    while (g_hashing.head != g_hashing.tail && g_hashing.jobs[g_hashing.head % g_hashing.capacity].done) {
+        hash_job_t* job = &g_hashing.jobs[g_hashing.head % g_hashing.capacity];
+        // Emitting takes the output locks, the job stays ours until head moves past it
+        pthread_mutex_unlock(&g_hashing.lock);
+        emit(job);
+        pthread_mutex_lock(&g_hashing.lock);
+        g_hashing.head++;
+    }
+    pthread_mutex_unlock(&g_hashing.lock);
+}
+
+/**
+ * @brief Logs how many events were not hashed because the queue was full, at most once a second.
+ *
+ * @param force Log now.
+ */
+void hashing_report(int force) {
+    uint64_t now = hashing_clock_ns();
+    if (g_hashing.skipped == 0 || (!force && now - g_hashing.last_report_ns < HASH_REPORT_INTERVAL_NS)) {
+        return;
+    }
+    log_message(WARNING, 1, "%lu files not hashed, the hash queue of %u jobs is full.\n", g_hashing.skipped, g_hashing.capacity);
+    g_hashing.skipped = 0;
+    g_hashing.last_report_ns = now;
+}
+
+/**
+ * @brief Name of the reason a file was not hashed.
+ *
+ * @param status The status.
+ * @return const char* "busy", "too_large" or "error", NULL if the file was hashed or not meant to be.
+ */
+const char* hashing_skip_reason(content_hash_status_t status) {
+    switch (status) {
+        case HASH_SKIPPED_BUSY: return "busy";
+        case HASH_SKIPPED_SIZE: return "too_large";
+        case HASH_FAILED: return "error";
+        default: return NULL;
+    }
+}
+
+/**
+ * @brief Formats a hash for the text log, as " {xxh64=...}" or " {hash_skipped=...}".
+ *
+ * @param hash The hash.
+ * @param out The buffer.
+ * @param size The size of out.
+ * @return int The length written, as snprintf().
+ */
+int hashing_format(const content_hash_t* hash, char* out, size_t size) {
+    const char* reason = hashing_skip_reason(hash->status);
+    if (hash->status == HASH_DONE) {
+        return snprintf(out, size, " {xxh64=%016lx}", hash->value);
+    }
+    if (reason) {
+        return snprintf(out, size, " {hash_skipped=%s}", reason);
+    }
+    return 0;
+}
+
+/**
+ * @brief Stops the workers. Jobs still queued are not emitted.
+ *
+ */
+void hashing_stop() {
+    if (!g_hashing.enabled) {
+        return;
+    }
+    pthread_mutex_lock(&g_hashing.lock);
+    g_hashing.stopping = 1;
+    pthread_cond_broadcast(&g_hashing.work);
+    pthread_mutex_unlock(&g_hashing.lock);
+    hashing_report(1);
+}
+
+/**
+ * @brief Metrics collector for content hashing.
+ *
+ * @param out The metrics output stream.
+ * @param arg Unused.
+ */
+void collect_hashing(FILE* out, void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_hashing.lock);
+    uint64_t queued = g_hashing.tail - g_hashing.head;
+    pthread_mutex_unlock(&g_hashing.lock);
+    metrics_write_gauge(out, "filemon_content_hash_queue", NULL, "Files queued for hashing or being hashed.", queued);
+    metrics_write_gauge(out, "filemon_content_hash_queue_capacity", NULL, "Files that can be queued for hashing before events go out without a hash.", g_hashing.capacity);
+}
+
+#endif
@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include "wrappers.h"
+#include "logger.h"
+#include "metrics.h"
+#include "mounts.h"
+#include "monitor.h"
+#include "watchspec.h"
+#include "rules.h"
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#define CONTROL_LINE_MAX 8192
+#define CONTROL_IDLE_SECONDS 30
+
+/*
+ * Control socket (--control PATH), a Unix stream socket only root can connect to. Every line is a
+ * command, answered by zero or more lines of output and then "ok" or "error: <reason>":
+ *   add DIRECTORY [FILTER OPTIONS]   Start watching a directory, with -i/-e/-I/-E/-N/-X as for -W
+ *   remove DIRECTORY                 Stop watching a directory
+ *   roots                            List the watched directories and their filters
+ *   marks                            List the marked filesystems
+ *   stats                            The metrics, as served by --metrics
+ *   reload                           Read the filter config again, as SIGHUP does
+ * add and remove go through add_watch_root() and remove_watch_root(): the reader threads keep
+ * running and only the filesystems that change are marked or unmarked. One client is served at a
+ * time, which also keeps the changes in order.
+ */
+typedef struct Control {
+    char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    int listen_fd;
+    pthread_t listener;
+    monitor_box_t* m_box;
+} control_t;
+
+void control_init(char* path, monitor_box_t* m_box);
+void* control_listener_thread(void* arg);
+int control_command(FILE* out, char* line);
+void control_stop();
+
+control_t g_control = { .listen_fd = -1 };
+
+/**
+ * @brief Opens the control socket.
+ *
+ * @param path The socket path, or NULL to not open one.
+ * @param m_box The monitor box.
+ */
+void control_init(char* path, monitor_box_t* m_box) {
+    struct sockaddr_un addr;
+
+    if (path == NULL) {
+        return;
+    }
+    g_control.m_box = m_box;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_message(ERROR, 1, "Control socket path is too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strncpy(g_control.path, path, sizeof(g_control.path) - 1);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(addr.sun_path);
+
+    g_control.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (g_control.listen_fd == -1 || bind(g_control.listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        log_message(ERROR, 1, "Failed to bind control socket \"%s\" (%s)\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    // Whoever can connect decides what is watched
+    if (chmod(addr.sun_path, S_IRUSR | S_IWUSR) == -1 || listen(g_control.listen_fd, 4) == -1) {
+        log_message(ERROR, 1, "Failed to listen on control socket \"%s\" (%s)\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (pthread_create(&g_control.listener, NULL, control_listener_thread, NULL) != 0) {
+        log_message(ERROR, 1, "Failed to create thread for control socket\n");
+        exit(EXIT_FAILURE);
+    }
+    log_message(DEBUG, 1, "Accepting control commands on \"%s\"\n", path);
+}
+
+static void control_write_list(FILE* out, const char* name, int* pids, char (*names)[PROC_NAME_LEN]) {
+    if (pids != NULL && pids[0] != 0) {
+        fprintf(out, " %s=", name);
+        for (int i = 0; i < FILTER_MAX && pids[i] != 0; i++) {
+            fprintf(out, "%s%d", i ? "," : "", pids[i]);
+        }
+    } else if (names != NULL && names[0][0] != '\0') {
+        fprintf(out, " %s=", name);
+        for (int i = 0; i < FILTER_MAX && names[i][0] != '\0'; i++) {
+            fprintf(out, "%s%s", i ? "," : "", names[i]);
+        }
+    }
+}
+
+static void control_roots(FILE* out) {
+    monitor_box_t* m_box = g_control.m_box;
+
+    // Writers hold the lock, so the set cannot be freed while it is listed
+    pthread_mutex_lock(&m_box->watch_lock);
+    for (int i = 0; i < m_box->watch->root_count; i++) {
+        watch_root_t* root = m_box->watch->roots[i];
+        fprintf(out, "%s mount=%s", root->path, root->mount_path);
+        control_write_list(out, "include_pids", root->filters.include_pids, NULL);
+        control_write_list(out, "exclude_pids", root->filters.exclude_pids, NULL);
+        control_write_list(out, "include_process", NULL, root->filters.include_process);
+        control_write_list(out, "exclude_process", NULL, root->filters.exclude_process);
+        if (root->filters.include_pattern[0] != '\0') {
+            fprintf(out, " include_pattern=%s", root->filters.include_pattern);
+        }
+        if (root->filters.exclude_pattern[0] != '\0') {
+            fprintf(out, " exclude_pattern=%s", root->filters.exclude_pattern);
+        }
+        if (root->filters.follow_children) {
+            fprintf(out, " follow_children=1");
+        }
+        fprintf(out, "\n");
+    }
+    pthread_mutex_unlock(&m_box->watch_lock);
+}
+
+static void control_marks(FILE* out) {
+    pthread_mutex_lock(&g_mounts.lock);
+    for (int i = 0; i < MOUNT_TABLE_SIZE; i++) {
+        mount_fs_t* entry = &g_mounts.table[i];
+        if (entry->path == NULL) {
+            continue;
+        }
+        fprintf(out, "%s fsid=%08x:%08x", entry->path, (unsigned int)entry->fsid.val[0], (unsigned int)entry->fsid.val[1]);
+        for (int j = 0; j < entry->alias_count; j++) {
+            fprintf(out, " alias=%s", entry->alias_path[j]);
+        }
+        fprintf(out, "\n");
+    }
+    pthread_mutex_unlock(&g_mounts.lock);
+}
+
+/**
+ * @brief Runs one control command.
+ *
+ * @param out Where the output goes.
+ * @param line The command, without the newline. Overwritten.
+ * @return int 1 on success, 0 if an "error:" line was written.
+ */
+int control_command(FILE* out, char* line) {
+    char error[PATH_MAX + 256];
+    char* command = line;
+    char* argument;
+
+    while (*command == ' ' || *command == '\t') {
+        command++;
+    }
+    argument = command + strcspn(command, " \t");
+    if (*argument != '\0') {
+        *argument++ = '\0';
+        argument += strspn(argument, " \t");
+    }
+
+    if (strcmp(command, "add") == 0) {
+        filter_options_t* options = malloc(sizeof(filter_options_t));
+        filters_t* filters = malloc(sizeof(filters_t));
+        char* directory = NULL;
+        int ok = options != NULL && filters != NULL;
+        if (!ok) {
+            snprintf(error, sizeof(error), "Unable to malloc for filters");
+        } else if (!(ok = parse_watch_root(argument, options, &directory, error, sizeof(error)))) {
+            log_message(ERROR, 1, "Control socket: %s\n", error);
+        } else {
+            init_filters(filters, options->include_pids, options->exclude_pids,
+                         options->include_process, options->exclude_process,
+                         options->include_pattern, options->exclude_pattern);
+            ok = add_watch_root(g_control.m_box, directory, NULL, filters, error, sizeof(error)) != -1;
+        }
+        free(options);
+        free(filters);
+        if (!ok) {
+            fprintf(out, "error: %s\n", error);
+            return 0;
+        }
+    } else if (strcmp(command, "remove") == 0) {
+        if (*argument == '\0') {
+            fprintf(out, "error: Expected \"remove DIRECTORY\".\n");
+            return 0;
+        }
+        if (!remove_watch_root(g_control.m_box, argument, error, sizeof(error))) {
+            fprintf(out, "error: %s\n", error);
+            return 0;
+        }
+    } else if (strcmp(command, "roots") == 0) {
+        control_roots(out);
+    } else if (strcmp(command, "marks") == 0) {
+        control_marks(out);
+    } else if (strcmp(command, "stats") == 0) {
+        metrics_write(out);
+    } else if (strcmp(command, "reload") == 0) {
+        int version;
+        if (g_rules.path[0] == '\0') {
+            fprintf(out, "error: No filter config, start filemon with --filter-config.\n");
+            return 0;
+        }
+        if (!(version = rules_reload(1, error, sizeof(error)))) {
+            fprintf(out, "error: %s\n", error);
+            return 0;
+        }
+        fprintf(out, "version %d\n", version);
+    } else if (strcmp(command, "help") == 0) {
+        fprintf(out, "add DIRECTORY [FILTER OPTIONS]\nremove DIRECTORY\nroots\nmarks\nstats\nreload\n");
+    } else {
+        fprintf(out, "error: Unknown command \"%s\", try \"help\".\n", command);
+        return 0;
+    }
+    fprintf(out, "ok\n");
+    return 1;
+}
+
+/**
+ * @brief Serves one client at a time until it disconnects or stays idle for CONTROL_IDLE_SECONDS.
+ *
+ * @param arg Unused.
+ * @return void*
+ */
+void* control_listener_thread(void* arg) {
+    (void)arg;
+    char line[CONTROL_LINE_MAX];
+    struct timeval timeout = { .tv_sec = CONTROL_IDLE_SECONDS, .tv_usec = 0 };
+
+    while (1) {
+        int client = accept4(g_control.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        FILE* in = fdopen(client, "r");
+        if (in == NULL) {
+            close(client);
+            continue;
+        }
+        while (fgets(line, sizeof(line), in) != NULL) {
+            char* reply = NULL;
+            size_t reply_len = 0;
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] == '\0') {
+                continue;
+            }
+            // Replies are sent like the metrics, so a client that went away cannot raise SIGPIPE
+            FILE* out = open_memstream(&reply, &reply_len);
+            if (out == NULL) {
+                break;
+            }
+            control_command(out, line);
+            fclose(out);
+            ssize_t sent = send(client, reply, reply_len, MSG_NOSIGNAL);
+            free(reply);
+            if (sent == -1) {
+                break;
+            }
+        }
+        fclose(in);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Closes the control socket and removes it.
+ *
+ */
+void control_stop() {
+    if (g_control.listen_fd == -1) {
+        return;
+    }
+    close(g_control.listen_fd);
+    g_control.listen_fd = -1;
+    unlink(g_control.path);
+}
+
+#endif
@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+#include "wrappers.h"
+#include "logger.h"
+
+#ifndef DESCENDANTS_H
+#define DESCENDANTS_H
+
+#define DESCENDANTS_SLOTS 65536
+#define DESCENDANTS_EMPTY 0
+#define DESCENDANTS_TOMBSTONE -1
+#define DESCENDANTS_EXIT_QUEUE 4096
+#define DESCENDANTS_EXIT_GRACE_NS 2000000000ULL
+
+/*
+ * The included PIDs and every process forked from them since, for --follow-children.
+ * The set is kept up to date from the kernel proc connector (PROC_EVENT_FORK / PROC_EVENT_EXIT) by a
+ * single writer thread. Event threads only read it, without locks: the set is an open-addressing
+ * table of PIDs where a removed PID leaves a tombstone, so a probe chain is never cut short.
+ * Tombstones count against the load limit, and when live PIDs and tombstones reach it the writer
+ * rebuilds the table with the live PIDs only, so a miss always ends at an empty slot soon. Readers
+ * retry a lookup that overlapped a rebuild, from the seqlock of the table.
+ * An exited process stays in the set for a grace period, since its last file events may still be
+ * waiting in the fanotify queue when the exit arrives.
+ */
+typedef struct {
+    int pid;
+    uint64_t exited_ns;
+} descendant_exit_t;
+
+typedef struct Descendants {
+    int enabled;
+    int nl_fd;
+    int count;
+    int tombstones;                // Written by the connector thread only
+    uint32_t seq;                  // Odd while the table is rebuilt
+    int full_warned;
+    int roots[FILTER_MAX];
+    int slots[DESCENDANTS_SLOTS];
+    descendant_exit_t exits[DESCENDANTS_EXIT_QUEUE];   // FIFO of exited PIDs waiting to be removed
+    int exits_head;
+    int exits_count;
+    pthread_t thread;
+} descendants_t;
+
+void descendants_init(int* roots);
+int descendants_contains(int pid);
+void descendants_add(int pid);
+void descendants_remove(int pid);
+void descendants_seed();
+void descendants_expire(int force);
+void* descendants_thread(void* arg);
+
+descendants_t g_descendants = { .enabled = 0 };
+
+static inline unsigned int descendants_slot(int pid) {
+    return ((unsigned int)pid * 2654435761U) & (DESCENDANTS_SLOTS - 1);
+}
+
+static inline int descendants_probe(int pid) {
+    unsigned int slot = descendants_slot(pid);
+    for (int i = 0; i < DESCENDANTS_SLOTS; i++) {
+        int value = __atomic_load_n(&g_descendants.slots[slot], __ATOMIC_ACQUIRE);
+        if (value == pid) {
+            return 1;
+        }
+        if (value == DESCENDANTS_EMPTY) {
+            return 0;
+        }
+        slot = (slot + 1) & (DESCENDANTS_SLOTS - 1);
+    }
+    return 0;
+}
+
+/**
+ * @brief Checks if a PID is one of the followed processes. Safe to call from any thread.
+ *
+ * @param pid The PID.
+ * @return int 1 if followed, 0 otherwise.
+ */
+int descendants_contains(int pid) {
+    uint32_t seq;
+    int found;
+    do {
+        seq = __atomic_load_n(&g_descendants.seq, __ATOMIC_ACQUIRE);
+        found = descendants_probe(pid);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&g_descendants.seq, __ATOMIC_RELAXED));
+    return found;
+}
+
+// Rebuilds the table without its tombstones. Only called by the connector thread.
+static void descendants_rehash() {
+    static int live[DESCENDANTS_SLOTS];
+    int n = 0;
+
+    for (int i = 0; i < DESCENDANTS_SLOTS; i++) {
+        if (g_descendants.slots[i] > 0) {
+            live[n++] = g_descendants.slots[i];
+        }
+    }
+    __atomic_store_n(&g_descendants.seq, g_descendants.seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (int i = 0; i < DESCENDANTS_SLOTS; i++) {
+        __atomic_store_n(&g_descendants.slots[i], DESCENDANTS_EMPTY, __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < n; i++) {
+        unsigned int slot = descendants_slot(live[i]);
+        while (g_descendants.slots[slot] != DESCENDANTS_EMPTY) {
+            slot = (slot + 1) & (DESCENDANTS_SLOTS - 1);
+        }
+        __atomic_store_n(&g_descendants.slots[slot], live[i], __ATOMIC_RELAXED);
+    }
+    g_descendants.tombstones = 0;
+    __atomic_store_n(&g_descendants.seq, g_descendants.seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Adds a PID to the set. Only called by the connector thread, or before it starts.
+ *
+ * @param pid The PID.
+ */
+void descendants_add(int pid) {
+    unsigned int slot = descendants_slot(pid);
+    int tombstone = -1;
+
+    if (pid <= 0) {
+        return;
+    }
+    for (int i = 0; i < DESCENDANTS_SLOTS; i++) {
+        int value = g_descendants.slots[slot];
+        if (value == pid) {
+            return;
+        }
+        if (value == DESCENDANTS_TOMBSTONE && tombstone == -1) {
+            tombstone = slot;
+        }
+        if (value == DESCENDANTS_EMPTY) {
+            break;
+        }
+        slot = (slot + 1) & (DESCENDANTS_SLOTS - 1);
+    }
+
+    // Keep a quarter of the table empty so probe chains stay short, a reused tombstone takes no more
+    if (tombstone == -1 && g_descendants.count + g_descendants.tombstones >= DESCENDANTS_SLOTS / 4 * 3) {
+        if (g_descendants.count >= DESCENDANTS_SLOTS / 4 * 3) {
+            if (!g_descendants.full_warned) {
+                log_message(WARNING, 1, "Following too many processes, new children will not be included.\n");
+                g_descendants.full_warned = 1;
+            }
+            return;
+        }
+        descendants_rehash();
+        slot = descendants_slot(pid);
+        while (g_descendants.slots[slot] != DESCENDANTS_EMPTY) {
+            slot = (slot + 1) & (DESCENDANTS_SLOTS - 1);
+        }
+    }
+    if (tombstone != -1) {
+        slot = tombstone;
+        g_descendants.tombstones--;
+    }
+    __atomic_store_n(&g_descendants.slots[slot], pid, __ATOMIC_RELEASE);
+    __atomic_store_n(&g_descendants.count, g_descendants.count + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Removes a PID from the set. Only called by the connector thread.
+ *
+ * @param pid The PID.
+ */
+void descendants_remove(int pid) {
+    unsigned int slot = descendants_slot(pid);
+    for (int i = 0; i < DESCENDANTS_SLOTS; i++) {
+        int value = g_descendants.slots[slot];
+        if (value == DESCENDANTS_EMPTY) {
+            return;
+        }
+        if (value == pid) {
+            __atomic_store_n(&g_descendants.slots[slot], DESCENDANTS_TOMBSTONE, __ATOMIC_RELEASE);
+            __atomic_store_n(&g_descendants.count, g_descendants.count - 1, __ATOMIC_RELAXED);
+            g_descendants.tombstones++;
+            return;
+        }
+        slot = (slot + 1) & (DESCENDANTS_SLOTS - 1);
+    }
+}
+
+static int read_ppid(int pid) {
+    char path[32];
+    char stat[512];
+    int ppid = -1;
+    FILE* file;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    file = fopen(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    if (fgets(stat, sizeof(stat), file)) {
+        // comm may contain spaces and parentheses, the fields resume after the last ')'
+        char* fields = strrchr(stat, ')');
+        if (fields == NULL || sscanf(fields + 1, " %*c %d", &ppid) != 1) {
+            ppid = -1;
+        }
+    }
+    fclose(file);
+    return ppid;
+}
+
+/**
+ * @brief Adds the included PIDs and all their running descendants from a /proc scan, and drops
+ * PIDs that no longer exist. Used at startup and after the connector lost messages.
+ */
+void descendants_seed() {
+    int capacity = 1024, n = 0, added;
+    int (*procs)[2] = malloc(capacity * sizeof(*procs));
+    DIR* dir = opendir("/proc");
+    struct dirent* entry;
+
+    if (procs == NULL || dir == NULL) {
+        log_message(ERROR, 1, "Failed to scan /proc for child processes\n");
+        exit(EXIT_FAILURE);
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (!is_valid_integer(entry->d_name)) {
+            continue;
+        }
+        if (n == capacity) {
+            capacity *= 2;
+            procs = realloc(procs, capacity * sizeof(*procs));
+            if (procs == NULL) {
+                log_message(ERROR, 1, "Failed to allocate memory to scan /proc\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        procs[n][0] = atoi(entry->d_name);
+        procs[n][1] = read_ppid(procs[n][0]);
+        n++;
+    }
+    closedir(dir);
+
+    for (int i = 0; i < DESCENDANTS_SLOTS; i++) {
+        int pid = g_descendants.slots[i];
+        if (pid > 0 && kill(pid, 0) == -1 && errno == ESRCH) {
+            descendants_remove(pid);
+        }
+    }
+    for (int i = 0; i < FILTER_MAX && g_descendants.roots[i] != 0; i++) {
+        descendants_add(g_descendants.roots[i]);
+    }
+    // Pull in children of followed processes until nothing changes, /proc is not in tree order
+    do {
+        added = 0;
+        for (int i = 0; i < n; i++) {
+            if (procs[i][1] > 0 && !descendants_contains(procs[i][0]) && descendants_contains(procs[i][1])) {
+                descendants_add(procs[i][0]);
+                added |= descendants_contains(procs[i][0]);
+            }
+        }
+    } while (added);
+    free(procs);
+}
+
+static inline uint64_t descendants_clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Removes exited processes whose grace period is over. Only called by the connector thread.
+ *
+ * @param force Remove the oldest one regardless, to make room in the queue.
+ */
+void descendants_expire(int force) {
+    uint64_t now = descendants_clock_ns();
+    while (g_descendants.exits_count > 0) {
+        descendant_exit_t* oldest = &g_descendants.exits[g_descendants.exits_head];
+        if (!force && now - oldest->exited_ns < DESCENDANTS_EXIT_GRACE_NS) {
+            break;
+        }
+        descendants_remove(oldest->pid);
+        g_descendants.exits_head = (g_descendants.exits_head + 1) % DESCENDANTS_EXIT_QUEUE;
+        g_descendants.exits_count--;
+        force = 0;
+    }
+}
+
+/**
+ * @brief Subscribes to the proc connector, seeds the set and starts the connector thread.
+ *
+ * @param roots The included PIDs, terminated by 0.
+ */
+void descendants_init(int* roots) {
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = CN_IDX_PROC, .nl_pid = 0 };
+    struct __attribute__((aligned(NLMSG_ALIGNTO))) {
+        struct nlmsghdr hdr;
+        struct __attribute__((packed)) {
+            struct cn_msg msg;
+            enum proc_cn_mcast_op op;
+        } body;
+    } request;
+
+    memcpy(g_descendants.roots, roots, sizeof(g_descendants.roots));
+    g_descendants.nl_fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+    if (g_descendants.nl_fd == -1) {
+        log_message(ERROR, 1, "Failed to open the proc connector: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    // Wake up every second to expire exited processes
+    struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+    setsockopt(g_descendants.nl_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (bind(g_descendants.nl_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        log_message(ERROR, 1, "Failed to bind the proc connector: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&request, 0, sizeof(request));
+    request.hdr.nlmsg_len = sizeof(request);
+    request.hdr.nlmsg_type = NLMSG_DONE;
+    request.hdr.nlmsg_pid = getpid();
+    request.body.msg.id.idx = CN_IDX_PROC;
+    request.body.msg.id.val = CN_VAL_PROC;
+    request.body.msg.len = sizeof(enum proc_cn_mcast_op);
+    request.body.op = PROC_CN_MCAST_LISTEN;
+    if (send(g_descendants.nl_fd, &request, sizeof(request), 0) == -1) {
+        log_message(ERROR, 1, "Failed to subscribe to process events: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    // Subscribed first, so a fork during the scan is queued on the socket rather than missed
+    descendants_seed();
+    g_descendants.enabled = 1;
+    if (pthread_create(&g_descendants.thread, NULL, descendants_thread, NULL) != 0) {
+        log_message(ERROR, 1, "Failed to create thread for process events\n");
+        exit(EXIT_FAILURE);
+    }
+    log_message(INFO, 1, "Following %d processes and their children.\n", g_descendants.count);
+}
+
+/**
+ * @brief Connector thread, the only writer of the set after startup.
+ *
+ * @param arg Unused.
+ * @return void*
+ */
+void* descendants_thread(void* arg) {
+    char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+    (void)arg;
+
+    while (1) {
+        ssize_t len = recv(g_descendants.nl_fd, buf, sizeof(buf), 0);
+        descendants_expire(0);
+        if (len == -1) {
+            if (errno == ENOBUFS) {
+                log_message(WARNING, 1, "Process events were lost, rescanning /proc.\n");
+                descendants_seed();
+            }
+            continue;
+        }
+        for (struct nlmsghdr* hdr = (struct nlmsghdr*)buf; NLMSG_OK(hdr, len); hdr = NLMSG_NEXT(hdr, len)) {
+            if (hdr->nlmsg_type == NLMSG_NOOP || hdr->nlmsg_type == NLMSG_ERROR) {
+                continue;
+            }
+            struct cn_msg* msg = (struct cn_msg*)NLMSG_DATA(hdr);
+            struct proc_event* event = (struct proc_event*)msg->data;
+            switch (event->what) {
+                case PROC_EVENT_FORK:
+                    // New processes only, threads share the followed tgid already
+                    if (event->event_data.fork.child_pid == event->event_data.fork.child_tgid &&
+                        descendants_contains(event->event_data.fork.parent_tgid)) {
+                        descendants_add(event->event_data.fork.child_tgid);
+                    }
+                    break;
+                case PROC_EVENT_EXIT:
+                    if (event->event_data.exit.process_pid == event->event_data.exit.process_tgid &&
+                        descendants_contains(event->event_data.exit.process_tgid)) {
+                        if (g_descendants.exits_count == DESCENDANTS_EXIT_QUEUE) {
+                            descendants_expire(1);
+                        }
+                        descendant_exit_t* exited = &g_descendants.exits[(g_descendants.exits_head + g_descendants.exits_count) % DESCENDANTS_EXIT_QUEUE];
+                        exited->pid = event->event_data.exit.process_tgid;
+                        exited->exited_ns = descendants_clock_ns();
+                        g_descendants.exits_count++;
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/fanotify.h>
+#include "logger.h"
+#include "probes.h"
+
+#ifndef FEATURES_H
+#define FEATURES_H
+
+/*
+ * What the running kernel's fanotify supports, found by asking it: a throwaway group is created with
+ * each fanotify_init() flag, and each mark type and mask bit is tried on the watched directory. This
+ * works without /boot/config-* (containers, minimal images) and reflects the kernel that is actually
+ * running rather than the headers filemon was built against.
+ * Mask bits are tried with FAN_MARK_REMOVE of a mark that does not exist. The kernel checks the flags
+ * and mask before it looks for the mark, so ENOENT means supported and EINVAL means not. Any other
+ * error (EPERM, ENODEV, EXDEV on a filesystem that cannot be marked so) says nothing about the
+ * kernel, the feature is left off and the error is logged. No mark is
+ * ever added: closing a group that held one waits for an SRCU grace period (10ms+ each), while this
+ * way the whole probe is a few dozen syscalls. It is done once and kept in g_features.
+ */
+typedef struct Features {
+    int probed;
+    int fanotify;                  // fanotify_init() works at all
+    int init_errno;                // Why it did not
+    int permission_events;         // FAN_CLASS_CONTENT and FAN_OPEN_PERM / FAN_ACCESS_PERM
+    int open_exec;                 // FAN_OPEN_EXEC (5.0)
+    int open_exec_perm;            // FAN_OPEN_EXEC_PERM (5.0)
+    int mark_filesystem;           // FAN_MARK_FILESYSTEM (4.20)
+    int report_dfid_name;          // FAN_REPORT_DFID_NAME (5.9)
+    int report_target_fid;         // FAN_REPORT_TARGET_FID (5.17)
+    int report_pidfd;              // FAN_REPORT_PIDFD (5.15)
+    int rename;                    // FAN_RENAME (5.17)
+    uint64_t probe_ns;
+} features_t;
+
+void features_probe(const char* path);
+void print_features();
+
+features_t g_features = { .probed = 0 };
+
+static int features_try_init(unsigned int flags, unsigned int event_f_flags) {
+    int fd = fanotify_init(flags | FAN_CLOEXEC | FAN_NONBLOCK, event_f_flags);
+    if (fd != -1) {
+        close(fd);
+        return 1;
+    }
+    return 0;
+}
+
+static int features_try_mark(int group_fd, unsigned int mark_flags, uint64_t mask, const char* path, const char* name) {
+    if (group_fd == -1) {
+        return 0;
+    }
+    if (fanotify_mark(group_fd, FAN_MARK_REMOVE | mark_flags, mask, AT_FDCWD, path) == 0 || errno == ENOENT) {
+        return 1;
+    }
+    if (errno != EINVAL) {
+        log_message(WARNING, 1, "Unable to probe %s on \"%s\": %s\n", name, path, strerror(errno));
+    }
+    return 0;
+}
+
+/**
+ * @brief Probes the fanotify features of the running kernel. Only the first call does any work.
+ *
+ * @param path A directory to place the probe marks on, the watched directory.
+ */
+void features_probe(const char* path) {
+    uint64_t start = probe_clock_ns();
+    int fd;
+
+    if (g_features.probed) {
+        return;
+    }
+    g_features.probed = 1;
+
+    fd = fanotify_init(FAN_CLOEXEC | FAN_NONBLOCK | FAN_CLASS_NOTIF, O_RDONLY);
+    if (fd == -1) {
+        g_features.init_errno = errno;
+        g_features.probe_ns = probe_clock_ns() - start;
+        return;
+    }
+    g_features.fanotify = 1;
+    #ifdef FAN_OPEN_EXEC
+    g_features.open_exec = features_try_mark(fd, 0, FAN_OPEN_EXEC, path, "FAN_OPEN_EXEC");
+    #endif
+    #ifdef FAN_MARK_FILESYSTEM
+    g_features.mark_filesystem = features_try_mark(fd, FAN_MARK_FILESYSTEM, FAN_CLOSE_NOWRITE, path, "FAN_MARK_FILESYSTEM");
+    #endif
+    close(fd);
+
+    // Without CONFIG_FANOTIFY_ACCESS_PERMISSIONS either the group or the mark is refused
+    fd = fanotify_init(FAN_CLOEXEC | FAN_NONBLOCK | FAN_CLASS_CONTENT, O_RDONLY);
+    if (fd != -1) {
+        g_features.permission_events = features_try_mark(fd, 0, FAN_OPEN_PERM | FAN_ACCESS_PERM, path, "permission events");
+        #ifdef FAN_OPEN_EXEC_PERM
+        g_features.open_exec_perm = g_features.permission_events && features_try_mark(fd, 0, FAN_OPEN_EXEC_PERM, path, "FAN_OPEN_EXEC_PERM");
+        #endif
+        close(fd);
+    }
+
+    #ifdef FAN_REPORT_DFID_NAME
+    fd = fanotify_init(FAN_CLOEXEC | FAN_NONBLOCK | FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME, O_RDONLY);
+    if (fd != -1) {
+        g_features.report_dfid_name = 1;
+        #ifdef FAN_RENAME
+        g_features.rename = features_try_mark(fd, 0, FAN_RENAME | FAN_ONDIR, path, "FAN_RENAME");
+        #endif
+        close(fd);
+    }
+    #endif
+
+    #ifdef FAN_REPORT_TARGET_FID
+    g_features.report_target_fid = g_features.report_dfid_name &&
+        features_try_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_REPORT_FID | FAN_REPORT_TARGET_FID, O_RDONLY);
+    #endif
+
+    #ifdef FAN_REPORT_PIDFD
+    g_features.report_pidfd = features_try_init(FAN_CLASS_NOTIF | FAN_REPORT_PIDFD, O_RDONLY);
+    #endif
+
+    g_features.probe_ns = probe_clock_ns() - start;
+}
+
+/**
+ * @brief Prints the probed feature matrix, as part of print_box().
+ */
+void print_features() {
+    log_message(NIL, 0, "- Fanotify: %d\n", g_features.fanotify);
+    log_message(NIL, 0, "- FAN_OPEN_EXEC: %d\n", g_features.open_exec);
+    log_message(NIL, 0, "- Permission Events: %d (FAN_OPEN_EXEC_PERM: %d)\n", g_features.permission_events, g_features.open_exec_perm);
+    log_message(NIL, 0, "- FAN_MARK_FILESYSTEM: %d\n", g_features.mark_filesystem);
+    log_message(NIL, 0, "- FAN_REPORT_DFID_NAME: %d (FAN_REPORT_TARGET_FID: %d)\n", g_features.report_dfid_name, g_features.report_target_fid);
+    log_message(NIL, 0, "- FAN_RENAME: %d\n", g_features.rename);
+    log_message(NIL, 0, "- FAN_REPORT_PIDFD: %d\n", g_features.report_pidfd);
+}
+
+#endif
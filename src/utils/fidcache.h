@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/fanotify.h>
+#include "wrappers.h"
+#include "metrics.h"
+
+#ifndef FIDCACHE_H
+#define FIDCACHE_H
+
+#define DIR_CACHE_SIZE 1024
+#define DIR_HANDLE_MAX 128
+
+#ifdef FAN_RENAME
+#define DIR_CACHE_INVALIDATE_MASK (FAN_DELETE | FAN_RENAME | FAN_MOVED_FROM | FAN_MOVED_TO)
+#else
+#define DIR_CACHE_INVALIDATE_MASK (FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO)
+#endif
+
+/*
+ * Directory handle to path cache for the create/delete/move group. Every event names its parent
+ * directory by file handle, and turning a handle into a path costs an open_by_handle_at() and a
+ * readlink(). Directories are few and hot, so resolved paths are kept in a direct-mapped table keyed
+ * by (fsid, handle). Renaming or deleting a directory changes the path of everything below it, so
+ * any such event flushes the whole table. Only the create/delete/move thread uses it.
+ */
+typedef struct {
+    uint64_t hash;                  // 0 if the slot is free
+    __kernel_fsid_t fsid;
+    int handle_type;
+    unsigned int handle_bytes;
+    unsigned char handle[DIR_HANDLE_MAX];
+    char* path;
+} dir_cache_entry_t;
+
+typedef struct DirCache {
+    dir_cache_entry_t entries[DIR_CACHE_SIZE];
+} dir_cache_t;
+
+int resolve_fid_path(int mount_fd, const struct fanotify_event_info_fid* fid, char* out, size_t size);
+void dir_cache_put(const struct fanotify_event_info_fid* fid, const char* path);
+void dir_cache_flush();
+
+dir_cache_t g_dir_cache;
+
+static uint64_t dir_cache_hash(const struct fanotify_event_info_fid* fid, const struct file_handle* handle) {
+    // FNV-1a over fsid, handle type and handle bytes
+    uint64_t hash = 14695981039346656037ULL;
+    const unsigned char* fsid = (const unsigned char*)&fid->fsid;
+    for (size_t i = 0; i < sizeof(fid->fsid); i++) {
+        hash = (hash ^ fsid[i]) * 1099511628211ULL;
+    }
+    hash = (hash ^ (uint32_t)handle->handle_type) * 1099511628211ULL;
+    for (unsigned int i = 0; i < handle->handle_bytes; i++) {
+        hash = (hash ^ handle->f_handle[i]) * 1099511628211ULL;
+    }
+    return hash | 1;
+}
+
+static dir_cache_entry_t* dir_cache_find(const struct fanotify_event_info_fid* fid, const struct file_handle* handle, uint64_t hash) {
+    dir_cache_entry_t* entry = &g_dir_cache.entries[hash % DIR_CACHE_SIZE];
+    if (entry->hash == hash && entry->handle_type == handle->handle_type &&
+        entry->handle_bytes == handle->handle_bytes &&
+        memcmp(&entry->fsid, &fid->fsid, sizeof(entry->fsid)) == 0 &&
+        memcmp(entry->handle, handle->f_handle, handle->handle_bytes) == 0) {
+        return entry;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Remembers the path of a directory handle.
+ *
+ * @param fid The record holding the directory handle.
+ * @param path The directory path.
+ */
+void dir_cache_put(const struct fanotify_event_info_fid* fid, const char* path) {
+    const struct file_handle* handle = (const struct file_handle*)fid->handle;
+    if (handle->handle_bytes > DIR_HANDLE_MAX) {
+        return;
+    }
+    uint64_t hash = dir_cache_hash(fid, handle);
+    dir_cache_entry_t* entry = &g_dir_cache.entries[hash % DIR_CACHE_SIZE];
+
+    free(entry->path);
+    entry->path = strdup(path);
+    if (entry->path == NULL) {
+        entry->hash = 0;
+        return;
+    }
+    entry->hash = hash;
+    entry->fsid = fid->fsid;
+    entry->handle_type = handle->handle_type;
+    entry->handle_bytes = handle->handle_bytes;
+    memcpy(entry->handle, handle->f_handle, handle->handle_bytes);
+}
+
+/**
+ * @brief Forgets every cached directory path.
+ */
+void dir_cache_flush() {
+    for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+        if (g_dir_cache.entries[i].hash != 0) {
+            free(g_dir_cache.entries[i].path);
+            g_dir_cache.entries[i].path = NULL;
+            g_dir_cache.entries[i].hash = 0;
+        }
+    }
+}
+
+/**
+ * @brief Resolves a FID info record to a path, "<directory>/<name>" for the *_NAME record types.
+ *
+ * @param mount_fd A directory on the filesystem the handle belongs to.
+ * @param fid The info record.
+ * @param out The output buffer.
+ * @param size Size of the output buffer.
+ * @return int 1 on success, 0 if the directory no longer exists.
+ */
+int resolve_fid_path(int mount_fd, const struct fanotify_event_info_fid* fid, char* out, size_t size) {
+    const struct file_handle* handle = (const struct file_handle*)fid->handle;
+    const char* name = NULL;
+    char dir_path[PATH_MAX];
+    char fd_path[32];
+    const char* dir = NULL;
+
+    switch (fid->hdr.info_type) {
+        case FAN_EVENT_INFO_TYPE_DFID_NAME:
+        #ifdef FAN_EVENT_INFO_TYPE_OLD_DFID_NAME
+        case FAN_EVENT_INFO_TYPE_OLD_DFID_NAME:
+        case FAN_EVENT_INFO_TYPE_NEW_DFID_NAME:
+        #endif
+            name = (const char*)handle->f_handle + handle->handle_bytes;
+            break;
+        default:
+            break;
+    }
+
+    uint64_t hash = dir_cache_hash(fid, handle);
+    dir_cache_entry_t* entry = dir_cache_find(fid, handle, hash);
+    if (entry != NULL) {
+        metrics_inc(METRIC_DIR_CACHE_HITS);
+        dir = entry->path;
+    } else {
+        metrics_inc(METRIC_DIR_CACHE_MISSES);
+        int fd = open_by_handle_at(mount_fd, (struct file_handle*)handle, O_RDONLY | O_PATH);
+        if (fd == -1) {
+            return 0;
+        }
+        snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+        ssize_t len = readlink(fd_path, dir_path, sizeof(dir_path) - 1);
+        close(fd);
+        if (len <= 0) {
+            return 0;
+        }
+        dir_path[len] = '\0';
+        dir_cache_put(fid, dir_path);
+        dir = dir_path;
+    }
+
+    if (name != NULL && strcmp(name, ".") != 0) {
+        snprintf(out, size, "%s/%s", strcmp(dir, "/") == 0 ? "" : dir, name);
+    } else {
+        snprintf(out, size, "%s", dir);
+    }
+    return 1;
+}
+
+#endif
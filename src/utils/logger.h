@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <unistd.h>
 #include <time.h>
 #include <sys/time.h>
 
@@ -22,9 +23,12 @@ typedef struct Logger{
     int verbosity_range[2];
     char logfile[PATH_MAX];
     FILE* f_logfile;
+    FILE* f_console;            // Where messages go without a log file
+    const char** severities;    // severity_colors on a terminal, severity_plain otherwise
 } logger_t;
 
 void logger_init(int verbosity_level, char* logfile);
+void logger_console(FILE* console);
 void log_message(Severity sev, int show_time, const char *format, ...);
 
 const char *severity_colors[] = {
@@ -35,6 +39,14 @@ const char *severity_colors[] = {
     "\x1b[91m[ERR]\x1b[0m "    // ERROR
 };
 
+const char *severity_plain[] = {
+    "",
+    "[DBG] ",
+    "[INF] ",
+    "[WRN] ",
+    "[ERR] "
+};
+
 logger_t g_logger;
 
 /**
@@ -54,6 +66,7 @@ void logger_init(int verbosity_level, char* logfile) {
         strncpy(g_logger.logfile, logfile, strlen(logfile));
         g_logger.f_logfile = fopen(g_logger.logfile, "w");
     }
+    logger_console(stdout);
 
     // Check if verbosity level is within range
     if (g_logger.verbosity_level < g_logger.verbosity_range[0] || g_logger.verbosity_level > g_logger.verbosity_range[1]) {
@@ -63,6 +76,18 @@ void logger_init(int verbosity_level, char* logfile) {
     }
 }
 
+/**
+ * @brief Sends the messages to a stream instead of stdout, when there is no log file.
+ *        Colours are only used when the messages end up on a terminal.
+ * 
+ * @param console The stream.
+ */
+void logger_console(FILE* console) {
+    g_logger.f_console = console;
+    FILE* out = g_logger.f_logfile ? g_logger.f_logfile : console;
+    g_logger.severities = isatty(fileno(out)) ? severity_colors : severity_plain;
+}
+
 /**
  * @brief Log a message with a given severity level.
  * 
@@ -86,6 +111,10 @@ void log_message(Severity sev, int show_time, const char *format, ...) {
         return;
     }
 
+    // Messages from before logger_init() go to stdout
+    FILE* console = g_logger.f_console ? g_logger.f_console : stdout;
+    const char** severities = g_logger.severities ? g_logger.severities : severity_colors;
+
     va_list args;
     if (g_logger.f_logfile != NULL){
         if (show_time) {
@@ -105,13 +134,13 @@ void log_message(Severity sev, int show_time, const char *format, ...) {
             }
         }
         va_start(args, format);
-        fprintf(g_logger.f_logfile, "%s", severity_colors[sev]);
+        fprintf(g_logger.f_logfile, "%s", severities[sev]);
         vfprintf(g_logger.f_logfile, format, args);
         fflush(g_logger.f_logfile);
         va_end(args);
     } else {
         if (show_time) {
-            printf("%02d-%02d-%04d %02d:%02d:%02d.%03d",
+            fprintf(console, "%02d-%02d-%04d %02d:%02d:%02d.%03d",
                 local_time->tm_mday,
                 local_time->tm_mon + 1,
                 local_time->tm_year + 1900,
@@ -120,14 +149,14 @@ void log_message(Severity sev, int show_time, const char *format, ...) {
                 local_time->tm_sec,
                 (int)tv.tv_usec / 1000);
             if (hours_offset >= 0)
-                printf(" UTC+%02d:%02d%4s", hours_offset, minutes_offset, "");
+                fprintf(console, " UTC+%02d:%02d%4s", hours_offset, minutes_offset, "");
             else {
-                printf(" UTC-%02d:%02d%4s", abs(hours_offset), minutes_offset, "");
+                fprintf(console, " UTC-%02d:%02d%4s", abs(hours_offset), minutes_offset, "");
             }
         }
         va_start(args, format);
-        printf("%s", severity_colors[sev]);
-        vprintf(format, args);
+        fprintf(console, "%s", severities[sev]);
+        vfprintf(console, format, args);
         va_end(args);
     }
 }
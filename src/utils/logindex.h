@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <filemon_index.h>
+#include "logger.h"
+#include "metrics.h"
+
+#ifndef LOGINDEX_H
+#define LOGINDEX_H
+
+#define LOGINDEX_BLOCK_RECORDS 65536   // Records per index block
+#define LOGINDEX_BLOCK_SECONDS 60      // A block is written at the latest this long after its first record
+#define LOGINDEX_BATCH_ENTRIES 4096    // Records per output batch, see output_event()
+
+/*
+ * Index of the structured log (--index), see include/filemon_index.h for the file layout.
+ * output_event() notes the keys of each record it serializes, output_flush() hands them over with
+ * their offset in the log once the batch is written. The records of the current block are kept in
+ * memory, and the block is sorted by key and appended to the index with a single write() when it
+ * is full or LOGINDEX_BLOCK_SECONDS old, so the index trails the log by at most that long.
+ */
+typedef struct {
+    uint64_t offset;               // In the batch until output_flush(), then in the log
+    uint32_t length;
+    int pid;
+    uint64_t time_ns;
+    uint64_t path;                 // hash_string() of the path and of the old path, 0 if none
+    uint64_t old_path;
+    uint64_t process;
+} logindex_entry_t;
+
+typedef struct {
+    uint64_t key;
+    uint32_t record;
+} logindex_posting_t;
+
+typedef struct LogIndex {
+    int enabled;
+    char path[PATH_MAX];
+    int fd;
+    off_t file_size;               // Cut back to this if a write fails half way
+    logindex_entry_t* entries;     // Of the current block
+    uint32_t count;
+    time_t opened;                 // When the first record of the current block came in
+    logindex_posting_t* postings;  // Scratch space to sort the keys of a block
+    char* block;                   // The block being written
+    uint64_t blocks_written;
+    uint64_t bytes_written;
+    uint64_t write_errors;
+    pthread_mutex_t lock;          // Records come from both reader threads, blocks also from the tick
+} logindex_t;
+
+void logindex_init(const char* output, int format, uint64_t data_offset);
+void logindex_add(const logindex_entry_t* entries, uint32_t count, uint64_t base, uint64_t written);
+void logindex_tick();
+void logindex_stop();
+void collect_logindex(FILE* out, void* arg);
+
+logindex_t g_logindex = { .enabled = 0, .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Room for the largest block, a path key and an old path key per record at most
+#define LOGINDEX_POSTINGS_MAX (LOGINDEX_BLOCK_RECORDS * 2)
+#define LOGINDEX_BLOCK_SIZE_MAX (sizeof(filemon_index_block_t) + LOGINDEX_BLOCK_RECORDS * sizeof(filemon_index_record_t) + \
+                                 FILEMON_INDEX_KINDS * (LOGINDEX_POSTINGS_MAX * (sizeof(filemon_index_key_t) + sizeof(uint32_t)) + 8))
+
+static int logindex_compare(const void* a, const void* b) {
+    const logindex_posting_t* x = (const logindex_posting_t*)a;
+    const logindex_posting_t* y = (const logindex_posting_t*)b;
+    if (x->key != y->key) {
+        return x->key < y->key ? -1 : 1;
+    }
+    return x->record < y->record ? -1 : (x->record > y->record);
+}
+
+// Sorts the postings of a kind and writes its keys and record numbers at p, returns the end
+static char* logindex_write_kind(char* p, filemon_index_block_t* block, filemon_index_kind_t kind, uint32_t count) {
+    logindex_posting_t* postings = g_logindex.postings;
+    filemon_index_key_t* keys = (filemon_index_key_t*)p;
+    uint32_t key_count = 0;
+
+    qsort(postings, count, sizeof(logindex_posting_t), logindex_compare);
+    for (uint32_t i = 0; i < count; i++) {
+        if (key_count == 0 || keys[key_count - 1].key != postings[i].key) {
+            keys[key_count++] = (filemon_index_key_t){ .key = postings[i].key, .first = i, .count = 0 };
+        }
+        keys[key_count - 1].count++;
+    }
+    uint32_t* records = (uint32_t*)(keys + key_count);
+    for (uint32_t i = 0; i < count; i++) {
+        records[i] = postings[i].record;
+    }
+    block->keys[kind] = key_count;
+    block->postings[kind] = count;
+    p = (char*)(records + count);
+    if (count % 2) {
+        memset(p, 0, sizeof(uint32_t));
+        p += sizeof(uint32_t);
+    }
+    return p;
+}
+
+/**
+ * @brief Appends the records in memory to the index as one block.
+ *
+ */
+static void logindex_flush() {
+    filemon_index_block_t* block = (filemon_index_block_t*)g_logindex.block;
+    filemon_index_record_t* records = (filemon_index_record_t*)(block + 1);
+    logindex_entry_t* entries = g_logindex.entries;
+    uint32_t count = g_logindex.count;
+    uint32_t postings;
+    char* p;
+
+    if (count == 0) {
+        return;
+    }
+    memset(block, 0, sizeof(*block));
+    block->magic = FILEMON_INDEX_BLOCK_MAGIC;
+    block->records = count;
+    block->first_offset = entries[0].offset;
+    block->end_offset = entries[count - 1].offset + entries[count - 1].length;
+    block->first_ns = entries[0].time_ns;
+    block->last_ns = entries[0].time_ns;
+    // The two reader threads take their time before the lock, records can be a little out of order
+    for (uint32_t i = 1; i < count; i++) {
+        if (entries[i].time_ns < block->first_ns) {
+            block->first_ns = entries[i].time_ns;
+        }
+        if (entries[i].time_ns > block->last_ns) {
+            block->last_ns = entries[i].time_ns;
+        }
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t ms = (entries[i].time_ns - block->first_ns) / 1000000;
+        records[i] = (filemon_index_record_t){
+            .offset = entries[i].offset,
+            .length = entries[i].length,
+            .time_ms = ms > UINT32_MAX ? UINT32_MAX : (uint32_t)ms,
+        };
+    }
+    p = (char*)(records + count);
+
+    postings = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        g_logindex.postings[postings++] = (logindex_posting_t){ entries[i].path, i };
+        if (entries[i].old_path != 0 && entries[i].old_path != entries[i].path) {
+            g_logindex.postings[postings++] = (logindex_posting_t){ entries[i].old_path, i };
+        }
+    }
+    p = logindex_write_kind(p, block, FILEMON_INDEX_PATHS, postings);
+    for (uint32_t i = 0; i < count; i++) {
+        g_logindex.postings[i] = (logindex_posting_t){ (uint64_t)(uint32_t)entries[i].pid, i };
+    }
+    p = logindex_write_kind(p, block, FILEMON_INDEX_PIDS, count);
+    for (uint32_t i = 0; i < count; i++) {
+        g_logindex.postings[i] = (logindex_posting_t){ entries[i].process, i };
+    }
+    p = logindex_write_kind(p, block, FILEMON_INDEX_PROCESSES, count);
+    block->size = p - (char*)(block + 1);
+
+    size_t total = p - g_logindex.block;
+    ssize_t written = write(g_logindex.fd, g_logindex.block, total);
+    if (written != (ssize_t)total) {
+        // Readers scan the log between the blocks around the lost one, but keep the file clean
+        if (written > 0 && ftruncate(g_logindex.fd, g_logindex.file_size) == -1) {
+            log_message(WARNING, 1, "Unable to cut back the index after a short write (%s)\n", strerror(errno));
+        }
+        if (g_logindex.write_errors++ == 0) {
+            log_message(WARNING, 1, "Unable to write the index of %u records, queries scan the log for them (%s)\n",
+                        count, written == -1 ? strerror(errno) : "short write");
+        }
+    } else {
+        g_logindex.file_size += total;
+        g_logindex.bytes_written += total;
+        g_logindex.blocks_written++;
+    }
+    g_logindex.count = 0;
+}
+
+/**
+ * @brief Creates the index of the log.
+ *
+ * @param output The log file, or NULL to not index it.
+ * @param format FILEMON_INDEX_JSONL or FILEMON_INDEX_CSV.
+ * @param data_offset Offset of the first record in the log.
+ */
+void logindex_init(const char* output, int format, uint64_t data_offset) {
+    filemon_index_file_t header = {
+        .magic = FILEMON_INDEX_MAGIC,
+        .version = FILEMON_INDEX_VERSION,
+        .header_size = sizeof(filemon_index_file_t),
+        .format = format,
+        .data_offset = data_offset,
+        .created_ns = (uint64_t)time(NULL) * 1000000000ULL,
+    };
+
+    if (output == NULL) {
+        return;
+    }
+    snprintf(g_logindex.path, sizeof(g_logindex.path), "%s" FILEMON_INDEX_SUFFIX, output);
+    g_logindex.entries = malloc(LOGINDEX_BLOCK_RECORDS * sizeof(logindex_entry_t));
+    g_logindex.postings = malloc(LOGINDEX_POSTINGS_MAX * sizeof(logindex_posting_t));
+    g_logindex.block = malloc(LOGINDEX_BLOCK_SIZE_MAX);
+    if (g_logindex.entries == NULL || g_logindex.postings == NULL || g_logindex.block == NULL) {
+        log_message(ERROR, 1, "Unable to malloc for the log index\n");
+        exit(EXIT_FAILURE);
+    }
+    // The log was just truncated, so is its index
+    g_logindex.fd = open(g_logindex.path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (g_logindex.fd == -1 || write(g_logindex.fd, &header, sizeof(header)) != sizeof(header)) {
+        log_message(ERROR, 1, "Unable to create index \"%s\" (%s)\n", g_logindex.path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    g_logindex.file_size = sizeof(header);
+    g_logindex.bytes_written = sizeof(header);
+    g_logindex.enabled = 1;
+    metrics_add_collector(collect_logindex, NULL);
+    log_message(INFO, 1, "Indexing the log in \"%s\"\n", g_logindex.path);
+}
+
+/**
+ * @brief Adds the records of a written output batch. Called in log order, under the output lock.
+ *
+ * @param entries The records, offsets relative to the batch.
+ * @param count Number of records.
+ * @param base Offset of the batch in the log.
+ * @param written Bytes of the batch that made it to the log, the records past them are dropped.
+ */
+void logindex_add(const logindex_entry_t* entries, uint32_t count, uint64_t base, uint64_t written) {
+    pthread_mutex_lock(&g_logindex.lock);
+    if (!g_logindex.enabled) {
+        pthread_mutex_unlock(&g_logindex.lock);
+        return;
+    }
+    for (uint32_t i = 0; i < count && entries[i].offset + entries[i].length <= written; i++) {
+        if (g_logindex.count == LOGINDEX_BLOCK_RECORDS) {
+            logindex_flush();
+        }
+        if (g_logindex.count == 0) {
+            g_logindex.opened = time(NULL);
+        }
+        g_logindex.entries[g_logindex.count] = entries[i];
+        g_logindex.entries[g_logindex.count++].offset += base;
+    }
+    pthread_mutex_unlock(&g_logindex.lock);
+}
+
+/**
+ * @brief Writes out a block that has waited LOGINDEX_BLOCK_SECONDS. Called once a second.
+ *
+ */
+void logindex_tick() {
+    if (__atomic_load_n(&g_logindex.count, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+    pthread_mutex_lock(&g_logindex.lock);
+    if (g_logindex.count != 0 && time(NULL) - g_logindex.opened >= LOGINDEX_BLOCK_SECONDS) {
+        logindex_flush();
+    }
+    pthread_mutex_unlock(&g_logindex.lock);
+}
+
+/**
+ * @brief Writes out the records in memory and closes the index.
+ *
+ */
+void logindex_stop() {
+    if (!g_logindex.enabled) {
+        return;
+    }
+    pthread_mutex_lock(&g_logindex.lock);
+    g_logindex.enabled = 0;
+    logindex_flush();
+    close(g_logindex.fd);
+    g_logindex.fd = -1;
+    pthread_mutex_unlock(&g_logindex.lock);
+}
+
+/**
+ * @brief Metrics collector for the log index.
+ *
+ * @param out The response.
+ * @param arg Unused.
+ */
+void collect_logindex(FILE* out, void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_logindex.lock);
+    uint64_t blocks = g_logindex.blocks_written;
+    uint64_t bytes = g_logindex.bytes_written;
+    uint64_t errors = g_logindex.write_errors;
+    uint32_t pending = g_logindex.count;
+    pthread_mutex_unlock(&g_logindex.lock);
+    metrics_write_gauge(out, "filemon_index_blocks_written", NULL, "Blocks appended to the log index since startup.", blocks);
+    metrics_write_gauge(out, "filemon_index_bytes_written", NULL, "Bytes appended to the log index since startup.", bytes);
+    metrics_write_gauge(out, "filemon_index_write_errors", NULL, "Blocks of the log index that could not be written.", errors);
+    metrics_write_gauge(out, "filemon_index_pending_records", NULL, "Records of the log not in the index yet.", pending);
+}
+
+#endif
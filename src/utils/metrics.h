@@ -0,0 +1,409 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "wrappers.h"
+#include "logger.h"
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#define METRICS_SLOTS_MAX 32
+#define METRICS_COLLECTORS_MAX 32
+#define METRICS_ADDRESS_MAX 108
+
+typedef enum {
+    METRIC_EVENTS_READ_RWE,
+    METRIC_EVENTS_READ_CDM,
+    METRIC_READ_BATCHES_RWE,
+    METRIC_READ_BATCHES_CDM,
+    METRIC_FILTERED_OUTSIDE_PARENT,
+    METRIC_FILTERED_SELF,
+    METRIC_FILTERED_PID,
+    METRIC_FILTERED_PROCESS,
+    METRIC_FILTERED_PATTERN,
+    METRIC_FILTERED_CGROUP,
+    METRIC_EVENTS_EMITTED_RWE,
+    METRIC_EVENTS_EMITTED_CDM,
+    METRIC_PERM_RESPONSES_ALLOW,
+    METRIC_PERM_RESPONSES_DENY,
+    METRIC_QUEUE_OVERFLOWS_RWE,
+    METRIC_QUEUE_OVERFLOWS_CDM,
+    METRIC_SESSIONS_CLOSED,
+    METRIC_SESSIONS_TIMED_OUT,
+    METRIC_SESSIONS_EVICTED,
+    METRIC_EVENTS_SHED,
+    METRIC_PROC_READS,
+    METRIC_PROCESS_UNRESOLVED,
+    METRIC_PROCTABLE_HITS,
+    METRIC_PROCTABLE_MISSES,
+    METRIC_PROCTABLE_EVICTIONS,
+    METRIC_DIR_CACHE_HITS,
+    METRIC_DIR_CACHE_MISSES,
+    METRIC_MOUNT_RESCANS,
+    METRIC_EVENTS_UNKNOWN_FS,
+    METRIC_FILTER_RELOADS,
+    METRIC_FILTER_RELOAD_ERRORS,
+    METRIC_HASH_DONE,
+    METRIC_HASH_CACHED,
+    METRIC_HASH_BUSY,
+    METRIC_HASH_TOO_LARGE,
+    METRIC_HASH_ERRORS,
+    METRIC_HASH_BYTES,
+    METRIC_CHUNKED_FILES,
+    METRIC_CHANGED_BYTES,
+    METRIC_POLICY_ALLOW,
+    METRIC_POLICY_DENY,
+    METRIC_POLICY_AUDIT,
+    METRIC_POLICY_TIMEOUTS,
+    METRIC_POLICY_CACHE_HITS,
+    METRIC_POLICY_CACHE_MISSES,
+    METRIC_ALERTS_RENAME,
+    METRIC_ALERTS_DELETE,
+    METRIC_ALERTS_MODIFY_DIRS,
+    METRIC_ALERTS_EXEC_NEW,
+    METRIC_MAX
+} metric_t;
+
+typedef struct {
+    const char* name;
+    const char* labels;
+    const char* help;
+} metric_desc_t;
+
+/* Entries sharing a name must be adjacent so HELP/TYPE is printed once per family. */
+const metric_desc_t metric_descs[METRIC_MAX] = {
+    [METRIC_EVENTS_READ_RWE]         = {"filemon_events_read_total", "group=\"read_write_execute\"", "Events read from the fanotify queue."},
+    [METRIC_EVENTS_READ_CDM]         = {"filemon_events_read_total", "group=\"create_delete_move\"", "Events read from the fanotify queue."},
+    [METRIC_READ_BATCHES_RWE]        = {"filemon_read_batches_total", "group=\"read_write_execute\"", "Successful read() calls on the fanotify fd."},
+    [METRIC_READ_BATCHES_CDM]        = {"filemon_read_batches_total", "group=\"create_delete_move\"", "Successful read() calls on the fanotify fd."},
+    [METRIC_FILTERED_OUTSIDE_PARENT] = {"filemon_events_filtered_total", "reason=\"outside_parent\"", "Events dropped by a filter."},
+    [METRIC_FILTERED_SELF]           = {"filemon_events_filtered_total", "reason=\"self\"", "Events dropped by a filter."},
+    [METRIC_FILTERED_PID]            = {"filemon_events_filtered_total", "reason=\"pid\"", "Events dropped by a filter."},
+    [METRIC_FILTERED_PROCESS]        = {"filemon_events_filtered_total", "reason=\"process\"", "Events dropped by a filter."},
+    [METRIC_FILTERED_PATTERN]        = {"filemon_events_filtered_total", "reason=\"pattern\"", "Events dropped by a filter."},
+    [METRIC_FILTERED_CGROUP]         = {"filemon_events_filtered_total", "reason=\"cgroup\"", "Events dropped by a filter."},
+    [METRIC_EVENTS_EMITTED_RWE]      = {"filemon_events_emitted_total", "group=\"read_write_execute\"", "Events written to the output."},
+    [METRIC_EVENTS_EMITTED_CDM]      = {"filemon_events_emitted_total", "group=\"create_delete_move\"", "Events written to the output."},
+    [METRIC_PERM_RESPONSES_ALLOW]    = {"filemon_permission_responses_total", "response=\"allow\"", "Responses written for FAN_*_PERM events."},
+    [METRIC_PERM_RESPONSES_DENY]     = {"filemon_permission_responses_total", "response=\"deny\"", "Responses written for FAN_*_PERM events."},
+    [METRIC_QUEUE_OVERFLOWS_RWE]     = {"filemon_queue_overflows_total", "group=\"read_write_execute\"", "FAN_Q_OVERFLOW events received."},
+    [METRIC_QUEUE_OVERFLOWS_CDM]     = {"filemon_queue_overflows_total", "group=\"create_delete_move\"", "FAN_Q_OVERFLOW events received."},
+    [METRIC_SESSIONS_CLOSED]         = {"filemon_sessions_total", "end=\"closed\"", "Open/close sessions emitted, by how they ended."},
+    [METRIC_SESSIONS_TIMED_OUT]      = {"filemon_sessions_total", "end=\"timeout\"", "Open/close sessions emitted, by how they ended."},
+    [METRIC_SESSIONS_EVICTED]        = {"filemon_sessions_total", "end=\"evicted\"", "Open/close sessions emitted, by how they ended."},
+    [METRIC_EVENTS_SHED]             = {"filemon_events_shed_total", "group=\"read_write_execute\"", "Events suppressed by load shedding."},
+    [METRIC_PROC_READS]              = {"filemon_proc_reads_total", "", "Process identities read from /proc."},
+    [METRIC_PROCESS_UNRESOLVED]      = {"filemon_process_unresolved_total", "", "Events whose process could not be named."},
+    [METRIC_PROCTABLE_HITS]          = {"filemon_process_table_lookups_total", "result=\"hit\"", "Process table lookups, a miss reads exe/cmdline/cgroup."},
+    [METRIC_PROCTABLE_MISSES]        = {"filemon_process_table_lookups_total", "result=\"miss\"", "Process table lookups, a miss reads exe/cmdline/cgroup."},
+    [METRIC_PROCTABLE_EVICTIONS]     = {"filemon_process_table_evictions_total", "", "Live processes evicted because the process table was full."},
+    [METRIC_DIR_CACHE_HITS]          = {"filemon_dir_cache_lookups_total", "result=\"hit\"", "Directory handle to path lookups, a miss calls open_by_handle_at()."},
+    [METRIC_DIR_CACHE_MISSES]        = {"filemon_dir_cache_lookups_total", "result=\"miss\"", "Directory handle to path lookups, a miss calls open_by_handle_at()."},
+    [METRIC_MOUNT_RESCANS]           = {"filemon_mount_rescans_total", "", "Rescans of /proc/self/mountinfo after a mount or unmount."},
+    [METRIC_EVENTS_UNKNOWN_FS]       = {"filemon_events_unknown_filesystem_total", "", "Create/delete/move events from a filesystem that is no longer watched."},
+    [METRIC_FILTER_RELOADS]          = {"filemon_filter_reloads_total", "result=\"ok\"", "Reloads of the filter config, a failed one keeps the rules in use."},
+    [METRIC_FILTER_RELOAD_ERRORS]    = {"filemon_filter_reloads_total", "result=\"error\"", "Reloads of the filter config, a failed one keeps the rules in use."},
+    [METRIC_HASH_DONE]               = {"filemon_content_hashes_total", "result=\"hashed\"", "Files of close-write and exec events, by how their hash was found."},
+    [METRIC_HASH_CACHED]             = {"filemon_content_hashes_total", "result=\"cached\"", "Files of close-write and exec events, by how their hash was found."},
+    [METRIC_HASH_BUSY]               = {"filemon_content_hashes_total", "result=\"busy\"", "Files of close-write and exec events, by how their hash was found."},
+    [METRIC_HASH_TOO_LARGE]          = {"filemon_content_hashes_total", "result=\"too_large\"", "Files of close-write and exec events, by how their hash was found."},
+    [METRIC_HASH_ERRORS]             = {"filemon_content_hashes_total", "result=\"error\"", "Files of close-write and exec events, by how their hash was found."},
+    [METRIC_HASH_BYTES]              = {"filemon_content_hash_bytes_total", "", "Bytes read to hash files."},
+    [METRIC_CHUNKED_FILES]           = {"filemon_chunked_files_total", "", "Files of --chunk cut into chunks and compared with their previous close."},
+    [METRIC_CHANGED_BYTES]           = {"filemon_changed_bytes_total", "", "Bytes in the chunks of --chunk files that were not there at their previous close."},
+    [METRIC_POLICY_ALLOW]            = {"filemon_policy_decisions_total", "action=\"allow\"", "Permission events decided by --policy, by action."},
+    [METRIC_POLICY_DENY]             = {"filemon_policy_decisions_total", "action=\"deny\"", "Permission events decided by --policy, by action."},
+    [METRIC_POLICY_AUDIT]            = {"filemon_policy_decisions_total", "action=\"audit\"", "Permission events decided by --policy, by action."},
+    [METRIC_POLICY_TIMEOUTS]         = {"filemon_policy_timeouts_total", "", "Policy decisions that ran out of --policy-budget and took the on-timeout action."},
+    [METRIC_POLICY_CACHE_HITS]       = {"filemon_policy_cache_lookups_total", "result=\"hit\"", "Policy decision cache lookups, a miss runs the rules."},
+    [METRIC_POLICY_CACHE_MISSES]     = {"filemon_policy_cache_lookups_total", "result=\"miss\"", "Policy decision cache lookups, a miss runs the rules."},
+    [METRIC_ALERTS_RENAME]           = {"filemon_alerts_total", "alert=\"rename\"", "Alerts raised by the --alert rules."},
+    [METRIC_ALERTS_DELETE]           = {"filemon_alerts_total", "alert=\"delete\"", "Alerts raised by the --alert rules."},
+    [METRIC_ALERTS_MODIFY_DIRS]      = {"filemon_alerts_total", "alert=\"modify-dirs\"", "Alerts raised by the --alert rules."},
+    [METRIC_ALERTS_EXEC_NEW]         = {"filemon_alerts_total", "alert=\"exec-new\"", "Alerts raised by the --alert rules."},
+};
+
+/* One slot per thread. Each slot is written by its owner only and is padded to whole cache lines. */
+typedef struct {
+    uint64_t counters[METRIC_MAX];
+} __attribute__((aligned(64))) metrics_slot_t;
+
+typedef void (*metrics_collector_fn)(FILE* out, void* arg);
+
+typedef struct {
+    metrics_collector_fn fn;
+    void* arg;
+} metrics_collector_t;
+
+typedef struct Metrics {
+    metrics_slot_t slots[METRICS_SLOTS_MAX];
+    metrics_slot_t shared;
+    int slots_used;
+    metrics_collector_t collectors[METRICS_COLLECTORS_MAX];
+    int collectors_used;
+    pthread_mutex_t collectors_lock;
+    char address[METRICS_ADDRESS_MAX];
+    int listen_fd;
+    pthread_t listener;
+} metrics_t;
+
+void metrics_init(char* address);
+void metrics_register_thread();
+void metrics_add_collector(metrics_collector_fn fn, void* arg);
+uint64_t metrics_sum(metric_t metric);
+void metrics_write(FILE* out);
+void metrics_write_gauge(FILE* out, const char* name, const char* labels, const char* help, double value);
+void* metrics_listener_thread(void* arg);
+void metrics_stop();
+
+metrics_t g_metrics = { .listen_fd = -1, .collectors_lock = PTHREAD_MUTEX_INITIALIZER };
+__thread metrics_slot_t* t_metrics_slot = NULL;
+
+/**
+ * @brief Adds n to a counter. Registered threads write their own slot without locking,
+ * everyone else falls back to an atomic add on the shared slot.
+ *
+ * @param metric The counter.
+ * @param n The amount to add.
+ */
+static inline void metrics_add(metric_t metric, uint64_t n) {
+    metrics_slot_t* slot = t_metrics_slot;
+    if (slot != NULL) {
+        __atomic_store_n(&slot->counters[metric], slot->counters[metric] + n, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&g_metrics.shared.counters[metric], n, __ATOMIC_RELAXED);
+    }
+}
+
+static inline void metrics_inc(metric_t metric) {
+    metrics_add(metric, 1);
+}
+
+/**
+ * @brief Gives the calling thread its own counter slot.
+ *
+ */
+void metrics_register_thread() {
+    int index = __atomic_fetch_add(&g_metrics.slots_used, 1, __ATOMIC_RELAXED);
+    if (index >= METRICS_SLOTS_MAX) {
+        log_message(DEBUG, 1, "Out of metrics slots, thread will use the shared slot.\n");
+        return;
+    }
+    t_metrics_slot = &g_metrics.slots[index];
+}
+
+/**
+ * @brief Registers a callback that appends its own metric families on every scrape.
+ *
+ * @param fn The collector.
+ * @param arg Passed back to the collector.
+ */
+void metrics_add_collector(metrics_collector_fn fn, void* arg) {
+    pthread_mutex_lock(&g_metrics.collectors_lock);
+    if (g_metrics.collectors_used < METRICS_COLLECTORS_MAX) {
+        g_metrics.collectors[g_metrics.collectors_used].fn = fn;
+        g_metrics.collectors[g_metrics.collectors_used].arg = arg;
+        g_metrics.collectors_used++;
+    } else {
+        log_message(WARNING, 1, "Too many metrics collectors registered.\n");
+    }
+    pthread_mutex_unlock(&g_metrics.collectors_lock);
+}
+
+/**
+ * @brief Sums a counter over every thread slot.
+ *
+ * @param metric The counter.
+ * @return uint64_t
+ */
+uint64_t metrics_sum(metric_t metric) {
+    uint64_t total = __atomic_load_n(&g_metrics.shared.counters[metric], __ATOMIC_RELAXED);
+    for (int i = 0; i < METRICS_SLOTS_MAX; i++) {
+        total += __atomic_load_n(&g_metrics.slots[i].counters[metric], __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+/**
+ * @brief Writes a single gauge family with one sample.
+ *
+ * @param out The output stream.
+ * @param name Metric name.
+ * @param labels Label set without braces, or NULL.
+ * @param help Help text, or NULL to skip HELP/TYPE lines.
+ * @param value The sample.
+ */
+void metrics_write_gauge(FILE* out, const char* name, const char* labels, const char* help, double value) {
+    if (help) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s gauge\n", name, help, name);
+    }
+    if (labels && labels[0] != '\0') {
+        fprintf(out, "%s{%s} %.17g\n", name, labels, value);
+    } else {
+        fprintf(out, "%s %.17g\n", name, value);
+    }
+}
+
+/**
+ * @brief Writes every counter and collector in Prometheus text format.
+ *
+ * @param out The output stream.
+ */
+void metrics_write(FILE* out) {
+    for (int i = 0; i < METRIC_MAX; i++) {
+        if (i == 0 || strcmp(metric_descs[i].name, metric_descs[i - 1].name) != 0) {
+            fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", metric_descs[i].name, metric_descs[i].help, metric_descs[i].name);
+        }
+        if (metric_descs[i].labels[0] != '\0') {
+            fprintf(out, "%s{%s} %lu\n", metric_descs[i].name, metric_descs[i].labels, (unsigned long)metrics_sum(i));
+        } else {
+            fprintf(out, "%s %lu\n", metric_descs[i].name, (unsigned long)metrics_sum(i));
+        }
+    }
+
+    long pages = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm != NULL) {
+        if (fscanf(statm, "%*s %ld", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(statm);
+    }
+    metrics_write_gauge(out, "filemon_resident_memory_bytes", NULL, "Resident set size.", (double)pages * sysconf(_SC_PAGESIZE));
+
+    pthread_mutex_lock(&g_metrics.collectors_lock);
+    for (int i = 0; i < g_metrics.collectors_used; i++) {
+        g_metrics.collectors[i].fn(out, g_metrics.collectors[i].arg);
+    }
+    pthread_mutex_unlock(&g_metrics.collectors_lock);
+}
+
+/**
+ * @brief Opens the metrics listener. A numeric address is a TCP port on 127.0.0.1,
+ * anything else is the path of a Unix domain socket.
+ *
+ * @param address The port number or socket path.
+ */
+void metrics_init(char* address) {
+    if (address == NULL) {
+        return;
+    }
+    strncpy(g_metrics.address, address, sizeof(g_metrics.address) - 1);
+
+    if (is_valid_integer(address)) {
+        int port = atoi(address);
+        if (port <= 0 || port > 65535) {
+            log_message(ERROR, 1, "Metrics port out of range: %s\n", address);
+            exit(EXIT_FAILURE);
+        }
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        g_metrics.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int reuse = 1;
+        setsockopt(g_metrics.listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (g_metrics.listen_fd == -1 || bind(g_metrics.listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+            log_message(ERROR, 1, "Failed to bind metrics listener on 127.0.0.1:%d (%s)\n", port, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, address, sizeof(addr.sun_path) - 1);
+        unlink(addr.sun_path);
+
+        g_metrics.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (g_metrics.listen_fd == -1 || bind(g_metrics.listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+            log_message(ERROR, 1, "Failed to bind metrics socket \"%s\" (%s)\n", address, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (listen(g_metrics.listen_fd, 16) == -1) {
+        log_message(ERROR, 1, "Failed to listen on metrics address \"%s\"\n", address);
+        exit(EXIT_FAILURE);
+    }
+    if (pthread_create(&g_metrics.listener, NULL, metrics_listener_thread, NULL) != 0) {
+        log_message(ERROR, 1, "Failed to create thread for metrics listener\n");
+        exit(EXIT_FAILURE);
+    }
+    log_message(DEBUG, 1, "Serving metrics on \"%s\"\n", address);
+}
+
+/**
+ * @brief Accepts one scraper at a time and answers with the current metrics. HTTP requests
+ * get an HTTP response, anything else (eg. socat on the Unix socket) gets the plain body.
+ *
+ * @param arg Unused.
+ * @return void*
+ */
+void* metrics_listener_thread(void* arg) {
+    (void)arg;
+    char request[1024];
+    struct timeval timeout = { .tv_sec = 0, .tv_usec = 200000 };
+
+    while (1) {
+        int client = accept4(g_metrics.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        ssize_t len = recv(client, request, sizeof(request) - 1, 0);
+        int is_http = (len >= 4 && strncmp(request, "GET ", 4) == 0);
+
+        char* body = NULL;
+        size_t body_len = 0;
+        FILE* out = open_memstream(&body, &body_len);
+        if (out == NULL) {
+            close(client);
+            continue;
+        }
+        metrics_write(out);
+        fclose(out);
+
+        if (is_http) {
+            char header[256];
+            int header_len = snprintf(header, sizeof(header),
+                "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                body_len);
+            send(client, header, header_len, MSG_NOSIGNAL);
+        }
+        send(client, body, body_len, MSG_NOSIGNAL);
+        free(body);
+        close(client);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Closes the listener and removes the Unix socket.
+ *
+ */
+void metrics_stop() {
+    if (g_metrics.listen_fd == -1) {
+        return;
+    }
+    close(g_metrics.listen_fd);
+    g_metrics.listen_fd = -1;
+    if (!is_valid_integer(g_metrics.address)) {
+        unlink(g_metrics.address);
+    }
+}
+
+#endif
@@ -11,8 +11,28 @@
 #include <sys/types.h>
 #include <regex.h>
 #include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <stdarg.h>
 #include "wrappers.h"
 #include "logger.h"
+#include "metrics.h"
+#include "probes.h"
+#include "summary.h"
+#include "session.h"
+#include "shedding.h"
+#include "process.h"
+#include "descendants.h"
+#include "cgroup.h"
+#include "fidcache.h"
+#include "mounts.h"
+#include "features.h"
+#include "pathtrie.h"
+#include "pathintern.h"
+#include "output.h"
+#include "ring.h"
+#include "stats.h"
+#include "rollup.h"
 
 #ifndef MONITOR_H
 #define MONITOR_H
@@ -24,8 +44,8 @@ typedef struct {
     uint64_t event_mask_read_write_execute;
     char flags_read_write_execute[FLAGS_MAX];
     char flags_create_delete_move[FLAGS_MAX];
-    int config_fanotify_enabled;
-    int config_fanotify_access_permissions_enabled;
+    int report_pidfd;
+    size_t event_len_read_write_execute;   // Bytes of one queued event, with its info records
 } fanotify_info_t;
 
 typedef struct {
@@ -42,45 +62,137 @@ typedef struct {
     regex_t include_regex;
     char exclude_pattern[FILTER_MAX];
     regex_t exclude_regex;
+
+    // Include PIDs and every process they start (--follow-children)
+    int follow_children;
 } filters_t;
 
+#define WATCH_ROOTS_MAX PATH_TRIE_ROOTS_MAX
+
 typedef struct {
-    fanotify_info_t fanotify_info;
-    filters_t filters;
-    char parent_path[PATH_MAX];
+    char path[PATH_MAX];
     char mount_path[PATH_MAX];
+    filters_t filters;
+} watch_root_t;
+
+/*
+ * Filter rules of --filter-config. They apply to every watched directory, on top of its own
+ * filters. A reload compiles a new rule set and publishes it in a new watch set, so every event of
+ * a batch is judged under one version of the rules.
+ */
+typedef struct {
+    uint64_t version;               // 1 for the rules loaded at startup
+    filters_t filters;
+    cgroup_rules_t cgroups;
+} rule_set_t;
+
+// Threads that hold a watch set while they handle a read batch
+typedef enum {
+    WATCH_READER_RWE,
+    WATCH_READER_CDM,
+    WATCH_READERS_MAX
+} watch_reader_t;
+
+/*
+ * Every watched directory tree shares the two fanotify groups and the marks: a filesystem holding
+ * several roots is marked once, and each event is read once. The roots only differ in their
+ * filters, and the trie tells which roots an event path is in.
+ * A watch set is never changed once published. Adding or removing a root builds a new set, swaps
+ * m_box->watch and frees the old set once no reader holds it. Each reader announces the set it
+ * uses for a batch in m_box->readers, so a change never stops the readers and every event of a
+ * batch is matched against the same roots.
+ */
+typedef struct {
+    watch_root_t* roots[WATCH_ROOTS_MAX];
+    int root_count;
+    path_trie_t trie;
+    rule_set_t* rules;              // NULL without --filter-config
+    uint64_t version;               // Tells the path verdicts of the sets apart, see pathintern.h
+} watch_set_t;
+
+typedef struct {
+    fanotify_info_t fanotify_info;
+    watch_set_t* watch;
+    watch_set_t* readers[WATCH_READERS_MAX];
+    pthread_mutex_t watch_lock;     // Serializes changes of the watch set
+    int root_count;                 // Roots in the current watch set, for the metrics
+    int marked;                     // Set once apply_fanotify_marks() has run
+    uint64_t start_ns;          // probe_clock_ns() when filemon started, 0 if unknown
+    uint64_t ready_ns;          // From start_ns until every mark was in place
 } monitor_box_t;
 
 typedef struct {
     monitor_box_t* m_box;
 } thread_arg_t;
 
-monitor_box_t* init_monitor_box(char* parent_path, char* mount_path, 
-                                int* include_pids, int* exclude_pids, 
-                                char** include_process, char** exclude_process,
-                                char* include_pattern, char* exclude_pattern);
+typedef enum {
+    FILTER_PASS,
+    FILTER_OUTSIDE_PARENT,
+    FILTER_SELF,
+    FILTER_PID,
+    FILTER_PROCESS,
+    FILTER_PATTERN,
+    FILTER_CGROUP,
+    FILTER_VERDICT_MAX
+} filter_verdict_t;
+
+const metric_t filter_verdict_metrics[FILTER_VERDICT_MAX] = {
+    [FILTER_OUTSIDE_PARENT] = METRIC_FILTERED_OUTSIDE_PARENT,
+    [FILTER_SELF] = METRIC_FILTERED_SELF,
+    [FILTER_PID] = METRIC_FILTERED_PID,
+    [FILTER_PROCESS] = METRIC_FILTERED_PROCESS,
+    [FILTER_PATTERN] = METRIC_FILTERED_PATTERN,
+    [FILTER_CGROUP] = METRIC_FILTERED_CGROUP,
+};
+
+monitor_box_t* init_monitor_box(const char* probe_path);
+void init_filters(filters_t* filters, int* include_pids, int* exclude_pids,
+                  char** include_process, char** exclude_process,
+                  char* include_pattern, char* exclude_pattern);
+int add_watch_root(monitor_box_t* m_box, const char* path, const char* mount_path, const filters_t* filters, char* error, size_t error_size);
+int remove_watch_root(monitor_box_t* m_box, const char* path, char* error, size_t error_size);
+int compile_filters(filters_t* filters, char* error, size_t error_size);
+void free_filters(filters_t* filters);
+int replace_rules(monitor_box_t* m_box, rule_set_t* rules, char* error, size_t error_size);
+watch_set_t* watch_enter(monitor_box_t* m_box, watch_reader_t reader);
+void watch_exit(monitor_box_t* m_box, watch_reader_t reader);
 void begin_monitor(monitor_box_t* m_box);
 void stop_monitor(monitor_box_t* m_box);
 void print_box(monitor_box_t* m_box);
 void apply_fanotify_marks(monitor_box_t* m_box);
+filter_verdict_t apply_filters(watch_set_t* watch, int pid, char* comm, const char* full_path, path_ref_t* ref);
+uint64_t watched_roots(watch_set_t* watch, const char* full_path, path_ref_t* ref, path_verdict_t* path);
+filter_verdict_t apply_root_filters(filters_t* filters, int pid, char* comm);
+int pattern_filter_pass(filters_t* filters, const char* full_path);
+void emit_event(event_t* event);
+void emit_session(session_t* session);
+void emit_hashed(hash_job_t* job);
+void emit_alert(const anomaly_alert_t* alert);
+void collect_sessions(FILE* out, void* arg);
+void collect_shedding(FILE* out, void* arg);
+void collect_proctable(FILE* out, void* arg);
+void collect_descendants(FILE* out, void* arg);
+void collect_mounts(FILE* out, void* arg);
+void collect_startup(FILE* out, void* arg);
+void collect_watch_roots(FILE* out, void* arg);
+int mark_filesystem(int fd, const char* path, void* arg);
+int unmark_filesystem(int fd, const char* path, void* arg);
+int fanotify_init_pidfd(unsigned int flags, unsigned int event_f_flags, int* report_pidfd);
+int resolve_batch_identities(char* buf, ssize_t buflen, proc_identity_t* identities, int* pidfds);
+void allow_batch_permissions(monitor_box_t* m_box, char* buf, ssize_t buflen, int probing);
+void collect_queue_depth(FILE* out, void* arg);
 void handle_events_read_write_execute(monitor_box_t* m_box);
 void handle_events_create_delete_move(monitor_box_t* m_box);
 void* handle_create_delete_move_thread(void* arg);
 void* handle_read_write_execute_thread(void* arg);
 
 /**
- * @brief 
+ * @brief Creates the fanotify groups. The directories to watch are added with add_watch_root().
  * 
- * @param parent_path The parent file path to monitor.
- * @param exclude_pattern Regex pattern to exclude certain path.
+ * @param probe_path A directory the fanotify features are probed on, the first watched directory.
  * @return monitor_box_t* 
  */
-monitor_box_t* init_monitor_box(char* parent_path, char* mount_path, 
-                                int* include_pids, int* exclude_pids, 
-                                char** include_process, char** exclude_process,
-                                char* include_pattern, char* exclude_pattern) {
-
-    int ret;
+monitor_box_t* init_monitor_box(const char* probe_path) {
 
     // Initiliaze and allocate memory properly for the monitor_box_t pointer 
     monitor_box_t* m_box = (monitor_box_t*) malloc(sizeof(monitor_box_t));
@@ -96,88 +208,122 @@ monitor_box_t* init_monitor_box(char* parent_path, char* mount_path,
     m_box->fanotify_info.fd_create_delete_move = -1;  
     m_box->fanotify_info.event_mask_create_delete_move = 0;
     m_box->fanotify_info.event_mask_read_write_execute = 0;
-    m_box->fanotify_info.config_fanotify_enabled = has_config_fanotify();
-    m_box->fanotify_info.config_fanotify_access_permissions_enabled = has_config_fanotify_access_perms();
-
-    /** Initialize Filters **/
-    memset(m_box->filters.include_pids, 0, sizeof(m_box->filters.include_pids));
-    memset(m_box->filters.exclude_pids, 0, sizeof(m_box->filters.exclude_pids));
-
-    for (int i = 0; i < FILTER_MAX; i++) {
-        memset(m_box->filters.include_process[i], 0, PROC_NAME_LEN);
-        memset(m_box->filters.exclude_process[i], 0, PROC_NAME_LEN);
-
-    }
-
-    memset(&m_box->filters.exclude_pattern, 0, sizeof(m_box->filters.exclude_pattern));
-    memset(&m_box->filters.exclude_regex, 0, sizeof(m_box->filters.exclude_regex));
+    m_box->fanotify_info.flags_read_write_execute[0] = '\0';
+    m_box->fanotify_info.flags_create_delete_move[0] = '\0';
+    m_box->fanotify_info.report_pidfd = 0;
+    m_box->start_ns = 0;
+    m_box->ready_ns = 0;
 
     /** Initialize the rest **/
-    memset(m_box->parent_path, 0, sizeof(m_box->parent_path));
-    memset(m_box->mount_path, 0, sizeof(m_box->parent_path));
+    m_box->watch = (watch_set_t*) calloc(1, sizeof(watch_set_t));
+    if (m_box->watch == NULL) {
+        log_message(ERROR, 1, "Failed to allocate memory to watch set\n");
+        exit(EXIT_FAILURE);
+    }
+    path_trie_init(&m_box->watch->trie);
+    memset(m_box->readers, 0, sizeof(m_box->readers));
+    pthread_mutex_init(&m_box->watch_lock, NULL);
+    m_box->root_count = 0;
+    m_box->marked = 0;
+
+    // Ask the running kernel what it supports instead of reading its build config. A bad
+    // directory is reported by add_watch_root(), probing on one would mistake ENOENT for support.
+    features_probe(is_directory(probe_path) ? probe_path : "/");
+    log_message(DEBUG, 1, "Probed fanotify features in %.3fms\n", g_features.probe_ns / 1e6);
+    if (!g_features.fanotify) {
+        if (g_features.init_errno == ENOSYS) {
+            log_message(ERROR, 1, "Current kernel was built with CONFIG_FANOTIFY=n.\n");
+        } else {
+            log_message(ERROR, 1, "fanotify_init() failed: %s\n", strerror(g_features.init_errno));
+        }
+        exit(EXIT_FAILURE);
+    }
 
-    
-    if (m_box->fanotify_info.config_fanotify_enabled) {
-        m_box->fanotify_info.fd_read_write_execute = fanotify_init(FAN_CLOEXEC | FAN_CLASS_CONTENT | FAN_NONBLOCK, O_RDONLY | O_LARGEFILE);
-        if (m_box->fanotify_info.fd_read_write_execute == -1) {
-            log_message(ERROR, 1, "Failed to fanotify_init(FAN_CLOEXEC | FAN_CLASS_CONTENT | FAN_NONBLOCK, O_RDONLY | O_LARGEFILE\n");
-            exit(EXIT_FAILURE);
-        } 
-        m_box->fanotify_info.event_mask_read_write_execute = FAN_EVENT_ON_CHILD;  
+    m_box->fanotify_info.fd_read_write_execute = fanotify_init_pidfd(FAN_CLOEXEC | (g_features.permission_events ? FAN_CLASS_CONTENT : FAN_CLASS_NOTIF) | FAN_NONBLOCK, O_RDONLY | O_LARGEFILE, &m_box->fanotify_info.report_pidfd);
+    if (m_box->fanotify_info.fd_read_write_execute == -1) {
+        log_message(ERROR, 1, "Failed to fanotify_init() the read/write/execute group: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    } 
+    m_box->fanotify_info.event_len_read_write_execute = FAN_EVENT_METADATA_LEN;
+    #ifdef FAN_REPORT_PIDFD
+    if (m_box->fanotify_info.report_pidfd) {
+        m_box->fanotify_info.event_len_read_write_execute += sizeof(struct fanotify_event_info_pidfd);
+    }
+    #endif
+    m_box->fanotify_info.event_mask_read_write_execute = FAN_EVENT_ON_CHILD;  
 
-        #ifdef FAN_ACCESS
-        m_box->fanotify_info.event_mask_read_write_execute |= FAN_ACCESS;
-        strncat(m_box->fanotify_info.flags_read_write_execute, "FAN_ACCESS, ", strlen("FAN_ACCESS, ") + 1);
-        #endif
+    #ifdef FAN_ACCESS
+    m_box->fanotify_info.event_mask_read_write_execute |= FAN_ACCESS;
+    strncat(m_box->fanotify_info.flags_read_write_execute, "FAN_ACCESS, ", strlen("FAN_ACCESS, ") + 1);
+    #endif
 
-        #ifdef FAN_OPEN
-        m_box->fanotify_info.event_mask_read_write_execute |= FAN_OPEN;
-        strncat(m_box->fanotify_info.flags_read_write_execute, "FAN_OPEN, ", strlen("FAN_OPEN, ") + 1);
-        #endif
+    #ifdef FAN_OPEN
+    m_box->fanotify_info.event_mask_read_write_execute |= FAN_OPEN;
+    strncat(m_box->fanotify_info.flags_read_write_execute, "FAN_OPEN, ", strlen("FAN_OPEN, ") + 1);
+    #endif
 
-        #ifdef FAN_MODIFY
-        m_box->fanotify_info.event_mask_read_write_execute |= FAN_MODIFY;
-        strncat(m_box->fanotify_info.flags_read_write_execute, "FAN_MODIFY, ", strlen("FAN_MODIFY, ") + 1);
-        #endif
+    #ifdef FAN_MODIFY
+    m_box->fanotify_info.event_mask_read_write_execute |= FAN_MODIFY;
+    strncat(m_box->fanotify_info.flags_read_write_execute, "FAN_MODIFY, ", strlen("FAN_MODIFY, ") + 1);
+    #endif
 
-        #ifdef FAN_OPEN_EXEC
+    #ifdef FAN_OPEN_EXEC
+    if (g_features.open_exec) {
         m_box->fanotify_info.event_mask_read_write_execute |= FAN_OPEN_EXEC;
         strncat(m_box->fanotify_info.flags_read_write_execute, "FAN_OPEN_EXEC, ", strlen("FAN_OPEN_EXEC, ") + 1);
-        #endif
+    }
+    #endif
 
-        #ifdef FAN_CLOSE_WRITE
-        m_box->fanotify_info.event_mask_read_write_execute |= FAN_CLOSE_WRITE;
-        strncat(m_box->fanotify_info.flags_read_write_execute, "FAN_CLOSE_WRITE, ", strlen("FAN_CLOSE_WRITE, ") + 1);
-        #endif
+    #ifdef FAN_CLOSE_WRITE
+    m_box->fanotify_info.event_mask_read_write_execute |= FAN_CLOSE_WRITE;
+    strncat(m_box->fanotify_info.flags_read_write_execute, "FAN_CLOSE_WRITE, ", strlen("FAN_CLOSE_WRITE, ") + 1);
+    #endif
 
-        #ifdef FAN_CLOSE_NOWRITE
-        m_box->fanotify_info.event_mask_read_write_execute |= FAN_CLOSE_NOWRITE;
-        strncat(m_box->fanotify_info.flags_read_write_execute, "FAN_CLOSE_NOWRITE, ", strlen("FAN_CLOSE_NOWRITE, ") + 1);
-        #endif
+    #ifdef FAN_CLOSE_NOWRITE
+    m_box->fanotify_info.event_mask_read_write_execute |= FAN_CLOSE_NOWRITE;
+    strncat(m_box->fanotify_info.flags_read_write_execute, "FAN_CLOSE_NOWRITE, ", strlen("FAN_CLOSE_NOWRITE, ") + 1);
+    #endif
 
-        if (m_box->fanotify_info.config_fanotify_access_permissions_enabled) {
-            #ifdef FAN_OPEN_PERM
-            m_box->fanotify_info.event_mask_read_write_execute |= FAN_OPEN_PERM;
-            strncat(m_box->fanotify_info.flags_read_write_execute, "FAN_OPEN_PERM, ", strlen("FAN_OPEN_PERM, ") + 1);
-            #endif
-        
-            #ifdef FAN_ACCESS_PERM
-            m_box->fanotify_info.event_mask_read_write_execute |= FAN_ACCESS_PERM;
-            strncat(m_box->fanotify_info.flags_read_write_execute, "FAN_ACCESS_PERM, ", strlen("FAN_ACCESS_PERM, ") + 1);
-            #endif
+    if (g_features.permission_events) {
+        #ifdef FAN_OPEN_PERM
+        m_box->fanotify_info.event_mask_read_write_execute |= FAN_OPEN_PERM;
+        strncat(m_box->fanotify_info.flags_read_write_execute, "FAN_OPEN_PERM, ", strlen("FAN_OPEN_PERM, ") + 1);
+        #endif
+    
+        #ifdef FAN_ACCESS_PERM
+        m_box->fanotify_info.event_mask_read_write_execute |= FAN_ACCESS_PERM;
+        strncat(m_box->fanotify_info.flags_read_write_execute, "FAN_ACCESS_PERM, ", strlen("FAN_ACCESS_PERM, ") + 1);
+        #endif
 
-            #ifdef FAN_OPEN_EXEC_PERM
+        #ifdef FAN_OPEN_EXEC_PERM
+        if (g_features.open_exec_perm) {
             m_box->fanotify_info.event_mask_read_write_execute |= FAN_OPEN_EXEC_PERM;
             strncat(m_box->fanotify_info.flags_read_write_execute, "FAN_OPEN_EXEC_PERM, ", strlen("FAN_OPEN_EXEC_PERM, ") + 1);
-            #endif
-        } else {
-            log_message(WARNING, 1, "Current kernel was built with CONFIG_FANOTIFY_ACCESS_PERMS=n. Not using FAN_*_PERM Flags...\n");
         }
+        #endif
+    } else if (g_policy.enabled) {
+        log_message(ERROR, 1, "--policy option: Current kernel does not support permission events (CONFIG_FANOTIFY_ACCESS_PERMISSIONS=n).\n");
+        exit(EXIT_FAILURE);
+    } else {
+        log_message(WARNING, 1, "Current kernel does not support permission events (CONFIG_FANOTIFY_ACCESS_PERMISSIONS=n). Not using FAN_*_PERM Flags...\n");
+    }
+    if (g_policy.uses_exec && !g_features.open_exec_perm) {
+        log_message(WARNING, 1, "Current kernel does not support FAN_OPEN_EXEC_PERM, exec rules of the policy never match.\n");
+    }
 
-        m_box->fanotify_info.flags_read_write_execute[strlen(m_box->fanotify_info.flags_read_write_execute) - 2] = '\0';
+    m_box->fanotify_info.flags_read_write_execute[strlen(m_box->fanotify_info.flags_read_write_execute) - 2] = '\0';
 
-        #ifdef FAN_REPORT_DFID_NAME
-        m_box->fanotify_info.fd_create_delete_move = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME, O_RDWR);
+    #ifdef FAN_REPORT_DFID_NAME
+    if (g_features.report_dfid_name) {
+        #ifdef FAN_REPORT_TARGET_FID
+        // Also report the handle of the created/deleted/moved child (5.17+), used to prime the directory cache
+        if (g_features.report_target_fid) {
+            m_box->fanotify_info.fd_create_delete_move = fanotify_init_pidfd(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_REPORT_FID | FAN_REPORT_TARGET_FID, O_RDWR, &m_box->fanotify_info.report_pidfd);
+        }
+        #endif
+        if (m_box->fanotify_info.fd_create_delete_move == -1) {
+            m_box->fanotify_info.fd_create_delete_move = fanotify_init_pidfd(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME, O_RDWR, &m_box->fanotify_info.report_pidfd);
+        }
         if (m_box->fanotify_info.fd_create_delete_move == -1) {
             log_message(ERROR, 1, "Failed to fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME, O_RDWR)\n");
             exit(EXIT_FAILURE);
@@ -194,45 +340,58 @@ monitor_box_t* init_monitor_box(char* parent_path, char* mount_path,
         strncat(m_box->fanotify_info.flags_create_delete_move, "FAN_DELETE, ", strlen("FAN_DELETE, ") + 1);
         #endif
 
+        // FAN_RENAME reports both sides of a move in one event, MOVED_FROM/MOVED_TO are only the
+        // fallback for kernels before 5.17
         #ifdef FAN_RENAME 
-        m_box->fanotify_info.event_mask_create_delete_move |= FAN_RENAME;
-        strncat(m_box->fanotify_info.flags_create_delete_move, "FAN_RENAME, ", strlen("FAN_RENAME, ") + 1);
-        #endif 
-
-        #ifdef FAN_MOVED_FROM
-        m_box->fanotify_info.event_mask_create_delete_move |= FAN_MOVED_FROM;
-        strncat(m_box->fanotify_info.flags_create_delete_move, "FAN_MOVED_FROM, ", strlen("FAN_MOVED_FROM, ") + 1);
+        if (g_features.rename) {
+            m_box->fanotify_info.event_mask_create_delete_move |= FAN_RENAME;
+            strncat(m_box->fanotify_info.flags_create_delete_move, "FAN_RENAME, ", strlen("FAN_RENAME, ") + 1);
+        } else
         #endif
+        {
+            #ifdef FAN_MOVED_FROM
+            m_box->fanotify_info.event_mask_create_delete_move |= FAN_MOVED_FROM;
+            strncat(m_box->fanotify_info.flags_create_delete_move, "FAN_MOVED_FROM, ", strlen("FAN_MOVED_FROM, ") + 1);
+            #endif
 
-        #ifdef FAN_MOVED_TO
-        m_box->fanotify_info.event_mask_create_delete_move |=FAN_MOVED_TO;
-        strncat(m_box->fanotify_info.flags_create_delete_move, "FAN_MOVED_TO, ", strlen("FAN_MOVED_TO, ") + 1);
-        #endif
+            #ifdef FAN_MOVED_TO
+            m_box->fanotify_info.event_mask_create_delete_move |=FAN_MOVED_TO;
+            strncat(m_box->fanotify_info.flags_create_delete_move, "FAN_MOVED_TO, ", strlen("FAN_MOVED_TO, ") + 1);
+            #endif
+        }
 
         m_box->fanotify_info.flags_create_delete_move[strlen(m_box->fanotify_info.flags_create_delete_move) - 2] = '\0';
-        
-        #else
-        log_message(WARNING, 1, "Unable to monitor for the creation, deletion and moving of directories/files.\n");
-        #endif  
     } else {
-        log_message(ERROR, 1, "Either kernel was built with CONFIG_FANOTIFY=n or CONFIG_FANOTIFY option does not exist!\n");
-        exit(EXIT_FAILURE);
-    }
-    
-    if (!path_exists(parent_path)) {
-        log_message(ERROR, 1, "Directory path does not exist: %s\n", parent_path);
-        exit(EXIT_FAILURE);
+        log_message(WARNING, 1, "Current kernel does not support FAN_REPORT_DFID_NAME. Unable to monitor for the creation, deletion and moving of directories/files.\n");
     }
-    if (!is_directory(parent_path)) {
-        log_message(ERROR, 1, "Stated path is not a directory: %s\n", parent_path);
-        exit(EXIT_FAILURE);
-    }
-    strncpy(m_box->parent_path, get_full_path(parent_path), PATH_MAX);
+    #else
+    log_message(WARNING, 1, "Unable to monitor for the creation, deletion and moving of directories/files.\n");
+    #endif  
+
+    return m_box;
+}
+
+/**
+ * @brief Fills in the filters of a watch root from the command line options.
+ * 
+ * @param filters The filters.
+ * @param include_pids PIDs to include, 0 terminated.
+ * @param exclude_pids PIDs to exclude, 0 terminated.
+ * @param include_process Process names to include, NULL terminated.
+ * @param exclude_process Process names to exclude, NULL terminated.
+ * @param include_pattern Regex pattern to include certain paths, may be NULL.
+ * @param exclude_pattern Regex pattern to exclude certain paths, may be NULL.
+ */
+void init_filters(filters_t* filters, int* include_pids, int* exclude_pids,
+                  char** include_process, char** exclude_process,
+                  char* include_pattern, char* exclude_pattern) {
+
+    memset(filters, 0, sizeof(*filters));
 
     if (include_pids[0] != 0) {
-        memcpy(m_box->filters.include_pids, include_pids, FILTER_MAX);
+        memcpy(filters->include_pids, include_pids, sizeof(filters->include_pids));
     } else if (exclude_pids[0] != 0) {
-        memcpy(m_box->filters.exclude_pids, exclude_pids, FILTER_MAX);
+        memcpy(filters->exclude_pids, exclude_pids, sizeof(filters->exclude_pids));
     }
 
     if (include_process[0]) {
@@ -240,51 +399,379 @@ monitor_box_t* init_monitor_box(char* parent_path, char* mount_path,
             if (!include_process[i]) {
                 break;
             } 
-            strncpy(m_box->filters.include_process[i], include_process[i], strlen(include_process[i]));
+            strncpy(filters->include_process[i], include_process[i], PROC_NAME_LEN - 1);
         }
     } else if (exclude_process[0]) {
         for (int i = 0; i < FILTER_MAX; i++) {
             if (!exclude_process[i]) {
                 break;
             } 
-            strncpy(m_box->filters.exclude_process[i], exclude_process[i], strlen(exclude_process[i]));
+            strncpy(filters->exclude_process[i], exclude_process[i], PROC_NAME_LEN - 1);
         }
     }
 
-
     if (include_pattern) {
-        strncpy(m_box->filters.include_pattern, include_pattern, sizeof(m_box->filters.include_pattern));
-        ret = regcomp(&m_box->filters.include_regex, m_box->filters.include_pattern, REG_EXTENDED);
-        if (ret) {
-            log_message(ERROR, 1, "Could not compile regex for include_pattern: %s\n", m_box->filters.include_pattern);
-            exit(EXIT_FAILURE);
-        }
+        strncpy(filters->include_pattern, include_pattern, sizeof(filters->include_pattern) - 1);
     } else if (exclude_pattern) {
-        strncpy(m_box->filters.exclude_pattern, exclude_pattern, sizeof(m_box->filters.exclude_pattern));
-        ret = regcomp(&m_box->filters.exclude_regex, m_box->filters.exclude_pattern, REG_EXTENDED);
-        if (ret) {
-            log_message(ERROR, 1, "Could not compile regex for exclude_pattern: %s\n", m_box->filters.exclude_pattern);
-            exit(EXIT_FAILURE);
+        strncpy(filters->exclude_pattern, exclude_pattern, sizeof(filters->exclude_pattern) - 1);
+    }
+}
+
+/**
+ * @brief Compiles the regex patterns of filters.
+ * 
+ * @param filters The filters.
+ * @param error Set to the reason on failure.
+ * @param error_size Size of error.
+ * @return int 1 on success, 0 otherwise, and nothing is left to free.
+ */
+int compile_filters(filters_t* filters, char* error, size_t error_size) {
+    if (filters->include_pattern[0] != 0 && regcomp(&filters->include_regex, filters->include_pattern, REG_EXTENDED)) {
+        snprintf(error, error_size, "Could not compile regex for include_pattern: %s", filters->include_pattern);
+        filters->include_pattern[0] = '\0';
+        filters->exclude_pattern[0] = '\0';
+        return 0;
+    }
+    if (filters->exclude_pattern[0] != 0 && regcomp(&filters->exclude_regex, filters->exclude_pattern, REG_EXTENDED)) {
+        snprintf(error, error_size, "Could not compile regex for exclude_pattern: %s", filters->exclude_pattern);
+        filters->exclude_pattern[0] = '\0';
+        free_filters(filters);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Frees the regex patterns compiled by compile_filters().
+ * 
+ * @param filters The filters.
+ */
+void free_filters(filters_t* filters) {
+    if (filters->include_pattern[0] != 0) {
+        regfree(&filters->include_regex);
+    }
+    if (filters->exclude_pattern[0] != 0) {
+        regfree(&filters->exclude_regex);
+    }
+}
+
+static void free_watch_root(watch_root_t* root) {
+    free_filters(&root->filters);
+    free(root);
+}
+
+// Logs an error of a watch set change and copies it for the control socket
+static void watch_error(char* error, size_t error_size, const char* format, ...) {
+    char message[PATH_MAX + 256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    log_message(ERROR, 1, "%s\n", message);
+    if (error != NULL && error_size > 0) {
+        snprintf(error, error_size, "%s", message);
+    }
+}
+
+static watch_set_t* watch_set_build(watch_root_t** roots, int count, rule_set_t* rules) {
+    watch_set_t* watch = (watch_set_t*) malloc(sizeof(watch_set_t));
+    if (watch == NULL) {
+        return NULL;
+    }
+    static uint64_t versions = 0;
+    path_trie_init(&watch->trie);
+    watch->rules = rules;
+    watch->root_count = 0;
+    watch->version = __atomic_add_fetch(&versions, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < count; i++) {
+        if (!path_trie_insert(&watch->trie, roots[i]->path, i)) {
+            path_trie_free(&watch->trie);
+            free(watch);
+            return NULL;
         }
-    } 
-    
+        watch->roots[watch->root_count++] = roots[i];
+    }
+    return watch;
+}
+
+static void watch_set_free(watch_set_t* watch) {
+    path_trie_free(&watch->trie);
+    free(watch);
+}
+
+/**
+ * @brief Makes a watch set the current one and frees the previous set once no reader holds it.
+ *        The caller holds m_box->watch_lock and must not hold g_mounts.lock, which readers take.
+ * 
+ * @param m_box The monitor box.
+ * @param next The new watch set.
+ */
+static void watch_publish(monitor_box_t* m_box, watch_set_t* next) {
+    watch_set_t* previous = __atomic_exchange_n(&m_box->watch, next, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&m_box->root_count, next->root_count, __ATOMIC_RELAXED);
+    for (int i = 0; i < WATCH_READERS_MAX; i++) {
+        while (__atomic_load_n(&m_box->readers[i], __ATOMIC_SEQ_CST) == previous) {
+            usleep(100);
+        }
+    }
+    watch_set_free(previous);
+}
+
+/**
+ * @brief Takes the current watch set for a read batch. It stays valid until watch_exit().
+ * 
+ * @param m_box The monitor box.
+ * @param reader The calling thread.
+ * @return watch_set_t* The watch set.
+ */
+watch_set_t* watch_enter(monitor_box_t* m_box, watch_reader_t reader) {
+    watch_set_t* watch;
+    // Announce, then check that it was not swapped out in between
+    do {
+        watch = __atomic_load_n(&m_box->watch, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&m_box->readers[reader], watch, __ATOMIC_SEQ_CST);
+    } while (watch != __atomic_load_n(&m_box->watch, __ATOMIC_SEQ_CST));
+    return watch;
+}
+
+/**
+ * @brief Releases the watch set taken by watch_enter().
+ * 
+ * @param m_box The monitor box.
+ * @param reader The calling thread.
+ */
+void watch_exit(monitor_box_t* m_box, watch_reader_t reader) {
+    __atomic_store_n(&m_box->readers[reader], NULL, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Adds a directory tree to watch, with its own filters. Once monitoring has begun, only the
+ *        filesystems no other root is on are marked, and the readers pick the root up on their next batch.
+ * 
+ * @param m_box The monitor box.
+ * @param path The directory.
+ * @param mount_path The mount holding the directory, or NULL to look it up in mountinfo.
+ * @param filters The filters of the directory, the regex patterns are compiled here.
+ * @param error Set to the reason on failure, may be NULL.
+ * @param error_size Size of error.
+ * @return int The index of the root, or -1 on failure (already logged).
+ */
+int add_watch_root(monitor_box_t* m_box, const char* path, const char* mount_path, const filters_t* filters, char* error, size_t error_size) {
+
+    watch_root_t* root;
+    watch_root_t* roots[WATCH_ROOTS_MAX];
+    watch_set_t* current;
+    watch_set_t* next;
+    char* full_path;
+    int marked = 1;
+
+    pthread_mutex_lock(&m_box->watch_lock);
+    current = m_box->watch;
+
+    if (current->root_count >= WATCH_ROOTS_MAX) {
+        watch_error(error, error_size, "Cannot watch more than %d directories: %s", WATCH_ROOTS_MAX, path);
+        pthread_mutex_unlock(&m_box->watch_lock);
+        return -1;
+    }
+    if (!path_exists(path)) {
+        watch_error(error, error_size, "Directory path does not exist: %s", path);
+        pthread_mutex_unlock(&m_box->watch_lock);
+        return -1;
+    }
+    if (!is_directory(path)) {
+        watch_error(error, error_size, "Stated path is not a directory: %s", path);
+        pthread_mutex_unlock(&m_box->watch_lock);
+        return -1;
+    }
+    full_path = get_full_path(path);
+    if (full_path == NULL) {
+        watch_error(error, error_size, "Unable to resolve fullpath of: %s", path);
+        pthread_mutex_unlock(&m_box->watch_lock);
+        return -1;
+    }
+    for (int i = 0; i < current->root_count; i++) {
+        if (strcmp(current->roots[i]->path, full_path) == 0) {
+            watch_error(error, error_size, "Directory is already watched: %s", full_path);
+            free(full_path);
+            pthread_mutex_unlock(&m_box->watch_lock);
+            return -1;
+        }
+    }
+
+    root = (watch_root_t*) malloc(sizeof(watch_root_t));
+    if (root == NULL) {
+        watch_error(error, error_size, "Failed to allocate memory to watch root");
+        free(full_path);
+        pthread_mutex_unlock(&m_box->watch_lock);
+        return -1;
+    }
+    strncpy(root->path, full_path, PATH_MAX - 1);
+    root->path[PATH_MAX - 1] = '\0';
+    free(full_path);
+    memcpy(&root->filters, filters, sizeof(root->filters));
+
+    char reason[256];
+    if (!compile_filters(&root->filters, reason, sizeof(reason))) {
+        watch_error(error, error_size, "%s", reason);
+        free(root);
+        pthread_mutex_unlock(&m_box->watch_lock);
+        return -1;
+    }
+
     if (mount_path == NULL) {
-        struct fstab* fs = getfssearch(m_box->parent_path);
-        if (fs == NULL) {
-            log_message(ERROR, 1, "Could not get mount point of \"%s\" via fstab.\n", m_box->parent_path); 
+        if (!mounts_find_root(root->path, root->mount_path, PATH_MAX)) {
+            watch_error(error, error_size, "Could not get mount point of \"%s\" via %s.", root->path, MOUNTINFO_PATH); 
             log_message(ERROR, 1, "Consider using 'findmnt -T <PATH>' or 'df <PATH>' to find the mount path and run filemon again with -m option.\n");
-            exit(EXIT_FAILURE);
+            free_watch_root(root);
+            pthread_mutex_unlock(&m_box->watch_lock);
+            return -1;
         }
-
-        strncpy(m_box->mount_path, fs->fs_file, PATH_MAX);
     } else {
-        strncpy(m_box->mount_path, mount_path, PATH_MAX);
+        strncpy(root->mount_path, mount_path, PATH_MAX - 1);
+        root->mount_path[PATH_MAX - 1] = '\0';
     }
-    return m_box;
+
+    memcpy(roots, current->roots, current->root_count * sizeof(roots[0]));
+    roots[current->root_count] = root;
+    next = watch_set_build(roots, current->root_count + 1, current->rules);
+    if (next == NULL) {
+        watch_error(error, error_size, "Too many watched directories to index: %s", root->path);
+        free_watch_root(root);
+        pthread_mutex_unlock(&m_box->watch_lock);
+        return -1;
+    }
+
+    // Only filesystems that are not marked yet get marks
+    if (m_box->marked) {
+        pthread_mutex_lock(&g_mounts.lock);
+        marked = mounts_add_parent(root->path, root->mount_path);
+        if (marked) {
+            mounts_refresh();
+            marked = mounts_watching(root->path);
+            if (!marked) {
+                mounts_remove_parent(root->path);
+                mounts_refresh();
+            }
+        }
+        pthread_mutex_unlock(&g_mounts.lock);
+    }
+    if (!marked) {
+        watch_error(error, error_size, "Failed to apply fanotify marks on the filesystem of \"%s\"", root->path);
+        watch_set_free(next);
+        free_watch_root(root);
+        pthread_mutex_unlock(&m_box->watch_lock);
+        return -1;
+    }
+
+    watch_publish(m_box, next);
+    pthread_mutex_unlock(&m_box->watch_lock);
+    if (m_box->marked) {
+        log_message(INFO, 1, "Started watching %s\n", root->path);
+    }
+    return next->root_count - 1;
+}
+
+/**
+ * @brief Stops watching a directory tree. The readers drop it on their next batch, and only the
+ *        filesystems no other root is on are unmarked.
+ * 
+ * @param m_box The monitor box.
+ * @param path The directory, as listed by print_box().
+ * @param error Set to the reason on failure, may be NULL.
+ * @param error_size Size of error.
+ * @return int 1 on success, 0 on failure (already logged).
+ */
+int remove_watch_root(monitor_box_t* m_box, const char* path, char* error, size_t error_size) {
+
+    watch_root_t* root = NULL;
+    watch_root_t* roots[WATCH_ROOTS_MAX];
+    watch_set_t* current;
+    watch_set_t* next;
+    char resolved[PATH_MAX];
+    int count = 0;
+
+    // The directory may already be gone, so try the path as given first
+    pthread_mutex_lock(&m_box->watch_lock);
+    current = m_box->watch;
+    for (int pass = 0; pass < 2 && root == NULL; pass++) {
+        const char* wanted = path;
+        if (pass == 1) {
+            if (realpath(path, resolved) == NULL) {
+                break;
+            }
+            wanted = resolved;
+        }
+        for (int i = 0; i < current->root_count; i++) {
+            if (strcmp(current->roots[i]->path, wanted) == 0) {
+                root = current->roots[i];
+                break;
+            }
+        }
+    }
+    if (root == NULL) {
+        watch_error(error, error_size, "Directory is not watched: %s", path);
+        pthread_mutex_unlock(&m_box->watch_lock);
+        return 0;
+    }
+
+    for (int i = 0; i < current->root_count; i++) {
+        if (current->roots[i] != root) {
+            roots[count++] = current->roots[i];
+        }
+    }
+    next = watch_set_build(roots, count, current->rules);
+    if (next == NULL) {
+        watch_error(error, error_size, "Failed to allocate memory to watch set");
+        pthread_mutex_unlock(&m_box->watch_lock);
+        return 0;
+    }
+    // No reader sees the root once this returns
+    watch_publish(m_box, next);
+
+    if (m_box->marked) {
+        pthread_mutex_lock(&g_mounts.lock);
+        mounts_remove_parent(root->path);
+        mounts_refresh();
+        pthread_mutex_unlock(&g_mounts.lock);
+    }
+    pthread_mutex_unlock(&m_box->watch_lock);
+    log_message(INFO, 1, "Stopped watching %s\n", root->path);
+    free_watch_root(root);
+    return 1;
+}
+
+/**
+ * @brief Makes a rule set the one every event is judged under from the next read batch on, and
+ *        frees the previous rule set.
+ * 
+ * @param m_box The monitor box.
+ * @param rules The rule set, with its patterns compiled.
+ * @param error Set to the reason on failure, may be NULL.
+ * @param error_size Size of error.
+ * @return int 1 on success, 0 on failure (already logged), the rule set is then left to the caller.
+ */
+int replace_rules(monitor_box_t* m_box, rule_set_t* rules, char* error, size_t error_size) {
+    pthread_mutex_lock(&m_box->watch_lock);
+    watch_set_t* current = m_box->watch;
+    rule_set_t* previous = current->rules;
+    watch_set_t* next = watch_set_build(current->roots, current->root_count, rules);
+    if (next == NULL) {
+        watch_error(error, error_size, "Failed to allocate memory to watch set");
+        pthread_mutex_unlock(&m_box->watch_lock);
+        return 0;
+    }
+    // No reader sees the previous rules once this returns
+    watch_publish(m_box, next);
+    pthread_mutex_unlock(&m_box->watch_lock);
+    if (previous != NULL) {
+        free_filters(&previous->filters);
+        free(previous);
+    }
+    return 1;
 }
 
 /**
- * @brief Begin monitoring the parent directory specified by the user.
+ * @brief Begin monitoring the directories specified by the user.
  * 
  * @param m_box The monitor box.
  */
@@ -297,6 +784,26 @@ void begin_monitor(monitor_box_t* m_box) {
     thread_arg_t args = { .m_box = m_box };
 
     apply_fanotify_marks(m_box);
+    // Events are queued from here on, whether or not the threads are running yet
+    if (m_box->start_ns) {
+        m_box->ready_ns = probe_clock_ns() - m_box->start_ns;
+    }
+    metrics_add_collector(collect_queue_depth, m_box);
+    metrics_add_collector(collect_startup, m_box);
+    metrics_add_collector(collect_watch_roots, m_box);
+    if (g_sessions.enabled) {
+        metrics_add_collector(collect_sessions, NULL);
+    }
+    if (g_shedding.enabled) {
+        metrics_add_collector(collect_shedding, NULL);
+    }
+    if (g_proctable.enabled) {
+        metrics_add_collector(collect_proctable, NULL);
+    }
+    if (g_descendants.enabled) {
+        metrics_add_collector(collect_descendants, NULL);
+    }
+    metrics_add_collector(collect_mounts, NULL);
     
     // Create the threads
     #ifdef FAN_REPORT_DFID_NAME
@@ -314,6 +821,7 @@ void begin_monitor(monitor_box_t* m_box) {
         printf("[+] All output is redirected to \"%s\"\n", get_full_path(g_logger.logfile));
     }
     log_message(INFO, 1, "Successfully started filemon.\n");
+    log_message(DEBUG, 1, "Marks in place %.3fms after start (feature probe %.3fms)\n", m_box->ready_ns / 1e6, g_features.probe_ns / 1e6);
 
     #ifdef FAN_REPORT_DFID_NAME
     pthread_join(thread1, NULL);
@@ -332,151 +840,109 @@ void handle_events_read_write_execute(monitor_box_t* m_box) {
     ssize_t buflen;
     struct fanotify_event_metadata *metadata;
     struct fanotify_response response;
-
+    proc_identity_t identities[sizeof(buf) / FAN_EVENT_METADATA_LEN];
+    int pidfds[sizeof(buf) / FAN_EVENT_METADATA_LEN];
+    char path_buffer[PATH_MAX];
+    int pidfd_count, index = 0;
+    int probing = FILEMON_PROBES_ACTIVE();
+    uint64_t event_start = probing ? probe_clock_ns() : 0;
+
+    if (g_shedding.enabled) {
+        shedding_update(m_box->fanotify_info.fd_read_write_execute, m_box->fanotify_info.event_len_read_write_execute);
+    }
     buflen = read(m_box->fanotify_info.fd_read_write_execute, buf, sizeof(buf));
     if (buflen > 0) {
+        watch_set_t* watch = watch_enter(m_box, WATCH_READER_RWE);
+        metrics_inc(METRIC_READ_BATCHES_RWE);
+        FILEMON_PROBE3(batch_read, GROUP_READ_WRITE_EXECUTE, buflen, probing ? probe_clock_ns() - event_start : 0);
+        // Without a policy nothing is decided, the processes waiting in open() go on before any other work
+        if (g_features.permission_events && !g_policy.enabled) {
+            allow_batch_permissions(m_box, buf, buflen, probing);
+        }
+        pidfd_count = resolve_batch_identities(buf, buflen, identities, pidfds);
         metadata = (struct fanotify_event_metadata *)buf;
-        while (FAN_EVENT_OK(metadata, buflen)) {
-            char *comm = get_comm_from_pid(metadata->pid);
-            char *full_path = get_path_from_fd(metadata->fd);
-            char flags[FLAGS_MAX];
-            if (m_box->fanotify_info.config_fanotify_access_permissions_enabled) {
-                #ifdef FAN_OPEN_PERM
-                if (metadata->mask & FAN_OPEN_PERM) {
-                    response.fd = metadata->fd;
-                    response.response = FAN_ALLOW;
-                    write(m_box->fanotify_info.fd_read_write_execute, &response, sizeof(response));
-                    strncat(flags, "FAN_OPEN_PERM, ", strlen("FAN_OPEN_PERM, ") + 1);
-                }
-                #endif
-                
-                #ifdef FAN_ACCESS_PERM
-                if (metadata->mask & FAN_ACCESS_PERM) {
-                    response.fd = metadata->fd;
-                    response.response = FAN_ALLOW;
-                    write(m_box->fanotify_info.fd_read_write_execute, &response, sizeof(response));
-                    strncat(flags, "FAN_ACCESS_PERM, ", strlen("FAN_ACCESS_PERM, ") + 1);
-                }
-                #endif
-
-                #ifdef FAN_OPEN_EXEC_PERM
-                if (metadata->mask & FAN_OPEN_EXEC_PERM) {
-                    response.fd = metadata->fd;
-                    response.response = FAN_ALLOW;
-                    write(m_box->fanotify_info.fd_read_write_execute, &response, sizeof(response));
-                    strncat(flags, "FAN_OPEN_EXEC_PERM, ", strlen("FAN_OPEN_EXEC_PERM, ") + 1);
-                }
-                #endif
-            }
-
-            #ifdef FAN_ACCESS
-            if (metadata->mask & FAN_ACCESS) {
-                strncat(flags, "FAN_ACCESS, ", strlen("FAN_ACCESS, ") + 1);
-            }
-            #endif
-
-            #ifdef FAN_OPEN
-            if (metadata->mask & FAN_OPEN) {
-                strncat(flags, "FAN_OPEN, ", strlen("FAN_OPEN, ") + 1);
-            }
-            #endif 
-
-            #ifdef FAN_MODIFY
-            if (metadata->mask & FAN_MODIFY) {
-                strncat(flags, "FAN_MODIFY, ", strlen("FAN_MODIFY, ") + 1);
+        for (; FAN_EVENT_OK(metadata, buflen); index++) {
+            metrics_inc(METRIC_EVENTS_READ_RWE);
+            if (probing) {
+                event_start = probe_clock_ns();
             }
-            #endif
-
-            #ifdef FAN_OPEN_EXEC
-            if (metadata->mask & FAN_OPEN_EXEC) {
-                strncat(flags, "FAN_OPEN_EXEC, ", strlen("FAN_OPEN_EXEC, ") + 1);
-            }
-            #endif
-
-            #ifdef FAN_CLOSE_WRITE
-            if (metadata->mask & FAN_CLOSE_WRITE) {
-                strncat(flags, "FAN_CLOSE_WRITE, ", strlen("FAN_CLOSE_WRITE, ") + 1);
+            if (metadata->mask & FAN_Q_OVERFLOW) {
+                metrics_inc(METRIC_QUEUE_OVERFLOWS_RWE);
+                log_message(WARNING, 1, "Fanotify queue overflowed, read/write/execute events were lost.\n");
+                metadata = FAN_EVENT_NEXT(metadata, buflen);
+                continue;
             }
-            #endif
 
-            #ifdef FAN_CLOSE_NOWRITE
-            if (metadata->mask & FAN_CLOSE_NOWRITE) {
-                strncat(flags, "FAN_CLOSE_NOWRITE, ", strlen("FAN_CLOSE_NOWRITE, ") + 1);
+            char *comm = identities[index].comm;
+            char *full_path = get_path_from_fd(metadata->fd, path_buffer, sizeof(path_buffer));
+            path_ref_t ref = { 0 };
+            policy_decision_t decision = { .action = POLICY_ALLOW };
+            int decided = 0;
+            if (g_policy.enabled && g_features.permission_events && (metadata->mask & PERM_EVENTS_MASK)) {
+                path_verdict_t scope;
+                response.fd = metadata->fd;
+                response.response = FAN_ALLOW;
+                // The marks reach past the watched directories, the policy only answers inside them.
+                // The other filters only choose what is logged, they run once the process goes on.
+                if (watched_roots(watch, full_path, &ref, &scope) != 0) {
+                    decided = 1;
+                    if (policy_decide(metadata->pid, comm, full_path, ref.hash, metadata->mask, &decision) == POLICY_DENY) {
+                        response.response = FAN_DENY;
+                    }
+                }
+                write(m_box->fanotify_info.fd_read_write_execute, &response, sizeof(response));
+                metrics_inc(response.response == FAN_DENY ? METRIC_PERM_RESPONSES_DENY : METRIC_PERM_RESPONSES_ALLOW);
+                FILEMON_PROBE5(perm_response, metadata->pid, metadata->mask, full_path, response.response, probing ? probe_clock_ns() - event_start : 0);
             }
-            #endif
 
-            if (strncmp(full_path, m_box->parent_path, strlen(m_box->parent_path)) != 0) {
-                memset(flags, 0, sizeof(flags));
+            filter_verdict_t verdict = apply_filters(watch, metadata->pid, comm, full_path, &ref);
+            if (verdict != FILTER_PASS) {
+                metrics_inc(filter_verdict_metrics[verdict]);
+                FILEMON_PROBE6(event_reject, GROUP_READ_WRITE_EXECUTE, metadata->pid, metadata->mask, full_path, verdict, probing ? probe_clock_ns() - event_start : 0);
                 close(metadata->fd);
                 metadata = FAN_EVENT_NEXT(metadata, buflen);
                 continue;
             }
-
-            // Ignore self
-            if (metadata->pid == getpid()) {
-                memset(flags, 0, sizeof(flags));
+            if (g_shedding.enabled && !shedding_admit(metadata->pid, comm, metadata->mask)) {
+                metrics_inc(METRIC_EVENTS_SHED);
                 close(metadata->fd);
                 metadata = FAN_EVENT_NEXT(metadata, buflen);
                 continue;
             }
+            FILEMON_PROBE5(event_accept, GROUP_READ_WRITE_EXECUTE, metadata->pid, metadata->mask, full_path, probing ? probe_clock_ns() - event_start : 0);
 
-            /* Apply Filters */
-            if (m_box->filters.include_pids[0] != 0) {
-                if (!is_in_int_array(m_box->filters.include_pids, FILTER_MAX, metadata->pid)) {
-                    memset(flags, 0, sizeof(flags));
-                    close(metadata->fd);
-                    metadata = FAN_EVENT_NEXT(metadata, buflen);
-                    continue;
-                }
-            } else if (m_box->filters.exclude_pids[0] != 0) {
-                if (is_in_int_array(m_box->filters.exclude_pids, FILTER_MAX, metadata->pid)) {
-                    memset(flags, 0, sizeof(flags));
-                    close(metadata->fd);
-                    metadata = FAN_EVENT_NEXT(metadata, buflen);
-                    continue;
-                }
-            }
-
-            if (m_box->filters.include_process[0][0] != 0) {
-                if (!is_in_process_names(m_box->filters.include_process, FILTER_MAX, comm)) {
-                    memset(flags, 0, sizeof(flags));
-                    close(metadata->fd);
-                    metadata = FAN_EVENT_NEXT(metadata, buflen);
-                    continue;
-                }
-            } else if (m_box->filters.exclude_process[0][0] != 0) {
-                if (is_in_process_names(m_box->filters.exclude_process, FILTER_MAX, comm)) {
-                    memset(flags, 0, sizeof(flags));
-                    close(metadata->fd);
-                    metadata = FAN_EVENT_NEXT(metadata, buflen);
-                    continue;
-                }
-            }
-
-            if (m_box->filters.include_pattern[0] != 0) {
-                if (!regex_search(m_box->filters.include_regex, full_path)) {
-                    memset(flags, 0, sizeof(flags));
-                    close(metadata->fd);
-                    metadata = FAN_EVENT_NEXT(metadata, buflen);
-                    continue;
-                }
-            } else if (m_box->filters.exclude_pattern[0] != 0) {
-                if (regex_search(m_box->filters.exclude_regex, full_path)) {
-                    memset(flags, 0, sizeof(flags));
-                    close(metadata->fd);
+            if (g_sessions.enabled) {
+                session_track(metadata->pid, comm, full_path, metadata->mask, emit_session);
+            } else {
+                content_hash_t hash = { .status = HASH_NONE };
+                chunk_diff_t changes = { .status = CHUNKS_NONE };
+                if (g_hashing.enabled && (metadata->mask & HASH_EVENTS_MASK) &&
+                    hashing_submit(metadata->fd, metadata->pid, comm, full_path, ref.hash, metadata->mask, &hash, &changes)) {
+                    // A worker closes the fd, the event is emitted with its hash by hashing_drain()
                     metadata = FAN_EVENT_NEXT(metadata, buflen);
                     continue;
                 }
+                event_t event = {
+                    .group = GROUP_READ_WRITE_EXECUTE,
+                    .pid = metadata->pid,
+                    .mask = metadata->mask,
+                    .comm = comm,
+                    .path = full_path,
+                    .path_hash = ref.hash,
+                    .hash = hash.status != HASH_NONE ? &hash : NULL,
+                    .changes = changes.status != CHUNKS_NONE ? &changes : NULL,
+                    // A plain default allow is left out, like without --policy
+                    .policy = decided && (decision.rule != 0 || decision.timed_out || decision.action != POLICY_ALLOW) ? &decision : NULL,
+                };
+                emit_event(&event);
             }
-            
-            flags[strlen(flags) - 2] = '\0';
-            log_message(INFO, 1, "%s (%d): %s == [%s]\n", comm, metadata->pid, full_path, flags);
-            memset(flags, 0, sizeof(flags));
 
             // Advance to the next event
             close(metadata->fd);
             metadata = FAN_EVENT_NEXT(metadata, buflen);
         }
+        watch_exit(m_box, WATCH_READER_RWE);
+        close_pidfds(pidfds, pidfd_count);
     }
     return;
 }
@@ -490,203 +956,650 @@ void handle_events_read_write_execute(monitor_box_t* m_box) {
  */
 void handle_events_create_delete_move(monitor_box_t* m_box) {
 
-    int mount_fd, event_fd;
+    int mount_fd;
     char buf[4096];
-    unsigned char *file_name;
-    struct file_handle *file_handle;
     ssize_t buflen;
     struct fanotify_event_metadata *metadata;
-    struct fanotify_event_info_fid *fid;
     char full_path[PATH_MAX];
+    char old_path[PATH_MAX];
+    proc_identity_t identities[sizeof(buf) / FAN_EVENT_METADATA_LEN];
+    int pidfds[sizeof(buf) / FAN_EVENT_METADATA_LEN];
+    int pidfd_count, index = 0;
+    int probing = FILEMON_PROBES_ACTIVE();
+    uint64_t event_start = probing ? probe_clock_ns() : 0;
 
     buflen = read(m_box->fanotify_info.fd_create_delete_move, buf, sizeof(buf));
 
     if (buflen > 0) {
+        watch_set_t* watch = watch_enter(m_box, WATCH_READER_CDM);
+        pthread_mutex_lock(&g_mounts.lock);
+        metrics_inc(METRIC_READ_BATCHES_CDM);
+        FILEMON_PROBE3(batch_read, GROUP_CREATE_DELETE_MOVE, buflen, probing ? probe_clock_ns() - event_start : 0);
+        pidfd_count = resolve_batch_identities(buf, buflen, identities, pidfds);
         metadata = (struct fanotify_event_metadata*)&buf;
-        while (FAN_EVENT_OK(metadata, buflen)) {
-            char* comm = get_comm_from_pid(metadata->pid);
-            mount_fd = open(m_box->mount_path, O_DIRECTORY | O_RDONLY);
-            if (mount_fd == -1) {
-                log_message(ERROR, 1, "Failed to open %s\n", m_box->parent_path);
-                stop_monitor(m_box);
-                exit(EXIT_FAILURE);
+        for (; FAN_EVENT_OK(metadata, buflen); index++) {
+            metrics_inc(METRIC_EVENTS_READ_CDM);
+            if (probing) {
+                event_start = probe_clock_ns();
             }
-
-            fid = (struct fanotify_event_info_fid *) (metadata + 1);
-            file_handle = (struct file_handle *) fid->handle;
-
-            /* Ensure that the event info is of the correct type. */
-
-            if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_FID || fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID) {
-                file_name = NULL;
-            } else if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) {
-                file_name = file_handle->f_handle + file_handle->handle_bytes;
+            if (metadata->mask & FAN_Q_OVERFLOW) {
+                metrics_inc(METRIC_QUEUE_OVERFLOWS_CDM);
+                log_message(WARNING, 1, "Fanotify queue overflowed, create/delete/move events were lost.\n");
+                metadata = FAN_EVENT_NEXT(metadata, buflen);
+                continue;
             }
 
-            event_fd = open_by_handle_at(mount_fd, file_handle, O_RDONLY);
-            if (event_fd == -1) {
-                if (errno == ESTALE) {
-                    close(mount_fd);
-                    metadata = FAN_EVENT_NEXT(metadata, buflen);
-                    continue;
-                } else {
-                    log_message(ERROR, 1, "Encountered error at open_by_handle_at()\n");
-                    exit(EXIT_FAILURE);
+            char* comm = identities[index].comm;
+            const struct fanotify_event_info_fid* dir_fid = NULL;
+            const struct fanotify_event_info_fid* old_fid = NULL;
+            const struct fanotify_event_info_fid* new_fid = NULL;
+            const struct fanotify_event_info_fid* target_fid = NULL;
+            int resolved = 0;
+
+            /* Walk every info record, a rename carries both the old and the new directory entry. */
+            const char* info = (const char*)metadata + metadata->metadata_len;
+            const char* end = (const char*)metadata + metadata->event_len;
+            while (info + sizeof(struct fanotify_event_info_header) <= end) {
+                const struct fanotify_event_info_header* hdr = (const struct fanotify_event_info_header*)info;
+                if (hdr->len == 0) {
+                    break;
                 }
+                switch (hdr->info_type) {
+                    case FAN_EVENT_INFO_TYPE_DFID_NAME:
+                    case FAN_EVENT_INFO_TYPE_DFID:
+                        dir_fid = (const struct fanotify_event_info_fid*)hdr;
+                        break;
+                    case FAN_EVENT_INFO_TYPE_FID:
+                        target_fid = (const struct fanotify_event_info_fid*)hdr;
+                        break;
+                    #ifdef FAN_EVENT_INFO_TYPE_OLD_DFID_NAME
+                    case FAN_EVENT_INFO_TYPE_OLD_DFID_NAME:
+                        old_fid = (const struct fanotify_event_info_fid*)hdr;
+                        break;
+                    case FAN_EVENT_INFO_TYPE_NEW_DFID_NAME:
+                        new_fid = (const struct fanotify_event_info_fid*)hdr;
+                        break;
+                    #endif
+                    default:
+                        break;
+                }
+                info += hdr->len;
             }
 
-            char* path = get_path_from_fd(event_fd);     
-            char flags[FLAGS_MAX];
-
-            if (file_name) {
-                snprintf(full_path, sizeof(full_path), "%s/%s", path, file_name);
-            } else {
-                strncpy(full_path, path, sizeof(full_path));
+            // Every record of an event is on the same filesystem
+            const struct fanotify_event_info_fid* any_fid = dir_fid ? dir_fid : old_fid;
+            mount_fd = any_fid ? mounts_fd(&any_fid->fsid) : -1;
+            if (mount_fd == -1 && any_fid && mounts_refresh_missed()) {
+                // A mount that raced the POLLPRI notification
+                mount_fd = mounts_fd(&any_fid->fsid);
             }
-
-            #ifdef FAN_CREATE
-            if (metadata->mask & FAN_CREATE) {
-                strncat(flags, "FAN_CREATE, ", strlen("FAN_CREATE, ") + 1);
-                if (metadata->mask & FAN_ONDIR) {
-                    strncat(flags, "FAN_ONDIR, ", strlen("FAN_ONDIR, ") + 1);
-                }
+            if (mount_fd == -1) {
+                metrics_inc(METRIC_EVENTS_UNKNOWN_FS);
+                metadata = FAN_EVENT_NEXT(metadata, buflen);
+                continue;
             }
-            #endif
 
-            #ifdef FAN_DELETE
-            if (metadata->mask & FAN_DELETE) {
-                strncat(flags, "FAN_DELETE, ", strlen("FAN_DELETE, ") + 1);
-                if (metadata->mask & FAN_ONDIR) {
-                    strncat(flags, "FAN_ONDIR, ", strlen("FAN_ONDIR, ") + 1);
-                }
+            if (old_fid && new_fid) {
+                resolved = resolve_fid_path(mount_fd, old_fid, old_path, sizeof(old_path)) &&
+                           resolve_fid_path(mount_fd, new_fid, full_path, sizeof(full_path));
+            } else if (dir_fid) {
+                resolved = resolve_fid_path(mount_fd, dir_fid, full_path, sizeof(full_path));
             }
-            #endif
-
-            #ifdef FAN_RENAME
-            if (metadata->mask & FAN_RENAME) {
-                strncat(flags, "FAN_RENAME, ", strlen("FAN_RENAME, ") + 1);
-                if (metadata->mask & FAN_ONDIR) {
-                    strncat(flags, "FAN_ONDIR, ", strlen("FAN_ONDIR, ") + 1);
-                }
+            if (!resolved) {
+                // The parent directory is already gone
+                metadata = FAN_EVENT_NEXT(metadata, buflen);
+                continue;
             }
-            #endif
-
-            #ifdef FAN_MOVED_FROM
-            if (metadata->mask & FAN_MOVED_FROM) {
-                strncat(flags, "FAN_MOVED_FROM, ", strlen("FAN_MOVED_FROM, ") + 1);
-                if (metadata->mask & FAN_ONDIR) {
-                    strncat(flags, "FAN_ONDIR, ", strlen("FAN_ONDIR, ") + 1);
+            // Reached through a bind mount inside a watched directory
+            if (path_trie_match(&watch->trie, full_path) == 0) {
+                char alias[PATH_MAX];
+                if (mounts_translate(&any_fid->fsid, full_path, alias, sizeof(alias))) {
+                    strncpy(full_path, alias, sizeof(full_path) - 1);
                 }
             }
-            #endif
-
-            #ifdef FAN_MOVED_TO
-            if (metadata->mask & FAN_MOVED_TO) {
-                strncat(flags, "FAN_MOVED_TO, ", strlen("FAN_MOVED_TO, ") + 1);
-                if (metadata->mask & FAN_ONDIR) {
-                    strncat(flags, "FAN_ONDIR, ", strlen("FAN_ONDIR, ") + 1);
+            if (old_fid && new_fid && path_trie_match(&watch->trie, old_path) == 0) {
+                char alias[PATH_MAX];
+                if (mounts_translate(&any_fid->fsid, old_path, alias, sizeof(alias))) {
+                    strncpy(old_path, alias, sizeof(old_path) - 1);
                 }
             }
-            #endif
 
-            if (strncmp(full_path, m_box->parent_path, strlen(m_box->parent_path)) != 0) {
-                memset(flags, 0, sizeof(flags));
-                close(metadata->fd);
-                close(mount_fd);
-                close(event_fd);
-                metadata = FAN_EVENT_NEXT(metadata, buflen);
-                continue;
+            // A renamed or deleted directory changes the path of everything below it
+            if ((metadata->mask & FAN_ONDIR) && (metadata->mask & DIR_CACHE_INVALIDATE_MASK)) {
+                dir_cache_flush();
+            } else if ((metadata->mask & FAN_ONDIR) && (metadata->mask & FAN_CREATE) && target_fid) {
+                dir_cache_put(target_fid, full_path);
             }
 
-            // Ignore self
-            if (metadata->pid == getpid()) {
-                memset(flags, 0, sizeof(flags));
-                close(metadata->fd);
-                close(mount_fd);
-                close(event_fd);
+            path_ref_t ref = { 0 };
+            filter_verdict_t verdict = apply_filters(watch, metadata->pid, comm, full_path, &ref);
+            if (verdict == FILTER_OUTSIDE_PARENT && old_fid && new_fid) {
+                // Moved out of the watched directory
+                verdict = apply_filters(watch, metadata->pid, comm, old_path, NULL);
+            }
+            if (verdict != FILTER_PASS) {
+                metrics_inc(filter_verdict_metrics[verdict]);
+                FILEMON_PROBE6(event_reject, GROUP_CREATE_DELETE_MOVE, metadata->pid, metadata->mask, full_path, verdict, probing ? probe_clock_ns() - event_start : 0);
                 metadata = FAN_EVENT_NEXT(metadata, buflen);
                 continue;
             }
 
-            /* Apply Filters */
-            if (m_box->filters.include_pids[0] != 0) {
-                if (!is_in_int_array(m_box->filters.include_pids, FILTER_MAX, metadata->pid)) {
-                    memset(flags, 0, sizeof(flags));
-                    close(metadata->fd);
-                    close(mount_fd);
-                    close(event_fd);
-                    metadata = FAN_EVENT_NEXT(metadata, buflen);
-                    continue;
-                }
-            } else if (m_box->filters.exclude_pids[0] != 0) {
-                if (is_in_int_array(m_box->filters.exclude_pids, FILTER_MAX, metadata->pid)) {
-                    memset(flags, 0, sizeof(flags));
-                    close(metadata->fd);
-                    close(mount_fd);
-                    close(event_fd);
-                    metadata = FAN_EVENT_NEXT(metadata, buflen);
-                    continue;
-                }
-            }
+            FILEMON_PROBE5(event_accept, GROUP_CREATE_DELETE_MOVE, metadata->pid, metadata->mask, full_path, probing ? probe_clock_ns() - event_start : 0);
+
+            event_t event = {
+                .group = GROUP_CREATE_DELETE_MOVE,
+                .pid = metadata->pid,
+                .mask = metadata->mask,
+                .comm = comm,
+                .path = full_path,
+                .old_path = (old_fid && new_fid) ? old_path : NULL,
+                .path_hash = ref.hash,
+            };
+            emit_event(&event);
+            
+            metadata = FAN_EVENT_NEXT(metadata, buflen);
+        }
+        mounts_release();
+        pthread_mutex_unlock(&g_mounts.lock);
+        watch_exit(m_box, WATCH_READER_CDM);
+        close_pidfds(pidfds, pidfd_count);
+    }
 
-            if (m_box->filters.include_process[0][0] != 0) {
-                if (!is_in_process_names(m_box->filters.include_process, FILTER_MAX, comm)) {
-                    memset(flags, 0, sizeof(flags));
-                    close(metadata->fd);
-                    close(mount_fd);
-                    close(event_fd);
-                    metadata = FAN_EVENT_NEXT(metadata, buflen);
-                    continue;
-                }
-            } else if (m_box->filters.exclude_process[0][0] != 0) {
-                if (is_in_process_names(m_box->filters.exclude_process, FILTER_MAX, comm)) {
-                    memset(flags, 0, sizeof(flags));
-                    close(metadata->fd);
-                    close(mount_fd);
-                    close(event_fd);
-                    metadata = FAN_EVENT_NEXT(metadata, buflen);
-                    continue;
-                }
-            }
+    return;
+}
+#endif
 
-            if (m_box->filters.include_pattern[0] != 0) {
-                if (!regex_search(m_box->filters.include_regex, full_path)) {
-                    memset(flags, 0, sizeof(flags));
-                    close(metadata->fd);
-                    close(mount_fd);
-                    close(event_fd);
-                    metadata = FAN_EVENT_NEXT(metadata, buflen);
-                    continue;
-                }
-            } else if (m_box->filters.exclude_pattern[0] != 0) {
-                if (regex_search(m_box->filters.exclude_regex, full_path)) {
-                    memset(flags, 0, sizeof(flags));
-                    close(metadata->fd);
-                    close(mount_fd);
-                    close(event_fd);
-                    metadata = FAN_EVENT_NEXT(metadata, buflen);
-                    continue;
+/**
+ * @brief Sends an event that passed the filters to the output, or to the summary tables in summary mode.
+ * 
+ * @param event The event.
+ */
+void emit_event(event_t* event) {
+    char flags[FLAGS_MAX];
+    uint64_t write_start = FILEMON_PROBE_ENABLED(log_write) ? probe_clock_ns() : 0;
+
+    if (g_anomaly.enabled) {
+        // Each reader thread has its own process table, the group tells them apart
+        anomaly_observe(event->group, event->pid, event->comm, event->path, event->path_hash, event->mask, emit_alert);
+    }
+    if (g_ring.enabled) {
+        ring_publish(event);
+    }
+    if (g_stats.enabled) {
+        stats_record(event);
+    }
+    if (g_rollup.enabled) {
+        rollup_record(event);
+    }
+    if (g_summary.interval > 0) {
+        summary_record(event->comm, event->pid, event->path, event->mask);
+    } else if (g_output.format != OUTPUT_TEXT) {
+        output_event(event);
+    } else {
+        char extra[1024];
+        int len = 0;
+        extra[0] = '\0';
+        if (event->session) {
+            const session_t* session = event->session;
+            struct tm opened;
+            localtime_r(&session->opened.tv_sec, &opened);
+            len += snprintf(extra, sizeof(extra), " {opened=%02d:%02d:%02d.%03d duration=%.3fms access=%u modify=%u written=%d%s}",
+                            opened.tm_hour, opened.tm_min, opened.tm_sec, (int)session->opened.tv_usec / 1000,
+                            (session->last_ns - session->opened_ns) / 1e6,
+                            session->access_count, session->modify_count, session->written,
+                            session->end == SESSION_TIMED_OUT ? " end=timeout" : (session->end == SESSION_EVICTED ? " end=evicted" : ""));
+        }
+        if (g_proctable.enabled && len < (int)sizeof(extra)) {
+            len += proctable_format(event->pid, extra + len, sizeof(extra) - len);
+        }
+        if (g_cgroups.show && len < (int)sizeof(extra)) {
+            len += cgroup_format(event->pid, event->comm, extra + len, sizeof(extra) - len);
+        }
+        if (event->hash && len < (int)sizeof(extra)) {
+            len += hashing_format(event->hash, extra + len, sizeof(extra) - len);
+        }
+        if (event->changes && len < (int)sizeof(extra)) {
+            len += chunking_format(event->changes, extra + len, sizeof(extra) - len);
+        }
+        if (event->policy && len < (int)sizeof(extra)) {
+            len += policy_format(event->policy, extra + len, sizeof(extra) - len);
+        }
+        mask_to_flags(event->mask, flags, sizeof(flags));
+        if (event->old_path) {
+            log_message(INFO, 1, "%s (%d): %s → %s == [%s]%s\n", event->comm, event->pid, event->old_path, event->path, flags, extra);
+        } else {
+            log_message(INFO, 1, "%s (%d): %s == [%s]%s\n", event->comm, event->pid, event->path, flags, extra);
+        }
+    }
+    metrics_inc(event->group == GROUP_READ_WRITE_EXECUTE ? METRIC_EVENTS_EMITTED_RWE : METRIC_EVENTS_EMITTED_CDM);
+    FILEMON_PROBE5(log_write, event->group, event->pid, event->mask, event->path, write_start ? probe_clock_ns() - write_start : 0);
+}
+
+/**
+ * @brief Session callback, emits one record for a finished open/close session.
+ * 
+ * @param session The session.
+ */
+void emit_session(session_t* session) {
+    event_t event = {
+        .group = GROUP_READ_WRITE_EXECUTE,
+        .pid = session->pid,
+        .mask = session->mask,
+        .comm = session->comm,
+        .path = session->path,
+        .session = session,
+    };
+    switch (session->end) {
+        case SESSION_TIMED_OUT:
+            metrics_inc(METRIC_SESSIONS_TIMED_OUT);
+            break;
+        case SESSION_EVICTED:
+            metrics_inc(METRIC_SESSIONS_EVICTED);
+            break;
+        default:
+            metrics_inc(METRIC_SESSIONS_CLOSED);
+            break;
+    }
+    emit_event(&event);
+}
+
+/**
+ * @brief Hashing callback, emits the event of a hashed file.
+ * 
+ * @param job The job of the event.
+ */
+void emit_hashed(hash_job_t* job) {
+    event_t event = {
+        .group = GROUP_READ_WRITE_EXECUTE,
+        .pid = job->pid,
+        .mask = job->mask,
+        .comm = job->comm,
+        .path = job->path,
+        .path_hash = job->path_hash,
+        .hash = job->want_hash ? &job->hash : NULL,
+        .changes = job->chunk ? &job->changes : NULL,
+    };
+    emit_event(&event);
+}
+
+/**
+ * @brief Alert callback, writes an alert record. Alerts are not events and skip the other sinks.
+ * 
+ * @param alert The alert.
+ */
+void emit_alert(const anomaly_alert_t* alert) {
+    if (g_output.format != OUTPUT_TEXT) {
+        event_t event = {
+            .group = GROUP_READ_WRITE_EXECUTE,
+            .pid = alert->pid,
+            .comm = (char*)alert->comm,
+            .path = alert->path,
+            .alert = alert,
+        };
+        output_event(&event);
+    } else if (alert->kind == ANOMALY_EXEC_NEW) {
+        log_message(WARNING, 1, "%s (%d): %s == [ALERT %s] {age=%us window=%us}\n", alert->comm, alert->pid, alert->path,
+                    anomaly_kind_name(alert->kind), alert->count, alert->window_s);
+    } else {
+        log_message(WARNING, 1, "%s (%d): %s == [ALERT %s] {count=%u threshold=%u window=%us}\n", alert->comm, alert->pid, alert->path,
+                    anomaly_kind_name(alert->kind), alert->count, alert->threshold, alert->window_s);
+    }
+}
+
+/**
+ * @brief Metrics collector for the session table.
+ * 
+ * @param out The metrics output stream.
+ * @param arg Unused.
+ */
+void collect_sessions(FILE* out, void* arg) {
+    (void)arg;
+    metrics_write_gauge(out, "filemon_sessions_open", NULL, "Open/close sessions currently tracked.", __atomic_load_n(&g_sessions.count, __ATOMIC_RELAXED));
+    metrics_write_gauge(out, "filemon_sessions_capacity", NULL, "Maximum number of tracked sessions.", g_sessions.max);
+}
+
+/**
+ * @brief Metrics collector for load shedding.
+ * 
+ * @param out The metrics output stream.
+ * @param arg Unused.
+ */
+void collect_shedding(FILE* out, void* arg) {
+    (void)arg;
+    metrics_write_gauge(out, "filemon_shedding_active", NULL, "1 while read/write/execute events are being shed.", __atomic_load_n(&g_shedding.active, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Metrics collector for the process table.
+ * 
+ * @param out The metrics output stream.
+ * @param arg Unused.
+ */
+void collect_proctable(FILE* out, void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_proctable.lock);
+    int count = g_proctable.count;
+    pthread_mutex_unlock(&g_proctable.lock);
+    metrics_write_gauge(out, "filemon_process_table_entries", NULL, "Processes in the lineage table.", count);
+    metrics_write_gauge(out, "filemon_process_table_capacity", NULL, "Maximum number of processes in the lineage table.", g_proctable.max);
+    metrics_write_gauge(out, "filemon_process_table_bytes", NULL, "Memory held by the lineage table.", (double)g_proctable.max * sizeof(proc_entry_t) + (g_proctable.buckets_mask + 1) * sizeof(int));
+}
+
+/**
+ * @brief Metrics collector for --follow-children.
+ * 
+ * @param out The metrics output stream.
+ * @param arg Unused.
+ */
+void collect_descendants(FILE* out, void* arg) {
+    (void)arg;
+    metrics_write_gauge(out, "filemon_followed_processes", NULL, "Included processes and descendants currently followed.", __atomic_load_n(&g_descendants.count, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Metrics collector for the watched filesystems.
+ * 
+ * @param out The metrics stream.
+ * @param arg Unused.
+ */
+void collect_mounts(FILE* out, void* arg) {
+    (void)arg;
+    metrics_write_gauge(out, "filemon_filesystems_watched", NULL, "Filesystems marked under the watched directories.", __atomic_load_n(&g_mounts.count, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Metrics collector for the startup timings.
+ * 
+ * @param out The metrics stream.
+ * @param arg The monitor box.
+ */
+void collect_startup(FILE* out, void* arg) {
+    monitor_box_t* m_box = (monitor_box_t*)arg;
+    metrics_write_gauge(out, "filemon_startup_seconds", NULL, "Time from start until the first event could be received.", m_box->ready_ns / 1e9);
+    metrics_write_gauge(out, "filemon_feature_probe_seconds", NULL, "Time spent probing fanotify features at startup.", g_features.probe_ns / 1e9);
+}
+
+/**
+ * @brief Metrics collector for the watched directories.
+ * 
+ * @param out The metrics stream.
+ * @param arg The monitor box.
+ */
+void collect_watch_roots(FILE* out, void* arg) {
+    monitor_box_t* m_box = (monitor_box_t*)arg;
+    metrics_write_gauge(out, "filemon_watch_roots", NULL, "Directory trees watched.", __atomic_load_n(&m_box->root_count, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief fanotify_init() that asks for FAN_REPORT_PIDFD when the kernel supports it (5.15+).
+ * 
+ * @param flags The fanotify_init flags.
+ * @param event_f_flags The fanotify_init event_f_flags.
+ * @param report_pidfd Set to 1 if the group reports pidfds.
+ * @return int The fanotify fd, or -1.
+ */
+int fanotify_init_pidfd(unsigned int flags, unsigned int event_f_flags, int* report_pidfd) {
+    int fd;
+    #ifdef FAN_REPORT_PIDFD
+    if (g_features.report_pidfd) {
+        fd = fanotify_init(flags | FAN_REPORT_PIDFD, event_f_flags);
+        if (fd != -1) {
+            *report_pidfd = 1;
+            return fd;
+        }
+    }
+    #endif
+    *report_pidfd = 0;
+    fd = fanotify_init(flags, event_f_flags);
+    return fd;
+}
+
+/**
+ * @brief Resolves the process of every event in a batch straight after read(), before the slower
+ * per-event work, so short-lived processes are looked at while they are still around.
+ * 
+ * @param buf The batch.
+ * @param buflen Length of the batch.
+ * @param identities One entry per event, in batch order.
+ * @param pidfds The pidfds of the batch, to be closed with close_pidfds() once the batch is done.
+ * @return int Number of pidfds.
+ */
+int resolve_batch_identities(char* buf, ssize_t buflen, proc_identity_t* identities, int* pidfds) {
+    struct fanotify_event_metadata* metadata = (struct fanotify_event_metadata*)buf;
+    int pidfd_count = 0;
+
+    identity_batch_begin();
+    for (int i = 0; FAN_EVENT_OK(metadata, buflen); i++) {
+        if (!(metadata->mask & FAN_Q_OVERFLOW)) {
+            int pidfd = event_pidfd(metadata);
+            if (pidfd >= 0) {
+                pidfds[pidfd_count++] = pidfd;
+            }
+            int resolved = resolve_identity(metadata->pid, pidfd, &identities[i]);
+            if (g_proctable.enabled) {
+                if (resolved == IDENTITY_LIVE) {
+                    proctable_observe(&identities[i], metadata->mask);
+                } else if (resolved == IDENTITY_UNRESOLVED) {
+                    proctable_identity(metadata->pid, &identities[i]);
                 }
             }
+        }
+        metadata = FAN_EVENT_NEXT(metadata, buflen);
+    }
+    return pidfd_count;
+}
 
-            flags[strlen(flags) - 2] = '\0';
-            if (file_name) {
-                log_message(INFO, 1, "%s (%d): %s/%s == [%s]\n", comm, metadata->pid, path, file_name, flags);
-            } else {
-                log_message(INFO, 1, "%s (%d): %s == [%s]\n", comm, metadata->pid, path, flags);
-            }
-            memset(flags, 0, sizeof(flags));
-            
-            close(metadata->fd);
-            close(mount_fd);
-            close(event_fd);
-            metadata = FAN_EVENT_NEXT(metadata, buflen);
+/**
+ * @brief Allows every permission event of a batch straight after read(), before the processes
+ *        of the batch are resolved. Only used without --policy, when there is nothing to decide.
+ * 
+ * @param m_box The monitor box.
+ * @param buf The batch.
+ * @param buflen Length of the batch.
+ * @param probing Whether the USDT probes are attached, the path is only looked up for them.
+ */
+void allow_batch_permissions(monitor_box_t* m_box, char* buf, ssize_t buflen, int probing) {
+    struct fanotify_event_metadata* metadata = (struct fanotify_event_metadata*)buf;
+    struct fanotify_response response = { .response = FAN_ALLOW };
+    char path_buffer[PATH_MAX];
+
+    for (; FAN_EVENT_OK(metadata, buflen); metadata = FAN_EVENT_NEXT(metadata, buflen)) {
+        if (!(metadata->mask & PERM_EVENTS_MASK) || (metadata->mask & FAN_Q_OVERFLOW)) {
+            continue;
+        }
+        uint64_t start = probing ? probe_clock_ns() : 0;
+        response.fd = metadata->fd;
+        write(m_box->fanotify_info.fd_read_write_execute, &response, sizeof(response));
+        metrics_inc(METRIC_PERM_RESPONSES_ALLOW);
+        if (probing) {
+            const char* path = get_path_from_fd(metadata->fd, path_buffer, sizeof(path_buffer));
+            FILEMON_PROBE5(perm_response, metadata->pid, metadata->mask, path, FAN_ALLOW, probe_clock_ns() - start);
         }
     }
+}
 
-    return;
+// The part of the verdict that only depends on the path, remembered in the path cache
+static void path_verdict(watch_set_t* watch, const char* full_path, path_verdict_t* path) {
+    path->watch_version = watch->version;
+    path->roots = path_trie_match(&watch->trie, full_path);
+    path->patterns = 0;
+    for (uint64_t roots = path->roots; roots; roots &= roots - 1) {
+        int index = __builtin_ctzll(roots);
+        if (pattern_filter_pass(&watch->roots[index]->filters, full_path)) {
+            path->patterns |= 1ULL << index;
+        }
+    }
+    path->rules_pattern = watch->rules == NULL || pattern_filter_pass(&watch->rules->filters, full_path);
+}
+
+/**
+ * @brief Runs an event through the watched directory check and the user filters. An event in
+ *        several (nested) roots passes if the filters of any of them let it through, and is still
+ *        only emitted once. The trie match and the path patterns are taken from the path cache
+ *        when the path was seen before under the same watch set.
+ * 
+ * @param watch The watch set of the batch.
+ * @param pid The PID that triggered the event.
+ * @param comm The process name of the PID.
+ * @param full_path The file/directory path of the event.
+ * @param ref Set to the id and hash of the path in the path cache, or NULL.
+ * @return filter_verdict_t FILTER_PASS if the event should be logged, otherwise the reason it was dropped.
+ */
+filter_verdict_t apply_filters(watch_set_t* watch, int pid, char* comm, const char* full_path, path_ref_t* ref) {
+
+    filter_verdict_t verdict = FILTER_OUTSIDE_PARENT;
+    path_verdict_t path;
+    path_ref_t local;
+    uint64_t roots;
+
+    if (full_path == NULL) {
+        return FILTER_OUTSIDE_PARENT;
+    }
+    if (ref == NULL) {
+        ref = &local;
+    }
+    if (!path_intern(full_path, ref, &path) || path.watch_version != watch->version) {
+        path_verdict(watch, full_path, &path);
+        path_intern_set_verdict(ref, &path);
+    }
+    if ((roots = path.roots) == 0) {
+        return FILTER_OUTSIDE_PARENT;
+    }
+
+    // Ignore self
+    if (pid == getpid()) {
+        return FILTER_SELF;
+    }
+
+    // When no root lets it through, the reason given by the last one is reported
+    while (roots) {
+        int index = __builtin_ctzll(roots);
+        verdict = apply_root_filters(&watch->roots[index]->filters, pid, comm);
+        if (verdict == FILTER_PASS && !(path.patterns & (1ULL << index))) {
+            verdict = FILTER_PATTERN;
+        }
+        if (verdict == FILTER_PASS) {
+            break;
+        }
+        roots &= roots - 1;
+    }
+    if (verdict != FILTER_PASS) {
+        return verdict;
+    }
+
+    // The rules of the filter config apply to every root
+    if (watch->rules != NULL) {
+        verdict = apply_root_filters(&watch->rules->filters, pid, comm);
+        if (verdict != FILTER_PASS) {
+            return verdict;
+        }
+        if (!path.rules_pattern) {
+            return FILTER_PATTERN;
+        }
+        if (!cgroup_rules_allowed(pid, comm, &watch->rules->cgroups)) {
+            return FILTER_CGROUP;
+        }
+    }
+
+    if (g_cgroups.filtering && !cgroup_allowed(pid, comm)) {
+        return FILTER_CGROUP;
+    }
+    return FILTER_PASS;
+}
+
+/**
+ * @brief The watched directory check alone, the first step of apply_filters(). Only looks the path
+ *        up in the path cache and the trie, so it is cheap enough to run before a permission
+ *        response; the path patterns are left to apply_filters().
+ * 
+ * @param watch The watch set of the batch.
+ * @param full_path The file/directory path of the event, or NULL.
+ * @param ref Set to the id and hash of the path in the path cache.
+ * @param path Scratch space for the remembered verdict of the path.
+ * @return uint64_t The bitmask of the watch roots the path is in, 0 if none.
+ */
+uint64_t watched_roots(watch_set_t* watch, const char* full_path, path_ref_t* ref, path_verdict_t* path) {
+    if (full_path == NULL) {
+        return 0;
+    }
+    if (path_intern(full_path, ref, path) && path->watch_version == watch->version) {
+        return path->roots;
+    }
+    return path_trie_match(&watch->trie, full_path);
+}
+
+/**
+ * @brief Runs an event through the PID and process name filters of one watch root, or of the filter config.
+ * 
+ * @param filters The filters.
+ * @param pid The PID that triggered the event.
+ * @param comm The process name of the PID.
+ * @return filter_verdict_t FILTER_PASS, FILTER_PID or FILTER_PROCESS.
+ */
+filter_verdict_t apply_root_filters(filters_t* filters, int pid, char* comm) {
+
+    if (filters->follow_children) {
+        if (!descendants_contains(pid)) {
+            return FILTER_PID;
+        }
+    } else if (filters->include_pids[0] != 0) {
+        if (!is_in_int_array(filters->include_pids, FILTER_MAX, pid)) {
+            return FILTER_PID;
+        }
+    } else if (filters->exclude_pids[0] != 0) {
+        if (is_in_int_array(filters->exclude_pids, FILTER_MAX, pid)) {
+            return FILTER_PID;
+        }
+    }
+
+    if (filters->include_process[0][0] != 0) {
+        if (!is_in_process_names(filters->include_process, FILTER_MAX, comm)) {
+            return FILTER_PROCESS;
+        }
+    } else if (filters->exclude_process[0][0] != 0) {
+        if (is_in_process_names(filters->exclude_process, FILTER_MAX, comm)) {
+            return FILTER_PROCESS;
+        }
+    }
+
+    return FILTER_PASS;
+}
+
+/**
+ * @brief Runs a path through the include or exclude pattern of one watch root, or of the filter config.
+ * 
+ * @param filters The filters.
+ * @param full_path The file/directory path of the event.
+ * @return int 1 if the path passes.
+ */
+int pattern_filter_pass(filters_t* filters, const char* full_path) {
+    if (filters->include_pattern[0] != 0) {
+        return regex_search(filters->include_regex, full_path);
+    }
+    if (filters->exclude_pattern[0] != 0) {
+        return !regex_search(filters->exclude_regex, full_path);
+    }
+    return 1;
+}
+
+/**
+ * @brief Metrics collector for the number of bytes waiting in each fanotify queue.
+ * 
+ * @param out The metrics output stream.
+ * @param arg The monitor box.
+ */
+void collect_queue_depth(FILE* out, void* arg) {
+    monitor_box_t* m_box = (monitor_box_t*)arg;
+    int pending_rwe = 0;
+    int pending_cdm = 0;
+
+    ioctl(m_box->fanotify_info.fd_read_write_execute, FIONREAD, &pending_rwe);
+    if (m_box->fanotify_info.fd_create_delete_move != -1) {
+        ioctl(m_box->fanotify_info.fd_create_delete_move, FIONREAD, &pending_cdm);
+    }
+    metrics_write_gauge(out, "filemon_queue_bytes", "group=\"read_write_execute\"", "Bytes of events waiting in the fanotify queue.", pending_rwe);
+    metrics_write_gauge(out, "filemon_queue_bytes", "group=\"create_delete_move\"", NULL, pending_cdm);
 }
-#endif
 
 #ifdef FAN_REPORT_DFID_NAME
 /**
@@ -697,8 +1610,25 @@ void handle_events_create_delete_move(monitor_box_t* m_box) {
  */
 void* handle_create_delete_move_thread(void* arg) {
     monitor_box_t* m_box = ((thread_arg_t*)arg)->m_box;
+    struct pollfd fds[2] = {
+        { .fd = m_box->fanotify_info.fd_create_delete_move, .events = POLLIN },
+        { .fd = g_mounts.mountinfo_fd, .events = POLLPRI },
+    };
+    metrics_register_thread();
     while (1) {
-        handle_events_create_delete_move(m_box);
+        if (poll(fds, 2, -1) <= 0) {
+            continue;
+        }
+        // Something was mounted or unmounted
+        if (fds[1].revents & (POLLPRI | POLLERR)) {
+            pthread_mutex_lock(&g_mounts.lock);
+            mounts_refresh();
+            pthread_mutex_unlock(&g_mounts.lock);
+        }
+        if (fds[0].revents & POLLIN) {
+            handle_events_create_delete_move(m_box);
+        }
+        output_flush();
     }
     return NULL;
 }
@@ -712,8 +1642,58 @@ void* handle_create_delete_move_thread(void* arg) {
  */
 void* handle_read_write_execute_thread(void* arg) {
     monitor_box_t* m_box = ((thread_arg_t*)arg)->m_box;
+    // A negative fd is skipped by poll()
+    #ifdef FAN_REPORT_DFID_NAME
+    struct pollfd fds[2] = {
+        { .fd = m_box->fanotify_info.fd_read_write_execute, .events = POLLIN },
+        { .fd = g_hashing.wake_fd, .events = POLLIN },
+    };
+    #else
+    // No create/delete/move thread, follow mounts from here
+    struct pollfd fds[3] = {
+        { .fd = m_box->fanotify_info.fd_read_write_execute, .events = POLLIN },
+        { .fd = g_hashing.wake_fd, .events = POLLIN },
+        { .fd = g_mounts.mountinfo_fd, .events = POLLPRI },
+    };
+    #endif
+    metrics_register_thread();
     while (1) {
-        handle_events_read_write_execute(m_box);
+        // Wake up at least once a second so idle sessions can time out
+        if (poll(fds, sizeof(fds) / sizeof(fds[0]), 1000) > 0) {
+            #ifndef FAN_REPORT_DFID_NAME
+            if (fds[2].revents & (POLLPRI | POLLERR)) {
+                pthread_mutex_lock(&g_mounts.lock);
+                mounts_refresh();
+                pthread_mutex_unlock(&g_mounts.lock);
+            }
+            #endif
+            if (fds[0].revents & POLLIN) {
+                handle_events_read_write_execute(m_box);
+            }
+        }
+        if (g_sessions.enabled) {
+            sessions_sweep(emit_session);
+        }
+        if (g_shedding.enabled) {
+            shedding_report(0);
+        }
+        if (g_hashing.enabled) {
+            hashing_drain(emit_hashed);
+            hashing_report(0);
+        }
+        if (g_proctable.enabled) {
+            proctable_sweep();
+        }
+        if (g_ring.enabled) {
+            ring_check_consumers();
+        }
+        if (g_rollup.enabled) {
+            rollup_tick();
+        }
+        output_flush();
+        if (g_logindex.enabled) {
+            logindex_tick();
+        }
     }
     return NULL;
 }
@@ -724,8 +1704,17 @@ void* handle_read_write_execute_thread(void* arg) {
  * @param m_box The monitor box.
  */
 void stop_monitor(monitor_box_t* m_box){
+    metrics_stop();
     close(m_box->fanotify_info.fd_read_write_execute);
     close(m_box->fanotify_info.fd_create_delete_move);
+    for (int i = 0; i < m_box->watch->root_count; i++) {
+        free_watch_root(m_box->watch->roots[i]);
+    }
+    if (m_box->watch->rules != NULL) {
+        free_filters(&m_box->watch->rules->filters);
+        free(m_box->watch->rules);
+    }
+    watch_set_free(m_box->watch);
     free(m_box);
     if (g_logger.logfile[0] != 0) {
         printf("[+] Successfully stopped filemon.\n");
@@ -743,57 +1732,147 @@ void stop_monitor(monitor_box_t* m_box){
 void print_box(monitor_box_t* m_box) {
     log_message(INFO, 1, "Monitor Box Information:\n");
     log_message(NIL, 0, "============================ MONITOR BOX ===========================\n");
-    log_message(NIL, 0, "- Parent Path: %s\n", m_box->parent_path);
-    log_message(NIL, 0, "- Mount Path: %s\n\n", m_box->mount_path);
+    watch_set_t* watch = m_box->watch;
+    for (int i = 0; i < watch->root_count; i++) {
+        log_message(NIL, 0, "- Parent Path: %s\n", watch->roots[i]->path);
+        log_message(NIL, 0, "\t└─ Mount Path: %s\n", watch->roots[i]->mount_path);
+    }
+    log_message(NIL, 0, "\n");
     log_message(NIL, 0, "------------------- FANOTIFY INFO -------------------\n");
-    log_message(NIL, 0, "- CONFIG_FANOTIFY Enabled: %d\n", m_box->fanotify_info.config_fanotify_enabled);
-    log_message(NIL, 0, "- CONFIG_FANOTIFY_ACCESS_PERMISSIONS Enabled: %d\n", m_box->fanotify_info.config_fanotify_access_permissions_enabled);
+    print_features();
     log_message(NIL, 0, "- Fanotify Read, Write, Execute FD: %d\n", m_box->fanotify_info.fd_read_write_execute);
     log_message(NIL, 0, "\t└─ Flags: %s\n", m_box->fanotify_info.flags_read_write_execute);
     log_message(NIL, 0, "- Fanotify Create, Delete, Move FD: %d\n", m_box->fanotify_info.fd_create_delete_move);
     log_message(NIL, 0, "\t└─ Flags: %s\n\n", m_box->fanotify_info.flags_create_delete_move);
-    log_message(NIL, 0, "---------------------- FILTERS ----------------------\n");
-    log_message(NIL, 0, "- Include PIDs: %s\n", strcat_int_array(m_box->filters.include_pids, FILTER_MAX));
-    log_message(NIL, 0, "- Exclude PIDs: %s\n\n", strcat_int_array(m_box->filters.exclude_pids, FILTER_MAX));
-    log_message(NIL, 0, "- Include Processes: %s\n", strcat_process_names(m_box->filters.include_process, FILTER_MAX));
-    log_message(NIL, 0, "- Exclude Processes: %s\n\n", strcat_process_names(m_box->filters.exclude_process, FILTER_MAX));
-    log_message(NIL, 0, "- Include Pattern: %s\n", m_box->filters.include_pattern);
-    log_message(NIL, 0, "- Exclude Pattern: %s\n\n", m_box->filters.exclude_pattern);
+    for (int i = 0; i < watch->root_count; i++) {
+        filters_t* filters = &watch->roots[i]->filters;
+        log_message(NIL, 0, "---------------------- FILTERS (%s) ----------------------\n", watch->roots[i]->path);
+        log_message(NIL, 0, "- Include PIDs: %s%s\n", strcat_int_array(filters->include_pids, FILTER_MAX), filters->follow_children ? " (and children)" : "");
+        log_message(NIL, 0, "- Exclude PIDs: %s\n\n", strcat_int_array(filters->exclude_pids, FILTER_MAX));
+        log_message(NIL, 0, "- Include Processes: %s\n", strcat_process_names(filters->include_process, FILTER_MAX));
+        log_message(NIL, 0, "- Exclude Processes: %s\n\n", strcat_process_names(filters->exclude_process, FILTER_MAX));
+        log_message(NIL, 0, "- Include Pattern: %s\n", filters->include_pattern);
+        log_message(NIL, 0, "- Exclude Pattern: %s\n\n", filters->exclude_pattern);
+    }
+    log_message(NIL, 0, "---------------------- FILTERS (all) ----------------------\n");
+    log_message(NIL, 0, "- Include Cgroups: %s\n", strcat_cgroups(g_cgroups.include, g_cgroups.include_count));
+    log_message(NIL, 0, "- Exclude Cgroups: %s\n\n", strcat_cgroups(g_cgroups.exclude, g_cgroups.exclude_count));
+    if (watch->rules != NULL) {
+        filters_t* filters = &watch->rules->filters;
+        log_message(NIL, 0, "---------------------- FILTERS (filter config, version %lu) ----------------------\n", (unsigned long)watch->rules->version);
+        log_message(NIL, 0, "- Include PIDs: %s\n", strcat_int_array(filters->include_pids, FILTER_MAX));
+        log_message(NIL, 0, "- Exclude PIDs: %s\n\n", strcat_int_array(filters->exclude_pids, FILTER_MAX));
+        log_message(NIL, 0, "- Include Processes: %s\n", strcat_process_names(filters->include_process, FILTER_MAX));
+        log_message(NIL, 0, "- Exclude Processes: %s\n\n", strcat_process_names(filters->exclude_process, FILTER_MAX));
+        log_message(NIL, 0, "- Include Pattern: %s\n", filters->include_pattern);
+        log_message(NIL, 0, "- Exclude Pattern: %s\n\n", filters->exclude_pattern);
+        log_message(NIL, 0, "- Include Cgroups: %s\n", strcat_cgroups(watch->rules->cgroups.include, watch->rules->cgroups.include_count));
+        log_message(NIL, 0, "- Exclude Cgroups: %s\n\n", strcat_cgroups(watch->rules->cgroups.exclude, watch->rules->cgroups.exclude_count));
+    }
     log_message(NIL, 0, "=====================================================================\n");
     return;
 }
 
 /**
-
- * @brief FAN_MARK_ADD recursively from path.
+ * @brief Marks the filesystems holding the watched directories and every filesystem mounted below them.
  * 
  * @param m_box The monitor box.
  */
 void apply_fanotify_marks(monitor_box_t* m_box) {
+    // Roots added from here on are marked by add_watch_root()
+    pthread_mutex_lock(&m_box->watch_lock);
+    watch_set_t* watch = m_box->watch;
+
+    mounts_init(mark_filesystem, unmark_filesystem, m_box);
+    pthread_mutex_lock(&g_mounts.lock);
+    for (int i = 0; i < watch->root_count; i++) {
+        mounts_add_parent(watch->roots[i]->path, watch->roots[i]->mount_path);
+    }
+    mounts_refresh();
+    for (int i = 0; i < watch->root_count; i++) {
+        if (!mounts_watching(watch->roots[i]->path)) {
+            log_message(ERROR, 1, "Failed to apply fanotify marks on the filesystem of \"%s\"\n", watch->roots[i]->path);
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_mutex_unlock(&g_mounts.lock);
+    m_box->marked = 1;
+    pthread_mutex_unlock(&m_box->watch_lock);
+}
 
+/**
+ * @brief Adds the marks of both fanotify groups to the filesystem (or mount, before
+ *        FAN_MARK_FILESYSTEM) an fd is on. The caller decides whether a failure is fatal.
+ * 
+ * @param fd An fd on the filesystem.
+ * @param path Where it is mounted, for the logs.
+ * @param arg The monitor box.
+ * @return int 1 on success, 0 otherwise.
+ */
+int mark_filesystem(int fd, const char* path, void* arg) {
+
+    monitor_box_t* m_box = (monitor_box_t*)arg;
     int ret;
 
-    #ifdef FAN_MARK_FILESYSTEM
-    int mark_mode = FAN_MARK_ADD | FAN_MARK_FILESYSTEM;
-    #else
     int mark_mode = FAN_MARK_ADD | FAN_MARK_MOUNT;
+    #ifdef FAN_MARK_FILESYSTEM
+    if (g_features.mark_filesystem) {
+        mark_mode = FAN_MARK_ADD | FAN_MARK_FILESYSTEM;
+    }
     #endif
 
-    ret = fanotify_mark(m_box->fanotify_info.fd_read_write_execute, mark_mode, m_box->fanotify_info.event_mask_read_write_execute, AT_FDCWD, m_box->mount_path);
+    ret = fanotify_mark(m_box->fanotify_info.fd_read_write_execute, mark_mode, m_box->fanotify_info.event_mask_read_write_execute, fd, NULL);
     if (ret == -1) {
-        log_message(ERROR, 1, "Failed to apply fanotify mark (event_mask_read_write_execute) on \"%s\" mount\n", m_box->mount_path);
-        exit(EXIT_FAILURE);
+        log_message(WARNING, 1, "Failed to apply fanotify mark (event_mask_read_write_execute) on \"%s\" mount: %s\n", path, strerror(errno));
+        return 0;
     }
-    log_message(DEBUG, 1, "Successfully applied fanotify mark (event_mask_read_write_execute) on \"%s\" mount\n", m_box->mount_path);
+    log_message(DEBUG, 1, "Successfully applied fanotify mark (event_mask_read_write_execute) on \"%s\" mount\n", path);
 
     #ifdef FAN_REPORT_DFID_NAME
-    ret = fanotify_mark(m_box->fanotify_info.fd_create_delete_move, mark_mode, m_box->fanotify_info.event_mask_create_delete_move, AT_FDCWD, m_box->mount_path);
+    if (m_box->fanotify_info.fd_create_delete_move == -1) {
+        return 1;
+    }
+    ret = fanotify_mark(m_box->fanotify_info.fd_create_delete_move, mark_mode, m_box->fanotify_info.event_mask_create_delete_move, fd, NULL);
     if (ret == -1) {
-        log_message(ERROR, 1, "Failed to apply fanotify mark (event_mask_create_delete_move) on \"%s\" mount\n", m_box->mount_path);
-        exit(EXIT_FAILURE);
+        // Some filesystems (no fsid, no file handles) cannot be reported by FID
+        log_message(WARNING, 1, "Failed to apply fanotify mark (event_mask_create_delete_move) on \"%s\" mount: %s\n", path, strerror(errno));
+        fanotify_mark(m_box->fanotify_info.fd_read_write_execute, (mark_mode & ~FAN_MARK_ADD) | FAN_MARK_REMOVE, m_box->fanotify_info.event_mask_read_write_execute, fd, NULL);
+        return 0;
     }
-    log_message(DEBUG, 1, "Successfully applied fanotify mark (event_mask_create_delete_move) on \"%s\" mount\n", m_box->mount_path);
+    log_message(DEBUG, 1, "Successfully applied fanotify mark (event_mask_create_delete_move) on \"%s\" mount\n", path);
     #endif
+    return 1;
 }
-#endif
 
+/**
+ * @brief Removes the marks of both fanotify groups from a filesystem no watched directory is on any more.
+ * 
+ * @param fd An fd on the filesystem.
+ * @param path Where it is mounted, for the logs.
+ * @param arg The monitor box.
+ * @return int 1 on success, 0 otherwise.
+ */
+int unmark_filesystem(int fd, const char* path, void* arg) {
+
+    monitor_box_t* m_box = (monitor_box_t*)arg;
+    int ret;
+
+    int mark_mode = FAN_MARK_REMOVE | FAN_MARK_MOUNT;
+    #ifdef FAN_MARK_FILESYSTEM
+    if (g_features.mark_filesystem) {
+        mark_mode = FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM;
+    }
+    #endif
+
+    ret = fanotify_mark(m_box->fanotify_info.fd_read_write_execute, mark_mode, m_box->fanotify_info.event_mask_read_write_execute, fd, NULL);
+    if (m_box->fanotify_info.fd_create_delete_move != -1) {
+        ret |= fanotify_mark(m_box->fanotify_info.fd_create_delete_move, mark_mode, m_box->fanotify_info.event_mask_create_delete_move, fd, NULL);
+    }
+    if (ret == -1) {
+        log_message(WARNING, 1, "Failed to remove fanotify marks from \"%s\" mount: %s\n", path, strerror(errno));
+        return 0;
+    }
+    log_message(DEBUG, 1, "Successfully removed fanotify marks from \"%s\" mount\n", path);
+    return 1;
+}
+#endif
@@ -0,0 +1,596 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/vfs.h>
+#include <sys/stat.h>
+#include <sys/fanotify.h>
+#include "wrappers.h"
+#include "logger.h"
+#include "metrics.h"
+
+#ifndef MOUNTS_H
+#define MOUNTS_H
+
+#define MOUNTINFO_PATH "/proc/self/mountinfo"
+#define MOUNT_TABLE_SIZE 256           // Power of two
+#define MOUNT_FS_MAX (MOUNT_TABLE_SIZE / 2)
+#define MOUNT_ALIAS_MAX 8
+#define MOUNT_PARENTS_MAX 64
+#define MOUNT_MISS_REFRESH_NS 100000000ULL    // Rescans for events on unknown filesystems, at most
+
+/*
+ * Filesystems under the watched directories. /proc/self/mountinfo is scanned for the mount holding each
+ * parent directory and every mount below one, and each distinct filesystem (by fsid) is marked once,
+ * however many parent directories it holds.
+ * Events are routed to their filesystem through an open addressing table keyed by fsid, so the
+ * lookup per event is a hash and usually one compare. The directory fd open_by_handle_at() needs is
+ * opened on the first event of a read batch and closed by mounts_release() at the end of it: an fd
+ * held between batches would keep the user from unmounting the filesystem.
+ * Handles resolve to paths under the first mount of a filesystem. Further mounts of it inside the
+ * watched trees (bind mounts) are kept as aliases, and mounts_translate() maps a path that resolved
+ * outside the parent directories onto the alias it was reached through.
+ * mountinfo raises POLLPRI on every mount and unmount, and mounts_refresh() then marks new
+ * filesystems and forgets the ones that went away (their marks die with the superblock). An event
+ * on a filesystem not in the table yet may beat the POLLPRI, mounts_refresh_missed() rescans for
+ * it at most every MOUNT_MISS_REFRESH_NS, since a filesystem being unmounted keeps sending events
+ * after it left mountinfo and must not cost a rescan each. A parent
+ * directory removed at runtime unmarks the filesystems no other parent needs, the rest keep their
+ * marks. The create/delete/move thread holds g_mounts.lock for a whole read batch and the control
+ * socket holds it to change the parent directories, so every other caller must hold it too.
+ */
+typedef struct {
+    __kernel_fsid_t fsid;
+    char* path;                        // NULL if the slot is free
+    char* root;                        // Directory of the filesystem mounted at path
+    int fd;                            // -1 unless opened during the current batch
+    int generation;
+    int alias_count;
+    char* alias_path[MOUNT_ALIAS_MAX];
+    char* alias_root[MOUNT_ALIAS_MAX];
+} mount_fs_t;
+
+typedef int (*mount_mark_fn)(int fd, const char* path, void* arg);
+
+typedef struct Mounts {
+    int count;
+    int generation;
+    int mountinfo_fd;
+    int parent_count;
+    char* parent_paths[MOUNT_PARENTS_MAX];
+    char* root_paths[MOUNT_PARENTS_MAX];   // The mount holding each parent directory
+    mount_fs_t table[MOUNT_TABLE_SIZE];
+    mount_fs_t* opened[MOUNT_FS_MAX];
+    int opened_count;
+    mount_mark_fn mark;
+    mount_mark_fn unmark;
+    void* mark_arg;
+    uint64_t missed_ns;                // Last mounts_refresh_missed() rescan
+    pthread_mutex_t lock;
+} mounts_t;
+
+int mounts_find_root(const char* path, char* out, size_t size);
+void mounts_init(mount_mark_fn mark, mount_mark_fn unmark, void* arg);
+int mounts_add_parent(const char* parent_path, const char* root_path);
+int mounts_remove_parent(const char* parent_path);
+int mounts_watching(const char* path);
+int mounts_refresh();
+int mounts_refresh_missed();
+int mounts_fd(const __kernel_fsid_t* fsid);
+void mounts_release();
+int mounts_translate(const __kernel_fsid_t* fsid, const char* path, char* out, size_t size);
+
+mounts_t g_mounts = { .count = 0, .mountinfo_fd = -1, .parent_count = 0, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static inline uint32_t mounts_slot(const __kernel_fsid_t* fsid) {
+    uint64_t key = ((uint64_t)(uint32_t)fsid->val[0] << 32) | (uint32_t)fsid->val[1];
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (MOUNT_TABLE_SIZE - 1);
+}
+
+static mount_fs_t* mounts_lookup(const __kernel_fsid_t* fsid) {
+    uint32_t slot = mounts_slot(fsid);
+    for (int i = 0; i < MOUNT_TABLE_SIZE; i++) {
+        mount_fs_t* entry = &g_mounts.table[(slot + i) & (MOUNT_TABLE_SIZE - 1)];
+        if (entry->path == NULL) {
+            return NULL;
+        }
+        if (entry->fsid.val[0] == fsid->val[0] && entry->fsid.val[1] == fsid->val[1]) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static mount_fs_t* mounts_insert(mount_fs_t* table, const mount_fs_t* fs) {
+    uint32_t slot = mounts_slot(&fs->fsid);
+    for (int i = 0; i < MOUNT_TABLE_SIZE; i++) {
+        mount_fs_t* entry = &table[(slot + i) & (MOUNT_TABLE_SIZE - 1)];
+        if (entry->path == NULL) {
+            *entry = *fs;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// mountinfo escapes space, tab, newline and backslash as \ooo
+static void mountinfo_unescape(char* str) {
+    char* out = str;
+    for (char* in = str; *in; in++) {
+        if (in[0] == '\\' && in[1] >= '0' && in[1] <= '3' && in[2] >= '0' && in[2] <= '7' && in[3] >= '0' && in[3] <= '7') {
+            *out++ = (char)((in[1] - '0') * 64 + (in[2] - '0') * 8 + (in[3] - '0'));
+            in += 3;
+        } else {
+            *out++ = *in;
+        }
+    }
+    *out = '\0';
+}
+
+/**
+ * @brief Parses one mountinfo line.
+ *
+ * @param mount_id Set to the mount id of the line, may be NULL.
+ * @return int 1 if the line holds a mount point and filesystem type.
+ */
+static int mountinfo_parse(char* line, uint64_t* mount_id, char** fs_root, char** mount_point, char** fs_type) {
+    char* save = NULL;
+    char* field = strtok_r(line, " \n", &save);
+    // mount_id parent_id major:minor root mount_point options [optional...] - fs_type source super_options
+    if (field && mount_id) {
+        *mount_id = strtoull(field, NULL, 10);
+    }
+    for (int i = 0; field && i < 3; i++) {
+        field = strtok_r(NULL, " \n", &save);
+    }
+    *fs_root = field;
+    field = field ? strtok_r(NULL, " \n", &save) : NULL;
+    if (field == NULL) {
+        return 0;
+    }
+    *mount_point = field;
+    while ((field = strtok_r(NULL, " \n", &save)) != NULL && strcmp(field, "-") != 0) {
+    }
+    *fs_type = field ? strtok_r(NULL, " \n", &save) : NULL;
+    if (*fs_type == NULL) {
+        return 0;
+    }
+    mountinfo_unescape(*fs_root);
+    mountinfo_unescape(*mount_point);
+    return 1;
+}
+
+// Kernel interfaces that cannot hold user files, watching them only adds noise
+static int mounts_pseudo_fs(const char* fs_type) {
+    static const char* pseudo[] = {
+        "proc", "sysfs", "cgroup", "cgroup2", "devpts", "debugfs", "tracefs", "securityfs", "bpf",
+        "fusectl", "configfs", "pstore", "mqueue", "autofs", "binfmt_misc", "efivarfs", "nsfs", NULL
+    };
+    for (int i = 0; pseudo[i]; i++) {
+        if (strcmp(fs_type, pseudo[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int path_is_below(const char* path, const char* dir) {
+    size_t len = strlen(dir);
+    if (strcmp(dir, "/") == 0) {
+        return 1;
+    }
+    return strncmp(path, dir, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+/**
+ * @brief Gets the id of the mount a path is on, as listed in mountinfo.
+ *
+ * @return int 1 on success, 0 if statx() cannot report it (before 5.8).
+ */
+static int mounts_statx_id(const char* path, uint64_t* mount_id) {
+    #ifdef STATX_MNT_ID
+    struct statx stx;
+    if (statx(AT_FDCWD, path, AT_NO_AUTOMOUNT, STATX_MNT_ID, &stx) == 0 && (stx.stx_mask & STATX_MNT_ID)) {
+        *mount_id = stx.stx_mnt_id;
+        return 1;
+    }
+    #else
+    (void)path;
+    (void)mount_id;
+    #endif
+    return 0;
+}
+
+/**
+ * @brief Finds the mount point holding a path. The mountinfo entry with the mount id statx() reports
+ *        for the path, or without one the last and longest matching entry.
+ *
+ * @param path An absolute path.
+ * @param out The output buffer.
+ * @param size Size of the output buffer.
+ * @return int 1 on success, 0 if mountinfo could not be read.
+ */
+int mounts_find_root(const char* path, char* out, size_t size) {
+    char line[PATH_MAX * 2];
+    char* fs_root;
+    char* mount_point;
+    char* fs_type;
+    uint64_t mount_id;
+    uint64_t line_id;
+    int by_id = mounts_statx_id(path, &mount_id);
+    size_t best = 0;
+    FILE* file = fopen(MOUNTINFO_PATH, "r");
+
+    if (file == NULL) {
+        return 0;
+    }
+    out[0] = '\0';
+    while (fgets(line, sizeof(line), file)) {
+        if (!mountinfo_parse(line, &line_id, &fs_root, &mount_point, &fs_type)) {
+            continue;
+        }
+        if (by_id) {
+            if (line_id == mount_id) {
+                strncpy(out, mount_point, size - 1);
+                out[size - 1] = '\0';
+                break;
+            }
+            continue;
+        }
+        if (!path_is_below(path, mount_point)) {
+            continue;
+        }
+        // Later entries are mounted on top of earlier ones
+        if (strlen(mount_point) >= best) {
+            best = strlen(mount_point);
+            strncpy(out, mount_point, size - 1);
+            out[size - 1] = '\0';
+        }
+    }
+    fclose(file);
+    return out[0] != '\0';
+}
+
+/**
+ * @brief Sets up the filesystem table. Parent directories are added with mounts_add_parent(), and
+ *        nothing is marked until the next mounts_refresh().
+ *
+ * @param mark Adds the fanotify marks to the filesystem an fd is on, returns 1 on success.
+ * @param unmark Removes them from a filesystem that is still mounted but no longer needed.
+ * @param arg Passed to mark and unmark.
+ */
+void mounts_init(mount_mark_fn mark, mount_mark_fn unmark, void* arg) {
+    g_mounts.mark = mark;
+    g_mounts.unmark = unmark;
+    g_mounts.mark_arg = arg;
+    g_mounts.mountinfo_fd = open(MOUNTINFO_PATH, O_RDONLY | O_CLOEXEC);
+    if (g_mounts.mountinfo_fd == -1) {
+        log_message(WARNING, 1, "Failed to open %s, mounts and unmounts will not be followed.\n", MOUNTINFO_PATH);
+    }
+}
+
+/**
+ * @brief Adds a watched directory, its filesystems are marked by the next mounts_refresh().
+ *
+ * @param parent_path The watched directory.
+ * @param root_path The mount holding the watched directory.
+ * @return int 1 on success, 0 if there are too many.
+ */
+int mounts_add_parent(const char* parent_path, const char* root_path) {
+    if (g_mounts.parent_count >= MOUNT_PARENTS_MAX) {
+        return 0;
+    }
+    g_mounts.parent_paths[g_mounts.parent_count] = strdup(parent_path);
+    g_mounts.root_paths[g_mounts.parent_count] = strdup(root_path);
+    if (g_mounts.parent_paths[g_mounts.parent_count] == NULL || g_mounts.root_paths[g_mounts.parent_count] == NULL) {
+        free(g_mounts.parent_paths[g_mounts.parent_count]);
+        free(g_mounts.root_paths[g_mounts.parent_count]);
+        return 0;
+    }
+    g_mounts.parent_count++;
+    return 1;
+}
+
+/**
+ * @brief Removes a watched directory, filesystems only it needed are unmarked by the next mounts_refresh().
+ *
+ * @param parent_path The watched directory.
+ * @return int 1 on success, 0 if it was not watched.
+ */
+int mounts_remove_parent(const char* parent_path) {
+    for (int i = 0; i < g_mounts.parent_count; i++) {
+        if (strcmp(g_mounts.parent_paths[i], parent_path) != 0) {
+            continue;
+        }
+        free(g_mounts.parent_paths[i]);
+        free(g_mounts.root_paths[i]);
+        g_mounts.parent_count--;
+        g_mounts.parent_paths[i] = g_mounts.parent_paths[g_mounts.parent_count];
+        g_mounts.root_paths[i] = g_mounts.root_paths[g_mounts.parent_count];
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Checks whether the filesystem a path is on is marked.
+ *
+ * @param path A path.
+ * @return int 1 if it is, 0 otherwise.
+ */
+int mounts_watching(const char* path) {
+    struct statfs st;
+    __kernel_fsid_t fsid;
+
+    if (statfs(path, &st) == -1) {
+        return 0;
+    }
+    memcpy(&fsid, &st.f_fsid, sizeof(fsid));
+    return mounts_lookup(&fsid) != NULL;
+}
+
+static int mounts_is_root(const char* mount_point) {
+    for (int i = 0; i < g_mounts.parent_count; i++) {
+        if (strcmp(mount_point, g_mounts.root_paths[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int mounts_below_parent(const char* mount_point) {
+    for (int i = 0; i < g_mounts.parent_count; i++) {
+        if (path_is_below(mount_point, g_mounts.parent_paths[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void mounts_forget_aliases(mount_fs_t* entry) {
+    for (int i = 0; i < entry->alias_count; i++) {
+        free(entry->alias_path[i]);
+        free(entry->alias_root[i]);
+    }
+    entry->alias_count = 0;
+}
+
+static void mounts_track(const char* mount_point, const char* fs_root) {
+    struct statfs st;
+    mount_fs_t fs = { .fd = -1, .generation = g_mounts.generation };
+    int fd;
+
+    if (statfs(mount_point, &st) == -1) {
+        return;
+    }
+    memcpy(&fs.fsid, &st.f_fsid, sizeof(fs.fsid));
+
+    mount_fs_t* entry = mounts_lookup(&fs.fsid);
+    if (entry != NULL) {
+        if (entry->generation != g_mounts.generation) {
+            entry->generation = g_mounts.generation;
+            mounts_forget_aliases(entry);
+        }
+        if (strcmp(entry->path, mount_point) != 0 && entry->alias_count < MOUNT_ALIAS_MAX) {
+            entry->alias_path[entry->alias_count] = strdup(mount_point);
+            entry->alias_root[entry->alias_count] = strdup(fs_root);
+            if (entry->alias_path[entry->alias_count] && entry->alias_root[entry->alias_count]) {
+                entry->alias_count++;
+            }
+        }
+        return;
+    }
+    if (g_mounts.count >= MOUNT_FS_MAX) {
+        log_message(WARNING, 1, "Too many filesystems under the watched directories, not watching %s.\n", mount_point);
+        return;
+    }
+    fd = open(mount_point, O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    if (!g_mounts.mark(fd, mount_point, g_mounts.mark_arg)) {
+        close(fd);
+        return;
+    }
+    close(fd);
+    fs.path = strdup(mount_point);
+    fs.root = strdup(fs_root);
+    if (fs.path == NULL || fs.root == NULL) {
+        free(fs.path);
+        free(fs.root);
+        return;
+    }
+    mounts_insert(g_mounts.table, &fs);
+    g_mounts.count++;
+    if (!mounts_is_root(mount_point)) {
+        log_message(INFO, 1, "Watching filesystem mounted at %s\n", mount_point);
+    }
+}
+
+/**
+ * @brief Rescans mountinfo, marks filesystems that appeared and forgets the ones that are gone.
+ *        Called at startup and whenever the mountinfo fd reports POLLPRI.
+ *
+ * @return int Number of filesystems watched.
+ */
+int mounts_refresh() {
+    char line[PATH_MAX * 2];
+    char* root_fs_roots[MOUNT_PARENTS_MAX] = { NULL };
+    char* fs_root;
+    char* mount_point;
+    char* fs_type;
+    FILE* file;
+    int removed = 0;
+
+    mounts_release();
+    g_mounts.generation++;
+    metrics_inc(METRIC_MOUNT_RESCANS);
+
+    // The mounts holding the parent directories go first, so that they resolve handles of their filesystems
+    file = fopen(MOUNTINFO_PATH, "r");
+    if (file != NULL) {
+        while (fgets(line, sizeof(line), file)) {
+            if (!mountinfo_parse(line, NULL, &fs_root, &mount_point, &fs_type)) {
+                continue;
+            }
+            for (int i = 0; i < g_mounts.parent_count; i++) {
+                if (strcmp(mount_point, g_mounts.root_paths[i]) == 0) {
+                    free(root_fs_roots[i]);
+                    root_fs_roots[i] = strdup(fs_root);
+                }
+            }
+        }
+        rewind(file);
+    }
+    for (int i = 0; i < g_mounts.parent_count; i++) {
+        mounts_track(g_mounts.root_paths[i], root_fs_roots[i] ? root_fs_roots[i] : "/");
+        free(root_fs_roots[i]);
+    }
+    if (file != NULL) {
+        while (fgets(line, sizeof(line), file)) {
+            if (!mountinfo_parse(line, NULL, &fs_root, &mount_point, &fs_type) || mounts_pseudo_fs(fs_type)) {
+                continue;
+            }
+            if (!mounts_is_root(mount_point) && mounts_below_parent(mount_point)) {
+                mounts_track(mount_point, fs_root);
+            }
+        }
+        fclose(file);
+    }
+
+    for (int i = 0; i < MOUNT_TABLE_SIZE; i++) {
+        mount_fs_t* entry = &g_mounts.table[i];
+        if (entry->path == NULL || entry->generation == g_mounts.generation) {
+            continue;
+        }
+        struct statfs st;
+        int fd = open(entry->path, O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+        if (fd != -1 && fstatfs(fd, &st) == 0 && memcmp(&st.f_fsid, &entry->fsid, sizeof(entry->fsid)) == 0) {
+            // Still mounted, but no watched directory holds it any more
+            g_mounts.unmark(fd, entry->path, g_mounts.mark_arg);
+            log_message(INFO, 1, "Stopped watching filesystem at %s\n", entry->path);
+        } else {
+            log_message(INFO, 1, "Filesystem at %s was unmounted\n", entry->path);
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+        mounts_forget_aliases(entry);
+        free(entry->path);
+        free(entry->root);
+        entry->path = NULL;
+        g_mounts.count--;
+        removed = 1;
+    }
+    if (removed) {
+        // Rehash so that no probe chain is broken by the freed slots
+        mount_fs_t table[MOUNT_TABLE_SIZE];
+        memset(table, 0, sizeof(table));
+        for (int i = 0; i < MOUNT_TABLE_SIZE; i++) {
+            if (g_mounts.table[i].path != NULL) {
+                mounts_insert(table, &g_mounts.table[i]);
+            }
+        }
+        memcpy(g_mounts.table, table, sizeof(table));
+    }
+    return g_mounts.count;
+}
+
+/**
+ * @brief Rescans mountinfo for an event on a filesystem that is not in the table, unless the last
+ *        such rescan was less than MOUNT_MISS_REFRESH_NS ago. The caller holds g_mounts.lock.
+ *
+ * @return int 1 if mountinfo was rescanned.
+ */
+int mounts_refresh_missed() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+    if (g_mounts.missed_ns != 0 && now - g_mounts.missed_ns < MOUNT_MISS_REFRESH_NS) {
+        return 0;
+    }
+    g_mounts.missed_ns = now;
+    mounts_refresh();
+    return 1;
+}
+
+/**
+ * @brief Returns a directory fd on a filesystem for open_by_handle_at(), valid until mounts_release().
+ *
+ * @param fsid The fsid from the FID record.
+ * @return int The fd, or -1 if the filesystem is not watched (or no longer mounted where it was).
+ */
+int mounts_fd(const __kernel_fsid_t* fsid) {
+    struct statfs st;
+    mount_fs_t* entry = mounts_lookup(fsid);
+
+    if (entry == NULL) {
+        return -1;
+    }
+    if (entry->fd != -1) {
+        return entry->fd;
+    }
+    entry->fd = open(entry->path, O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+    if (entry->fd == -1) {
+        return -1;
+    }
+    // Unmounted since the last scan, the path now leads to the filesystem underneath
+    if (fstatfs(entry->fd, &st) == -1 || memcmp(&st.f_fsid, fsid, sizeof(*fsid)) != 0) {
+        close(entry->fd);
+        entry->fd = -1;
+        return -1;
+    }
+    g_mounts.opened[g_mounts.opened_count++] = entry;
+    return entry->fd;
+}
+
+/**
+ * @brief Maps a path resolved through the first mount of a filesystem onto a bind mount of it
+ *        inside the watched trees.
+ *
+ * @param fsid The fsid from the FID record.
+ * @param path The resolved path.
+ * @param out The output buffer.
+ * @param size Size of the output buffer.
+ * @return int 1 if the path was translated, 0 otherwise.
+ */
+int mounts_translate(const __kernel_fsid_t* fsid, const char* path, char* out, size_t size) {
+    char internal[PATH_MAX];
+    mount_fs_t* entry = mounts_lookup(fsid);
+
+    if (entry == NULL || entry->alias_count == 0 || !path_is_below(path, entry->path)) {
+        return 0;
+    }
+    // Path inside the filesystem, then the same path under each alias
+    snprintf(internal, sizeof(internal), "%s%s", strcmp(entry->root, "/") == 0 ? "" : entry->root,
+             path + (strcmp(entry->path, "/") == 0 ? 0 : strlen(entry->path)));
+    for (int i = 0; i < entry->alias_count; i++) {
+        const char* alias_root = entry->alias_root[i];
+        if (!path_is_below(internal[0] ? internal : "/", alias_root)) {
+            continue;
+        }
+        snprintf(out, size, "%s%s", strcmp(entry->alias_path[i], "/") == 0 ? "" : entry->alias_path[i],
+                 internal + (strcmp(alias_root, "/") == 0 ? 0 : strlen(alias_root)));
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Closes the fds handed out by mounts_fd(), at the end of every read batch.
+ */
+void mounts_release() {
+    for (int i = 0; i < g_mounts.opened_count; i++) {
+        close(g_mounts.opened[i]->fd);
+        g_mounts.opened[i]->fd = -1;
+    }
+    g_mounts.opened_count = 0;
+}
+
+#endif
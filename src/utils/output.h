@@ -0,0 +1,762 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include "wrappers.h"
+#include "logger.h"
+#include "session.h"
+#include "process.h"
+#include "cgroup.h"
+#include "logindex.h"
+#include "contenthash.h"
+#include "policy.h"
+#include "anomaly.h"
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#define OUTPUT_BATCH_SIZE (256 * 1024)
+#define OUTPUT_RECORD_SLACK 1024       // Room for everything but the escaped strings of a record
+
+typedef enum {
+    OUTPUT_TEXT,
+    OUTPUT_JSONL,
+    OUTPUT_CSV
+} output_format_t;
+
+// Fanotify groups, also reported by the USDT probes
+typedef enum {
+    GROUP_READ_WRITE_EXECUTE,
+    GROUP_CREATE_DELETE_MOVE
+} event_group_t;
+
+typedef struct {
+    event_group_t group;
+    int pid;
+    uint64_t mask;
+    char* comm;
+    const char* path;
+    const char* old_path;       // Set for FAN_RENAME, the path before the rename
+    const session_t* session;   // Set when the event stands for a whole open/close session
+    uint64_t path_hash;         // hash_string() of path, 0 if it was not worked out by the filters
+    const content_hash_t* hash; // Set for the close-write and exec events of --hash
+    const chunk_diff_t* changes; // Set for the close-write events of --chunk
+    const policy_decision_t* policy; // Set for the permission events of --policy
+    const anomaly_alert_t* alert; // Set for the alert records of --alert, which are not events
+} event_t;
+
+/*
+ * Structured output (--format jsonl|csv), one record per event for log pipelines. Records are
+ * serialized by hand straight into a per-thread batch buffer, which is written out with one
+ * write() per read batch, so there is no printf and no intermediate string per event.
+ * JSON strings are escaped per RFC 8259. Paths are bytes on Linux: valid UTF-8 is copied as is and
+ * any other byte is written as \u00XX. CSV follows RFC 4180, every text field is quoted.
+ * The CSV columns are fixed by the options at startup and named in the header line.
+ */
+typedef struct {
+    char data[OUTPUT_BATCH_SIZE];
+    size_t len;
+    logindex_entry_t* entries;     // Keys of the records in data, with --index
+    uint32_t entry_count;
+} output_batch_t;
+
+typedef struct {
+    time_t second;
+    char prefix[20];               // "YYYY-MM-DDTHH:MM:SS"
+    char offset[7];                // "+HH:MM"
+} output_clock_t;
+
+typedef struct Output {
+    output_format_t format;
+    int fd;
+    uint64_t offset;               // Bytes written to fd, where the next batch goes in the log
+    int sessions;                  // Columns to write, as enabled at output_init()
+    int lineage;
+    int cgroups;
+    int hashes;
+    int chunks;
+    int policy;
+    int alerts;
+    pthread_mutex_t lock;          // Keeps the batches of both threads whole
+} output_t;
+
+int output_parse_format(const char* name);
+void output_init(output_format_t format, const char* path);
+void output_event(const event_t* event);
+char* output_serialize(char* p, const event_t* event, const struct timespec* now, const proc_entry_t* lineage, const cgroup_id_entry_t* cgroup);
+void output_flush();
+
+output_t g_output = { .format = OUTPUT_TEXT, .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+__thread output_batch_t* t_output_batch = NULL;
+__thread output_clock_t t_output_clock = { .second = -1 };
+
+// 0 copied as is, 1 escaped, 2 start of a multi-byte UTF-8 sequence
+static const unsigned char json_class[256] = {
+    [0x00 ... 0x1f] = 1,
+    ['"'] = 1,
+    ['\\'] = 1,
+    [0x80 ... 0xff] = 2,
+};
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/**
+ * @brief Parses the argument of --format.
+ *
+ * @param name "text", "jsonl" or "csv".
+ * @return int The output_format_t, or -1 if unknown.
+ */
+int output_parse_format(const char* name) {
+    if (strcmp(name, "text") == 0) {
+        return OUTPUT_TEXT;
+    }
+    if (strcmp(name, "jsonl") == 0) {
+        return OUTPUT_JSONL;
+    }
+    if (strcmp(name, "csv") == 0) {
+        return OUTPUT_CSV;
+    }
+    return -1;
+}
+
+/**
+ * @brief Opens the output of a structured format. Call after the features adding fields are set up.
+ *
+ * @param format The format, nothing is done for OUTPUT_TEXT.
+ * @param path The output file, or NULL for stdout.
+ */
+void output_init(output_format_t format, const char* path) {
+    g_output.format = format;
+    if (format == OUTPUT_TEXT) {
+        return;
+    }
+    g_output.sessions = g_sessions.enabled;
+    g_output.lineage = g_proctable.enabled;
+    g_output.cgroups = g_cgroups.show;
+    g_output.hashes = g_hashing.enabled && g_hashing.hash_all;
+    g_output.chunks = g_chunking.enabled;
+    g_output.policy = g_policy.enabled;
+    g_output.alerts = g_anomaly.enabled;
+    if (path == NULL) {
+        g_output.fd = STDOUT_FILENO;
+    } else {
+        g_output.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (g_output.fd == -1) {
+            log_message(ERROR, 1, "Failed to open output \"%s\" (%s)\n", path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (format == OUTPUT_CSV) {
+        char header[256] = "time,group,pid,comm,flags,path,old_path";
+        if (g_output.sessions) {
+            strcat(header, ",opened,duration_us,access,modify,written,end");
+        }
+        if (g_output.lineage) {
+            strcat(header, ",ppid,uid,exe,cmdline");
+        }
+        if (g_output.cgroups) {
+            strcat(header, ",cgroup,cgroup_id,container");
+        }
+        if (g_output.hashes) {
+            strcat(header, ",xxh64,hash_skipped");
+        }
+        if (g_output.chunks) {
+            strcat(header, ",chunk_status,changed_bytes,changed_ranges");
+        }
+        if (g_output.policy) {
+            strcat(header, ",policy,policy_rule");
+        }
+        if (g_output.alerts) {
+            strcat(header, ",alert,alert_count");
+        }
+        strcat(header, "\n");
+        if (write(g_output.fd, header, strlen(header)) == -1) {
+            log_message(ERROR, 1, "Failed to write output (%s)\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        g_output.offset = strlen(header);
+    }
+}
+
+static output_batch_t* output_batch() {
+    if (t_output_batch == NULL) {
+        t_output_batch = (output_batch_t*)malloc(sizeof(output_batch_t));
+        if (t_output_batch == NULL) {
+            log_message(ERROR, 1, "Failed to allocate memory to output batch\n");
+            exit(EXIT_FAILURE);
+        }
+        t_output_batch->len = 0;
+        t_output_batch->entries = NULL;
+        t_output_batch->entry_count = 0;
+        if (g_logindex.enabled) {
+            t_output_batch->entries = (logindex_entry_t*)malloc(LOGINDEX_BATCH_ENTRIES * sizeof(logindex_entry_t));
+            if (t_output_batch->entries == NULL) {
+                log_message(ERROR, 1, "Failed to allocate memory to output batch\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    return t_output_batch;
+}
+
+/**
+ * @brief Writes out the records the calling thread has serialized so far.
+ *
+ */
+void output_flush() {
+    output_batch_t* batch = t_output_batch;
+    size_t done = 0;
+
+    if (batch == NULL || batch->len == 0) {
+        return;
+    }
+    pthread_mutex_lock(&g_output.lock);
+    while (done < batch->len) {
+        ssize_t ret = write(g_output.fd, batch->data + done, batch->len - done);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            break;
+        }
+        done += ret;
+    }
+    // Still under the lock, so the index gets the records in log order
+    if (batch->entry_count) {
+        logindex_add(batch->entries, batch->entry_count, g_output.offset, done);
+        batch->entry_count = 0;
+    }
+    g_output.offset += done;
+    pthread_mutex_unlock(&g_output.lock);
+    batch->len = 0;
+}
+
+static inline char* out_bytes(char* p, const char* s, size_t n) {
+    memcpy(p, s, n);
+    return p + n;
+}
+
+#define out_literal(p, s) out_bytes((p), (s), sizeof(s) - 1)
+
+static inline char* out_uint(char* p, uint64_t value) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    while (n) {
+        *p++ = digits[--n];
+    }
+    return p;
+}
+
+static inline char* out_int(char* p, int64_t value) {
+    if (value < 0) {
+        *p++ = '-';
+        return out_uint(p, -(uint64_t)value);
+    }
+    return out_uint(p, value);
+}
+
+// 16 lowercase hex digits
+static inline char* out_hex64(char* p, uint64_t value) {
+    for (int shift = 60; shift >= 0; shift -= 4) {
+        *p++ = hex_digits[(value >> shift) & 0xf];
+    }
+    return p;
+}
+
+static inline char* out_2digits(char* p, int value) {
+    *p++ = '0' + value / 10;
+    *p++ = '0' + value % 10;
+    return p;
+}
+
+// RFC 3339 local time with milliseconds, the date part is only worked out once a second
+static char* out_time(char* p, time_t second, long nsec) {
+    output_clock_t* clock = &t_output_clock;
+    if (clock->second != second) {
+        struct tm tm;
+        localtime_r(&second, &tm);
+        char* q = clock->prefix;
+        q = out_2digits(q, (tm.tm_year + 1900) / 100);
+        q = out_2digits(q, (tm.tm_year + 1900) % 100);
+        *q++ = '-';
+        q = out_2digits(q, tm.tm_mon + 1);
+        *q++ = '-';
+        q = out_2digits(q, tm.tm_mday);
+        *q++ = 'T';
+        q = out_2digits(q, tm.tm_hour);
+        *q++ = ':';
+        q = out_2digits(q, tm.tm_min);
+        *q++ = ':';
+        out_2digits(q, tm.tm_sec);
+        long offset = tm.tm_gmtoff;
+        q = clock->offset;
+        *q++ = offset < 0 ? '-' : '+';
+        offset = offset < 0 ? -offset : offset;
+        q = out_2digits(q, offset / 3600);
+        *q++ = ':';
+        out_2digits(q, offset % 3600 / 60);
+        clock->second = second;
+    }
+    p = out_bytes(p, clock->prefix, sizeof(clock->prefix) - 1);
+    int ms = nsec / 1000000;
+    *p++ = '.';
+    *p++ = '0' + ms / 100;
+    p = out_2digits(p, ms % 100);
+    return out_bytes(p, clock->offset, sizeof(clock->offset) - 1);
+}
+
+// Length of the valid UTF-8 sequence at s, 0 if it is not one
+static inline int utf8_sequence(const unsigned char* s) {
+    if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+        return (s[1] & 0xc0) == 0x80 ? 2 : 0;
+    }
+    if (s[0] >= 0xe0 && s[0] <= 0xef) {
+        unsigned char low = s[0] == 0xe0 ? 0xa0 : 0x80;
+        unsigned char high = s[0] == 0xed ? 0x9f : 0xbf;
+        return s[1] >= low && s[1] <= high && (s[2] & 0xc0) == 0x80 ? 3 : 0;
+    }
+    if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+        unsigned char low = s[0] == 0xf0 ? 0x90 : 0x80;
+        unsigned char high = s[0] == 0xf4 ? 0x8f : 0xbf;
+        return s[1] >= low && s[1] <= high && (s[2] & 0xc0) == 0x80 && (s[3] & 0xc0) == 0x80 ? 4 : 0;
+    }
+    return 0;
+}
+
+// A JSON string, at most 6 bytes per input byte plus the quotes
+static char* out_json_string(char* p, const char* str) {
+    const unsigned char* s = (const unsigned char*)str;
+    *p++ = '"';
+    while (1) {
+        const unsigned char* run = s;
+        while (*s && json_class[*s] == 0) {
+            s++;
+        }
+        p = out_bytes(p, (const char*)run, s - run);
+        if (*s == '\0') {
+            break;
+        }
+        if (json_class[*s] == 2) {
+            int len = utf8_sequence(s);
+            if (len) {
+                p = out_bytes(p, (const char*)s, len);
+                s += len;
+                continue;
+            }
+        }
+        *p++ = '\\';
+        switch (*s) {
+            case '"':  *p++ = '"'; break;
+            case '\\': *p++ = '\\'; break;
+            case '\n': *p++ = 'n'; break;
+            case '\r': *p++ = 'r'; break;
+            case '\t': *p++ = 't'; break;
+            case '\b': *p++ = 'b'; break;
+            case '\f': *p++ = 'f'; break;
+            default:
+                p = out_literal(p, "u00");
+                *p++ = hex_digits[*s >> 4];
+                *p++ = hex_digits[*s & 0xf];
+                break;
+        }
+        s++;
+    }
+    *p++ = '"';
+    return p;
+}
+
+// A quoted CSV field, at most 2 bytes per input byte plus the quotes
+static char* out_csv_string(char* p, const char* s) {
+    *p++ = '"';
+    while (1) {
+        const char* quote = strchr(s, '"');
+        if (quote == NULL) {
+            p = out_bytes(p, s, strlen(s));
+            break;
+        }
+        p = out_bytes(p, s, quote + 1 - s);
+        *p++ = '"';
+        s = quote + 1;
+    }
+    *p++ = '"';
+    return p;
+}
+
+// Flag names, as a JSON array or one '|' separated CSV field
+static char* out_flags(char* p, uint64_t mask, int json) {
+    int first = 1;
+    *p++ = json ? '[' : '"';
+    for (size_t i = 0; i < FAN_FLAGS_COUNT; i++) {
+        if (!(mask & fan_flags[i].mask)) {
+            continue;
+        }
+        if (!first) {
+            *p++ = json ? ',' : '|';
+        }
+        if (json) {
+            *p++ = '"';
+        }
+        p = out_bytes(p, fan_flags[i].name, strlen(fan_flags[i].name));
+        if (json) {
+            *p++ = '"';
+        }
+        first = 0;
+    }
+    *p++ = json ? ']' : '"';
+    return p;
+}
+
+static const char* session_end_name(session_end_t end) {
+    switch (end) {
+        case SESSION_TIMED_OUT:
+            return "timeout";
+        case SESSION_EVICTED:
+            return "evicted";
+        default:
+            return "close";
+    }
+}
+
+static char* output_jsonl(char* p, const event_t* event, const struct timespec* now, const proc_entry_t* lineage, const cgroup_id_entry_t* cgroup) {
+    p = out_literal(p, "{\"time\":\"");
+    p = out_time(p, now->tv_sec, now->tv_nsec);
+    if (event->alert) {
+        p = out_literal(p, "\",\"group\":\"alert\",\"pid\":");
+    } else if (event->group == GROUP_READ_WRITE_EXECUTE) {
+        p = out_literal(p, "\",\"group\":\"read_write_execute\",\"pid\":");
+    } else {
+        p = out_literal(p, "\",\"group\":\"create_delete_move\",\"pid\":");
+    }
+    p = out_int(p, event->pid);
+    p = out_literal(p, ",\"comm\":");
+    p = out_json_string(p, event->comm);
+    p = out_literal(p, ",\"flags\":");
+    p = out_flags(p, event->mask, 1);
+    p = out_literal(p, ",\"path\":");
+    p = out_json_string(p, event->path);
+    if (event->old_path) {
+        p = out_literal(p, ",\"old_path\":");
+        p = out_json_string(p, event->old_path);
+    }
+    if (event->session) {
+        const session_t* session = event->session;
+        p = out_literal(p, ",\"opened\":\"");
+        p = out_time(p, session->opened.tv_sec, session->opened.tv_usec * 1000L);
+        p = out_literal(p, "\",\"duration_us\":");
+        p = out_uint(p, (session->last_ns - session->opened_ns) / 1000);
+        p = out_literal(p, ",\"access\":");
+        p = out_uint(p, session->access_count);
+        p = out_literal(p, ",\"modify\":");
+        p = out_uint(p, session->modify_count);
+        p = out_literal(p, ",\"written\":");
+        p = out_int(p, session->written);
+        p = out_literal(p, ",\"end\":\"");
+        const char* end = session_end_name(session->end);
+        p = out_bytes(p, end, strlen(end));
+        *p++ = '"';
+    }
+    if (lineage) {
+        p = out_literal(p, ",\"ppid\":");
+        p = out_int(p, lineage->identity.ppid);
+        p = out_literal(p, ",\"uid\":");
+        p = out_int(p, lineage->identity.uid);
+        p = out_literal(p, ",\"exe\":");
+        p = out_json_string(p, lineage->exe);
+        p = out_literal(p, ",\"cmdline\":");
+        p = out_json_string(p, lineage->cmdline);
+    }
+    if (cgroup) {
+        const char* container = cgroup_container(cgroup->path);
+        p = out_literal(p, ",\"cgroup\":");
+        p = out_json_string(p, cgroup->path);
+        p = out_literal(p, ",\"cgroup_id\":");
+        p = out_uint(p, cgroup->cgroup_id);
+        if (container) {
+            p = out_literal(p, ",\"container\":\"");
+            p = out_bytes(p, container, CONTAINER_ID_SHORT);
+            *p++ = '"';
+        }
+    }
+    if (event->hash) {
+        const char* reason = hashing_skip_reason(event->hash->status);
+        if (event->hash->status == HASH_DONE) {
+            p = out_literal(p, ",\"xxh64\":\"");
+            p = out_hex64(p, event->hash->value);
+            *p++ = '"';
+        } else if (reason) {
+            p = out_literal(p, ",\"hash_skipped\":\"");
+            p = out_bytes(p, reason, strlen(reason));
+            *p++ = '"';
+        }
+    }
+    if (event->changes) {
+        const chunk_diff_t* changes = event->changes;
+        const char* status = chunking_status_name(changes->status);
+        p = out_literal(p, ",\"chunk_status\":\"");
+        p = out_bytes(p, status, strlen(status));
+        *p++ = '"';
+        if (changes->status == CHUNKS_CHANGED) {
+            p = out_literal(p, ",\"changed_bytes\":");
+            p = out_uint(p, changes->changed_bytes);
+            p = out_literal(p, ",\"changed_ranges\":[");
+            for (uint32_t i = 0; i < changes->range_count && i < CHUNK_RANGES_MAX; i++) {
+                if (i > 0) {
+                    *p++ = ',';
+                }
+                *p++ = '[';
+                p = out_uint(p, changes->ranges[i].start);
+                *p++ = ',';
+                p = out_uint(p, changes->ranges[i].end);
+                *p++ = ']';
+            }
+            *p++ = ']';
+            if (changes->range_count > CHUNK_RANGES_MAX) {
+                p = out_literal(p, ",\"changed_range_count\":");
+                p = out_uint(p, changes->range_count);
+            }
+        }
+    }
+    if (event->policy) {
+        const char* action = policy_action_name(event->policy->action);
+        p = out_literal(p, ",\"policy\":\"");
+        p = out_bytes(p, action, strlen(action));
+        *p++ = '"';
+        if (event->policy->timed_out) {
+            p = out_literal(p, ",\"policy_timeout\":true");
+        } else {
+            p = out_literal(p, ",\"policy_rule\":");
+            p = out_int(p, event->policy->rule);
+        }
+    }
+    if (event->alert) {
+        const anomaly_alert_t* alert = event->alert;
+        const char* kind = anomaly_kind_name(alert->kind);
+        p = out_literal(p, ",\"alert\":\"");
+        p = out_bytes(p, kind, strlen(kind));
+        if (alert->kind == ANOMALY_EXEC_NEW) {
+            p = out_literal(p, "\",\"age_s\":");
+            p = out_uint(p, alert->count);
+        } else {
+            p = out_literal(p, "\",\"count\":");
+            p = out_uint(p, alert->count);
+            p = out_literal(p, ",\"threshold\":");
+            p = out_uint(p, alert->threshold);
+        }
+        p = out_literal(p, ",\"window_s\":");
+        p = out_uint(p, alert->window_s);
+    }
+    return out_literal(p, "}\n");
+}
+
+static char* output_csv(char* p, const event_t* event, const struct timespec* now, const proc_entry_t* lineage, const cgroup_id_entry_t* cgroup) {
+    p = out_time(p, now->tv_sec, now->tv_nsec);
+    if (event->alert) {
+        p = out_literal(p, ",alert,");
+    } else if (event->group == GROUP_READ_WRITE_EXECUTE) {
+        p = out_literal(p, ",read_write_execute,");
+    } else {
+        p = out_literal(p, ",create_delete_move,");
+    }
+    p = out_int(p, event->pid);
+    *p++ = ',';
+    p = out_csv_string(p, event->comm);
+    *p++ = ',';
+    p = out_flags(p, event->mask, 0);
+    *p++ = ',';
+    p = out_csv_string(p, event->path);
+    *p++ = ',';
+    if (event->old_path) {
+        p = out_csv_string(p, event->old_path);
+    }
+    if (g_output.sessions) {
+        const session_t* session = event->session;
+        *p++ = ',';
+        if (session) {
+            const char* end = session_end_name(session->end);
+            p = out_time(p, session->opened.tv_sec, session->opened.tv_usec * 1000L);
+            *p++ = ',';
+            p = out_uint(p, (session->last_ns - session->opened_ns) / 1000);
+            *p++ = ',';
+            p = out_uint(p, session->access_count);
+            *p++ = ',';
+            p = out_uint(p, session->modify_count);
+            *p++ = ',';
+            p = out_int(p, session->written);
+            *p++ = ',';
+            p = out_bytes(p, end, strlen(end));
+        } else {
+            p = out_literal(p, ",,,,,");
+        }
+    }
+    if (g_output.lineage) {
+        *p++ = ',';
+        if (lineage) {
+            p = out_int(p, lineage->identity.ppid);
+            *p++ = ',';
+            p = out_int(p, lineage->identity.uid);
+            *p++ = ',';
+            p = out_csv_string(p, lineage->exe);
+            *p++ = ',';
+            p = out_csv_string(p, lineage->cmdline);
+        } else {
+            p = out_literal(p, ",,,");
+        }
+    }
+    if (g_output.cgroups) {
+        *p++ = ',';
+        if (cgroup) {
+            const char* container = cgroup_container(cgroup->path);
+            p = out_csv_string(p, cgroup->path);
+            *p++ = ',';
+            p = out_uint(p, cgroup->cgroup_id);
+            *p++ = ',';
+            if (container) {
+                p = out_bytes(p, container, CONTAINER_ID_SHORT);
+            }
+        } else {
+            p = out_literal(p, ",,");
+        }
+    }
+    if (g_output.hashes) {
+        const char* reason = event->hash ? hashing_skip_reason(event->hash->status) : NULL;
+        *p++ = ',';
+        if (event->hash && event->hash->status == HASH_DONE) {
+            p = out_hex64(p, event->hash->value);
+        }
+        *p++ = ',';
+        if (reason) {
+            p = out_bytes(p, reason, strlen(reason));
+        }
+    }
+    if (g_output.chunks) {
+        const chunk_diff_t* changes = event->changes;
+        *p++ = ',';
+        if (changes) {
+            const char* status = chunking_status_name(changes->status);
+            p = out_bytes(p, status, strlen(status));
+        }
+        *p++ = ',';
+        if (changes && changes->status == CHUNKS_CHANGED) {
+            p = out_uint(p, changes->changed_bytes);
+            *p++ = ',';
+            // Only the first CHUNK_RANGES_MAX ranges, changed_bytes counts them all
+            for (uint32_t i = 0; i < changes->range_count && i < CHUNK_RANGES_MAX; i++) {
+                if (i > 0) {
+                    *p++ = ';';
+                }
+                p = out_uint(p, changes->ranges[i].start);
+                *p++ = '-';
+                p = out_uint(p, changes->ranges[i].end);
+            }
+        } else {
+            *p++ = ',';
+        }
+    }
+    if (g_output.policy) {
+        *p++ = ',';
+        if (event->policy) {
+            const char* action = policy_action_name(event->policy->action);
+            p = out_bytes(p, action, strlen(action));
+        }
+        *p++ = ',';
+        // The rule is left empty when the budget ran out
+        if (event->policy && !event->policy->timed_out) {
+            p = out_int(p, event->policy->rule);
+        }
+    }
+    if (g_output.alerts) {
+        *p++ = ',';
+        if (event->alert) {
+            const char* kind = anomaly_kind_name(event->alert->kind);
+            p = out_bytes(p, kind, strlen(kind));
+        }
+        *p++ = ',';
+        // The age in seconds of the file for exec-new
+        if (event->alert) {
+            p = out_uint(p, event->alert->count);
+        }
+    }
+    *p++ = '\n';
+    return p;
+}
+
+/**
+ * @brief Serializes one record in the format of g_output.
+ *
+ * @param p Where the record goes, with room for it.
+ * @param event The event.
+ * @param now When it happened.
+ * @param lineage The lineage fields of the process, or NULL.
+ * @param cgroup The cgroup of the process, or NULL.
+ * @return char* The end of the record.
+ */
+char* output_serialize(char* p, const event_t* event, const struct timespec* now, const proc_entry_t* lineage, const cgroup_id_entry_t* cgroup) {
+    if (g_output.format == OUTPUT_CSV) {
+        return output_csv(p, event, now, lineage, cgroup);
+    }
+    return output_jsonl(p, event, now, lineage, cgroup);
+}
+
+/**
+ * @brief Adds the record of an event to the batch of the calling thread, see output_flush().
+ *
+ * @param event The event.
+ */
+void output_event(const event_t* event) {
+    output_batch_t* batch = output_batch();
+    const cgroup_id_entry_t* cgroup = NULL;
+    proc_entry_t lineage;
+    int has_lineage = 0;
+    struct timespec now;
+    size_t bound;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (g_output.lineage) {
+        has_lineage = proctable_lookup(event->pid, &lineage);
+    }
+    if (g_output.cgroups) {
+        cgroup = cgroup_of(event->pid, event->comm);
+    }
+
+    // Escaping at most grows a string six times
+    bound = OUTPUT_RECORD_SLACK + 6 * (strlen(event->comm) + strlen(event->path));
+    if (event->old_path) {
+        bound += 6 * strlen(event->old_path);
+    }
+    if (has_lineage) {
+        bound += 6 * (strlen(lineage.exe) + strlen(lineage.cmdline));
+    }
+    if (cgroup) {
+        bound += 6 * strlen(cgroup->path);
+    }
+    if (event->changes) {
+        bound += CHUNK_RANGES_MAX * 48;
+    }
+    if (batch->len + bound > sizeof(batch->data) || batch->entry_count == LOGINDEX_BATCH_ENTRIES) {
+        output_flush();
+    }
+    char* end = output_serialize(batch->data + batch->len, event, &now, has_lineage ? &lineage : NULL, cgroup);
+    if (batch->entries) {
+        batch->entries[batch->entry_count++] = (logindex_entry_t){
+            .offset = batch->len,
+            .length = end - (batch->data + batch->len),
+            .pid = event->pid,
+            .time_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec,
+            .path = event->path_hash ? event->path_hash : hash_string(event->path),
+            .old_path = event->old_path ? hash_string(event->old_path) : 0,
+            .process = hash_string(event->comm),
+        };
+    }
+    batch->len = end - batch->data;
+}
+
+#endif
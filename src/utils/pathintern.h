@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "wrappers.h"
+#include "logger.h"
+#include "metrics.h"
+
+#ifndef PATHINTERN_H
+#define PATHINTERN_H
+
+#define PATH_INTERN_STRIPES 16         // A power of two, picked by the top bits of the hash
+#define PATH_INTERN_SIZE_DEFAULT 16    // MB
+#define PATH_INTERN_SIZE_MAX 4096
+#define PATH_INTERN_ENTRY_BYTES 128    // Arena bytes planned per path, sets the number of entries
+
+/*
+ * Path intern table (--path-cache MB). The same few thousand paths make most of the events, and
+ * each of them went through the trie and every include/exclude regex again. Each distinct path
+ * gets an entry and a 32-bit id, stable for as long as the path stays in the table, and the entry
+ * remembers the path part of the filter verdict: which roots the path is in and which of their
+ * pattern filters it passes. The verdict is stamped with the version of the watch set it was
+ * worked out for, so adding or removing a root or reloading the rules invalidates it without a
+ * sweep. PID and process name filters still run on every event, they depend on more than the path.
+ *
+ * The table is split in stripes, each with its own lock, so the two reader threads rarely meet.
+ * A stripe copies its paths into an arena. When the arena or the entries run out, the paths looked
+ * up since the previous collection are copied to the other half of the arena and the rest are
+ * dropped (a copying collection), keeping their ids; if the survivors still fill the stripe, it is
+ * emptied. Memory is fixed at startup.
+ */
+typedef struct {
+    uint64_t watch_version;        // Watch set the verdict was worked out for, 0 if none
+    uint64_t roots;                // path_trie_match() of the path
+    uint64_t patterns;             // Bit i set if the path passes the pattern filter of root i
+    int rules_pattern;             // 1 if it passes the pattern filter of the filter config
+} path_verdict_t;
+
+typedef struct {
+    uint32_t id;                   // 0 if the path is not in the table
+    uint64_t hash;                 // hash_string() of the path
+} path_ref_t;
+
+typedef struct {
+    uint64_t hash;
+    uint32_t offset;               // Of the path in the arena, next free entry + 1 when free
+    uint32_t len;                  // 0 if the entry is free
+    int referenced;                // Looked up since the previous collection
+    path_verdict_t verdict;
+} path_entry_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    path_entry_t* entries;
+    uint32_t used;                 // Entries handed out at least once, the free ones are listed
+    uint32_t free;                 // First free entry + 1, 0 if none
+    uint32_t* slots;               // Open addressing on hash, entry index + 1, 0 if empty
+    char* arena;
+    char* spare;                   // The other half, survivors are copied into it
+    uint32_t arena_used;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t collections;
+} path_stripe_t;
+
+typedef struct PathIntern {
+    int enabled;
+    uint32_t entries;              // Per stripe
+    uint32_t slot_mask;
+    uint32_t arena_size;           // Per half
+    path_stripe_t stripes[PATH_INTERN_STRIPES];
+} path_intern_t;
+
+void path_intern_init(int size_mb);
+int path_intern(const char* path, path_ref_t* ref, path_verdict_t* verdict);
+void path_intern_set_verdict(const path_ref_t* ref, const path_verdict_t* verdict);
+void collect_path_intern(FILE* out, void* arg);
+
+path_intern_t g_path_intern = { .enabled = 0 };
+
+#define PATH_INTERN_STRIPE(hash) ((uint32_t)((hash) >> 60) & (PATH_INTERN_STRIPES - 1))
+#define PATH_INTERN_ID(stripe, index) (((uint32_t)(stripe) << 28) | ((index) + 1))
+
+/**
+ * @brief Sets up the table.
+ *
+ * @param size_mb Memory for the table in MB, 0 to not intern paths.
+ */
+void path_intern_init(int size_mb) {
+    size_t stripe_size = (size_t)size_mb * 1024 * 1024 / PATH_INTERN_STRIPES;
+    uint32_t slots = 1;
+
+    if (size_mb == 0) {
+        return;
+    }
+    // Half of a stripe for the two arena halves, the rest for the entries and slots
+    g_path_intern.arena_size = stripe_size / 4;
+    g_path_intern.entries = stripe_size / 2 / (sizeof(path_entry_t) + 2 * sizeof(uint32_t));
+    if (g_path_intern.entries > g_path_intern.arena_size / PATH_INTERN_ENTRY_BYTES) {
+        g_path_intern.entries = g_path_intern.arena_size / PATH_INTERN_ENTRY_BYTES;
+    }
+    if (g_path_intern.entries > (1 << 27)) {
+        g_path_intern.entries = 1 << 27;
+    }
+    while (slots < g_path_intern.entries * 2) {
+        slots <<= 1;
+    }
+    g_path_intern.slot_mask = slots - 1;
+    for (int i = 0; i < PATH_INTERN_STRIPES; i++) {
+        path_stripe_t* stripe = &g_path_intern.stripes[i];
+        pthread_mutex_init(&stripe->lock, NULL);
+        stripe->entries = calloc(g_path_intern.entries, sizeof(path_entry_t));
+        stripe->slots = calloc(slots, sizeof(uint32_t));
+        stripe->arena = malloc(g_path_intern.arena_size);
+        stripe->spare = malloc(g_path_intern.arena_size);
+        if (stripe->entries == NULL || stripe->slots == NULL || stripe->arena == NULL || stripe->spare == NULL) {
+            log_message(ERROR, 1, "Unable to malloc for the path cache\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    g_path_intern.enabled = 1;
+    metrics_add_collector(collect_path_intern, NULL);
+    log_message(INFO, 1, "Path cache of %d MB, %u paths\n", size_mb, g_path_intern.entries * PATH_INTERN_STRIPES);
+}
+
+static void path_intern_insert_slot(path_stripe_t* stripe, uint64_t hash, uint32_t index) {
+    uint32_t slot = (uint32_t)hash & g_path_intern.slot_mask;
+    while (stripe->slots[slot] != 0) {
+        slot = (slot + 1) & g_path_intern.slot_mask;
+    }
+    stripe->slots[slot] = index + 1;
+}
+
+/**
+ * @brief Keeps the paths looked up since the previous collection and drops the others.
+ *
+ * @param stripe The stripe, locked.
+ * @param keep 0 to drop every path.
+ */
+static void path_intern_collect(path_stripe_t* stripe, int keep) {
+    char* arena = stripe->spare;
+    uint32_t used = 0;
+
+    memset(stripe->slots, 0, (g_path_intern.slot_mask + 1) * sizeof(uint32_t));
+    stripe->free = 0;
+    for (uint32_t i = stripe->used; i-- > 0;) {
+        path_entry_t* entry = &stripe->entries[i];
+        if (entry->len != 0 && keep && entry->referenced) {
+            memcpy(arena + used, stripe->arena + entry->offset, entry->len + 1);
+            entry->offset = used;
+            entry->referenced = 0;
+            used += entry->len + 1;
+            path_intern_insert_slot(stripe, entry->hash, i);
+        } else {
+            entry->len = 0;
+            entry->offset = stripe->free;
+            stripe->free = i + 1;
+        }
+    }
+    stripe->spare = stripe->arena;
+    stripe->arena = arena;
+    stripe->arena_used = used;
+    stripe->collections++;
+}
+
+/**
+ * @brief Finds a path in the table, adding it if it is not there.
+ *
+ * @param path The path.
+ * @param ref Set to the id and the hash of the path. The id is 0 if the path is not in the table.
+ * @param verdict Set to the verdict remembered for the path.
+ * @return int 1 if verdict was set, check its watch_version; 0 if nothing is remembered.
+ */
+int path_intern(const char* path, path_ref_t* ref, path_verdict_t* verdict) {
+    uint32_t len = strlen(path);
+    uint64_t hash = hash_bytes(path, len);
+
+    ref->hash = hash;
+    ref->id = 0;
+    if (!g_path_intern.enabled || len == 0 || len + 1 > g_path_intern.arena_size / 4) {
+        return 0;
+    }
+
+    uint32_t index = PATH_INTERN_STRIPE(hash);
+    path_stripe_t* stripe = &g_path_intern.stripes[index];
+    pthread_mutex_lock(&stripe->lock);
+    uint32_t slot = (uint32_t)hash & g_path_intern.slot_mask;
+    while (stripe->slots[slot] != 0) {
+        path_entry_t* entry = &stripe->entries[stripe->slots[slot] - 1];
+        if (entry->hash == hash && entry->len == len && memcmp(stripe->arena + entry->offset, path, len) == 0) {
+            entry->referenced = 1;
+            *verdict = entry->verdict;
+            ref->id = PATH_INTERN_ID(index, stripe->slots[slot] - 1);
+            stripe->hits++;
+            pthread_mutex_unlock(&stripe->lock);
+            return 1;
+        }
+        slot = (slot + 1) & g_path_intern.slot_mask;
+    }
+
+    stripe->misses++;
+    if (stripe->arena_used + len + 1 > g_path_intern.arena_size || (stripe->free == 0 && stripe->used == g_path_intern.entries)) {
+        path_intern_collect(stripe, 1);
+        // Every path was hot, start over rather than collect again soon
+        if (stripe->arena_used + len + 1 > g_path_intern.arena_size * 3 / 4 || (stripe->free == 0 && stripe->used == g_path_intern.entries)) {
+            path_intern_collect(stripe, 0);
+        }
+        slot = (uint32_t)hash & g_path_intern.slot_mask;
+        while (stripe->slots[slot] != 0) {
+            slot = (slot + 1) & g_path_intern.slot_mask;
+        }
+    }
+    uint32_t entry_index;
+    if (stripe->free != 0) {
+        entry_index = stripe->free - 1;
+        stripe->free = stripe->entries[entry_index].offset;
+    } else {
+        entry_index = stripe->used++;
+    }
+    path_entry_t* entry = &stripe->entries[entry_index];
+    memcpy(stripe->arena + stripe->arena_used, path, len + 1);
+    entry->hash = hash;
+    entry->offset = stripe->arena_used;
+    entry->len = len;
+    entry->referenced = 1;
+    memset(&entry->verdict, 0, sizeof(entry->verdict));
+    stripe->arena_used += len + 1;
+    stripe->slots[slot] = entry_index + 1;
+    ref->id = PATH_INTERN_ID(index, entry_index);
+    pthread_mutex_unlock(&stripe->lock);
+    return 0;
+}
+
+/**
+ * @brief Remembers the verdict of a path for the next events on it.
+ *
+ * @param ref The path, as set by path_intern().
+ * @param verdict The verdict.
+ */
+void path_intern_set_verdict(const path_ref_t* ref, const path_verdict_t* verdict) {
+    if (ref->id == 0) {
+        return;
+    }
+    path_stripe_t* stripe = &g_path_intern.stripes[ref->id >> 28];
+    path_entry_t* entry = &stripe->entries[(ref->id & ((1U << 28) - 1)) - 1];
+    pthread_mutex_lock(&stripe->lock);
+    // The path may have been dropped by a collection in between
+    if (entry->len != 0 && entry->hash == ref->hash) {
+        entry->verdict = *verdict;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+}
+
+/**
+ * @brief Metrics collector for the path cache.
+ *
+ * @param out The response.
+ * @param arg Unused.
+ */
+void collect_path_intern(FILE* out, void* arg) {
+    uint64_t hits = 0, misses = 0, collections = 0, bytes = 0, paths = 0;
+    (void)arg;
+
+    for (int i = 0; i < PATH_INTERN_STRIPES; i++) {
+        path_stripe_t* stripe = &g_path_intern.stripes[i];
+        pthread_mutex_lock(&stripe->lock);
+        hits += stripe->hits;
+        misses += stripe->misses;
+        collections += stripe->collections;
+        bytes += stripe->arena_used;
+        for (uint32_t j = 0; j < stripe->used; j++) {
+            paths += stripe->entries[j].len != 0;
+        }
+        pthread_mutex_unlock(&stripe->lock);
+    }
+    metrics_write_gauge(out, "filemon_path_cache_lookups", "result=\"hit\"", "Paths looked up in the path cache since startup.", hits);
+    metrics_write_gauge(out, "filemon_path_cache_lookups", "result=\"miss\"", NULL, misses);
+    metrics_write_gauge(out, "filemon_path_cache_paths", NULL, "Paths in the path cache.", paths);
+    metrics_write_gauge(out, "filemon_path_cache_bytes", NULL, "Bytes of paths in the path cache arenas.", bytes);
+    metrics_write_gauge(out, "filemon_path_cache_collections", NULL, "Times a stripe of the path cache was full and dropped its cold paths.", collections);
+}
+
+#endif
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "logger.h"
+
+#ifndef PATHTRIE_H
+#define PATHTRIE_H
+
+#define PATH_TRIE_NODES_MAX 4096
+#define PATH_TRIE_ROOTS_MAX 64         // Bits in path_trie_node_t.roots
+
+/*
+ * Prefix trie over the watched directories, one node per path component. Every event is read once
+ * and path_trie_match() walks its path down the trie, collecting the watch roots that end on the
+ * way as a bit mask, so a path is matched against every root in one pass of its components instead
+ * of one string compare per root. "/tmp/ab" does not match a root at "/tmp/a".
+ * Children are a singly linked sibling list: there are rarely more than a handful per node.
+ */
+typedef struct {
+    char* name;                    // Path component, NULL for "/"
+    size_t name_len;
+    int first_child;               // -1 if none
+    int next_sibling;              // -1 if none
+    uint64_t roots;                // Bit i set if watch root i is this directory
+} path_trie_node_t;
+
+typedef struct PathTrie {
+    int count;
+    path_trie_node_t nodes[PATH_TRIE_NODES_MAX];
+} path_trie_t;
+
+void path_trie_init(path_trie_t* trie);
+void path_trie_free(path_trie_t* trie);
+int path_trie_insert(path_trie_t* trie, const char* path, int root);
+uint64_t path_trie_match(const path_trie_t* trie, const char* path);
+
+/**
+ * @brief Empties a trie, leaving only the "/" node.
+ *
+ * @param trie The trie.
+ */
+void path_trie_init(path_trie_t* trie) {
+    trie->count = 1;
+    trie->nodes[0].name = NULL;
+    trie->nodes[0].name_len = 0;
+    trie->nodes[0].first_child = -1;
+    trie->nodes[0].next_sibling = -1;
+    trie->nodes[0].roots = 0;
+}
+
+/**
+ * @brief Frees the component names of a trie, which is then empty.
+ *
+ * @param trie The trie.
+ */
+void path_trie_free(path_trie_t* trie) {
+    for (int i = 1; i < trie->count; i++) {
+        free(trie->nodes[i].name);
+    }
+    path_trie_init(trie);
+}
+
+static int path_trie_child(const path_trie_t* trie, int node, const char* name, size_t len) {
+    int child = trie->nodes[node].first_child;
+    while (child != -1) {
+        const path_trie_node_t* entry = &trie->nodes[child];
+        if (entry->name_len == len && memcmp(entry->name, name, len) == 0) {
+            return child;
+        }
+        child = entry->next_sibling;
+    }
+    return -1;
+}
+
+/**
+ * @brief Adds a watch root.
+ *
+ * @param trie The trie.
+ * @param path Absolute path of the root, without "." or ".." components.
+ * @param root Index of the root, below PATH_TRIE_ROOTS_MAX.
+ * @return int 1 on success, 0 if the trie is full.
+ */
+int path_trie_insert(path_trie_t* trie, const char* path, int root) {
+    int node = 0;
+    const char* p = path;
+
+    while (*p) {
+        while (*p == '/') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        size_t len = strcspn(p, "/");
+        int child = path_trie_child(trie, node, p, len);
+        if (child == -1) {
+            if (trie->count >= PATH_TRIE_NODES_MAX) {
+                return 0;
+            }
+            child = trie->count;
+            path_trie_node_t* entry = &trie->nodes[child];
+            entry->name = strndup(p, len);
+            if (entry->name == NULL) {
+                return 0;
+            }
+            entry->name_len = len;
+            entry->first_child = -1;
+            entry->next_sibling = trie->nodes[node].first_child;
+            entry->roots = 0;
+            trie->nodes[node].first_child = child;
+            trie->count++;
+        }
+        node = child;
+        p += len;
+    }
+    trie->nodes[node].roots |= 1ULL << root;
+    return 1;
+}
+
+/**
+ * @brief Finds the watch roots a path is in.
+ *
+ * @param trie The trie.
+ * @param path An absolute path.
+ * @return uint64_t Bit i set for every root i that is the path or one of its parents.
+ */
+uint64_t path_trie_match(const path_trie_t* trie, const char* path) {
+    int node = 0;
+    uint64_t roots = trie->nodes[0].roots;
+    const char* p = path;
+
+    while (*p) {
+        while (*p == '/') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        size_t len = strcspn(p, "/");
+        node = path_trie_child(trie, node, p, len);
+        if (node == -1) {
+            break;
+        }
+        roots |= trie->nodes[node].roots;
+        p += len;
+    }
+    return roots;
+}
+
+#endif
@@ -0,0 +1,556 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <regex.h>
+#include <sys/stat.h>
+#include <sys/fanotify.h>
+#include "wrappers.h"
+#include "logger.h"
+#include "metrics.h"
+#include "cgroup.h"
+
+#ifndef POLICY_H
+#define POLICY_H
+
+#define POLICY_RULES_MAX 256
+#define POLICY_LINE_MAX 4096
+#define POLICY_NAMES_MAX 16            // Processes or executables in one condition
+#define POLICY_EXE_LEN 256             // Longer executable paths match no exe= condition
+#define POLICY_EXE_CACHE_SIZE 4096     // A power of two
+#define POLICY_CACHE_ENTRIES 16384     // A power of two
+#define POLICY_BUDGET_DEFAULT 100      // Microseconds
+#define POLICY_BUDGET_MAX 1000000
+#define POLICY_LATENCY_BUCKETS 10
+
+/*
+ * Permission policy (--policy FILE). FAN_OPEN_PERM, FAN_ACCESS_PERM and FAN_OPEN_EXEC_PERM events
+ * under the watched directories are answered with the action of the first rule that matches,
+ * instead of always FAN_ALLOW, whatever the other filters leave out of the log:
+ *   # ACTION  EVENTS      PATH       CONDITIONS
+ *   deny      open        ^/etc/     !exe=/usr/sbin/confd,/usr/bin/dpkg
+ *   audit     exec        ^/tmp/
+ *   allow     open,access *          process=backup cgroup=/system.slice/backup.service
+ *   default   allow
+ *   on-timeout allow
+ * ACTION is allow, deny or audit (allowed, and marked in the output). EVENTS is a list of open,
+ * access and exec, or all. PATH is an extended regex, * matches every path. A condition is
+ * process=NAMES, exe=PATHS or cgroup=CGROUPS (a cgroup and the ones below it), a leading ! negates
+ * it, and every condition of a rule has to hold. "default" is the action when no rule matches,
+ * allow if not given.
+ *
+ * Each decision has a budget of --policy-budget microseconds. It is checked after the process is
+ * looked up and before each rule, and when it runs out the event gets the "on-timeout" action
+ * (allow if not given) and the decision is not cached. A decision depends on the executable (its
+ * device and inode), the process name and cgroup if any rule looks at them, the path and the
+ * event, so it is cached under those in a direct-mapped table. The executable is found again
+ * with a stat() of /proc/PID/exe on every decision, while the process waits for the answer, so
+ * neither an exec nor a reused PID keeps the identity of the process before; its path is only
+ * read again when the device and inode changed. The table and the executables of PIDs are only
+ * used by the read/write/execute thread and need no lock. The policy is read once at start.
+ */
+typedef enum {
+    POLICY_ALLOW,
+    POLICY_DENY,
+    POLICY_AUDIT
+} policy_action_t;
+
+enum {
+    POLICY_EVENT_OPEN = 1,
+    POLICY_EVENT_ACCESS = 2,
+    POLICY_EVENT_EXEC = 4,
+    POLICY_EVENT_ALL = 7
+};
+
+typedef struct {
+    int negate;
+    int count;                     // 0 if the rule has no such condition
+} policy_condition_t;
+
+typedef struct {
+    int line;                      // In the policy file, reported as the rule of a decision
+    policy_action_t action;
+    int events;                    // POLICY_EVENT_* bits
+    int has_pattern;               // 0 for *
+    regex_t pattern;
+    policy_condition_t process;
+    char processes[POLICY_NAMES_MAX][PROC_NAME_LEN];
+    policy_condition_t exe;
+    char* exes[POLICY_NAMES_MAX];
+    policy_condition_t cgroup;
+    char (*cgroups)[CGROUP_PATH_LEN];
+} policy_rule_t;
+
+typedef struct {
+    policy_action_t action;
+    int rule;                      // Line of the rule that matched, 0 for the default action
+    int timed_out;                 // The budget ran out, action is the on-timeout one
+} policy_decision_t;
+
+typedef struct {
+    int pid;
+    uint64_t dev;                  // The path below is of this executable
+    uint64_t ino;                  // 0 if the executable could not be found
+    char exe[POLICY_EXE_LEN];      // Only read when a rule has an exe= condition
+} policy_exe_entry_t;
+
+typedef struct {
+    uint64_t subject;              // 0 if the entry is free
+    uint64_t path_hash;
+    uint8_t events;
+    uint8_t action;
+    uint16_t rule;
+} policy_cache_entry_t;
+
+typedef struct Policy {
+    int enabled;
+    uint64_t budget_ns;
+    policy_action_t default_action;
+    policy_action_t timeout_action;
+    int uses_process;              // Some rule has a process= condition, and so on
+    int uses_exe;
+    int uses_cgroup;
+    int uses_exec;
+    int count;
+    policy_rule_t* rules;
+    policy_exe_entry_t* exes;
+    policy_cache_entry_t* cache;
+    uint64_t latency[POLICY_LATENCY_BUCKETS + 1];   // Decisions per latency bucket, the last is +Inf
+    uint64_t latency_sum_ns;
+} policy_t;
+
+// Upper bounds of the decision latency buckets
+static const uint64_t policy_latency_bounds_ns[POLICY_LATENCY_BUCKETS] = {
+    1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000
+};
+
+void policy_init(const char* path, int budget_us);
+policy_action_t policy_decide(int pid, const char* comm, const char* path, uint64_t path_hash, uint64_t mask, policy_decision_t* decision);
+const char* policy_action_name(policy_action_t action);
+int policy_format(const policy_decision_t* decision, char* out, size_t size);
+void collect_policy(FILE* out, void* arg);
+
+policy_t g_policy = { .enabled = 0 };
+
+static inline uint64_t policy_clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int policy_parse_action(const char* name, policy_action_t* action) {
+    if (strcmp(name, "allow") == 0) {
+        *action = POLICY_ALLOW;
+    } else if (strcmp(name, "deny") == 0) {
+        *action = POLICY_DENY;
+    } else if (strcmp(name, "audit") == 0) {
+        *action = POLICY_AUDIT;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+static int policy_parse_events(char* list, int* events) {
+    char* save = NULL;
+    *events = 0;
+    for (char* name = strtok_r(list, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+        if (strcmp(name, "open") == 0) {
+            *events |= POLICY_EVENT_OPEN;
+        } else if (strcmp(name, "access") == 0) {
+            *events |= POLICY_EVENT_ACCESS;
+        } else if (strcmp(name, "exec") == 0) {
+            *events |= POLICY_EVENT_EXEC;
+        } else if (strcmp(name, "all") == 0) {
+            *events |= POLICY_EVENT_ALL;
+        } else {
+            return 0;
+        }
+    }
+    return *events != 0;
+}
+
+// Parses "[!]key=a,b,c" into a rule, 0 with error set on failure
+static int policy_parse_condition(policy_rule_t* rule, char* token, char* error, size_t error_size) {
+    int negate = token[0] == '!';
+    char* key = token + negate;
+    char* value = strchr(key, '=');
+    char* save = NULL;
+
+    if (value == NULL || value[1] == '\0') {
+        snprintf(error, error_size, "\"%s\" is not a condition.", token);
+        return 0;
+    }
+    *value++ = '\0';
+    policy_condition_t* condition = strcmp(key, "process") == 0 ? &rule->process :
+                                    strcmp(key, "exe") == 0 ? &rule->exe :
+                                    strcmp(key, "cgroup") == 0 ? &rule->cgroup : NULL;
+    if (condition == NULL) {
+        snprintf(error, error_size, "Unknown condition \"%s\".", key);
+        return 0;
+    }
+    if (condition->count > 0) {
+        snprintf(error, error_size, "%s is given twice.", key);
+        return 0;
+    }
+    if (condition == &rule->cgroup) {
+        rule->cgroups = calloc(CGROUP_FILTER_MAX, CGROUP_PATH_LEN);
+        if (rule->cgroups == NULL) {
+            snprintf(error, error_size, "Unable to malloc for the policy.");
+            return 0;
+        }
+    }
+    condition->negate = negate;
+    for (char* name = strtok_r(value, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+        if (condition == &rule->cgroup) {
+            if (!cgroup_filter_add(rule->cgroups, &condition->count, name)) {
+                snprintf(error, error_size, "cgroup has more than %d cgroups.", CGROUP_FILTER_MAX);
+                return 0;
+            }
+            continue;
+        }
+        if (condition->count == POLICY_NAMES_MAX) {
+            snprintf(error, error_size, "%s has more than %d names.", key, POLICY_NAMES_MAX);
+            return 0;
+        }
+        if (condition == &rule->process) {
+            strncpy(rule->processes[condition->count++], name, PROC_NAME_LEN - 1);
+        } else if ((rule->exes[condition->count++] = strdup(name)) == NULL) {
+            snprintf(error, error_size, "Unable to malloc for the policy.");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Parses one line of the policy file, tokenized in place
+static int policy_parse_line(char* line, int number, char* error, size_t error_size) {
+    char* tokens[3 + 3];
+    char* save = NULL;
+    int count = 0;
+
+    if (line[strspn(line, " \t")] == '#') {
+        return 1;
+    }
+    for (char* token = strtok_r(line, " \t", &save); token != NULL; token = strtok_r(NULL, " \t", &save)) {
+        if (count == sizeof(tokens) / sizeof(tokens[0])) {
+            snprintf(error, error_size, "Too many conditions.");
+            return 0;
+        }
+        tokens[count++] = token;
+    }
+    if (count == 0) {
+        return 1;
+    }
+    if (strcmp(tokens[0], "default") == 0 || strcmp(tokens[0], "on-timeout") == 0) {
+        policy_action_t* action = tokens[0][0] == 'd' ? &g_policy.default_action : &g_policy.timeout_action;
+        if (count != 2 || !policy_parse_action(tokens[1], action) || *action == POLICY_AUDIT) {
+            snprintf(error, error_size, "%s needs allow or deny.", tokens[0]);
+            return 0;
+        }
+        return 1;
+    }
+
+    if (g_policy.count == POLICY_RULES_MAX) {
+        snprintf(error, error_size, "More than %d rules.", POLICY_RULES_MAX);
+        return 0;
+    }
+    policy_rule_t* rule = &g_policy.rules[g_policy.count];
+    rule->line = number;
+    if (!policy_parse_action(tokens[0], &rule->action)) {
+        snprintf(error, error_size, "Unknown action \"%s\".", tokens[0]);
+        return 0;
+    }
+    if (count < 3) {
+        snprintf(error, error_size, "A rule needs an action, events and a path.");
+        return 0;
+    }
+    if (!policy_parse_events(tokens[1], &rule->events)) {
+        snprintf(error, error_size, "Events must be open, access, exec or all.");
+        return 0;
+    }
+    rule->has_pattern = strcmp(tokens[2], "*") != 0;
+    if (rule->has_pattern && regcomp(&rule->pattern, tokens[2], REG_EXTENDED | REG_NOSUB) != 0) {
+        snprintf(error, error_size, "\"%s\" is not a valid regex.", tokens[2]);
+        rule->has_pattern = 0;
+        return 0;
+    }
+    g_policy.count++;
+    for (int i = 3; i < count; i++) {
+        if (!policy_parse_condition(rule, tokens[i], error, error_size)) {
+            return 0;
+        }
+    }
+    g_policy.uses_process |= rule->process.count > 0;
+    g_policy.uses_exe |= rule->exe.count > 0;
+    g_policy.uses_cgroup |= rule->cgroup.count > 0;
+    g_policy.uses_exec |= (rule->events & POLICY_EVENT_EXEC) != 0;
+    return 1;
+}
+
+/**
+ * @brief Reads and compiles the policy, exits on error.
+ *
+ * @param path The policy file, NULL to leave the policy off.
+ * @param budget_us Time budget of one decision in microseconds.
+ */
+void policy_init(const char* path, int budget_us) {
+    char line[POLICY_LINE_MAX];
+    char error[256] = "";
+    int number = 0;
+    FILE* file;
+
+    if (path == NULL) {
+        return;
+    }
+    g_policy.budget_ns = (uint64_t)budget_us * 1000;
+    g_policy.default_action = POLICY_ALLOW;
+    g_policy.timeout_action = POLICY_ALLOW;
+    g_policy.rules = calloc(POLICY_RULES_MAX, sizeof(policy_rule_t));
+    g_policy.exes = calloc(POLICY_EXE_CACHE_SIZE, sizeof(policy_exe_entry_t));
+    g_policy.cache = calloc(POLICY_CACHE_ENTRIES, sizeof(policy_cache_entry_t));
+    if (g_policy.rules == NULL || g_policy.exes == NULL || g_policy.cache == NULL) {
+        log_message(ERROR, 1, "Unable to malloc for the policy\n");
+        exit(EXIT_FAILURE);
+    }
+    file = fopen(path, "r");
+    if (file == NULL) {
+        log_message(ERROR, 1, "--policy option: Failed to open \"%s\" (%s).\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        number++;
+        size_t len = strlen(line);
+        if (len == sizeof(line) - 1 && line[len - 1] != '\n') {
+            snprintf(error, sizeof(error), "Longer than %d characters.", POLICY_LINE_MAX - 2);
+        } else {
+            line[strcspn(line, "\r\n")] = '\0';
+            policy_parse_line(line, number, error, sizeof(error));
+        }
+        if (error[0] != '\0') {
+            log_message(ERROR, 1, "--policy option: \"%s\" line %d: %s\n", path, number, error);
+            exit(EXIT_FAILURE);
+        }
+    }
+    fclose(file);
+    g_policy.enabled = 1;
+    metrics_add_collector(collect_policy, NULL);
+    log_message(INFO, 1, "Policy of %d rules from \"%s\" (default %s, on-timeout %s after %dus)\n", g_policy.count, path,
+                policy_action_name(g_policy.default_action), policy_action_name(g_policy.timeout_action), budget_us);
+}
+
+// Finds the executable of a process, reading the path of /proc/<pid>/exe only when it changed
+static policy_exe_entry_t* policy_exe_of(int pid) {
+    policy_exe_entry_t* entry = &g_policy.exes[(unsigned int)pid & (POLICY_EXE_CACHE_SIZE - 1)];
+    char link[32];
+    struct stat st;
+
+    snprintf(link, sizeof(link), "/proc/%d/exe", pid);
+    if (stat(link, &st) != 0) {
+        st.st_dev = 0;
+        st.st_ino = 0;
+    }
+    if (entry->pid == pid && entry->ino != 0 && entry->dev == st.st_dev && entry->ino == st.st_ino) {
+        return entry;
+    }
+    entry->pid = pid;
+    entry->dev = st.st_dev;
+    entry->ino = st.st_ino;
+    entry->exe[0] = '\0';
+    if (g_policy.uses_exe) {
+        ssize_t len = readlink(link, entry->exe, sizeof(entry->exe));
+        entry->exe[len > 0 && len < (ssize_t)sizeof(entry->exe) ? len : 0] = '\0';
+    }
+    return entry;
+}
+
+static int policy_rule_matches(const policy_rule_t* rule, const char* comm, const policy_exe_entry_t* exe, const cgroup_id_entry_t* cgroup, const char* path) {
+    int found;
+
+    if (rule->process.count > 0) {
+        found = 0;
+        for (int i = 0; i < rule->process.count && !found; i++) {
+            found = strcmp(rule->processes[i], comm) == 0;
+        }
+        if (found == rule->process.negate) {
+            return 0;
+        }
+    }
+    if (rule->exe.count > 0) {
+        found = 0;
+        for (int i = 0; i < rule->exe.count && !found; i++) {
+            found = strcmp(rule->exes[i], exe->exe) == 0;
+        }
+        if (found == rule->exe.negate) {
+            return 0;
+        }
+    }
+    if (rule->cgroup.count > 0) {
+        found = cgroup != NULL && cgroup_path_matches(cgroup->path, (const char (*)[CGROUP_PATH_LEN])rule->cgroups, rule->cgroup.count);
+        if (found == rule->cgroup.negate) {
+            return 0;
+        }
+    }
+    return !rule->has_pattern || regexec(&rule->pattern, path, 0, NULL, 0) == 0;
+}
+
+static inline void policy_record(policy_decision_t* decision, uint64_t start) {
+    uint64_t elapsed = policy_clock_ns() - start;
+    int bucket = 0;
+
+    while (bucket < POLICY_LATENCY_BUCKETS && elapsed > policy_latency_bounds_ns[bucket]) {
+        bucket++;
+    }
+    __atomic_store_n(&g_policy.latency[bucket], g_policy.latency[bucket] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_policy.latency_sum_ns, g_policy.latency_sum_ns + elapsed, __ATOMIC_RELAXED);
+    metrics_inc(decision->action == POLICY_DENY ? METRIC_POLICY_DENY : (decision->action == POLICY_AUDIT ? METRIC_POLICY_AUDIT : METRIC_POLICY_ALLOW));
+}
+
+/**
+ * @brief Decides how to answer a permission event. Called by the read/write/execute thread.
+ *
+ * @param pid The PID of the event.
+ * @param comm The process name of the PID.
+ * @param path The path of the event, or NULL.
+ * @param path_hash hash_string() of path, or 0.
+ * @param mask The event mask.
+ * @param decision Set to the action, the rule that gave it and whether the budget ran out.
+ * @return policy_action_t The action, only POLICY_DENY is answered with FAN_DENY.
+ */
+policy_action_t policy_decide(int pid, const char* comm, const char* path, uint64_t path_hash, uint64_t mask, policy_decision_t* decision) {
+    uint64_t start = policy_clock_ns();
+    const cgroup_id_entry_t* cgroup = NULL;
+    int events = POLICY_EVENT_ACCESS;
+
+    decision->action = g_policy.default_action;
+    decision->rule = 0;
+    decision->timed_out = 0;
+    if (pid == getpid()) {
+        decision->action = POLICY_ALLOW;
+        return POLICY_ALLOW;
+    }
+    #ifdef FAN_OPEN_EXEC_PERM
+    if (mask & FAN_OPEN_EXEC_PERM) {
+        events = POLICY_EVENT_EXEC;
+    } else
+    #endif
+    if (mask & FAN_OPEN_PERM) {
+        events = POLICY_EVENT_OPEN;
+    }
+    if (path == NULL) {
+        path = "";
+    }
+    if (path_hash == 0) {
+        path_hash = hash_string(path);
+    }
+
+    // Who asks: the executable, and its name and cgroup when the rules look at them
+    policy_exe_entry_t* exe = policy_exe_of(pid);
+    uint64_t subject = (exe->ino ^ (exe->dev << 32) ^ (exe->dev >> 32)) * 0x9E3779B185EBCA87ULL;
+    if (g_policy.uses_process) {
+        subject = (subject ^ hash_string(comm)) * 0x9E3779B185EBCA87ULL;
+    }
+    if (g_policy.uses_cgroup) {
+        cgroup = cgroup_of(pid, comm);
+        subject = (subject ^ (cgroup ? cgroup->cgroup_id : 0)) * 0x9E3779B185EBCA87ULL;
+    }
+    subject |= 1;
+
+    // The open and then the reads of a file are decided apart, keep them in different entries
+    policy_cache_entry_t* entry = &g_policy.cache[((subject ^ path_hash ^ events) * 0x9E3779B185EBCA87ULL >> 32) & (POLICY_CACHE_ENTRIES - 1)];
+    if (entry->subject == subject && entry->path_hash == path_hash && entry->events == events) {
+        decision->action = entry->action;
+        decision->rule = entry->rule;
+        metrics_inc(METRIC_POLICY_CACHE_HITS);
+        policy_record(decision, start);
+        return decision->action;
+    }
+    metrics_inc(METRIC_POLICY_CACHE_MISSES);
+
+    for (int i = 0; i < g_policy.count; i++) {
+        const policy_rule_t* rule = &g_policy.rules[i];
+        if (!(rule->events & events)) {
+            continue;
+        }
+        if (policy_clock_ns() - start > g_policy.budget_ns) {
+            decision->action = g_policy.timeout_action;
+            decision->rule = 0;
+            decision->timed_out = 1;
+            metrics_inc(METRIC_POLICY_TIMEOUTS);
+            policy_record(decision, start);
+            return decision->action;
+        }
+        if (policy_rule_matches(rule, comm, exe, cgroup, path)) {
+            decision->action = rule->action;
+            decision->rule = rule->line;
+            break;
+        }
+    }
+    entry->subject = subject;
+    entry->path_hash = path_hash;
+    entry->events = events;
+    entry->action = decision->action;
+    entry->rule = decision->rule;
+    policy_record(decision, start);
+    return decision->action;
+}
+
+/**
+ * @brief Name of an action in the output.
+ *
+ * @param action The action.
+ * @return const char* "allow", "deny" or "audit".
+ */
+const char* policy_action_name(policy_action_t action) {
+    switch (action) {
+        case POLICY_DENY: return "deny";
+        case POLICY_AUDIT: return "audit";
+        default: return "allow";
+    }
+}
+
+/**
+ * @brief Formats a decision for the text log, as " {policy=deny rule=N}" or " {policy=allow timeout}".
+ *
+ * @param decision The decision.
+ * @param out The buffer.
+ * @param size The size of out.
+ * @return int The length written, as snprintf().
+ */
+int policy_format(const policy_decision_t* decision, char* out, size_t size) {
+    if (decision->timed_out) {
+        return snprintf(out, size, " {policy=%s timeout}", policy_action_name(decision->action));
+    }
+    return snprintf(out, size, " {policy=%s rule=%d}", policy_action_name(decision->action), decision->rule);
+}
+
+/**
+ * @brief Metrics collector for the decision latency of the policy.
+ *
+ * @param out The metrics output stream.
+ * @param arg Unused.
+ */
+void collect_policy(FILE* out, void* arg) {
+    uint64_t count = 0;
+    (void)arg;
+
+    fprintf(out, "# HELP filemon_policy_decision_seconds Time to decide how to answer a permission event.\n");
+    fprintf(out, "# TYPE filemon_policy_decision_seconds histogram\n");
+    for (int i = 0; i <= POLICY_LATENCY_BUCKETS; i++) {
+        count += __atomic_load_n(&g_policy.latency[i], __ATOMIC_RELAXED);
+        if (i < POLICY_LATENCY_BUCKETS) {
+            fprintf(out, "filemon_policy_decision_seconds_bucket{le=\"%g\"} %lu\n", policy_latency_bounds_ns[i] / 1e9, count);
+        } else {
+            fprintf(out, "filemon_policy_decision_seconds_bucket{le=\"+Inf\"} %lu\n", count);
+        }
+    }
+    fprintf(out, "filemon_policy_decision_seconds_sum %.9f\n", __atomic_load_n(&g_policy.latency_sum_ns, __ATOMIC_RELAXED) / 1e9);
+    fprintf(out, "filemon_policy_decision_seconds_count %lu\n", count);
+    metrics_write_gauge(out, "filemon_policy_rules", NULL, "Rules of the permission policy.", g_policy.count);
+}
+
+#endif
@@ -0,0 +1,71 @@
+#include <stdint.h>
+#include <time.h>
+
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * USDT probes for perf/bpftrace. Each probe has a semaphore that the tracer bumps when it
+ * attaches, so the timing around a probe is only taken while someone is listening.
+ *
+ *   filemon:batch_read     (group, bytes, read_ns)
+ *   filemon:event_accept   (group, pid, mask, path, stage_ns)
+ *   filemon:event_reject   (group, pid, mask, path, verdict, stage_ns)
+ *   filemon:perm_response  (pid, mask, path, response, stage_ns)
+ *   filemon:log_write      (group, pid, mask, path, write_ns)
+ *
+ * Without <sys/sdt.h> (systemtap-sdt-dev / systemtap-sdt-devel) every probe compiles to nothing.
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define FILEMON_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef FILEMON_HAVE_SDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define FILEMON_PROBE_SEMAPHORE(name) \
+    __extension__ unsigned short filemon_##name##_semaphore __attribute__((unused)) __attribute__((section(".probes")))
+
+FILEMON_PROBE_SEMAPHORE(batch_read);
+FILEMON_PROBE_SEMAPHORE(event_accept);
+FILEMON_PROBE_SEMAPHORE(event_reject);
+FILEMON_PROBE_SEMAPHORE(perm_response);
+FILEMON_PROBE_SEMAPHORE(log_write);
+
+#define FILEMON_PROBE_ENABLED(name) __builtin_expect(filemon_##name##_semaphore, 0)
+#define FILEMON_PROBES_ACTIVE() \
+    (FILEMON_PROBE_ENABLED(batch_read) || FILEMON_PROBE_ENABLED(event_accept) || \
+     FILEMON_PROBE_ENABLED(event_reject) || FILEMON_PROBE_ENABLED(perm_response) || \
+     FILEMON_PROBE_ENABLED(log_write))
+
+#define FILEMON_PROBE3(name, a1, a2, a3) STAP_PROBE3(filemon, name, a1, a2, a3)
+#define FILEMON_PROBE5(name, a1, a2, a3, a4, a5) STAP_PROBE5(filemon, name, a1, a2, a3, a4, a5)
+#define FILEMON_PROBE6(name, a1, a2, a3, a4, a5, a6) STAP_PROBE6(filemon, name, a1, a2, a3, a4, a5, a6)
+#else
+#define FILEMON_PROBE_ENABLED(name) 0
+#define FILEMON_PROBES_ACTIVE() 0
+// sizeof keeps the arguments referenced without evaluating them
+#define FILEMON_PROBE_UNUSED(a) (void)sizeof(a)
+#define FILEMON_PROBE3(name, a1, a2, a3) \
+    do { FILEMON_PROBE_UNUSED(a1); FILEMON_PROBE_UNUSED(a2); FILEMON_PROBE_UNUSED(a3); } while (0)
+#define FILEMON_PROBE5(name, a1, a2, a3, a4, a5) \
+    do { FILEMON_PROBE3(name, a1, a2, a3); FILEMON_PROBE_UNUSED(a4); FILEMON_PROBE_UNUSED(a5); } while (0)
+#define FILEMON_PROBE6(name, a1, a2, a3, a4, a5, a6) \
+    do { FILEMON_PROBE5(name, a1, a2, a3, a4, a5); FILEMON_PROBE_UNUSED(a6); } while (0)
+#endif
+
+/**
+ * @brief Monotonic clock in nanoseconds, used for probe stage latencies.
+ *
+ * @return uint64_t
+ */
+static inline uint64_t probe_clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif
@@ -0,0 +1,558 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <sys/fanotify.h>
+#include "wrappers.h"
+#include "logger.h"
+#include "metrics.h"
+
+#ifndef PROCESS_H
+#define PROCESS_H
+
+#define IDENTITY_CACHE_SIZE 256
+#define UNKNOWN_PROCESS "unknown-process"
+#define PROCTABLE_MAX_DEFAULT 4096
+#define PROCTABLE_MAX_MAX 262144
+#define PROCTABLE_SWEEP_NS 5000000000ULL
+#define PROCTABLE_SWEEP_BATCH 256       // Entries checked per call, a sweep is spread over the event loop
+#define PROC_EXE_LEN 256
+#define PROC_CMDLINE_LEN 256
+#define PROC_CGROUP_LEN 128
+
+// resolve_identity() results
+#define IDENTITY_UNRESOLVED 0
+#define IDENTITY_LIVE 1         // Read from /proc while the process was known to be alive
+#define IDENTITY_REMEMBERED 2   // Process already gone, taken from an earlier sighting
+
+#ifndef FAN_NOPIDFD
+#define FAN_NOPIDFD -1
+#endif
+#ifndef FAN_EPIDFD
+#define FAN_EPIDFD -2
+#endif
+// The group was created without FAN_REPORT_PIDFD
+#define PIDFD_NOT_REPORTED -3
+
+/*
+ * Who caused an event. With FAN_REPORT_PIDFD the kernel hands us a pidfd for the process at read
+ * time, which tells us whether /proc/<pid> still belongs to that process or the PID has been reused.
+ * Identities are remembered per thread in a small direct-mapped cache, so a PID seen repeatedly in
+ * one batch costs one /proc walk, and a process that has already been reaped can still be named
+ * from an earlier sighting.
+ */
+typedef struct {
+    int pid;
+    int ppid;
+    int uid;
+    int gid;
+    char comm[PROC_NAME_LEN];
+} proc_identity_t;
+
+typedef struct {
+    proc_identity_t identity;
+    uint64_t batch;
+} identity_cache_entry_t;
+
+/*
+ * Process table for --lineage. One entry per live process, shared by both event threads, holding
+ * what is too expensive to read per event: exe, cmdline and cgroup. An entry is filled the first
+ * time the process is seen alive and refilled when it execs (FAN_OPEN_EXEC) or when its comm/ppid
+ * no longer match, which is how a reused PID shows up. Exited processes are swept out every few
+ * seconds, PROCTABLE_SWEEP_BATCH entries per turn of the event loop and without holding the lock
+ * while /proc is checked, and the least recently seen entry is evicted when the table is full.
+ */
+typedef struct {
+    proc_identity_t identity;
+    char exe[PROC_EXE_LEN];
+    char cmdline[PROC_CMDLINE_LEN];
+    char cgroup[PROC_CGROUP_LEN];
+    int bucket_next;
+    int lru_prev;
+    int lru_next;
+} proc_entry_t;
+
+typedef struct ProcTable {
+    int enabled;
+    int max;
+    int count;
+    int buckets_mask;
+    int* buckets;
+    proc_entry_t* entries;
+    int free_head;
+    int lru_head;
+    int lru_tail;
+    uint64_t last_sweep_ns;
+    int sweep_next;                 // Next entry of the sweep in progress, max between sweeps
+    pthread_mutex_t lock;
+} proctable_t;
+
+__thread identity_cache_entry_t t_identity_cache[IDENTITY_CACHE_SIZE];
+__thread uint64_t t_identity_batch = 1;
+proctable_t g_proctable = { .enabled = 0 };
+
+int event_pidfd(const struct fanotify_event_metadata* metadata);
+void identity_batch_begin();
+int resolve_identity(int pid, int pidfd, proc_identity_t* identity);
+void close_pidfds(int* pidfds, int count);
+void proctable_init(int max);
+void proctable_observe(const proc_identity_t* identity, uint64_t mask);
+int proctable_format(int pid, char* out, size_t size);
+int proctable_lookup(int pid, proc_entry_t* entry);
+int proctable_identity(int pid, proc_identity_t* identity);
+void proctable_sweep();
+
+/**
+ * @brief Finds the pidfd info record of an event.
+ *
+ * @param metadata The fanotify event.
+ * @return int The pidfd, FAN_NOPIDFD / FAN_EPIDFD as reported by the kernel, or PIDFD_NOT_REPORTED
+ *             if the event has no pidfd record.
+ */
+int event_pidfd(const struct fanotify_event_metadata* metadata) {
+    #ifdef FAN_EVENT_INFO_TYPE_PIDFD
+    const char* info = (const char*)metadata + metadata->metadata_len;
+    const char* end = (const char*)metadata + metadata->event_len;
+
+    while (info + sizeof(struct fanotify_event_info_header) <= end) {
+        const struct fanotify_event_info_header* hdr = (const struct fanotify_event_info_header*)info;
+        if (hdr->len == 0) {
+            break;
+        }
+        if (hdr->info_type == FAN_EVENT_INFO_TYPE_PIDFD) {
+            return ((const struct fanotify_event_info_pidfd*)hdr)->pidfd;
+        }
+        info += hdr->len;
+    }
+    #else
+    (void)metadata;
+    #endif
+    return PIDFD_NOT_REPORTED;
+}
+
+/**
+ * @brief Starts a new read batch. Cache entries from earlier batches are only trusted for reaped processes.
+ */
+void identity_batch_begin() {
+    t_identity_batch++;
+}
+
+static int pidfd_alive(int pidfd) {
+    if (pidfd < 0) {
+        // No pidfd to check against, trust /proc like before
+        return 1;
+    }
+    #ifdef SYS_pidfd_send_signal
+    return syscall(SYS_pidfd_send_signal, pidfd, 0, NULL, 0) == 0;
+    #else
+    return 1;
+    #endif
+}
+
+static int read_proc_identity(int pid, proc_identity_t* identity) {
+    char path[32];
+    char line[128];
+    int dir_fd, fd;
+    ssize_t len;
+    FILE* status;
+
+    snprintf(path, sizeof(path), "/proc/%d", pid);
+    dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1) {
+        return 0;
+    }
+    metrics_inc(METRIC_PROC_READS);
+
+    fd = openat(dir_fd, "comm", O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        close(dir_fd);
+        return 0;
+    }
+    len = read(fd, identity->comm, PROC_NAME_LEN - 1);
+    close(fd);
+    if (len <= 0) {
+        close(dir_fd);
+        return 0;
+    }
+    identity->comm[len] = '\0';
+    identity->comm[strcspn(identity->comm, "\n")] = '\0';
+
+    identity->ppid = -1;
+    identity->uid = -1;
+    identity->gid = -1;
+    fd = openat(dir_fd, "status", O_RDONLY | O_CLOEXEC);
+    close(dir_fd);
+    if (fd != -1) {
+        status = fdopen(fd, "r");
+        if (status == NULL) {
+            close(fd);
+        } else {
+            while (fgets(line, sizeof(line), status) && (identity->uid == -1 || identity->gid == -1)) {
+                if (sscanf(line, "PPid: %d", &identity->ppid) != 1 && sscanf(line, "Uid: %d", &identity->uid) != 1) {
+                    sscanf(line, "Gid: %d", &identity->gid);
+                }
+            }
+            fclose(status);
+        }
+    }
+    identity->pid = pid;
+    return 1;
+}
+
+/**
+ * @brief Resolves the name and credentials of the process behind an event.
+ *
+ * @param pid The PID from the event.
+ * @param pidfd The pidfd from the event, or FAN_NOPIDFD / FAN_EPIDFD.
+ * @param identity Filled in. The name is "unknown-process" if it could not be resolved.
+ * @return int IDENTITY_LIVE, IDENTITY_REMEMBERED or IDENTITY_UNRESOLVED.
+ */
+int resolve_identity(int pid, int pidfd, proc_identity_t* identity) {
+    identity_cache_entry_t* entry = &t_identity_cache[(unsigned int)pid % IDENTITY_CACHE_SIZE];
+
+    if (entry->identity.pid == pid && entry->batch == t_identity_batch) {
+        *identity = entry->identity;
+        return IDENTITY_LIVE;
+    }
+
+    // FAN_NOPIDFD means the process was reaped before the event was read, so /proc/<pid> is either
+    // gone or belongs to someone else. Without a pidfd we cannot tell and read /proc as before.
+    // A pidfd that is still alive after the read proves /proc/<pid> was that process all along.
+    if (pidfd != FAN_NOPIDFD && read_proc_identity(pid, identity) && pidfd_alive(pidfd)) {
+        entry->identity = *identity;
+        entry->batch = t_identity_batch;
+        return IDENTITY_LIVE;
+    }
+
+    if (entry->identity.pid == pid) {
+        *identity = entry->identity;
+        return IDENTITY_REMEMBERED;
+    }
+
+    metrics_inc(METRIC_PROCESS_UNRESOLVED);
+    identity->pid = pid;
+    identity->ppid = -1;
+    identity->uid = -1;
+    identity->gid = -1;
+    strncpy(identity->comm, UNKNOWN_PROCESS, PROC_NAME_LEN);
+    return IDENTITY_UNRESOLVED;
+}
+
+/**
+ * @brief Closes the pidfds collected over one read batch.
+ *
+ * @param pidfds The pidfds.
+ * @param count Number of pidfds.
+ */
+void close_pidfds(int* pidfds, int count) {
+    for (int i = 0; i < count; i++) {
+        close(pidfds[i]);
+    }
+}
+
+/**
+ * @brief Enables the process table.
+ *
+ * @param max Maximum number of processes kept.
+ */
+void proctable_init(int max) {
+    int buckets = 1;
+    while (buckets < max * 2) {
+        buckets <<= 1;
+    }
+
+    g_proctable.enabled = 1;
+    g_proctable.max = max;
+    g_proctable.count = 0;
+    g_proctable.buckets_mask = buckets - 1;
+    g_proctable.buckets = (int*)malloc(buckets * sizeof(int));
+    g_proctable.entries = (proc_entry_t*)calloc(max, sizeof(proc_entry_t));
+    if (g_proctable.buckets == NULL || g_proctable.entries == NULL) {
+        log_message(ERROR, 1, "Failed to allocate memory to process table\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < buckets; i++) {
+        g_proctable.buckets[i] = -1;
+    }
+    for (int i = 0; i < max; i++) {
+        g_proctable.entries[i].bucket_next = i + 1 < max ? i + 1 : -1;
+    }
+    g_proctable.free_head = 0;
+    g_proctable.lru_head = -1;
+    g_proctable.lru_tail = -1;
+    g_proctable.last_sweep_ns = 0;
+    g_proctable.sweep_next = max;
+    pthread_mutex_init(&g_proctable.lock, NULL);
+}
+
+static inline int proctable_bucket(int pid) {
+    return ((uint32_t)pid * 2654435761U) & g_proctable.buckets_mask;
+}
+
+static int proctable_find(int pid) {
+    int index = g_proctable.buckets[proctable_bucket(pid)];
+    while (index != -1 && g_proctable.entries[index].identity.pid != pid) {
+        index = g_proctable.entries[index].bucket_next;
+    }
+    return index;
+}
+
+static void proctable_lru_unlink(int index) {
+    proc_entry_t* e = &g_proctable.entries[index];
+    if (e->lru_prev != -1) {
+        g_proctable.entries[e->lru_prev].lru_next = e->lru_next;
+    } else {
+        g_proctable.lru_head = e->lru_next;
+    }
+    if (e->lru_next != -1) {
+        g_proctable.entries[e->lru_next].lru_prev = e->lru_prev;
+    } else {
+        g_proctable.lru_tail = e->lru_prev;
+    }
+}
+
+static void proctable_lru_push_front(int index) {
+    proc_entry_t* e = &g_proctable.entries[index];
+    e->lru_prev = -1;
+    e->lru_next = g_proctable.lru_head;
+    if (g_proctable.lru_head != -1) {
+        g_proctable.entries[g_proctable.lru_head].lru_prev = index;
+    }
+    g_proctable.lru_head = index;
+    if (g_proctable.lru_tail == -1) {
+        g_proctable.lru_tail = index;
+    }
+}
+
+static void proctable_remove(int index) {
+    proc_entry_t* e = &g_proctable.entries[index];
+    int* link = &g_proctable.buckets[proctable_bucket(e->identity.pid)];
+    while (*link != index) {
+        link = &g_proctable.entries[*link].bucket_next;
+    }
+    *link = e->bucket_next;
+    proctable_lru_unlink(index);
+    e->identity.pid = 0;
+    e->bucket_next = g_proctable.free_head;
+    g_proctable.free_head = index;
+    g_proctable.count--;
+}
+
+static ssize_t read_proc_file(int pid, const char* name, char* buf, size_t size) {
+    char path[64];
+    ssize_t len = -1;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%d/%s", pid, name);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        len = read(fd, buf, size - 1);
+        close(fd);
+    }
+    if (len < 0) {
+        len = 0;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+static void proctable_fill(proc_entry_t* e) {
+    char path[64];
+    char cgroups[512];
+    ssize_t len;
+    int pid = e->identity.pid;
+
+    snprintf(path, sizeof(path), "/proc/%d/exe", pid);
+    len = readlink(path, e->exe, sizeof(e->exe) - 1);
+    e->exe[len > 0 ? len : 0] = '\0';
+
+    // Arguments are NUL separated, join them with spaces
+    len = read_proc_file(pid, "cmdline", e->cmdline, sizeof(e->cmdline));
+    for (ssize_t i = 0; i < len; i++) {
+        if (e->cmdline[i] == '\0') {
+            e->cmdline[i] = ' ';
+        } else if (e->cmdline[i] == '"') {
+            e->cmdline[i] = '\'';
+        }
+    }
+    while (len > 0 && e->cmdline[len - 1] == ' ') {
+        len--;
+    }
+    e->cmdline[len] = '\0';
+
+    // cgroup v2 has a single "0::/path" line, with v1 take the first hierarchy
+    e->cgroup[0] = '\0';
+    read_proc_file(pid, "cgroup", cgroups, sizeof(cgroups));
+    char* line = strstr(cgroups, "0::");
+    if (line == NULL) {
+        line = strchr(cgroups, ':');
+        line = line ? strchr(line + 1, ':') : NULL;
+    } else {
+        line += 2;
+    }
+    if (line != NULL) {
+        line++;
+        line[strcspn(line, "\n")] = '\0';
+        strncpy(e->cgroup, line, sizeof(e->cgroup) - 1);
+        e->cgroup[sizeof(e->cgroup) - 1] = '\0';
+    }
+}
+
+/**
+ * @brief Records a process seen alive. Only the first sighting, an exec or a reused PID reads /proc.
+ *
+ * @param identity The live identity from resolve_identity().
+ * @param mask The event mask.
+ */
+void proctable_observe(const proc_identity_t* identity, uint64_t mask) {
+    pthread_mutex_lock(&g_proctable.lock);
+    int index = proctable_find(identity->pid);
+    int refill = 0;
+
+    #ifdef FAN_OPEN_EXEC
+    refill = (mask & FAN_OPEN_EXEC) != 0;
+    #else
+    (void)mask;
+    #endif
+
+    if (index == -1) {
+        if (g_proctable.free_head == -1) {
+            metrics_inc(METRIC_PROCTABLE_EVICTIONS);
+            proctable_remove(g_proctable.lru_tail);
+        }
+        index = g_proctable.free_head;
+        g_proctable.free_head = g_proctable.entries[index].bucket_next;
+        g_proctable.entries[index].bucket_next = g_proctable.buckets[proctable_bucket(identity->pid)];
+        g_proctable.buckets[proctable_bucket(identity->pid)] = index;
+        g_proctable.count++;
+        refill = 1;
+    } else {
+        proc_entry_t* e = &g_proctable.entries[index];
+        if (e->identity.ppid != identity->ppid || strcmp(e->identity.comm, identity->comm) != 0) {
+            refill = 1;
+        }
+        proctable_lru_unlink(index);
+    }
+    proctable_lru_push_front(index);
+
+    proc_entry_t* e = &g_proctable.entries[index];
+    e->identity = *identity;
+    if (refill) {
+        metrics_inc(METRIC_PROCTABLE_MISSES);
+        proctable_fill(e);
+    } else {
+        metrics_inc(METRIC_PROCTABLE_HITS);
+    }
+    pthread_mutex_unlock(&g_proctable.lock);
+}
+
+/**
+ * @brief Formats the lineage fields of a process for the log line.
+ *
+ * @param pid The PID.
+ * @param out The output buffer.
+ * @param size Size of the output buffer.
+ * @return int Number of characters written.
+ */
+int proctable_format(int pid, char* out, size_t size) {
+    proc_entry_t e;
+    int len;
+    if (!proctable_lookup(pid, &e)) {
+        len = snprintf(out, size, " {lineage=unknown}");
+    } else {
+        len = snprintf(out, size, " {ppid=%d uid=%d exe=%s cgroup=%s cmdline=\"%s\"}",
+                       e.identity.ppid, e.identity.uid, e.exe, e.cgroup, e.cmdline);
+    }
+    return len < (int)size ? len : (int)size - 1;
+}
+
+/**
+ * @brief Copies the lineage fields of a process out of the table.
+ *
+ * @param pid The PID.
+ * @param entry Set to the entry of the process.
+ * @return int 1 if the process is in the table, 0 otherwise.
+ */
+int proctable_lookup(int pid, proc_entry_t* entry) {
+    pthread_mutex_lock(&g_proctable.lock);
+    int index = proctable_find(pid);
+    if (index != -1) {
+        *entry = g_proctable.entries[index];
+    }
+    pthread_mutex_unlock(&g_proctable.lock);
+    return index != -1;
+}
+
+/**
+ * @brief Names a process that the other event thread saw alive but this one did not.
+ *
+ * @param pid The PID.
+ * @param identity Filled in if the process is in the table.
+ * @return int 1 if found, 0 otherwise.
+ */
+int proctable_identity(int pid, proc_identity_t* identity) {
+    pthread_mutex_lock(&g_proctable.lock);
+    int index = proctable_find(pid);
+    if (index != -1) {
+        *identity = g_proctable.entries[index].identity;
+    }
+    pthread_mutex_unlock(&g_proctable.lock);
+    return index != -1;
+}
+
+/**
+ * @brief Drops processes that have exited. A sweep starts at most once every PROCTABLE_SWEEP_NS
+ *        and each call checks the next PROCTABLE_SWEEP_BATCH entries of it. Called from one thread.
+ */
+void proctable_sweep() {
+    int indexes[PROCTABLE_SWEEP_BATCH];
+    int pids[PROCTABLE_SWEEP_BATCH];
+    char path[32];
+    int count = 0, i;
+
+    if (g_proctable.sweep_next >= g_proctable.max) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        uint64_t now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        if (now - g_proctable.last_sweep_ns < PROCTABLE_SWEEP_NS) {
+            return;
+        }
+        g_proctable.last_sweep_ns = now;
+        g_proctable.sweep_next = 0;
+    }
+
+    pthread_mutex_lock(&g_proctable.lock);
+    for (i = g_proctable.sweep_next; i < g_proctable.max && count < PROCTABLE_SWEEP_BATCH; i++) {
+        if (g_proctable.entries[i].identity.pid != 0) {
+            indexes[count] = i;
+            pids[count++] = g_proctable.entries[i].identity.pid;
+        }
+    }
+    g_proctable.sweep_next = i;
+    pthread_mutex_unlock(&g_proctable.lock);
+
+    // The event threads keep using the table while /proc is checked
+    for (i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "/proc/%d", pids[i]);
+        if (access(path, F_OK) == 0) {
+            pids[i] = 0;
+        }
+    }
+
+    pthread_mutex_lock(&g_proctable.lock);
+    for (i = 0; i < count; i++) {
+        // The entry may have been evicted or taken over in the meantime
+        if (pids[i] != 0 && g_proctable.entries[indexes[i]].identity.pid == pids[i]) {
+            proctable_remove(indexes[i]);
+        }
+    }
+    pthread_mutex_unlock(&g_proctable.lock);
+}
+
+#endif
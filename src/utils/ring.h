@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <filemon_ring.h>
+#include "logger.h"
+#include "metrics.h"
+#include "output.h"
+
+#ifndef RING_H
+#define RING_H
+
+#define RING_SIZE_DEFAULT 16           // MB
+#define RING_SIZE_MAX 4096             // MB
+#define RING_CHECK_INTERVAL_NS 1000000000ULL
+
+/*
+ * Shared-memory event ring (--ring NAME), every emitted event is also appended to /dev/shm/NAME
+ * for consumers built on include/filemon_ring.h. An event costs a copy into the mapping and two
+ * stores, no syscall and no allocation. filemon never waits for a consumer: when the ring is full
+ * the oldest records are overwritten, and consumers that were still reading them find out from the
+ * tail. Consumers publish their read position and lost count in the header, ring_check_consumers()
+ * looks at them once a second to report consumers that fall behind and to free the slots of
+ * consumers that died without closing.
+ */
+typedef struct Ring {
+    int enabled;
+    char name[NAME_MAX];
+    filemon_ring_header_t* header;
+    char* data;
+    size_t map_size;
+    uint64_t mask;
+    uint64_t seq;
+    uint64_t last_check_ns;
+    struct {
+        uint32_t pid;              // Consumer the rest belongs to
+        uint64_t lost;             // Already reported
+        int stalled;
+    } checked[FILEMON_RING_CONSUMERS_MAX];
+    pthread_mutex_t lock;          // Both reader threads publish
+} ring_t;
+
+void ring_init(const char* name, int size_mb);
+void ring_publish(const event_t* event);
+void ring_check_consumers();
+void ring_stop();
+void collect_ring(FILE* out, void* arg);
+
+ring_t g_ring = { .enabled = 0, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static inline uint64_t ring_clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Creates the ring in /dev/shm, replacing one left behind by an earlier filemon.
+ *
+ * @param name Name of the shared memory object, or NULL to not publish events.
+ * @param size_mb Size of the data area in MB, rounded up to a power of two.
+ */
+void ring_init(const char* name, int size_mb) {
+    uint64_t capacity = 1;
+    size_t header_size = (sizeof(filemon_ring_header_t) + 4095) & ~(size_t)4095;
+    int fd;
+
+    if (name == NULL) {
+        return;
+    }
+    snprintf(g_ring.name, sizeof(g_ring.name), "/%s", name[0] == '/' ? name + 1 : name);
+    if (strchr(g_ring.name + 1, '/') != NULL || g_ring.name[1] == '\0') {
+        log_message(ERROR, 1, "--ring option: \"%s\" is not a valid name, it cannot contain '/'.\n", name);
+        exit(EXIT_FAILURE);
+    }
+    while (capacity < (uint64_t)size_mb * 1024 * 1024) {
+        capacity <<= 1;
+    }
+
+    // Consumers still mapping the old ring keep it, they just see no new records
+    shm_unlink(g_ring.name);
+    fd = shm_open(g_ring.name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        log_message(ERROR, 1, "Unable to create ring /dev/shm%s (%s)\n", g_ring.name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    g_ring.map_size = header_size + capacity;
+    if (ftruncate(fd, g_ring.map_size) == -1) {
+        log_message(ERROR, 1, "Unable to size ring /dev/shm%s (%s)\n", g_ring.name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    g_ring.header = mmap(NULL, g_ring.map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (g_ring.header == MAP_FAILED) {
+        log_message(ERROR, 1, "Unable to map ring /dev/shm%s (%s)\n", g_ring.name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    g_ring.data = (char*)g_ring.header + header_size;
+    g_ring.mask = capacity - 1;
+    g_ring.seq = 0;
+    g_ring.header->version = FILEMON_RING_VERSION;
+    g_ring.header->header_size = header_size;
+    g_ring.header->capacity = capacity;
+    g_ring.header->producer_pid = getpid();
+    __atomic_store_n(&g_ring.header->magic, FILEMON_RING_MAGIC, __ATOMIC_RELEASE);
+    g_ring.enabled = 1;
+    metrics_add_collector(collect_ring, NULL);
+    log_message(INFO, 1, "Publishing events to ring /dev/shm%s (%luMB)\n", g_ring.name, capacity >> 20);
+}
+
+/**
+ * @brief Appends an event to the ring, overwriting the oldest records if there is no room.
+ *
+ * @param event The event.
+ */
+void ring_publish(const event_t* event) {
+    filemon_ring_header_t* header = g_ring.header;
+    filemon_record_t* record;
+    struct timespec now;
+    size_t comm_len = strlen(event->comm);
+    size_t path_len = strlen(event->path);
+    size_t old_path_len = event->old_path ? strlen(event->old_path) : 0;
+    uint32_t size = (sizeof(filemon_record_t) + comm_len + path_len + old_path_len + 3 + 7) & ~7U;
+    uint64_t head, tail, end, pad;
+    char* p;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    pthread_mutex_lock(&g_ring.lock);
+    head = header->head;
+    tail = header->tail;
+    // A record never wraps, the rest of the data area is padded instead
+    pad = g_ring.mask + 1 - (head & g_ring.mask);
+    pad = pad < size ? pad : 0;
+    end = head + pad + size;
+
+    // Retire the records in the way before touching their bytes, so readers can tell
+    if (end - tail > g_ring.mask + 1) {
+        while (end - tail > g_ring.mask + 1) {
+            tail += ((filemon_record_t*)(g_ring.data + (tail & g_ring.mask)))->size;
+        }
+        __atomic_store_n(&header->tail, tail, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+    if (pad) {
+        record = (filemon_record_t*)(g_ring.data + (head & g_ring.mask));
+        record->size = pad;
+        record->type = FILEMON_RECORD_PAD;
+        head += pad;
+    }
+    record = (filemon_record_t*)(g_ring.data + (head & g_ring.mask));
+    record->size = size;
+    record->type = FILEMON_RECORD_EVENT;
+    record->group = event->group == GROUP_READ_WRITE_EXECUTE ? FILEMON_GROUP_READ_WRITE_EXECUTE : FILEMON_GROUP_CREATE_DELETE_MOVE;
+    record->seq = ++g_ring.seq;
+    record->time_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    record->mask = event->mask;
+    record->pid = event->pid;
+    record->comm_len = comm_len;
+    record->path_len = path_len;
+    record->old_path_len = old_path_len;
+    p = (char*)(record + 1);
+    memcpy(p, event->comm, comm_len + 1);
+    p += comm_len + 1;
+    memcpy(p, event->path, path_len + 1);
+    p += path_len + 1;
+    if (event->old_path) {
+        memcpy(p, event->old_path, old_path_len + 1);
+    }
+    __atomic_store_n(&header->records, g_ring.seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&header->head, end, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_ring.lock);
+}
+
+/**
+ * @brief Reports consumers that lost events or stopped reading, and frees the slots of dead ones.
+ *
+ */
+void ring_check_consumers() {
+    filemon_ring_header_t* header = g_ring.header;
+    uint64_t now = ring_clock_ns();
+    uint64_t tail;
+
+    if (now - g_ring.last_check_ns < RING_CHECK_INTERVAL_NS) {
+        return;
+    }
+    g_ring.last_check_ns = now;
+    tail = __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < FILEMON_RING_CONSUMERS_MAX; i++) {
+        filemon_ring_slot_t* slot = &header->consumers[i];
+        uint32_t pid = __atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE);
+        if (pid != g_ring.checked[i].pid) {
+            g_ring.checked[i].pid = pid;
+            g_ring.checked[i].lost = 0;
+            g_ring.checked[i].stalled = 0;
+        }
+        if (pid == 0) {
+            continue;
+        }
+        if (kill(pid, 0) == -1 && errno == ESRCH) {
+            log_message(DEBUG, 1, "Ring consumer %s(%u) exited without closing, freeing its slot\n", slot->name, pid);
+            __atomic_compare_exchange_n(&slot->pid, &pid, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+            continue;
+        }
+        uint64_t lost = __atomic_load_n(&slot->lost, __ATOMIC_RELAXED);
+        uint64_t position = __atomic_load_n(&slot->position, __ATOMIC_RELAXED);
+        if (lost > g_ring.checked[i].lost) {
+            log_message(WARNING, 1, "Ring consumer %s(%u) is too slow, it was lapped and lost %lu events\n", slot->name, pid, lost - g_ring.checked[i].lost);
+            g_ring.checked[i].lost = lost;
+        } else if (position < tail && !g_ring.checked[i].stalled) {
+            // Lapped but not reading, so it has not counted what it lost yet
+            log_message(WARNING, 1, "Ring consumer %s(%u) stopped reading, it was lapped\n", slot->name, pid);
+        }
+        g_ring.checked[i].stalled = position < tail;
+    }
+}
+
+/**
+ * @brief Removes the ring from /dev/shm, consumers that still map it keep reading what is left.
+ *
+ */
+void ring_stop() {
+    if (!g_ring.enabled) {
+        return;
+    }
+    g_ring.enabled = 0;
+    shm_unlink(g_ring.name);
+}
+
+/**
+ * @brief Metrics collector for the ring and the lag of each consumer.
+ *
+ * @param out The response.
+ * @param arg Unused.
+ */
+void collect_ring(FILE* out, void* arg) {
+    static const char* const helps[2] = {
+        "Bytes written to the ring that the consumer has not read yet.",
+        "Records the consumer lost because it was lapped.",
+    };
+    filemon_ring_header_t* header = g_ring.header;
+    uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    char labels[128];
+
+    (void)arg;
+    metrics_write_gauge(out, "filemon_ring_records", NULL, "Events written to the shared-memory ring since startup.", __atomic_load_n(&header->records, __ATOMIC_RELAXED));
+    metrics_write_gauge(out, "filemon_ring_capacity_bytes", NULL, "Size of the data area of the ring.", header->capacity);
+    // Samples of a metric stay together, one pass over the slots per metric
+    for (int metric = 0; metric < 2; metric++) {
+        int first = 1;
+        for (int i = 0; i < FILEMON_RING_CONSUMERS_MAX; i++) {
+            filemon_ring_slot_t* slot = &header->consumers[i];
+            uint32_t pid = __atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE);
+            char name[FILEMON_RING_NAME_LEN];
+            if (pid == 0) {
+                continue;
+            }
+            // The name comes from the consumer, keep it out of the label syntax
+            for (int j = 0; j < FILEMON_RING_NAME_LEN; j++) {
+                name[j] = slot->name[j] == '"' || slot->name[j] == '\\' || slot->name[j] == '\n' ? '_' : slot->name[j];
+            }
+            name[FILEMON_RING_NAME_LEN - 1] = '\0';
+            snprintf(labels, sizeof(labels), "consumer=\"%s\",pid=\"%u\"", name, pid);
+            if (metric == 0) {
+                uint64_t position = __atomic_load_n(&slot->position, __ATOMIC_RELAXED);
+                metrics_write_gauge(out, "filemon_ring_consumer_lag_bytes", labels, first ? helps[0] : NULL, head > position ? head - position : 0);
+            } else {
+                metrics_write_gauge(out, "filemon_ring_consumer_lost_records", labels, first ? helps[1] : NULL, __atomic_load_n(&slot->lost, __ATOMIC_RELAXED));
+            }
+            first = 0;
+        }
+    }
+}
+
+#endif
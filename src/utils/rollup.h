@@ -0,0 +1,442 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <filemon_rollup.h>
+#include "logger.h"
+#include "metrics.h"
+#include "output.h"
+
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#define ROLLUP_KEYS_MAX 65536          // Distinct (directory, process, type) per minute
+#define ROLLUP_STRINGS_MAX (1 << 17)   // Distinct directories and process names per day
+#define ROLLUP_TYPES 64
+#define ROLLUP_OTHER "(other)"         // Counted under this name once a limit is reached
+
+/*
+ * Per-minute rollup sink (--rollup DIR), see include/filemon_rollup.h for the file layout.
+ * Events of the current minute are counted in memory per (directory, process, type). When the
+ * minute is over, the new dictionary strings and the counts go to the day file with a single
+ * writev(), from whichever thread sees the new minute first. Memory is bounded: past
+ * ROLLUP_KEYS_MAX keys in a minute, or ROLLUP_STRINGS_MAX names in a day, events are counted
+ * under "(other)" for their type.
+ */
+typedef struct {
+    uint32_t directory;
+    uint32_t process;
+    uint32_t count;
+    uint8_t type;
+} rollup_key_t;
+
+typedef struct {
+    uint64_t hash;
+    uint32_t id;                   // + 1, 0 if the slot is free
+} rollup_string_t;
+
+typedef struct Rollup {
+    int enabled;
+    char directory[PATH_MAX];
+    int fd;
+    int64_t day;
+    int64_t minute;                // Since the epoch, of the counts in memory
+    off_t file_size;               // Cut back to this if a write fails half way
+    rollup_key_t* keys;
+    uint32_t key_count;
+    uint32_t* key_slots;           // Open addressing, key index + 1, 0 if empty
+    uint32_t overflow[ROLLUP_TYPES];
+    rollup_string_t* strings;      // Open addressing on the hash of the name
+    uint32_t string_count;
+    uint32_t other;                // Id of "(other)", UINT32_MAX until it is needed
+    char* pending;                 // Strings not written yet, in the file format
+    size_t pending_len;
+    size_t pending_size;
+    uint32_t pending_count;
+    filemon_rollup_record_t* records;
+    uint64_t bytes_written;
+    uint64_t write_errors;
+    pthread_mutex_t lock;          // Both reader threads count
+} rollup_t;
+
+void rollup_init(const char* directory);
+void rollup_record(const event_t* event);
+void rollup_tick();
+void rollup_stop();
+void collect_rollup(FILE* out, void* arg);
+
+rollup_t g_rollup = { .enabled = 0, .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+#define ROLLUP_KEY_SLOTS (ROLLUP_KEYS_MAX * 2)
+#define ROLLUP_STRING_SLOTS (ROLLUP_STRINGS_MAX * 2)
+
+// Adds a name to the dictionary of the day file, it is written with the next flush
+static uint32_t rollup_add_string(uint64_t hash, uint32_t slot, const char* str, size_t len) {
+    size_t need = sizeof(uint16_t) + len + 1;
+    uint16_t len16 = len;
+
+    if (g_rollup.pending_len + need > g_rollup.pending_size) {
+        size_t size = g_rollup.pending_size * 2 > g_rollup.pending_len + need ? g_rollup.pending_size * 2 : g_rollup.pending_len + need;
+        char* pending = realloc(g_rollup.pending, size);
+        if (pending == NULL) {
+            return g_rollup.other;
+        }
+        g_rollup.pending = pending;
+        g_rollup.pending_size = size;
+    }
+    memcpy(g_rollup.pending + g_rollup.pending_len, &len16, sizeof(len16));
+    memcpy(g_rollup.pending + g_rollup.pending_len + sizeof(len16), str, len);
+    g_rollup.pending[g_rollup.pending_len + sizeof(len16) + len] = '\0';
+    g_rollup.pending_len += need;
+    g_rollup.pending_count++;
+    g_rollup.strings[slot].hash = hash;
+    g_rollup.strings[slot].id = g_rollup.string_count + 1;
+    return g_rollup.string_count++;
+}
+
+static uint32_t rollup_find_string(uint64_t hash, uint32_t* slot) {
+    *slot = (uint32_t)hash & (ROLLUP_STRING_SLOTS - 1);
+    while (g_rollup.strings[*slot].id != 0) {
+        if (g_rollup.strings[*slot].hash == hash) {
+            return g_rollup.strings[*slot].id - 1;
+        }
+        *slot = (*slot + 1) & (ROLLUP_STRING_SLOTS - 1);
+    }
+    return UINT32_MAX;
+}
+
+// Id of a name, names are identified by their 64-bit hash like in the summary tables
+static uint32_t rollup_string(const char* str, size_t len) {
+    uint64_t hash = hash_bytes(str, len);
+    uint32_t slot;
+    uint32_t id = rollup_find_string(hash, &slot);
+
+    if (id != UINT32_MAX) {
+        return id;
+    }
+    if (len > UINT16_MAX || g_rollup.string_count >= ROLLUP_STRINGS_MAX) {
+        if (g_rollup.other == UINT32_MAX) {
+            hash = hash_bytes(ROLLUP_OTHER, strlen(ROLLUP_OTHER));
+            g_rollup.other = rollup_find_string(hash, &slot);
+            if (g_rollup.other == UINT32_MAX) {
+                g_rollup.other = rollup_add_string(hash, slot, ROLLUP_OTHER, strlen(ROLLUP_OTHER));
+            }
+        }
+        return g_rollup.other;
+    }
+    return rollup_add_string(hash, slot, str, len);
+}
+
+static void rollup_count(uint32_t directory, uint32_t process, int type) {
+    uint64_t hash = ((uint64_t)directory * 0x9e3779b97f4a7c15ULL) ^ ((uint64_t)process * 0xc2b2ae3d27d4eb4fULL) ^ type;
+    uint32_t slot = (uint32_t)(hash ^ (hash >> 32)) & (ROLLUP_KEY_SLOTS - 1);
+    rollup_key_t* key;
+
+    while (g_rollup.key_slots[slot] != 0) {
+        key = &g_rollup.keys[g_rollup.key_slots[slot] - 1];
+        if (key->directory == directory && key->process == process && key->type == type) {
+            key->count++;
+            return;
+        }
+        slot = (slot + 1) & (ROLLUP_KEY_SLOTS - 1);
+    }
+    if (g_rollup.key_count == ROLLUP_KEYS_MAX || directory == UINT32_MAX || process == UINT32_MAX) {
+        g_rollup.overflow[type]++;
+        return;
+    }
+    key = &g_rollup.keys[g_rollup.key_count];
+    key->directory = directory;
+    key->process = process;
+    key->type = type;
+    key->count = 1;
+    g_rollup.key_slots[slot] = ++g_rollup.key_count;
+}
+
+static void rollup_clear() {
+    g_rollup.key_count = 0;
+    memset(g_rollup.key_slots, 0, ROLLUP_KEY_SLOTS * sizeof(uint32_t));
+    memset(g_rollup.overflow, 0, sizeof(g_rollup.overflow));
+}
+
+/**
+ * @brief Appends the counts of the minute in memory to the day file and clears them.
+ *
+ */
+static void rollup_flush() {
+    static const char padding[8] = { 0 };
+    filemon_rollup_block_t strings = {
+        .magic = FILEMON_ROLLUP_BLOCK_MAGIC,
+        .type = FILEMON_ROLLUP_STRINGS,
+    };
+    filemon_rollup_block_t records = {
+        .magic = FILEMON_ROLLUP_BLOCK_MAGIC,
+        .type = FILEMON_ROLLUP_RECORDS,
+        .minute = g_rollup.minute % 1440,
+    };
+    struct iovec iov[5];
+    int iov_count = 0;
+    size_t total = 0;
+    uint32_t count = 0;
+    ssize_t written;
+
+    for (uint32_t i = 0; i < g_rollup.key_count; i++) {
+        filemon_rollup_record_t* record = &g_rollup.records[count++];
+        memset(record, 0, sizeof(*record));
+        record->directory = g_rollup.keys[i].directory;
+        record->process = g_rollup.keys[i].process;
+        record->type = g_rollup.keys[i].type;
+        record->count = g_rollup.keys[i].count;
+    }
+    for (int type = 0; type < ROLLUP_TYPES; type++) {
+        if (g_rollup.overflow[type] != 0) {
+            filemon_rollup_record_t* record = &g_rollup.records[count++];
+            memset(record, 0, sizeof(*record));
+            record->directory = rollup_string(ROLLUP_OTHER, strlen(ROLLUP_OTHER));
+            record->process = record->directory;
+            record->type = type;
+            record->count = g_rollup.overflow[type];
+        }
+    }
+    if (count == 0 && g_rollup.pending_count == 0) {
+        return;
+    }
+    // After the records, "(other)" may have just been added
+    strings.count = g_rollup.pending_count;
+    strings.size = (g_rollup.pending_len + 7) & ~(size_t)7;
+    if (g_rollup.pending_count != 0) {
+        iov[iov_count++] = (struct iovec){ &strings, sizeof(strings) };
+        iov[iov_count++] = (struct iovec){ g_rollup.pending, g_rollup.pending_len };
+        iov[iov_count++] = (struct iovec){ (void*)padding, strings.size - g_rollup.pending_len };
+    }
+    if (count != 0) {
+        records.count = count;
+        records.size = count * sizeof(filemon_rollup_record_t);
+        iov[iov_count++] = (struct iovec){ &records, sizeof(records) };
+        iov[iov_count++] = (struct iovec){ g_rollup.records, records.size };
+    }
+    for (int i = 0; i < iov_count; i++) {
+        total += iov[i].iov_len;
+    }
+    written = writev(g_rollup.fd, iov, iov_count);
+    if (written != (ssize_t)total) {
+        // Keep the file readable, the strings are written again with the next minute
+        if (written > 0 && ftruncate(g_rollup.fd, g_rollup.file_size) == -1) {
+            log_message(WARNING, 1, "Unable to cut back the rollup file after a short write (%s)\n", strerror(errno));
+        }
+        if (g_rollup.write_errors++ == 0) {
+            log_message(WARNING, 1, "Unable to write the rollup of %02ld:%02ld, its counts are lost (%s)\n",
+                        (long)(g_rollup.minute % 1440 / 60), (long)(g_rollup.minute % 60), written == -1 ? strerror(errno) : "short write");
+        }
+    } else {
+        g_rollup.file_size += total;
+        g_rollup.bytes_written += total;
+        g_rollup.pending_len = 0;
+        g_rollup.pending_count = 0;
+    }
+    rollup_clear();
+}
+
+/**
+ * @brief Opens the file of a day, reading back the dictionary if filemon already wrote to it.
+ *
+ * @param day Days since 1970-01-01 UTC.
+ * @return int 1 on success, 0 if the file cannot be used.
+ */
+static int rollup_open_day(int64_t day) {
+    char path[PATH_MAX + 32];
+    filemon_rollup_segment_t segment;
+    time_t seconds = day * 86400;
+    struct tm tm;
+
+    if (g_rollup.fd != -1) {
+        close(g_rollup.fd);
+    }
+    g_rollup.fd = -1;
+    g_rollup.day = day;
+    g_rollup.string_count = 0;
+    g_rollup.other = UINT32_MAX;
+    g_rollup.pending_len = 0;
+    g_rollup.pending_count = 0;
+    memset(g_rollup.strings, 0, ROLLUP_STRING_SLOTS * sizeof(rollup_string_t));
+    gmtime_r(&seconds, &tm);
+    snprintf(path, sizeof(path), "%s/%04d-%02d-%02d" FILEMON_ROLLUP_SUFFIX, g_rollup.directory, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+
+    if (filemon_rollup_open(&segment, path) == 0) {
+        while (filemon_rollup_next(&segment) != NULL);
+        for (uint32_t i = 0; i < segment.string_count; i++) {
+            uint32_t slot;
+            uint64_t hash = hash_bytes(segment.strings[i], strlen(segment.strings[i]));
+            if (rollup_find_string(hash, &slot) == UINT32_MAX) {
+                g_rollup.strings[slot].hash = hash;
+                g_rollup.strings[slot].id = i + 1;
+            }
+        }
+        g_rollup.string_count = segment.string_count;
+        g_rollup.file_size = segment.offset;
+        if (segment.offset < segment.size) {
+            log_message(WARNING, 1, "Rollup file \"%s\" ends in a damaged block, cutting off %lu bytes\n", path, (unsigned long)(segment.size - segment.offset));
+        }
+        filemon_rollup_close(&segment);
+        g_rollup.fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (g_rollup.fd == -1 || ftruncate(g_rollup.fd, g_rollup.file_size) == -1) {
+            log_message(ERROR, 1, "Unable to open rollup file \"%s\" (%s)\n", path, strerror(errno));
+            return 0;
+        }
+        return 1;
+    }
+    if (errno != ENOENT) {
+        log_message(ERROR, 1, "Rollup file \"%s\" cannot be read (%s)\n", path, errno == EPROTO ? "not a rollup file of this version" : strerror(errno));
+        return 0;
+    }
+
+    filemon_rollup_file_t header = {
+        .magic = FILEMON_ROLLUP_MAGIC,
+        .version = FILEMON_ROLLUP_VERSION,
+        .header_size = sizeof(filemon_rollup_file_t),
+        .day = day,
+        .created_ns = (uint64_t)time(NULL) * 1000000000ULL,
+    };
+    g_rollup.fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_EXCL | O_CLOEXEC, 0640);
+    if (g_rollup.fd == -1 || write(g_rollup.fd, &header, sizeof(header)) != sizeof(header)) {
+        log_message(ERROR, 1, "Unable to create rollup file \"%s\" (%s)\n", path, strerror(errno));
+        return 0;
+    }
+    g_rollup.file_size = sizeof(header);
+    g_rollup.bytes_written += sizeof(header);
+    return 1;
+}
+
+// Flushes the minute in memory and moves on to another one, and to the file of its day
+static void rollup_roll(int64_t minute) {
+    // Without a file, counts are dropped until the file of the next day opens
+    if (g_rollup.fd != -1) {
+        rollup_flush();
+    } else {
+        rollup_clear();
+    }
+    __atomic_store_n(&g_rollup.minute, minute, __ATOMIC_RELAXED);
+    if (minute / 1440 != g_rollup.day) {
+        rollup_open_day(minute / 1440);
+    }
+}
+
+/**
+ * @brief Enables the rollup sink.
+ *
+ * @param directory Directory of the day files, or NULL to not write rollups.
+ */
+void rollup_init(const char* directory) {
+    struct stat st;
+
+    if (directory == NULL) {
+        return;
+    }
+    if (stat(directory, &st) == -1 || !S_ISDIR(st.st_mode) || realpath(directory, g_rollup.directory) == NULL) {
+        log_message(ERROR, 1, "--rollup option: \"%s\" is not a directory.\n", directory);
+        exit(EXIT_FAILURE);
+    }
+    g_rollup.keys = malloc(ROLLUP_KEYS_MAX * sizeof(rollup_key_t));
+    g_rollup.key_slots = calloc(ROLLUP_KEY_SLOTS, sizeof(uint32_t));
+    g_rollup.strings = calloc(ROLLUP_STRING_SLOTS, sizeof(rollup_string_t));
+    g_rollup.records = malloc((ROLLUP_KEYS_MAX + ROLLUP_TYPES) * sizeof(filemon_rollup_record_t));
+    if (g_rollup.keys == NULL || g_rollup.key_slots == NULL || g_rollup.strings == NULL || g_rollup.records == NULL) {
+        log_message(ERROR, 1, "Unable to malloc for the rollup tables\n");
+        exit(EXIT_FAILURE);
+    }
+    g_rollup.minute = time(NULL) / 60;
+    g_rollup.day = g_rollup.minute / 1440;
+    if (!rollup_open_day(g_rollup.day)) {
+        exit(EXIT_FAILURE);
+    }
+    g_rollup.enabled = 1;
+    metrics_add_collector(collect_rollup, NULL);
+    log_message(INFO, 1, "Writing per-minute rollups to \"%s\"\n", g_rollup.directory);
+}
+
+/**
+ * @brief Counts an event for its directory, process and each of its types.
+ *
+ * @param event The event.
+ */
+void rollup_record(const event_t* event) {
+    int64_t minute = time(NULL) / 60;
+    const char* slash = strrchr(event->path, '/');
+    size_t directory_len = (slash == NULL || slash == event->path) ? 1 : (size_t)(slash - event->path);
+    uint64_t mask = event->mask & ~(uint64_t)(FAN_ONDIR | FAN_EVENT_ON_CHILD);
+
+    pthread_mutex_lock(&g_rollup.lock);
+    if (minute != g_rollup.minute) {
+        rollup_roll(minute);
+    }
+    uint32_t directory = rollup_string(event->path, directory_len);
+    uint32_t process = rollup_string(event->comm, strlen(event->comm));
+    while (mask) {
+        rollup_count(directory, process, __builtin_ctzll(mask));
+        mask &= mask - 1;
+    }
+    pthread_mutex_unlock(&g_rollup.lock);
+}
+
+/**
+ * @brief Writes out a finished minute even when no event comes along. Called once a second.
+ *
+ */
+void rollup_tick() {
+    int64_t minute = time(NULL) / 60;
+    if (minute == __atomic_load_n(&g_rollup.minute, __ATOMIC_RELAXED)) {
+        return;
+    }
+    pthread_mutex_lock(&g_rollup.lock);
+    if (minute != g_rollup.minute) {
+        rollup_roll(minute);
+    }
+    pthread_mutex_unlock(&g_rollup.lock);
+}
+
+/**
+ * @brief Writes out the minute in memory and closes the day file.
+ *
+ */
+void rollup_stop() {
+    if (!g_rollup.enabled) {
+        return;
+    }
+    pthread_mutex_lock(&g_rollup.lock);
+    g_rollup.enabled = 0;
+    if (g_rollup.fd != -1) {
+        rollup_flush();
+        close(g_rollup.fd);
+        g_rollup.fd = -1;
+    }
+    pthread_mutex_unlock(&g_rollup.lock);
+}
+
+/**
+ * @brief Metrics collector for the rollup sink.
+ *
+ * @param out The response.
+ * @param arg Unused.
+ */
+void collect_rollup(FILE* out, void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_rollup.lock);
+    uint64_t bytes = g_rollup.bytes_written;
+    uint64_t errors = g_rollup.write_errors;
+    uint32_t keys = g_rollup.key_count;
+    uint32_t strings = g_rollup.string_count;
+    pthread_mutex_unlock(&g_rollup.lock);
+    metrics_write_gauge(out, "filemon_rollup_bytes_written", NULL, "Bytes appended to the rollup files since startup.", bytes);
+    metrics_write_gauge(out, "filemon_rollup_write_errors", NULL, "Minutes whose rollup could not be written.", errors);
+    metrics_write_gauge(out, "filemon_rollup_keys", NULL, "Directory, process and type keys counted in the current minute.", keys);
+    metrics_write_gauge(out, "filemon_rollup_strings", NULL, "Directory and process names in the dictionary of the current day file.", strings);
+}
+
+#endif
@@ -0,0 +1,398 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include "wrappers.h"
+#include "logger.h"
+#include "metrics.h"
+#include "cgroup.h"
+#include "monitor.h"
+#include "watchspec.h"
+
+#ifndef RULES_H
+#define RULES_H
+
+#define RULES_FILE_MAX (1024 * 1024)
+#define RULES_SETTLE_MS 100            // Quiet time after a change before the file is read
+
+/*
+ * Filter config (--filter-config FILE), filter rules that apply to every watched directory and can
+ * be changed without a restart. One rule per line, named after the command line option:
+ *   # Comment
+ *   exclude-process updatedb mlocate
+ *   exclude-pattern \.swp$
+ *   exclude-cgroup  /system.slice/backup.service
+ * A repeated list option adds to the list, a repeated pattern is or'ed with the previous ones.
+ * The file is read again on SIGHUP, on the control socket reload command, and when it or its
+ * directory changes (editors and ConfigMaps replace the file instead of writing it). The new rules
+ * are compiled on the reloader thread and published with replace_rules(), so the reader threads
+ * never wait for a reload. A file that does not parse is logged and the rules in use are kept.
+ */
+typedef struct Rules {
+    char path[PATH_MAX];
+    uint64_t version;              // Of the rules in use, 0 before the first load
+    uint64_t hash;                 // Of the file contents the rules were loaded from
+    int inotify_fd;
+    int wake_fd[2];                // Written by rules_request_reload()
+    pthread_mutex_t lock;          // Serializes reloads
+    pthread_t reloader;
+    monitor_box_t* m_box;
+} rules_t;
+
+typedef enum {
+    RULE_INCLUDE_PATTERN,
+    RULE_EXCLUDE_PATTERN,
+    RULE_INCLUDE_PIDS,
+    RULE_EXCLUDE_PIDS,
+    RULE_INCLUDE_PROCESS,
+    RULE_EXCLUDE_PROCESS,
+    RULE_INCLUDE_CGROUP,
+    RULE_EXCLUDE_CGROUP,
+    RULE_KEYS_MAX
+} rule_key_t;
+
+// Command line option each key stands for, 0 for the cgroup keys
+static const struct {
+    const char* name;
+    int opt;
+} rule_keys[RULE_KEYS_MAX] = {
+    [RULE_INCLUDE_PATTERN] = {"include-pattern", 'i'},
+    [RULE_EXCLUDE_PATTERN] = {"exclude-pattern", 'e'},
+    [RULE_INCLUDE_PIDS]    = {"include-pids", 'I'},
+    [RULE_EXCLUDE_PIDS]    = {"exclude-pids", 'E'},
+    [RULE_INCLUDE_PROCESS] = {"include-process", 'N'},
+    [RULE_EXCLUDE_PROCESS] = {"exclude-process", 'X'},
+    [RULE_INCLUDE_CGROUP]  = {"include-cgroup", 0},
+    [RULE_EXCLUDE_CGROUP]  = {"exclude-cgroup", 0},
+};
+
+void rules_init(char* path, monitor_box_t* m_box);
+rule_set_t* rules_parse(char* text, uint64_t version, char* error, size_t error_size);
+int rules_reload(int forced, char* error, size_t error_size);
+void rules_request_reload();
+void* rules_reload_thread(void* arg);
+void collect_rules(FILE* out, void* arg);
+
+rules_t g_rules = { .inotify_fd = -1, .wake_fd = { -1, -1 }, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * @brief Loads the filter config, which is fatal if it fails, and starts following its changes.
+ *
+ * @param path The filter config, or NULL to not use one.
+ * @param m_box The monitor box, its watch roots already added.
+ */
+void rules_init(char* path, monitor_box_t* m_box) {
+    char error[PATH_MAX + 256];
+    char directory[PATH_MAX];
+
+    if (path == NULL) {
+        return;
+    }
+    g_rules.m_box = m_box;
+    if (realpath(path, g_rules.path) == NULL) {
+        log_message(ERROR, 1, "Filter config \"%s\" cannot be read (%s)\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (!rules_reload(1, error, sizeof(error))) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (pipe2(g_rules.wake_fd, O_NONBLOCK | O_CLOEXEC) == -1) {
+        log_message(ERROR, 1, "Failed to create pipe for filter config reloads\n");
+        exit(EXIT_FAILURE);
+    }
+    strncpy(directory, g_rules.path, sizeof(directory) - 1);
+    directory[sizeof(directory) - 1] = '\0';
+    g_rules.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (g_rules.inotify_fd == -1 ||
+        inotify_add_watch(g_rules.inotify_fd, dirname(directory), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE) == -1) {
+        log_message(WARNING, 1, "Cannot follow changes of the filter config (%s), reload it with SIGHUP.\n", strerror(errno));
+    }
+    if (pthread_create(&g_rules.reloader, NULL, rules_reload_thread, NULL) != 0) {
+        log_message(ERROR, 1, "Failed to create thread for filter config reloads\n");
+        exit(EXIT_FAILURE);
+    }
+    metrics_add_collector(collect_rules, NULL);
+}
+
+// Adds the value of a repeated key, a pattern is or'ed with the previous ones
+static char* rules_append(char* previous, const char* value, int pattern) {
+    char* joined;
+    if (previous == NULL) {
+        return strdup(value);
+    }
+    if (pattern) {
+        joined = malloc(strlen(previous) + strlen(value) + 6);
+        if (joined != NULL) {
+            sprintf(joined, "(%s)|(%s)", previous, value);
+        }
+    } else {
+        joined = malloc(strlen(previous) + strlen(value) + 2);
+        if (joined != NULL) {
+            sprintf(joined, "%s %s", previous, value);
+        }
+    }
+    free(previous);
+    return joined;
+}
+
+/**
+ * @brief Compiles the contents of a filter config into a rule set.
+ *
+ * @param text The contents, tokenized in place.
+ * @param version Version of the new rule set.
+ * @param error Set to the reason on failure.
+ * @param error_size Size of error.
+ * @return rule_set_t* The rule set, or NULL on failure.
+ */
+rule_set_t* rules_parse(char* text, uint64_t version, char* error, size_t error_size) {
+    char* values[RULE_KEYS_MAX] = { NULL };
+    filter_options_t* options = calloc(1, sizeof(filter_options_t));
+    rule_set_t* rules = calloc(1, sizeof(rule_set_t));
+    char* line = text;
+    int number = 0;
+    int ok = options != NULL && rules != NULL;
+
+    if (!ok) {
+        snprintf(error, error_size, "Unable to malloc for filter rules.");
+    }
+    while (ok && line != NULL && *line != '\0') {
+        char* next = strchr(line, '\n');
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+        number++;
+        line += strspn(line, " \t");
+        line[strcspn(line, "\r")] = '\0';
+        if (*line == '\0' || *line == '#') {
+            line = next;
+            continue;
+        }
+
+        char* value = line + strcspn(line, " \t");
+        if (*value != '\0') {
+            *value++ = '\0';
+            value += strspn(value, " \t");
+        }
+        size_t len = strlen(value);
+        while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t')) {
+            value[--len] = '\0';
+        }
+        int key = 0;
+        while (key < RULE_KEYS_MAX && strcmp(rule_keys[key].name, line) != 0) {
+            key++;
+        }
+        if (key == RULE_KEYS_MAX) {
+            snprintf(error, error_size, "line %d: Unknown option \"%s\".", number, line);
+            ok = 0;
+        } else if (*value == '\0') {
+            snprintf(error, error_size, "line %d: %s needs a value.", number, line);
+            ok = 0;
+        } else if ((values[key] = rules_append(values[key], value, key <= RULE_EXCLUDE_PATTERN)) == NULL) {
+            snprintf(error, error_size, "Unable to malloc for filter rules.");
+            ok = 0;
+        }
+        line = next;
+    }
+
+    // Like on the command line, a kind of rule is either include or exclude
+    for (int key = 0; ok && key < RULE_KEYS_MAX; key += 2) {
+        if (values[key] != NULL && values[key + 1] != NULL) {
+            snprintf(error, error_size, "%s and %s cannot be used at the same time.", rule_keys[key].name, rule_keys[key + 1].name);
+            ok = 0;
+        }
+    }
+    for (int key = RULE_INCLUDE_PATTERN; ok && key <= RULE_EXCLUDE_PATTERN; key++) {
+        if (values[key] != NULL && strlen(values[key]) >= FILTER_MAX) {
+            snprintf(error, error_size, "%s is longer than %d characters.", rule_keys[key].name, FILTER_MAX - 1);
+            ok = 0;
+        }
+    }
+    for (int key = 0; ok && key < RULE_KEYS_MAX; key++) {
+        if (values[key] == NULL || rule_keys[key].opt == 0) {
+            continue;
+        }
+        ok = parse_filter_option(rule_keys[key].opt, values[key], options, error, error_size);
+    }
+    for (int key = RULE_INCLUDE_CGROUP; ok && key <= RULE_EXCLUDE_CGROUP; key++) {
+        char* save = NULL;
+        char* token = values[key] ? strtok_r(values[key], " \t", &save) : NULL;
+        for (; ok && token != NULL; token = strtok_r(NULL, " \t", &save)) {
+            if (key == RULE_INCLUDE_CGROUP) {
+                ok = cgroup_filter_add(rules->cgroups.include, &rules->cgroups.include_count, token);
+            } else {
+                ok = cgroup_filter_add(rules->cgroups.exclude, &rules->cgroups.exclude_count, token);
+            }
+            if (!ok) {
+                snprintf(error, error_size, "%s has more than %d cgroups.", rule_keys[key].name, CGROUP_FILTER_MAX);
+            }
+        }
+    }
+
+    if (ok) {
+        rules->version = version;
+        rules->cgroups.version = version;
+        init_filters(&rules->filters, options->include_pids, options->exclude_pids,
+                     options->include_process, options->exclude_process,
+                     options->include_pattern, options->exclude_pattern);
+        ok = compile_filters(&rules->filters, error, error_size);
+    }
+    for (int key = 0; key < RULE_KEYS_MAX; key++) {
+        free(values[key]);
+    }
+    free(options);
+    if (!ok) {
+        free(rules);
+        return NULL;
+    }
+    return rules;
+}
+
+// Reads the whole filter config, NULL terminated
+static char* rules_read_file(const char* path, char* error, size_t error_size) {
+    char* text = malloc(RULES_FILE_MAX + 1);
+    ssize_t len = 0;
+    ssize_t ret;
+    int fd;
+
+    if (text == NULL) {
+        snprintf(error, error_size, "Unable to malloc for filter config.");
+        return NULL;
+    }
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        snprintf(error, error_size, "%s.", strerror(errno));
+        free(text);
+        return NULL;
+    }
+    while (len <= RULES_FILE_MAX && (ret = read(fd, text + len, RULES_FILE_MAX + 1 - len)) > 0) {
+        len += ret;
+    }
+    close(fd);
+    if (len > RULES_FILE_MAX) {
+        snprintf(error, error_size, "Larger than %d bytes.", RULES_FILE_MAX);
+        free(text);
+        return NULL;
+    }
+    text[len] = '\0';
+    return text;
+}
+
+/**
+ * @brief Reads the filter config again and publishes its rules as a new version.
+ *
+ * @param forced Publish even if the file did not change since the last load.
+ * @param error Set to the reason on failure, may be NULL.
+ * @param error_size Size of error.
+ * @return int The version in use afterwards, 0 on failure (already logged).
+ */
+int rules_reload(int forced, char* error, size_t error_size) {
+    char reason[PATH_MAX + 128];
+    rule_set_t* rules = NULL;
+    uint64_t hash;
+    char* text;
+
+    pthread_mutex_lock(&g_rules.lock);
+    text = rules_read_file(g_rules.path, reason, sizeof(reason));
+    if (text != NULL) {
+        hash = hash_string(text);
+        if (!forced && g_rules.version > 0 && hash == g_rules.hash) {
+            free(text);
+            pthread_mutex_unlock(&g_rules.lock);
+            return (int)g_rules.version;
+        }
+        rules = rules_parse(text, g_rules.version + 1, reason, sizeof(reason));
+        free(text);
+    }
+    if (rules == NULL) {
+        if (g_rules.version > 0) {
+            log_message(ERROR, 1, "Filter config \"%s\": %s Keeping version %lu.\n", g_rules.path, reason, (unsigned long)g_rules.version);
+            metrics_inc(METRIC_FILTER_RELOAD_ERRORS);
+        } else {
+            log_message(ERROR, 1, "Filter config \"%s\": %s\n", g_rules.path, reason);
+        }
+        if (error != NULL && error_size > 0) {
+            snprintf(error, error_size, "%s", reason);
+        }
+        pthread_mutex_unlock(&g_rules.lock);
+        return 0;
+    }
+    if (!replace_rules(g_rules.m_box, rules, error, error_size)) {
+        free_filters(&rules->filters);
+        free(rules);
+        metrics_inc(METRIC_FILTER_RELOAD_ERRORS);
+        pthread_mutex_unlock(&g_rules.lock);
+        return 0;
+    }
+    if (g_rules.version > 0) {
+        log_message(INFO, 1, "Reloaded filter config \"%s\", now at version %lu.\n", g_rules.path, (unsigned long)rules->version);
+        metrics_inc(METRIC_FILTER_RELOADS);
+    }
+    __atomic_store_n(&g_rules.version, rules->version, __ATOMIC_RELAXED);
+    g_rules.hash = hash;
+    pthread_mutex_unlock(&g_rules.lock);
+    return (int)g_rules.version;
+}
+
+/**
+ * @brief Asks the reloader thread to read the filter config again. Safe to call from a signal handler.
+ *
+ */
+void rules_request_reload() {
+    if (g_rules.wake_fd[1] != -1) {
+        ssize_t ret = write(g_rules.wake_fd[1], "r", 1);
+        (void)ret;
+    }
+}
+
+/**
+ * @brief Reloads the filter config on rules_request_reload() and when its directory changes.
+ *
+ * @param arg Unused.
+ * @return void*
+ */
+void* rules_reload_thread(void* arg) {
+    (void)arg;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[2] = {
+        { .fd = g_rules.wake_fd[0], .events = POLLIN },
+        { .fd = g_rules.inotify_fd, .events = POLLIN },
+    };
+
+    while (1) {
+        if (poll(fds, 2, -1) <= 0) {
+            continue;
+        }
+        int forced = 0;
+        // An editor saving the file makes several changes, wait for them to settle
+        do {
+            forced |= (fds[0].revents & POLLIN) != 0;
+            while (read(g_rules.wake_fd[0], buf, sizeof(buf)) > 0) {
+            }
+            while (g_rules.inotify_fd != -1 && read(g_rules.inotify_fd, buf, sizeof(buf)) > 0) {
+            }
+        } while (poll(fds, 2, RULES_SETTLE_MS) > 0);
+        rules_reload(forced, NULL, 0);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Metrics collector for the filter config.
+ *
+ * @param out The metrics stream.
+ * @param arg Unused.
+ */
+void collect_rules(FILE* out, void* arg) {
+    (void)arg;
+    metrics_write_gauge(out, "filemon_filter_rules_version", NULL, "Version of the filter config rules in use, counted from 1 at startup.", __atomic_load_n(&g_rules.version, __ATOMIC_RELAXED));
+}
+
+#endif
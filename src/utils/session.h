@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/fanotify.h>
+#include "wrappers.h"
+#include "logger.h"
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#define SESSION_MAX_DEFAULT 4096
+#define SESSION_TIMEOUT_DEFAULT 30
+#define SESSION_MAX_MAX 1048576
+#define SESSION_TIMEOUT_MAX 86400     // Seconds
+
+#ifdef FAN_OPEN_EXEC
+#define SESSION_OPEN_MASK (FAN_OPEN | FAN_OPEN_EXEC)
+#else
+#define SESSION_OPEN_MASK FAN_OPEN
+#endif
+
+typedef enum {
+    SESSION_CLOSED,
+    SESSION_TIMED_OUT,
+    SESSION_EVICTED
+} session_end_t;
+
+/*
+ * One session per (pid, file), from the first event seen to the close that balances the opens.
+ * Sessions are kept in a fixed pool, chained by hash and linked in least-recently-used order.
+ * Only the read/write/execute thread touches the table, so there is no locking.
+ */
+typedef struct {
+    uint64_t hash;
+    int pid;
+    char comm[PROC_NAME_LEN];
+    char* path;
+    struct timeval opened;
+    uint64_t opened_ns;
+    uint64_t last_ns;
+    uint64_t mask;
+    int opens;
+    uint32_t access_count;
+    uint32_t modify_count;
+    int written;
+    session_end_t end;
+    int bucket_next;
+    int lru_prev;
+    int lru_next;
+} session_t;
+
+typedef void (*session_emit_fn)(session_t* session);
+
+typedef struct Sessions {
+    int enabled;
+    int max;
+    uint64_t timeout_ns;
+    int count;
+    int buckets_mask;
+    int* buckets;
+    session_t* pool;
+    int free_head;
+    int lru_head;          // Most recently used
+    int lru_tail;          // Least recently used
+    uint64_t last_sweep_ns;
+} sessions_t;
+
+void sessions_init(int max, int timeout);
+void session_track(int pid, const char* comm, const char* path, uint64_t mask, session_emit_fn emit);
+void session_release(session_t* session);
+void sessions_sweep(session_emit_fn emit);
+
+sessions_t g_sessions = { .enabled = 0 };
+
+static inline uint64_t session_clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Enables session correlation.
+ *
+ * @param max Maximum number of open sessions, the least recently used one is evicted beyond that.
+ * @param timeout Seconds without events after which a session is closed.
+ */
+void sessions_init(int max, int timeout) {
+    int buckets = 1;
+    while (buckets < max * 2) {
+        buckets <<= 1;
+    }
+
+    g_sessions.enabled = 1;
+    g_sessions.max = max;
+    g_sessions.timeout_ns = (uint64_t)timeout * 1000000000ULL;
+    g_sessions.buckets_mask = buckets - 1;
+    g_sessions.buckets = (int*)malloc(buckets * sizeof(int));
+    g_sessions.pool = (session_t*)calloc(max, sizeof(session_t));
+    if (g_sessions.buckets == NULL || g_sessions.pool == NULL) {
+        log_message(ERROR, 1, "Failed to allocate memory to session table\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < buckets; i++) {
+        g_sessions.buckets[i] = -1;
+    }
+    for (int i = 0; i < max; i++) {
+        g_sessions.pool[i].bucket_next = i + 1 < max ? i + 1 : -1;
+    }
+    g_sessions.free_head = 0;
+    g_sessions.lru_head = -1;
+    g_sessions.lru_tail = -1;
+    g_sessions.last_sweep_ns = session_clock_ns();
+}
+
+static void session_lru_unlink(int index) {
+    session_t* s = &g_sessions.pool[index];
+    if (s->lru_prev != -1) {
+        g_sessions.pool[s->lru_prev].lru_next = s->lru_next;
+    } else {
+        g_sessions.lru_head = s->lru_next;
+    }
+    if (s->lru_next != -1) {
+        g_sessions.pool[s->lru_next].lru_prev = s->lru_prev;
+    } else {
+        g_sessions.lru_tail = s->lru_prev;
+    }
+}
+
+static void session_lru_push_front(int index) {
+    session_t* s = &g_sessions.pool[index];
+    s->lru_prev = -1;
+    s->lru_next = g_sessions.lru_head;
+    if (g_sessions.lru_head != -1) {
+        g_sessions.pool[g_sessions.lru_head].lru_prev = index;
+    }
+    g_sessions.lru_head = index;
+    if (g_sessions.lru_tail == -1) {
+        g_sessions.lru_tail = index;
+    }
+}
+
+/**
+ * @brief Unlinks a session from the hash chain and LRU list. It stays valid until session_release().
+ */
+static void session_detach(int index) {
+    session_t* s = &g_sessions.pool[index];
+    int* link = &g_sessions.buckets[s->hash & g_sessions.buckets_mask];
+    while (*link != index) {
+        link = &g_sessions.pool[*link].bucket_next;
+    }
+    *link = s->bucket_next;
+    session_lru_unlink(index);
+    g_sessions.count--;
+}
+
+/**
+ * @brief Returns a detached session to the pool.
+ *
+ * @param session A detached session.
+ */
+void session_release(session_t* session) {
+    int index = (int)(session - g_sessions.pool);
+    free(session->path);
+    session->path = NULL;
+    session->bucket_next = g_sessions.free_head;
+    g_sessions.free_head = index;
+}
+
+/**
+ * @brief Folds an event into its (pid, file) session.
+ *
+ * @param pid The PID.
+ * @param comm The process name.
+ * @param path The file path.
+ * @param mask The fanotify event mask.
+ * @param emit Called with the session when this event closes it, and with the least recently used
+ *             session when the pool is full and a slot has to be freed.
+ */
+void session_track(int pid, const char* comm, const char* path, uint64_t mask, session_emit_fn emit) {
+    uint64_t hash = hash_string(path) ^ ((uint64_t)pid * 0x9e3779b97f4a7c15ULL);
+    uint64_t now = session_clock_ns();
+    session_t* s = NULL;
+    int index = g_sessions.buckets[hash & g_sessions.buckets_mask];
+
+    while (index != -1) {
+        s = &g_sessions.pool[index];
+        if (s->hash == hash && s->pid == pid && strcmp(s->path, path) == 0) {
+            break;
+        }
+        index = s->bucket_next;
+    }
+
+    if (index == -1) {
+        if (g_sessions.free_head == -1) {
+            // Pool is full, push out the least recently used session
+            int victim = g_sessions.lru_tail;
+            session_detach(victim);
+            g_sessions.pool[victim].end = SESSION_EVICTED;
+            emit(&g_sessions.pool[victim]);
+            session_release(&g_sessions.pool[victim]);
+        }
+        index = g_sessions.free_head;
+        g_sessions.free_head = g_sessions.pool[index].bucket_next;
+
+        s = &g_sessions.pool[index];
+        memset(s, 0, sizeof(*s));
+        s->hash = hash;
+        s->pid = pid;
+        strncpy(s->comm, comm, PROC_NAME_LEN - 1);
+        s->path = strdup(path);
+        gettimeofday(&s->opened, NULL);
+        s->opened_ns = now;
+        s->end = SESSION_CLOSED;
+        s->bucket_next = g_sessions.buckets[hash & g_sessions.buckets_mask];
+        g_sessions.buckets[hash & g_sessions.buckets_mask] = index;
+        session_lru_push_front(index);
+        g_sessions.count++;
+    } else {
+        session_lru_unlink(index);
+        session_lru_push_front(index);
+    }
+
+    s->last_ns = now;
+    s->mask |= mask;
+    if (mask & SESSION_OPEN_MASK) {
+        s->opens++;
+    }
+    if (mask & FAN_ACCESS) {
+        s->access_count++;
+    }
+    if (mask & FAN_MODIFY) {
+        s->modify_count++;
+    }
+    if (mask & FAN_CLOSE_WRITE) {
+        s->written = 1;
+    }
+    if (mask & (FAN_CLOSE_WRITE | FAN_CLOSE_NOWRITE)) {
+        s->opens--;
+        if (s->opens <= 0) {
+            session_detach(index);
+            emit(s);
+            session_release(s);
+        }
+    }
+}
+
+/**
+ * @brief Closes sessions that have been idle for longer than the timeout. Runs at most once a second.
+ *
+ * @param emit Called for every closed session, which is released afterwards.
+ */
+void sessions_sweep(session_emit_fn emit) {
+    uint64_t now = session_clock_ns();
+    if (now - g_sessions.last_sweep_ns < 1000000000ULL) {
+        return;
+    }
+    g_sessions.last_sweep_ns = now;
+
+    while (g_sessions.lru_tail != -1 && now - g_sessions.pool[g_sessions.lru_tail].last_ns >= g_sessions.timeout_ns) {
+        int index = g_sessions.lru_tail;
+        session_detach(index);
+        g_sessions.pool[index].end = SESSION_TIMED_OUT;
+        emit(&g_sessions.pool[index]);
+        session_release(&g_sessions.pool[index]);
+    }
+}
+
+#endif
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/fanotify.h>
+#include "wrappers.h"
+#include "logger.h"
+
+#ifndef SHEDDING_H
+#define SHEDDING_H
+
+#define SHED_BUCKETS 1024
+#define SHED_PROBE_LIMIT 8
+#define SHED_THRESHOLD_DEFAULT 4096
+#define SHED_THRESHOLD_MAX 1048576     // Events
+#define SHED_RATE_MAX 1000000          // Events per second
+#define SHED_ACCESS_SAMPLE_MAX 1000000 // Keep 1 in N FAN_ACCESS events
+#define SHED_ACCESS_SAMPLE_DEFAULT 100
+#define SHED_REPORT_INTERVAL_NS 1000000000ULL
+#define SHED_IDLE_NS 10000000000ULL
+
+/*
+ * Load shedding for the read/write/execute group. It stays off until the kernel queue holds more
+ * than `threshold` events and switches off again once the queue has drained to a quarter of that.
+ * While it is on, every process gets a token bucket of `rate` events per second, and pure FAN_ACCESS
+ * events are additionally sampled 1 in `access_sample`. Permission events are never shed, and the
+ * create/delete/move group does not go through here at all. Suppressed events are counted per
+ * process and reported as "N events suppressed from comm(pid)".
+ * Only the read/write/execute thread touches the buckets, so there is no locking.
+ */
+typedef struct {
+    int pid;                       // 0 if the slot is free
+    char comm[PROC_NAME_LEN];
+    double tokens;
+    uint64_t last_ns;
+    uint64_t access_seen;
+    uint64_t suppressed;
+} shed_bucket_t;
+
+typedef struct Shedding {
+    int enabled;
+    int active;
+    double rate;
+    uint64_t threshold;            // Queued events
+    int access_sample;
+    uint64_t last_report_ns;
+    shed_bucket_t buckets[SHED_BUCKETS];
+} shedding_t;
+
+void shedding_init(int rate, int threshold, int access_sample);
+void shedding_update(int fanotify_fd, size_t event_len);
+int shedding_admit(int pid, const char* comm, uint64_t mask);
+void shedding_report(int force);
+
+shedding_t g_shedding = { .enabled = 0 };
+
+static inline uint64_t shedding_clock_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Enables load shedding.
+ *
+ * @param rate Events per second let through for each process while shedding.
+ * @param threshold Queued events at which shedding switches on.
+ * @param access_sample Keep 1 in this many FAN_ACCESS events of a process while shedding.
+ */
+void shedding_init(int rate, int threshold, int access_sample) {
+    g_shedding.enabled = 1;
+    g_shedding.active = 0;
+    g_shedding.rate = rate;
+    g_shedding.threshold = threshold;
+    g_shedding.access_sample = access_sample;
+    g_shedding.last_report_ns = shedding_clock_ns();
+    memset(g_shedding.buckets, 0, sizeof(g_shedding.buckets));
+}
+
+static void shedding_report_bucket(shed_bucket_t* bucket) {
+    if (bucket->suppressed == 0) {
+        return;
+    }
+    log_message(WARNING, 1, "%lu events suppressed from %s(%d)\n", bucket->suppressed, bucket->comm, bucket->pid);
+    bucket->suppressed = 0;
+}
+
+/**
+ * @brief Switches shedding on or off from the number of events waiting in the fanotify queue.
+ *
+ * @param fanotify_fd The read/write/execute fanotify fd.
+ * @param event_len Bytes of one event in the queue, with its info records.
+ */
+void shedding_update(int fanotify_fd, size_t event_len) {
+    int bytes = 0;
+    if (ioctl(fanotify_fd, FIONREAD, &bytes) == -1 || bytes < 0) {
+        return;
+    }
+    uint64_t queued = (uint64_t)bytes / event_len;
+    if (!g_shedding.active && queued >= g_shedding.threshold) {
+        g_shedding.active = 1;
+        log_message(WARNING, 1, "Event queue is %lu events deep, shedding read/write/execute events.\n", queued);
+    } else if (g_shedding.active && queued < g_shedding.threshold / 4) {
+        g_shedding.active = 0;
+        shedding_report(1);
+        log_message(INFO, 1, "Event queue drained, stopped shedding.\n");
+    }
+}
+
+static shed_bucket_t* shedding_bucket(int pid, const char* comm, uint64_t now) {
+    uint32_t start = ((uint32_t)pid * 2654435761U) & (SHED_BUCKETS - 1);
+    shed_bucket_t* victim = NULL;
+
+    for (int i = 0; i < SHED_PROBE_LIMIT; i++) {
+        shed_bucket_t* bucket = &g_shedding.buckets[(start + i) & (SHED_BUCKETS - 1)];
+        if (bucket->pid == pid) {
+            return bucket;
+        }
+        if (bucket->pid == 0) {
+            if (victim == NULL || victim->pid != 0) {
+                victim = bucket;
+            }
+        } else if (victim == NULL || (victim->pid != 0 && bucket->last_ns < victim->last_ns)) {
+            victim = bucket;
+        }
+    }
+
+    // Take over a free slot, or the least recently used one after reporting what it held
+    shedding_report_bucket(victim);
+    memset(victim, 0, sizeof(*victim));
+    victim->pid = pid;
+    strncpy(victim->comm, comm, PROC_NAME_LEN - 1);
+    victim->tokens = g_shedding.rate;
+    victim->last_ns = now;
+    return victim;
+}
+
+/**
+ * @brief Decides whether an event survives load shedding.
+ *
+ * @param pid The PID.
+ * @param comm The process name.
+ * @param mask The fanotify event mask.
+ * @return int 1 if the event should be emitted, 0 if it was suppressed.
+ */
+int shedding_admit(int pid, const char* comm, uint64_t mask) {
+    if (!g_shedding.active || (mask & PERM_EVENTS_MASK)) {
+        return 1;
+    }
+
+    uint64_t now = shedding_clock_ns();
+    shed_bucket_t* bucket = shedding_bucket(pid, comm, now);
+
+    bucket->tokens += (now - bucket->last_ns) / 1e9 * g_shedding.rate;
+    if (bucket->tokens > g_shedding.rate) {
+        bucket->tokens = g_shedding.rate;
+    }
+    bucket->last_ns = now;
+
+    if ((mask & ~(uint64_t)FAN_ONDIR) == FAN_ACCESS && bucket->access_seen++ % g_shedding.access_sample != 0) {
+        bucket->suppressed++;
+        return 0;
+    }
+    if (bucket->tokens < 1) {
+        bucket->suppressed++;
+        return 0;
+    }
+    bucket->tokens -= 1;
+    return 1;
+}
+
+/**
+ * @brief Reports suppressed events per process and frees idle buckets. Runs at most once a second.
+ *
+ * @param force Report now regardless of the last run.
+ */
+void shedding_report(int force) {
+    uint64_t now = shedding_clock_ns();
+    if (!force && now - g_shedding.last_report_ns < SHED_REPORT_INTERVAL_NS) {
+        return;
+    }
+    g_shedding.last_report_ns = now;
+
+    for (int i = 0; i < SHED_BUCKETS; i++) {
+        shed_bucket_t* bucket = &g_shedding.buckets[i];
+        if (bucket->pid == 0) {
+            continue;
+        }
+        shedding_report_bucket(bucket);
+        if (now - bucket->last_ns >= SHED_IDLE_NS) {
+            bucket->pid = 0;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <filemon_stats.h>
+#include "wrappers.h"
+#include "logger.h"
+#include "metrics.h"
+#include "output.h"
+
+#ifndef STATS_H
+#define STATS_H
+
+#define STATS_PATHS_DEFAULT 65536
+#define STATS_PATHS_MAX (16 * 1024 * 1024)
+#define STATS_PROCESSES_MAX 4096
+
+/*
+ * Live statistics table (--stats NAME), per-path and per-process event counters in /dev/shm/NAME
+ * for tools like filemon-top, see include/filemon_stats.h for the layout. filemon is the only
+ * writer. It finds the entry of a key through a private open addressing index on the key hash, so
+ * readers never see the index and the shared memory only holds what they read. Updates go through
+ * the seqlock of the entry, readers copy it and retry, which never makes filemon wait.
+ * Both tables have a fixed size. An entry gets its referenced bit set by every event, a full
+ * table reuses the first entry the clock hand finds without it, clearing the bits it passes.
+ */
+typedef struct {
+    filemon_stats_entry_t* entries;
+    uint32_t capacity;
+    uint32_t used;
+    uint32_t hand;                 // Clock hand, next entry looked at for eviction
+    uint8_t* referenced;
+    uint32_t* slots;               // Open addressing on hash, entry index + 1, 0 if empty
+    uint32_t slot_mask;
+} stats_table_t;
+
+typedef struct Stats {
+    int enabled;
+    char name[NAME_MAX];
+    filemon_stats_header_t* header;
+    size_t map_size;
+    stats_table_t tables[FILEMON_STATS_TABLES];
+    pthread_mutex_t lock;          // Both reader threads count
+} stats_t;
+
+void stats_init(const char* name, int paths);
+void stats_record(const event_t* event);
+void stats_stop();
+void collect_stats(FILE* out, void* arg);
+
+stats_t g_stats = { .enabled = 0, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static inline void stats_write_begin(uint32_t* seq) {
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void stats_write_end(uint32_t* seq) {
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+static void stats_table_init(stats_table_t* table, filemon_stats_entry_t* entries, uint32_t capacity) {
+    uint32_t slots = 1;
+    while (slots < capacity * 2) {
+        slots <<= 1;
+    }
+    table->entries = entries;
+    table->capacity = capacity;
+    table->used = 0;
+    table->hand = 0;
+    table->slot_mask = slots - 1;
+    table->referenced = calloc(capacity, sizeof(uint8_t));
+    table->slots = calloc(slots, sizeof(uint32_t));
+    if (table->referenced == NULL || table->slots == NULL) {
+        log_message(ERROR, 1, "Unable to malloc for the statistics table\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Creates the statistics table in /dev/shm, replacing one left behind by an earlier filemon.
+ *
+ * @param name Name of the shared memory object, or NULL to not keep statistics.
+ * @param paths Number of paths the table holds.
+ */
+void stats_init(const char* name, int paths) {
+    size_t header_size = (sizeof(filemon_stats_header_t) + 4095) & ~(size_t)4095;
+    struct timespec now;
+    char* map;
+    int fd;
+
+    if (name == NULL) {
+        return;
+    }
+    snprintf(g_stats.name, sizeof(g_stats.name), "/%s", name[0] == '/' ? name + 1 : name);
+    if (strchr(g_stats.name + 1, '/') != NULL || g_stats.name[1] == '\0') {
+        log_message(ERROR, 1, "--stats option: \"%s\" is not a valid name, it cannot contain '/'.\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    // Readers still mapping the old table keep it, it just stops changing
+    shm_unlink(g_stats.name);
+    fd = shm_open(g_stats.name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        log_message(ERROR, 1, "Unable to create statistics table /dev/shm%s (%s)\n", g_stats.name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    g_stats.map_size = header_size + sizeof(filemon_stats_entry_t) * ((size_t)paths + STATS_PROCESSES_MAX);
+    if (ftruncate(fd, g_stats.map_size) == -1) {
+        log_message(ERROR, 1, "Unable to size statistics table /dev/shm%s (%s)\n", g_stats.name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    map = mmap(NULL, g_stats.map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        log_message(ERROR, 1, "Unable to map statistics table /dev/shm%s (%s)\n", g_stats.name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    g_stats.header = (filemon_stats_header_t*)map;
+    stats_table_init(&g_stats.tables[FILEMON_STATS_PATHS], (filemon_stats_entry_t*)(map + header_size), paths);
+    stats_table_init(&g_stats.tables[FILEMON_STATS_PROCESSES], (filemon_stats_entry_t*)(map + header_size) + paths, STATS_PROCESSES_MAX);
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    g_stats.header->version = FILEMON_STATS_VERSION;
+    g_stats.header->header_size = header_size;
+    g_stats.header->entry_size = sizeof(filemon_stats_entry_t);
+    g_stats.header->capacity[FILEMON_STATS_PATHS] = paths;
+    g_stats.header->capacity[FILEMON_STATS_PROCESSES] = STATS_PROCESSES_MAX;
+    g_stats.header->producer_pid = getpid();
+    g_stats.header->started_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    __atomic_store_n(&g_stats.header->magic, FILEMON_STATS_MAGIC, __ATOMIC_RELEASE);
+    g_stats.enabled = 1;
+    metrics_add_collector(collect_stats, NULL);
+    log_message(INFO, 1, "Keeping statistics in /dev/shm%s (%d paths, %d processes)\n", g_stats.name, paths, STATS_PROCESSES_MAX);
+}
+
+/**
+ * @brief Finds the slot holding hash, or the empty slot where it would go.
+ */
+static uint32_t stats_find_slot(stats_table_t* table, uint64_t hash) {
+    uint32_t slot = (uint32_t)hash & table->slot_mask;
+    while (table->slots[slot] != 0 && table->entries[table->slots[slot] - 1].hash != hash) {
+        slot = (slot + 1) & table->slot_mask;
+    }
+    return slot;
+}
+
+/**
+ * @brief Removes a slot with backward shift deletion so probe chains stay intact.
+ */
+static void stats_remove_slot(stats_table_t* table, uint32_t slot) {
+    uint32_t mask = table->slot_mask;
+    uint32_t next = (slot + 1) & mask;
+    while (table->slots[next] != 0) {
+        uint32_t home = (uint32_t)table->entries[table->slots[next] - 1].hash & mask;
+        // Move the entry back if its home position is not in (slot, next]
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            table->slots[slot] = table->slots[next];
+            slot = next;
+        }
+        next = (next + 1) & mask;
+    }
+    table->slots[slot] = 0;
+}
+
+/**
+ * @brief Takes a free entry, or the first one the clock hand finds unreferenced.
+ *
+ * @return uint32_t The entry index.
+ */
+static uint32_t stats_evict(filemon_stats_table_t which) {
+    stats_table_t* table = &g_stats.tables[which];
+    filemon_stats_totals_t* totals = &g_stats.header->totals;
+    uint32_t index;
+
+    if (table->used < table->capacity) {
+        return table->used++;
+    }
+    while (table->referenced[table->hand]) {
+        table->referenced[table->hand] = 0;
+        table->hand = (table->hand + 1) % table->capacity;
+    }
+    index = table->hand;
+    table->hand = (table->hand + 1) % table->capacity;
+    stats_remove_slot(table, stats_find_slot(table, table->entries[index].hash));
+    totals->evictions[which]++;
+    return index;
+}
+
+// Counts an event for one key, under g_stats.lock and the seqlock of the totals
+static void stats_count(filemon_stats_table_t which, uint64_t hash, int pid, const char* name, uint64_t mask, uint64_t now) {
+    stats_table_t* table = &g_stats.tables[which];
+    uint32_t slot = stats_find_slot(table, hash);
+    filemon_stats_entry_t* entry;
+    uint32_t index;
+
+    if (table->slots[slot] != 0) {
+        index = table->slots[slot] - 1;
+        entry = &table->entries[index];
+        stats_write_begin(&entry->seq);
+    } else {
+        index = stats_evict(which);
+        entry = &table->entries[index];
+        stats_write_begin(&entry->seq);
+        size_t len = strlen(name);
+        entry->flags = FILEMON_STATS_USED;
+        entry->pid = pid;
+        entry->hash = hash;
+        entry->first_ns = now;
+        entry->events = 0;
+        memset(entry->counters, 0, sizeof(entry->counters));
+        if (len < FILEMON_STATS_NAME_LEN) {
+            memcpy(entry->name, name, len + 1);
+        } else {
+            // Keep the tail of long paths, it is the part that tells files apart
+            entry->flags |= FILEMON_STATS_TRUNCATED;
+            memcpy(entry->name, name + len - (FILEMON_STATS_NAME_LEN - 1), FILEMON_STATS_NAME_LEN);
+        }
+        // The eviction may have moved slots around
+        table->slots[stats_find_slot(table, hash)] = index + 1;
+    }
+    entry->last_ns = now;
+    entry->events++;
+    for (int i = 0; i < FILEMON_STATS_COUNTERS; i++) {
+        if (mask & filemon_stat_masks[i]) {
+            entry->counters[i]++;
+        }
+    }
+    stats_write_end(&entry->seq);
+    table->referenced[index] = 1;
+}
+
+/**
+ * @brief Counts an event for its path and its process.
+ *
+ * @param event The event.
+ */
+void stats_record(const event_t* event) {
+    filemon_stats_totals_t* totals = &g_stats.header->totals;
+    uint64_t path_hash = event->path_hash ? event->path_hash : hash_string(event->path);
+    uint64_t process_hash = hash_string(event->comm) ^ ((uint64_t)event->pid * 0x9e3779b97f4a7c15ULL);
+    struct timespec ts;
+    uint64_t now;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    now = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    pthread_mutex_lock(&g_stats.lock);
+    stats_write_begin(&totals->seq);
+    stats_count(FILEMON_STATS_PATHS, path_hash, 0, event->path, event->mask, now);
+    stats_count(FILEMON_STATS_PROCESSES, process_hash, event->pid, event->comm, event->mask, now);
+    totals->events++;
+    totals->updated_ns = now;
+    stats_write_end(&totals->seq);
+    pthread_mutex_unlock(&g_stats.lock);
+}
+
+/**
+ * @brief Removes the statistics table from /dev/shm, readers that still map it keep the last values.
+ *
+ */
+void stats_stop() {
+    if (!g_stats.enabled) {
+        return;
+    }
+    g_stats.enabled = 0;
+    shm_unlink(g_stats.name);
+}
+
+/**
+ * @brief Metrics collector for the statistics table.
+ *
+ * @param out The response.
+ * @param arg Unused.
+ */
+void collect_stats(FILE* out, void* arg) {
+    filemon_stats_totals_t totals;
+    uint32_t used[FILEMON_STATS_TABLES];
+
+    (void)arg;
+    pthread_mutex_lock(&g_stats.lock);
+    totals = g_stats.header->totals;
+    used[FILEMON_STATS_PATHS] = g_stats.tables[FILEMON_STATS_PATHS].used;
+    used[FILEMON_STATS_PROCESSES] = g_stats.tables[FILEMON_STATS_PROCESSES].used;
+    pthread_mutex_unlock(&g_stats.lock);
+    metrics_write_gauge(out, "filemon_stats_entries", "table=\"paths\"", "Entries in use in the --stats table.", used[FILEMON_STATS_PATHS]);
+    metrics_write_gauge(out, "filemon_stats_entries", "table=\"processes\"", NULL, used[FILEMON_STATS_PROCESSES]);
+    metrics_write_gauge(out, "filemon_stats_evictions", "table=\"paths\"", "Entries of the --stats table reused for another key.", totals.evictions[FILEMON_STATS_PATHS]);
+    metrics_write_gauge(out, "filemon_stats_evictions", "table=\"processes\"", NULL, totals.evictions[FILEMON_STATS_PROCESSES]);
+}
+
+#endif
@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "wrappers.h"
+#include "logger.h"
+
+#ifndef SUMMARY_H
+#define SUMMARY_H
+
+#define SUMMARY_CAPACITY 1024
+#define SUMMARY_KEY_LEN 256
+#define SUMMARY_TOP_DEFAULT 10
+#define SUMMARY_TOP_MAX SUMMARY_CAPACITY
+#define SUMMARY_INTERVAL_MAX 86400     // Seconds
+
+/*
+ * Space-Saving heavy-hitter tables (Metwally et al.). Each table tracks at most SUMMARY_CAPACITY
+ * keys. When a new key arrives and the table is full it takes over the slot of the current minimum,
+ * inheriting its count as the error bound. Keys are identified by a 64-bit hash of the full string,
+ * the stored copy is only for display and may be truncated.
+ */
+typedef struct {
+    uint64_t hash;
+    uint64_t count;
+    uint64_t error;
+    uint64_t mask;
+    int heap_pos;
+    char key[SUMMARY_KEY_LEN];
+} summary_counter_t;
+
+typedef struct {
+    const char* title;
+    int size;
+    summary_counter_t counters[SUMMARY_CAPACITY];
+    int heap[SUMMARY_CAPACITY];            // Min-heap of counter indices ordered by count
+    int slots[SUMMARY_CAPACITY * 2];       // Open addressing on hash, counter index + 1, 0 if empty
+} space_saving_t;
+
+typedef enum {
+    SUMMARY_FILES,
+    SUMMARY_DIRECTORIES,
+    SUMMARY_PROCESSES,
+    SUMMARY_PROCESS_FILES,
+    SUMMARY_TABLES_MAX
+} summary_table_t;
+
+typedef struct Summary {
+    int interval;
+    int top;
+    uint64_t events;
+    uint64_t flag_counts[FAN_FLAGS_COUNT];
+    space_saving_t* tables[SUMMARY_TABLES_MAX];
+    pthread_mutex_t lock;
+    pthread_t thread;
+} summary_t;
+
+void summary_init(int interval, int top);
+void summary_record(const char* comm, int pid, const char* path, uint64_t mask);
+void summary_print();
+void* summary_thread(void* arg);
+void space_saving_reset(space_saving_t* table);
+void space_saving_add(space_saving_t* table, const char* key, uint64_t mask);
+
+summary_t g_summary = { .interval = 0, .top = SUMMARY_TOP_DEFAULT, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+const char* summary_titles[SUMMARY_TABLES_MAX] = {
+    [SUMMARY_FILES] = "Files",
+    [SUMMARY_DIRECTORIES] = "Directories",
+    [SUMMARY_PROCESSES] = "Processes",
+    [SUMMARY_PROCESS_FILES] = "Process + File",
+};
+
+/**
+ * @brief Enables summary mode. Tables are allocated once and never grow.
+ *
+ * @param interval Seconds between two summaries.
+ * @param top Number of rows printed per table.
+ */
+void summary_init(int interval, int top) {
+    g_summary.interval = interval;
+    g_summary.top = top > SUMMARY_CAPACITY ? SUMMARY_CAPACITY : top;
+    for (int i = 0; i < SUMMARY_TABLES_MAX; i++) {
+        g_summary.tables[i] = (space_saving_t*)malloc(sizeof(space_saving_t));
+        if (g_summary.tables[i] == NULL) {
+            log_message(ERROR, 1, "Failed to allocate memory to summary tables\n");
+            exit(EXIT_FAILURE);
+        }
+        g_summary.tables[i]->title = summary_titles[i];
+        space_saving_reset(g_summary.tables[i]);
+    }
+    if (pthread_create(&g_summary.thread, NULL, summary_thread, NULL) != 0) {
+        log_message(ERROR, 1, "Failed to create thread for summary\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * @brief Clears a table without freeing it.
+ *
+ * @param table The Space-Saving table.
+ */
+void space_saving_reset(space_saving_t* table) {
+    table->size = 0;
+    memset(table->slots, 0, sizeof(table->slots));
+}
+
+static inline void space_saving_swap(space_saving_t* table, int a, int b) {
+    int tmp = table->heap[a];
+    table->heap[a] = table->heap[b];
+    table->heap[b] = tmp;
+    table->counters[table->heap[a]].heap_pos = a;
+    table->counters[table->heap[b]].heap_pos = b;
+}
+
+static void space_saving_sift_up(space_saving_t* table, int pos) {
+    while (pos > 0) {
+        int parent = (pos - 1) / 2;
+        if (table->counters[table->heap[parent]].count <= table->counters[table->heap[pos]].count) {
+            break;
+        }
+        space_saving_swap(table, parent, pos);
+        pos = parent;
+    }
+}
+
+static void space_saving_sift_down(space_saving_t* table, int pos) {
+    while (1) {
+        int smallest = pos;
+        int left = 2 * pos + 1;
+        int right = left + 1;
+        if (left < table->size && table->counters[table->heap[left]].count < table->counters[table->heap[smallest]].count) {
+            smallest = left;
+        }
+        if (right < table->size && table->counters[table->heap[right]].count < table->counters[table->heap[smallest]].count) {
+            smallest = right;
+        }
+        if (smallest == pos) {
+            break;
+        }
+        space_saving_swap(table, smallest, pos);
+        pos = smallest;
+    }
+}
+
+/**
+ * @brief Finds the slot holding hash, or the empty slot where it would go.
+ */
+static int space_saving_find_slot(space_saving_t* table, uint64_t hash) {
+    int mask = SUMMARY_CAPACITY * 2 - 1;
+    int slot = (int)(hash & mask);
+    while (table->slots[slot] != 0 && table->counters[table->slots[slot] - 1].hash != hash) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+/**
+ * @brief Removes a slot with backward shift deletion so probe chains stay intact.
+ */
+static void space_saving_remove_slot(space_saving_t* table, int slot) {
+    int mask = SUMMARY_CAPACITY * 2 - 1;
+    int next = (slot + 1) & mask;
+    while (table->slots[next] != 0) {
+        int home = (int)(table->counters[table->slots[next] - 1].hash & mask);
+        // Move the entry back if its home position is not in (slot, next]
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            table->slots[slot] = table->slots[next];
+            slot = next;
+        }
+        next = (next + 1) & mask;
+    }
+    table->slots[slot] = 0;
+}
+
+static void space_saving_set_key(summary_counter_t* counter, const char* key) {
+    size_t len = strlen(key);
+    if (len < SUMMARY_KEY_LEN) {
+        memcpy(counter->key, key, len + 1);
+    } else {
+        // Keep the tail of long paths, it is the part that tells files apart
+        memcpy(counter->key, "...", 3);
+        memcpy(counter->key + 3, key + len - (SUMMARY_KEY_LEN - 4), SUMMARY_KEY_LEN - 3);
+    }
+}
+
+/**
+ * @brief Counts one occurrence of key.
+ *
+ * @param table The Space-Saving table.
+ * @param key The key.
+ * @param mask The fanotify mask of the event, OR-ed into the flags seen for this key.
+ */
+void space_saving_add(space_saving_t* table, const char* key, uint64_t mask) {
+    uint64_t hash = hash_string(key);
+    int slot = space_saving_find_slot(table, hash);
+    summary_counter_t* counter;
+
+    if (table->slots[slot] != 0) {
+        counter = &table->counters[table->slots[slot] - 1];
+        counter->count++;
+        counter->mask |= mask;
+        space_saving_sift_down(table, counter->heap_pos);
+        return;
+    }
+
+    if (table->size < SUMMARY_CAPACITY) {
+        int index = table->size++;
+        counter = &table->counters[index];
+        counter->hash = hash;
+        counter->count = 1;
+        counter->error = 0;
+        counter->mask = mask;
+        counter->heap_pos = index;
+        space_saving_set_key(counter, key);
+        table->heap[index] = index;
+        table->slots[slot] = index + 1;
+        space_saving_sift_up(table, index);
+        return;
+    }
+
+    // Table is full, replace the minimum
+    int index = table->heap[0];
+    counter = &table->counters[index];
+    space_saving_remove_slot(table, space_saving_find_slot(table, counter->hash));
+    counter->hash = hash;
+    counter->error = counter->count;
+    counter->count++;
+    counter->mask = mask;
+    space_saving_set_key(counter, key);
+    table->slots[space_saving_find_slot(table, hash)] = index + 1;
+    space_saving_sift_down(table, 0);
+}
+
+/**
+ * @brief Counts an event in every summary table.
+ *
+ * @param comm The process name.
+ * @param pid The PID.
+ * @param path The file/directory path.
+ * @param mask The fanotify event mask.
+ */
+void summary_record(const char* comm, int pid, const char* path, uint64_t mask) {
+    char key[PATH_MAX + PROC_NAME_LEN + 32];
+    const char* slash = strrchr(path, '/');
+    size_t dir_len = (slash == NULL || slash == path) ? 1 : (size_t)(slash - path);
+    if (dir_len >= sizeof(key)) {
+        dir_len = sizeof(key) - 1;
+    }
+
+    pthread_mutex_lock(&g_summary.lock);
+    g_summary.events++;
+    for (size_t i = 0; i < FAN_FLAGS_COUNT; i++) {
+        if (mask & fan_flags[i].mask) {
+            g_summary.flag_counts[i]++;
+        }
+    }
+
+    space_saving_add(g_summary.tables[SUMMARY_FILES], path, mask);
+
+    memcpy(key, path, dir_len);
+    key[dir_len] = '\0';
+    space_saving_add(g_summary.tables[SUMMARY_DIRECTORIES], key, mask);
+
+    snprintf(key, sizeof(key), "%s (%d)", comm, pid);
+    space_saving_add(g_summary.tables[SUMMARY_PROCESSES], key, mask);
+
+    snprintf(key, sizeof(key), "%s (%d): %s", comm, pid, path);
+    space_saving_add(g_summary.tables[SUMMARY_PROCESS_FILES], key, mask);
+    pthread_mutex_unlock(&g_summary.lock);
+}
+
+static int summary_compare_desc(const void* a, const void* b) {
+    const summary_counter_t* x = *(const summary_counter_t* const*)a;
+    const summary_counter_t* y = *(const summary_counter_t* const*)b;
+    if (x->count == y->count) {
+        return 0;
+    }
+    return x->count < y->count ? 1 : -1;
+}
+
+/**
+ * @brief Prints the top entries of every table and resets them for the next interval.
+ *
+ */
+void summary_print() {
+    // Snapshot under the lock, format outside of it so readers are not held up by the output
+    static summary_counter_t rows[SUMMARY_TABLES_MAX][SUMMARY_CAPACITY];
+    static const summary_counter_t* order[SUMMARY_CAPACITY];
+    int sizes[SUMMARY_TABLES_MAX];
+    uint64_t flag_counts[FAN_FLAGS_COUNT];
+    uint64_t events;
+    char flags[FLAGS_MAX];
+
+    pthread_mutex_lock(&g_summary.lock);
+    events = g_summary.events;
+    memcpy(flag_counts, g_summary.flag_counts, sizeof(flag_counts));
+    for (int t = 0; t < SUMMARY_TABLES_MAX; t++) {
+        sizes[t] = g_summary.tables[t]->size;
+        memcpy(rows[t], g_summary.tables[t]->counters, sizes[t] * sizeof(summary_counter_t));
+        space_saving_reset(g_summary.tables[t]);
+    }
+    g_summary.events = 0;
+    memset(g_summary.flag_counts, 0, sizeof(g_summary.flag_counts));
+    pthread_mutex_unlock(&g_summary.lock);
+
+    log_message(INFO, 1, "Summary of the last %ds: %lu events\n", g_summary.interval, (unsigned long)events);
+    if (events == 0) {
+        return;
+    }
+
+    log_message(NIL, 0, "---------------------- BY FLAG ----------------------\n");
+    for (size_t i = 0; i < FAN_FLAGS_COUNT; i++) {
+        if (flag_counts[i] != 0) {
+            log_message(NIL, 0, "  %12lu  %s\n", (unsigned long)flag_counts[i], fan_flags[i].name);
+        }
+    }
+
+    for (int t = 0; t < SUMMARY_TABLES_MAX; t++) {
+        for (int i = 0; i < sizes[t]; i++) {
+            order[i] = &rows[t][i];
+        }
+        qsort(order, sizes[t], sizeof(order[0]), summary_compare_desc);
+
+        log_message(NIL, 0, "---------------------- TOP %s ----------------------\n", summary_titles[t]);
+        log_message(NIL, 0, "  %12s  %10s  %s\n", "COUNT", "ERROR", "KEY == [FLAGS]");
+        for (int i = 0; i < sizes[t] && i < g_summary.top; i++) {
+            mask_to_flags(order[i]->mask, flags, sizeof(flags));
+            log_message(NIL, 0, "  %12lu  %10lu  %s == [%s]\n",
+                        (unsigned long)order[i]->count, (unsigned long)order[i]->error, order[i]->key, flags);
+        }
+    }
+    log_message(NIL, 0, "=====================================================\n");
+}
+
+/**
+ * @brief Thread function that prints a summary every interval.
+ *
+ * @param arg Unused.
+ * @return void*
+ */
+void* summary_thread(void* arg) {
+    (void)arg;
+    while (1) {
+        sleep(g_summary.interval);
+        summary_print();
+    }
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "wrappers.h"
+
+#ifndef WATCHSPEC_H
+#define WATCHSPEC_H
+
+// Filter options of a DIRECTORY, from the command line, a -W argument or the control socket
+typedef struct {
+    char* include_pattern;
+    char* exclude_pattern;
+    int include_pids[FILTER_MAX];
+    int exclude_pids[FILTER_MAX];
+    char* include_process[FILTER_MAX];
+    char* exclude_process[FILTER_MAX];
+} filter_options_t;
+
+int parse_filter_option(int opt, char* arg, filter_options_t* options, char* error, size_t error_size);
+int parse_watch_root(char* spec, filter_options_t* options, char** directory, char* error, size_t error_size);
+
+/**
+ * @brief Parses one of the -i, -e, -I, -E, -N and -X filter options.
+ * 
+ * @param opt The option character.
+ * @param arg The option argument, tokenized in place.
+ * @param options The filter options of the DIRECTORY.
+ * @param error Set to the reason on failure.
+ * @param error_size Size of error.
+ * @return int 1 on success, 0 otherwise.
+ */
+int parse_filter_option(int opt, char* arg, filter_options_t* options, char* error, size_t error_size) {
+    char* save = NULL;
+    char* token;
+    int i = 0;
+    switch (opt) {
+        case 'i':
+            if (options->exclude_pattern){
+                snprintf(error, error_size, "-%c option: Cannot be used with -e option at the same time.", opt);
+                return 0;
+            }
+            if (options->include_pattern){
+                snprintf(error, error_size, "-%c option: Cannot be used more than once.", opt);
+                return 0;
+            }
+            options->include_pattern = arg;
+            break;
+        case 'e':
+            if (options->include_pattern){
+                snprintf(error, error_size, "-%c option: Cannot be used with -i option at the same time.", opt);
+                return 0;
+            }
+            if (options->exclude_pattern){
+                snprintf(error, error_size, "-%c option: Cannot be used more than once.", opt);
+                return 0;
+            }
+            options->exclude_pattern = arg;
+            break;
+        case 'I':
+            token = strtok_r(arg, " ", &save);
+            i = 0;
+            if (options->exclude_pids[0] != 0) {
+                snprintf(error, error_size, "-%c option: Cannot be used with -E option at the same time.", opt);
+                return 0;
+            }             
+            if (options->include_pids[0] != 0) {
+                snprintf(error, error_size, "-%c option: Cannot be used more than once.", opt);
+                return 0;
+            } 
+            while (token != NULL && i < FILTER_MAX - 1) {
+                if (!is_valid_integer(token)) {
+                    snprintf(error, error_size, "-%c option: '%s' is not an integer.", opt, token);
+                    return 0;
+                } 
+                options->include_pids[i] = atoi(token);
+                i++;
+                token = strtok_r(NULL, " ", &save);
+            }
+            break;
+        case 'E':
+            token = strtok_r(arg, " ", &save);
+            i = 0;
+            if (options->include_pids[0] != 0) {
+                snprintf(error, error_size, "-%c option: Cannot be used with -I option at the same time.", opt);
+                return 0;
+            } 
+            if (options->exclude_pids[0] != 0) {
+                snprintf(error, error_size, "-%c option: Cannot be used more than once.", opt);
+                return 0;
+            } 
+            while (token != NULL && i < FILTER_MAX - 1) {
+                if (!is_valid_integer(token)) {
+                    snprintf(error, error_size, "-%c option: '%s' is not an integer.", opt, token);
+                    return 0;
+                } 
+                options->exclude_pids[i] = atoi(token);
+                i++;
+                token = strtok_r(NULL, " ", &save);
+            }
+            break;
+        case 'N':
+            token = strtok_r(arg, " ", &save);
+            i = 0;
+            if (options->exclude_process[0]) {
+                snprintf(error, error_size, "-%c option: Cannot be used with -X option at the same time.", opt);
+                return 0;
+            } 
+            if (options->include_process[0]) {
+                snprintf(error, error_size, "-%c option: Cannot be used more than once.", opt);
+                return 0;
+            } 
+            while (token != NULL && i < FILTER_MAX - 1) {
+                options->include_process[i] = token;
+                i++;
+                token = strtok_r(NULL, " ", &save);
+            }
+            break;
+        case 'X':
+            token = strtok_r(arg, " ", &save);
+            i = 0;
+            if (options->include_process[0]) {
+                snprintf(error, error_size, "-%c option: Cannot be used with -N option at the same time.", opt);
+                return 0;
+            } 
+            if (options->exclude_process[0]) {
+                snprintf(error, error_size, "-%c option: Cannot be used more than once.", opt);
+                return 0;
+            } 
+            while (token != NULL && i < FILTER_MAX - 1) {
+                options->exclude_process[i] = token;
+                i++;
+                token = strtok_r(NULL, " ", &save);
+            }
+            break;
+        default:
+            snprintf(error, error_size, "-%c option: Unknown filter option.", opt);
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Parses a "DIRECTORY [FILTER OPTIONS]" argument of -W or of the control socket add command.
+ *        Uses getopt(), so it must not run while another thread parses options.
+ * 
+ * @param spec The argument, tokenized in place.
+ * @param options Set to the filter options of the directory.
+ * @param directory Set to the directory.
+ * @param error Set to the reason on failure.
+ * @param error_size Size of error.
+ * @return int 1 on success, 0 otherwise.
+ */
+int parse_watch_root(char* spec, filter_options_t* options, char** directory, char* error, size_t error_size) {
+    char* args[FILTER_MAX];
+    int count;
+    int opt;
+
+    args[0] = "filemon";
+    count = split_arguments(spec, args + 1, FILTER_MAX - 2);
+    if (count <= 0) {
+        snprintf(error, error_size, "Expected \"DIRECTORY [FILTER OPTIONS]\".");
+        return 0;
+    }
+    count++;
+    args[count] = NULL;
+
+    memset(options, 0, sizeof(*options));
+    optind = 0;
+    while ((opt = getopt(count, args, ":i:e:I:E:N:X:")) != -1) {
+        if (opt == '?' || opt == ':') {
+            snprintf(error, error_size, "-%c option: %s.", optopt, opt == '?' ? "Unknown filter option" : "Missing argument");
+            return 0;
+        }
+        if (!parse_filter_option(opt, optarg, options, error, error_size)) {
+            return 0;
+        }
+    }
+    if (optind != count - 1) {
+        snprintf(error, error_size, "Expected \"DIRECTORY [FILTER OPTIONS]\".");
+        return 0;
+    }
+    *directory = args[optind];
+    return 1;
+}
+
+#endif
@@ -1,12 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <limits.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <regex.h>
-#include <fstab.h>
 #include <sys/stat.h> 
-#include <sys/utsname.h>
+#include <sys/fanotify.h>
 #include "logger.h"
 
 #ifndef WRAPPER_H
@@ -16,66 +17,100 @@
 #define FLAGS_MAX 1024
 #define PROC_NAME_LEN 16
 
-char* get_path_from_fd(int fd);
-char* get_comm_from_pid(int pid);
+#if defined(FAN_OPEN_EXEC_PERM)
+#define PERM_EVENTS_MASK (FAN_OPEN_PERM | FAN_ACCESS_PERM | FAN_OPEN_EXEC_PERM)
+#else
+#define PERM_EVENTS_MASK (FAN_OPEN_PERM | FAN_ACCESS_PERM)
+#endif
+
+typedef struct {
+    uint64_t mask;
+    const char* name;
+} fan_flag_t;
+
+// Order in which flags are printed
+const fan_flag_t fan_flags[] = {
+    #ifdef FAN_OPEN_PERM
+    {FAN_OPEN_PERM, "FAN_OPEN_PERM"},
+    #endif
+    #ifdef FAN_ACCESS_PERM
+    {FAN_ACCESS_PERM, "FAN_ACCESS_PERM"},
+    #endif
+    #ifdef FAN_OPEN_EXEC_PERM
+    {FAN_OPEN_EXEC_PERM, "FAN_OPEN_EXEC_PERM"},
+    #endif
+    #ifdef FAN_ACCESS
+    {FAN_ACCESS, "FAN_ACCESS"},
+    #endif
+    #ifdef FAN_OPEN
+    {FAN_OPEN, "FAN_OPEN"},
+    #endif
+    #ifdef FAN_MODIFY
+    {FAN_MODIFY, "FAN_MODIFY"},
+    #endif
+    #ifdef FAN_OPEN_EXEC
+    {FAN_OPEN_EXEC, "FAN_OPEN_EXEC"},
+    #endif
+    #ifdef FAN_CLOSE_WRITE
+    {FAN_CLOSE_WRITE, "FAN_CLOSE_WRITE"},
+    #endif
+    #ifdef FAN_CLOSE_NOWRITE
+    {FAN_CLOSE_NOWRITE, "FAN_CLOSE_NOWRITE"},
+    #endif
+    #ifdef FAN_CREATE
+    {FAN_CREATE, "FAN_CREATE"},
+    #endif
+    #ifdef FAN_DELETE
+    {FAN_DELETE, "FAN_DELETE"},
+    #endif
+    #ifdef FAN_RENAME
+    {FAN_RENAME, "FAN_RENAME"},
+    #endif
+    #ifdef FAN_MOVED_FROM
+    {FAN_MOVED_FROM, "FAN_MOVED_FROM"},
+    #endif
+    #ifdef FAN_MOVED_TO
+    {FAN_MOVED_TO, "FAN_MOVED_TO"},
+    #endif
+    {FAN_ONDIR, "FAN_ONDIR"},
+};
+#define FAN_FLAGS_COUNT (sizeof(fan_flags) / sizeof(fan_flags[0]))
+
+char* get_path_from_fd(int fd, char* out, size_t size);
 int path_exists(const char* path);
 int is_directory(const char* path);
 int regex_search(regex_t expr, const char* haystack );
-int has_config_fanotify();
-int has_config_fanotify_access_perms();
 char* get_full_path(const char *path);
 int is_valid_integer(const char *str);
 char* strcat_int_array(int *array, size_t size);
 int is_in_int_array(int *haystack, size_t size, int needle);
 char* strcat_process_names(char array[][PROC_NAME_LEN], size_t size);
 int is_in_process_names(char haystack[][PROC_NAME_LEN], size_t size, char* needle);
+void mask_to_flags(uint64_t mask, char* flags, size_t size);
+uint64_t hash_string(const char* str);
+uint64_t hash_bytes(const char* data, size_t len);
+int split_arguments(char* str, char** argv, int max);
 
 /**
  * @brief Get the path from fd object
  * 
  * @param fd The fanotify fd.
- * @return char* The file path or directory path.
+ * @param out Where the path goes.
+ * @param size Size of out.
+ * @return char* out holding the file path or directory path, or NULL.
  */
-char* get_path_from_fd(int fd) {
+char* get_path_from_fd(int fd, char* out, size_t size) {
+    char fd_path[32];
     ssize_t len;
-    char* filepath = (char*)malloc(PATH_MAX);
-    char* fd_path = (char*)malloc(PATH_MAX);
     if (fd <= 0) {
         return NULL;
     }
-    snprintf(fd_path, PATH_MAX, "/proc/self/fd/%d", fd);
-    if ((len = readlink(fd_path, filepath, PATH_MAX - 1)) < 0) {
+    snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+    if ((len = readlink(fd_path, out, size - 1)) < 0) {
         return NULL;
     }
-    filepath[len] = '\0';
-    return filepath;
-}
-
-/**
- * @brief Get the comm from pid object
- * 
- * @param pid The PID of the process that triggered the fan event.
- * @return char* The process name.
- */
-char* get_comm_from_pid(int pid){
-    char* comm_path = (char*)malloc(PATH_MAX);
-    char* comm = (char*)malloc(16);
-    snprintf(comm_path, PATH_MAX, "/proc/%d/comm", pid);
-    FILE *comm_file = fopen(comm_path, "r");
-
-    if (comm_file == NULL) {
-        // unknown because the short-lived process already finished before we can even get the name
-        return "unknown-process";
-    }
-
-    if (fgets(comm, 16, comm_file)) {
-        comm[strcspn(comm, "\n")] = '\0';
-    }
-    close(fileno(comm_file));
-    if (comm[0] == '\0' || comm[0] == ' ') {
-        return "unknown-process";
-    }
-    return comm;
+    out[len] = '\0';
+    return out;
 }
 
 /**
@@ -120,84 +155,6 @@ int regex_search(regex_t expr, const char* haystack) {
     return 0;
 }
 
-/**
- * @brief Checks if CONFIG_FANOTIFY is enabled. Returns 1 on success, otherwise 0.
- * 
- * @return int 
- */
-int has_config_fanotify() {
-    struct utsname uname_data;
-    FILE *file;
-    char filepath[256];
-    char line[256];
-    const char *search_str = "CONFIG_FANOTIFY=y";
-
-    // Get the kernel version
-    if (uname(&uname_data) != 0) {
-        log_message(ERROR, 1, "Unable to get kernel version via uname.\n");
-        return 0;
-    }
-
-    // Construct the file path
-    snprintf(filepath, sizeof(filepath), "/boot/config-%s", uname_data.release);
-
-    // Open the file for reading
-    file = fopen(filepath, "r");
-    if (file == NULL) {
-        log_message(ERROR, 1, "Unable to open: \"/boot/config-%s\"\n", uname_data.release);
-        return 0;
-    }
-
-    // Search for the string in the file
-    while (fgets(line, sizeof(line), file)) {
-        if (strncmp(line, search_str, strlen(search_str)) == 0) {
-            fclose(file);
-            return 1;
-        }
-    }
-    fclose(file);
-    return 0;
-}
-
-/**
- * @brief Checks if CONFIG_FANOTIFY_ACCESS_PERMISSIONS is enabled. Returns 1 on sucess, otherwise 0.
- * 
- * @return int 
- */
-int has_config_fanotify_access_perms() {
-    struct utsname uname_data;
-    FILE *file;
-    char filepath[256];
-    char line[256];
-    const char *search_str = "CONFIG_FANOTIFY_ACCESS_PERMISSIONS=y";
-
-    // Get the kernel version
-    if (uname(&uname_data) != 0) {
-        log_message(ERROR, 1, "Unable to get kernel version via uname.\n");
-        return 0;
-    }
-
-    // Construct the file path
-    snprintf(filepath, sizeof(filepath), "/boot/config-%s", uname_data.release);
-
-    // Open the file for reading
-    file = fopen(filepath, "r");
-    if (file == NULL) {
-        log_message(ERROR, 1, "Unable to fopen: %s\n", filepath);
-        return 0;
-    }
-
-    // Search for the string in the file
-    while (fgets(line, sizeof(line), file)) {
-        if (strncmp(line, search_str, strlen(search_str)) == 0) {
-            fclose(file);
-            return 1;
-        }
-    }
-    fclose(file);
-    return 0;
-}
-
 /**
  * @brief Get the full path given any path.
  * 
@@ -220,33 +177,6 @@ char* get_full_path(const char *path) {
     return resolved_path;
 }
 
-/**
- * @brief Get the mount information of a given path.
- * 
- * @param path 
- * @return struct fstab* 
- */
-struct fstab *getfssearch(const char *path) {
-    /* stat the file in question */
-    struct stat path_stat;
-    stat(path, &path_stat);
-
-    /* iterate through the list of devices */
-    struct fstab *fs = NULL;
-    while( (fs = getfsent()) ) {
-        /* stat the mount point */
-        struct stat dev_stat;
-        stat(fs->fs_file, &dev_stat);
-
-        /* check if our file and the mount point are on the same device */
-        if( dev_stat.st_dev == path_stat.st_dev ) {
-            break;
-        }
-    }
-    endfsent();
-    return fs;
-}
-
 /**
  * @brief Pre-check to be used before converting a string into an integer.
  * 
@@ -350,4 +280,99 @@ int is_in_process_names(char haystack[][PROC_NAME_LEN], size_t size, char* needl
     }
     return 0;
 }
+
+/**
+ * @brief Writes the names of the FAN_* flags set in mask as a comma separated list.
+ * 
+ * @param mask The fanotify event mask.
+ * @param flags The output buffer.
+ * @param size The size of the output buffer.
+ */
+void mask_to_flags(uint64_t mask, char* flags, size_t size) {
+    size_t length = 0;
+    flags[0] = '\0';
+    for (size_t i = 0; i < FAN_FLAGS_COUNT; i++) {
+        if (!(mask & fan_flags[i].mask)) {
+            continue;
+        }
+        int written = snprintf(flags + length, size - length, "%s%s", length ? ", " : "", fan_flags[i].name);
+        if (written < 0 || (size_t)written >= size - length) {
+            break;
+        }
+        length += written;
+    }
+}
+
+/**
+ * @brief 64-bit FNV-1a hash of a string. The path and process keys of the path cache, the policy,
+ *        the summaries and the log index all come from here, filemon_index_hash() must match it.
+ * 
+ * @param str A null terminated string.
+ * @return uint64_t 
+ */
+uint64_t hash_string(const char* str) {
+    return hash_bytes(str, strlen(str));
+}
+
+/**
+ * @brief hash_string() of a string whose length is known.
+ * 
+ * @param data The string, without the NUL.
+ * @param len Length of the string.
+ * @return uint64_t 
+ */
+uint64_t hash_bytes(const char* data, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Splits a string into arguments in place, on spaces and tabs outside single or double quotes.
+ *        The quotes are removed, there are no escapes.
+ * 
+ * @param str The string, overwritten.
+ * @param argv The output array.
+ * @param max Size of the output array.
+ * @return int Number of arguments, or -1 on an unterminated quote or too many arguments.
+ */
+int split_arguments(char* str, char** argv, int max) {
+    char* in = str;
+    char* out = str;
+    int count = 0;
+
+    while (*in) {
+        if (*in == ' ' || *in == '\t') {
+            in++;
+            continue;
+        }
+        if (count >= max) {
+            return -1;
+        }
+        argv[count++] = out;
+        while (*in && *in != ' ' && *in != '\t') {
+            if (*in == '\'' || *in == '"') {
+                char quote = *in++;
+                while (*in && *in != quote) {
+                    *out++ = *in++;
+                }
+                if (*in != quote) {
+                    return -1;
+                }
+                in++;
+            } else {
+                *out++ = *in++;
+            }
+        }
+        // The separator was already read, so this never overwrites unread input
+        if (*in) {
+            in++;
+        }
+        *out++ = '\0';
+    }
+    return count;
+}
 #endif
@@ -0,0 +1,131 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifndef XXH64_H
+#define XXH64_H
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+/*
+ * XXH64 (seed 0), fed in pieces of any size. Used for the content hashes of --hash and for the
+ * chunks of --chunk. The four lanes of a 32-byte stripe are independent, so their multiplies overlap.
+ */
+typedef struct {
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char buffer[32];
+    uint32_t buffered;
+} xxh64_state_t;
+
+static inline uint64_t xxh64_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh64_read64(const unsigned char* p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap64(value);
+    #endif
+    return value;
+}
+
+static inline uint32_t xxh64_read32(const unsigned char* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    value = __builtin_bswap32(value);
+    #endif
+    return value;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc = xxh64_rotl(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t value) {
+    acc ^= xxh64_round(0, value);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static inline void xxh64_init(xxh64_state_t* state) {
+    memset(state, 0, sizeof(*state));
+    state->v[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+    state->v[1] = XXH_PRIME64_2;
+    state->v[2] = 0;
+    state->v[3] = -XXH_PRIME64_1;
+}
+
+static inline void xxh64_stripe(xxh64_state_t* state, const unsigned char* p) {
+    state->v[0] = xxh64_round(state->v[0], xxh64_read64(p));
+    state->v[1] = xxh64_round(state->v[1], xxh64_read64(p + 8));
+    state->v[2] = xxh64_round(state->v[2], xxh64_read64(p + 16));
+    state->v[3] = xxh64_round(state->v[3], xxh64_read64(p + 24));
+}
+
+static inline void xxh64_update(xxh64_state_t* state, const unsigned char* data, size_t len) {
+    state->total += len;
+    if (state->buffered + len < sizeof(state->buffer)) {
+        memcpy(state->buffer + state->buffered, data, len);
+        state->buffered += len;
+        return;
+    }
+    if (state->buffered) {
+        size_t fill = sizeof(state->buffer) - state->buffered;
+        memcpy(state->buffer + state->buffered, data, fill);
+        xxh64_stripe(state, state->buffer);
+        data += fill;
+        len -= fill;
+        state->buffered = 0;
+    }
+    for (; len >= 32; data += 32, len -= 32) {
+        xxh64_stripe(state, data);
+    }
+    memcpy(state->buffer, data, len);
+    state->buffered = len;
+}
+
+static inline uint64_t xxh64_digest(const xxh64_state_t* state) {
+    const unsigned char* p = state->buffer;
+    uint32_t remaining = state->buffered;
+    uint64_t hash;
+
+    if (state->total >= 32) {
+        hash = xxh64_rotl(state->v[0], 1) + xxh64_rotl(state->v[1], 7) + xxh64_rotl(state->v[2], 12) + xxh64_rotl(state->v[3], 18);
+        for (int i = 0; i < 4; i++) {
+            hash = xxh64_merge(hash, state->v[i]);
+        }
+    } else {
+        hash = state->v[2] + XXH_PRIME64_5;
+    }
+    hash += state->total;
+    for (; remaining >= 8; p += 8, remaining -= 8) {
+        hash ^= xxh64_round(0, xxh64_read64(p));
+        hash = xxh64_rotl(hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (remaining >= 4) {
+        hash ^= (uint64_t)xxh64_read32(p) * XXH_PRIME64_1;
+        hash = xxh64_rotl(hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+        remaining -= 4;
+    }
+    for (; remaining > 0; p++, remaining--) {
+        hash ^= *p * XXH_PRIME64_5;
+        hash = xxh64_rotl(hash, 11) * XXH_PRIME64_1;
+    }
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+#endif
@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/utils/anomaly.h"
+#include "test.h"
+
+/*
+ * The --alert rules: the sliding window drops buckets as time moves on, a process alerts once per
+ * window while above the threshold, modified directories count once each, and a freshly written
+ * file alerts once when executed.
+ */
+
+static anomaly_alert_t test_last;
+static int test_alerts = 0;
+
+static void test_emit(const anomaly_alert_t* alert) {
+    test_last = *alert;
+    test_alerts++;
+}
+
+static void test_window() {
+    anomaly_window_t window;
+    uint64_t base = 1000;
+
+    memset(&window, 0, sizeof(window));
+    for (uint64_t t = 0; t < ANOMALY_BUCKETS; t++) {
+        CHECK(anomaly_window_add(&window, base + t, 1) == t + 1);
+    }
+    // Each step drops the bucket that left the window
+    CHECK(anomaly_window_add(&window, base + ANOMALY_BUCKETS, 1) == ANOMALY_BUCKETS);
+    CHECK(anomaly_window_add(&window, base + ANOMALY_BUCKETS + 3, 0) == ANOMALY_BUCKETS - 3);
+    // A gap of a whole window or more empties it
+    CHECK(anomaly_window_add(&window, base + 3 * ANOMALY_BUCKETS, 1) == 1);
+    CHECK(anomaly_window_add(&window, base + 4 * ANOMALY_BUCKETS, 0) == 0);
+}
+
+// rename:5/16 has buckets of one second
+static void test_rate() {
+    anomaly_process_t* process = anomaly_process(0, 4321, "worker");
+    uint64_t base = 1000000;
+
+    test_alerts = 0;
+    for (int i = 0; i < 10; i++) {
+        anomaly_count(process, ANOMALY_RENAME, base, "/srv/a", test_emit);
+    }
+    CHECK(test_alerts == 1);
+    CHECK(test_last.kind == ANOMALY_RENAME && test_last.count == 6 && test_last.threshold == 5 && test_last.window_s == 16);
+    CHECK(test_last.pid == 4321 && strcmp(test_last.comm, "worker") == 0);
+
+    // Still above the threshold, but within the window of the alert
+    for (int i = 0; i < 10; i++) {
+        anomaly_count(process, ANOMALY_RENAME, base + 8000, "/srv/b", test_emit);
+    }
+    CHECK(test_alerts == 1);
+
+    // The first second slid out, 10 are left, and a new window has begun
+    anomaly_count(process, ANOMALY_RENAME, base + 16000, "/srv/c", test_emit);
+    CHECK(test_alerts == 2);
+    CHECK(test_last.count == 11);
+
+    // One event every 4 seconds never has more than 4 in the window
+    test_alerts = 0;
+    process = anomaly_process(0, 4322, "slow");
+    for (int i = 0; i < 100; i++) {
+        anomaly_count(process, ANOMALY_RENAME, base + 100000 + i * 4000, "/srv/d", test_emit);
+    }
+    CHECK(test_alerts == 0);
+
+    // Another process on the same slot starts from zero
+    process = anomaly_process(0, 4322 + ANOMALY_PROCESSES, "other");
+    CHECK(process->pid == 4322 + ANOMALY_PROCESSES && process->windows[ANOMALY_RENAME].total == 0);
+}
+
+// modify-dirs:3/60, through anomaly_observe() and the real clock
+static void test_dirs() {
+    test_alerts = 0;
+    for (int i = 0; i < 10; i++) {
+        anomaly_observe(1, 5000, "editor", "/srv/one/file", 0, FAN_MODIFY, test_emit);
+    }
+    anomaly_observe(1, 5000, "editor", "/srv/two/file", 0, FAN_MODIFY, test_emit);
+    anomaly_observe(1, 5000, "editor", "/srv/three/file", 0, FAN_MODIFY, test_emit);
+    anomaly_observe(1, 5000, "editor", "/srv/three/other", 0, FAN_MODIFY, test_emit);
+    CHECK(test_alerts == 0);
+    anomaly_observe(1, 5000, "editor", "/srv/four/file", 0, FAN_MODIFY, test_emit);
+    CHECK(test_alerts == 1);
+    CHECK(test_last.kind == ANOMALY_MODIFY_DIRS && test_last.count == 4);
+    CHECK(strcmp(test_last.path, "/srv/four/file") == 0);
+    // The tables of the two reader threads are apart
+    anomaly_observe(0, 5000, "editor", "/srv/five/file", 0, FAN_MODIFY, test_emit);
+    CHECK(test_alerts == 1);
+}
+
+// exec-new:30
+static void test_exec_new() {
+    test_alerts = 0;
+    anomaly_observe(1, 6000, "curl", "/tmp/payload", 0, FAN_CREATE, test_emit);
+    anomaly_observe(0, 6000, "curl", "/tmp/payload", 0, FAN_CLOSE_WRITE, test_emit);
+    anomaly_observe(0, 6001, "sh", "/usr/bin/ls", 0, ANOMALY_EXEC_MASK, test_emit);
+    CHECK(test_alerts == 0);
+    anomaly_observe(0, 6001, "sh", "/tmp/payload", 0, ANOMALY_EXEC_MASK, test_emit);
+    CHECK(test_alerts == 1);
+    CHECK(test_last.kind == ANOMALY_EXEC_NEW && test_last.count == 0 && test_last.window_s == 30);
+    // Once per write
+    anomaly_observe(0, 6002, "sh", "/tmp/payload", 0, ANOMALY_EXEC_MASK, test_emit);
+    CHECK(test_alerts == 1);
+    anomaly_observe(0, 6000, "curl", "/tmp/payload", 0, FAN_CLOSE_WRITE, test_emit);
+    anomaly_observe(0, 6003, "sh", "/tmp/payload", 0, ANOMALY_EXEC_MASK, test_emit);
+    CHECK(test_alerts == 2);
+}
+
+int main() {
+    char* rules[] = { "rename:5/16", "modify-dirs:3/60", "exec-new:30" };
+
+    anomaly_init(rules, sizeof(rules) / sizeof(rules[0]));
+    REQUIRE(g_anomaly.enabled);
+    test_window();
+    test_rate();
+    test_dirs();
+    if (ANOMALY_EXEC_MASK) {
+        test_exec_new();
+    }
+    return test_done("anomaly");
+}
@@ -0,0 +1,50 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/utils/cgroup.h"
+#include "test.h"
+
+/*
+ * The per-thread PID cache of the cgroups: a process moved to another cgroup without an exec keeps
+ * its PID and comm, its cached cgroup is only trusted for CGROUP_RECHECK_NS.
+ */
+
+int main() {
+    const char* comm = "test_cgroup";
+    char path[CGROUP_PATH_LEN];
+    int pid = getpid();
+
+    REQUIRE(read_cgroup_path(pid, path, sizeof(path)));
+    const cgroup_id_entry_t* entry = cgroup_of(pid, comm);
+    REQUIRE(entry != NULL);
+    CHECK(strcmp(entry->path, path) == 0 && entry->cgroup_id != 0);
+    CHECK(cgroup_of(pid, comm) == entry);
+    uint64_t id = entry->cgroup_id;
+
+    // Pretend the cache saw the process in another cgroup a moment ago
+    cgroup_cache_t* cache = cgroup_cache();
+    cgroup_pid_entry_t* pid_entry = &cache->pids[(unsigned int)pid % CGROUP_CACHE_SIZE];
+    cgroup_id_entry_t* moved = &cache->ids[(id + 1) % CGROUP_CACHE_SIZE];
+    moved->cgroup_id = id + 1;
+    strcpy(moved->path, "/filemon-test-moved");
+    pid_entry->cgroup_id = id + 1;
+    CHECK(cgroup_of(pid, comm) == moved);
+
+    // Once the entry is old, the cgroup is read again
+    pid_entry->checked_ns = cgroup_clock_ns() - CGROUP_RECHECK_NS;
+    entry = cgroup_of(pid, comm);
+    REQUIRE(entry != NULL);
+    CHECK(strcmp(entry->path, path) == 0 && entry->cgroup_id == id);
+    CHECK(pid_entry->cgroup_id == id);
+
+    // A recheck that finds the same cgroup keeps the entry
+    pid_entry->checked_ns = cgroup_clock_ns() - CGROUP_RECHECK_NS;
+    CHECK(cgroup_of(pid, comm) == entry && pid_entry->checked_ns + CGROUP_RECHECK_NS > cgroup_clock_ns());
+
+    // Another process on the same slot is read at once
+    CHECK(cgroup_of(pid + CGROUP_CACHE_SIZE * 4096, comm) == NULL);
+    return test_done("cgroup");
+}
@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/utils/chunking.h"
+#include "test.h"
+
+/*
+ * The --chunk chunker and diff: the cuts must not depend on how the file is split across
+ * chunker_feed() calls, stay within the chunk bounds, move only next to an edit, and an edit must
+ * come out as a changed range around it on the next close.
+ */
+
+#define TEST_DATA_SIZE (8 * 1024 * 1024)
+#define TEST_CHUNKS_MAX (TEST_DATA_SIZE / CHUNK_MIN + 2)
+
+typedef struct {
+    uint64_t offset;
+    uint32_t length;
+    uint64_t hash;
+} test_chunk_t;
+
+typedef struct {
+    test_chunk_t chunks[TEST_CHUNKS_MAX];
+    int count;
+} test_cuts_t;
+
+static void test_collect(void* arg, uint64_t offset, uint32_t length, uint64_t hash) {
+    test_cuts_t* cuts = (test_cuts_t*)arg;
+    if (cuts->count < TEST_CHUNKS_MAX) {
+        cuts->chunks[cuts->count++] = (test_chunk_t){ .offset = offset, .length = length, .hash = hash };
+    }
+}
+
+// Feeds data in pieces of the sizes in pieces[], cycling through them
+static void test_cut(test_cuts_t* cuts, const unsigned char* data, size_t size, const size_t* pieces, int piece_count) {
+    chunker_t chunker;
+    cuts->count = 0;
+    chunker_init(&chunker, test_collect, cuts);
+    for (size_t done = 0, i = 0; done < size; i++) {
+        size_t len = pieces[i % piece_count];
+        len = len < size - done ? len : size - done;
+        chunker_feed(&chunker, data + done, len);
+        done += len;
+    }
+    chunker_finish(&chunker);
+}
+
+static int test_same_cuts(const test_cuts_t* a, const test_cuts_t* b) {
+    return a->count == b->count && memcmp(a->chunks, b->chunks, a->count * sizeof(test_chunk_t)) == 0;
+}
+
+static void test_fill(unsigned char* data, size_t size, uint64_t state) {
+    for (size_t i = 0; i < size; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        data[i] = state >> 56;
+    }
+}
+
+static void test_splits(const unsigned char* data, test_cuts_t* whole, test_cuts_t* split) {
+    const size_t all[] = { TEST_DATA_SIZE };
+    const size_t bytes[] = { 1 };
+    const size_t primes[] = { 4099, 65537, 7, 262147 };
+    const size_t reads[] = { 1024 * 1024 };
+    const size_t boundaries[] = { CHUNK_MIN - 1, 1, CHUNK_AVG, CHUNK_MAX + 1 };
+
+    test_cut(whole, data, TEST_DATA_SIZE, all, 1);
+    CHECK(whole->count > 16);
+    for (int i = 0; i < whole->count; i++) {
+        const test_chunk_t* chunk = &whole->chunks[i];
+        CHECK(chunk->length <= CHUNK_MAX);
+        CHECK(chunk->length >= CHUNK_MIN || i == whole->count - 1);
+        CHECK(i == 0 || chunk->offset == whole->chunks[i - 1].offset + whole->chunks[i - 1].length);
+    }
+    test_cut(split, data, TEST_DATA_SIZE, bytes, 1);
+    CHECK(test_same_cuts(whole, split));
+    test_cut(split, data, TEST_DATA_SIZE, primes, 4);
+    CHECK(test_same_cuts(whole, split));
+    test_cut(split, data, TEST_DATA_SIZE, reads, 1);
+    CHECK(test_same_cuts(whole, split));
+    test_cut(split, data, TEST_DATA_SIZE, boundaries, 4);
+    CHECK(test_same_cuts(whole, split));
+}
+
+// Inserting bytes moves the cuts next to them only, the chunks after resynchronize
+static void test_locality(unsigned char* data, const test_cuts_t* before, test_cuts_t* after) {
+    const size_t all[] = { TEST_DATA_SIZE };
+    size_t at = TEST_DATA_SIZE / 2;
+    int shared = 0;
+
+    memmove(data + at + 100, data + at, TEST_DATA_SIZE - at - 100);
+    test_fill(data + at, 100, 42);
+    test_cut(after, data, TEST_DATA_SIZE, all, 1);
+    for (int i = 0; i < after->count; i++) {
+        for (int j = 0; j < before->count; j++) {
+            if (after->chunks[i].hash == before->chunks[j].hash) {
+                shared++;
+                break;
+            }
+        }
+    }
+    // The chunk of the edit and the last one, cut short by the end of the buffer, differ
+    CHECK(shared >= after->count - 4);
+}
+
+// Two closes of a file through the manifest, an overwrite in the middle is the changed range
+static void test_diff(unsigned char* data) {
+    char directory[] = "/tmp/filemon-test-chunks-XXXXXX";
+    const char* path = "/srv/test/disk.img";
+    uint64_t path_hash = 0x1234;
+    chunk_job_t* job = calloc(1, sizeof(chunk_job_t));
+    chunk_diff_t diff;
+    size_t at = 3 * 1024 * 1024 + 12345;
+
+    REQUIRE(job != NULL && mkdtemp(directory) != NULL);
+    chunking_init(".*", directory);
+
+    REQUIRE(chunking_begin(job, path, path_hash, &diff));
+    chunker_feed(&job->chunker, data, TEST_DATA_SIZE);
+    REQUIRE(chunking_end(job, TEST_DATA_SIZE, 1));
+    CHECK(diff.status == CHUNKS_NEW);
+
+    REQUIRE(chunking_begin(job, path, path_hash, &diff));
+    chunker_feed(&job->chunker, data, TEST_DATA_SIZE);
+    REQUIRE(chunking_end(job, TEST_DATA_SIZE, 2));
+    CHECK(diff.status == CHUNKS_CHANGED);
+    CHECK(diff.changed_bytes == 0 && diff.range_count == 0);
+
+    test_fill(data + at, 10, 7);
+    REQUIRE(chunking_begin(job, path, path_hash, &diff));
+    for (size_t done = 0; done < TEST_DATA_SIZE; done += 1024 * 1024) {
+        chunker_feed(&job->chunker, data + done, 1024 * 1024);
+    }
+    REQUIRE(chunking_end(job, TEST_DATA_SIZE, 3));
+    CHECK(diff.status == CHUNKS_CHANGED);
+    CHECK(diff.range_count == 1);
+    CHECK(diff.ranges[0].start <= at && diff.ranges[0].end >= at + 10);
+    CHECK(diff.changed_bytes == diff.ranges[0].end - diff.ranges[0].start);
+    CHECK(diff.changed_bytes <= 2 * CHUNK_MAX);
+
+    char manifest[PATH_MAX + 32];
+    snprintf(manifest, sizeof(manifest), "%s/%016lx" CHUNK_MANIFEST_SUFFIX, directory, path_hash);
+    unlink(manifest);
+    rmdir(directory);
+    free(job);
+}
+
+int main() {
+    unsigned char* data = malloc(TEST_DATA_SIZE);
+    test_cuts_t* whole = malloc(sizeof(test_cuts_t));
+    test_cuts_t* split = malloc(sizeof(test_cuts_t));
+
+    REQUIRE(data != NULL && whole != NULL && split != NULL);
+    test_fill(data, TEST_DATA_SIZE, 0x9E3779B97F4A7C15ULL);
+    test_splits(data, whole, split);
+    test_locality(data, whole, split);
+    test_diff(data);
+    free(data);
+    free(whole);
+    free(split);
+    return test_done("chunking");
+}
@@ -0,0 +1,82 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "../src/utils/descendants.h"
+#include "test.h"
+
+/*
+ * The --follow-children PID set under PID churn: tombstones must not pile up until every miss
+ * scans the table, and lookups from another thread must see the PIDs that stay in the set while
+ * the table is rebuilt.
+ */
+
+#define TEST_KEPT 1000
+#define TEST_CHURN 40000                   // PIDs in the set at once besides the kept ones
+#define TEST_FORKS 2000000
+
+static volatile int test_running = 1;
+static long test_missed = 0;
+
+// Longest run of non-empty slots, the most a miss can scan
+static int test_longest_chain() {
+    int longest = 0, run = 0;
+    // Twice around, for a run that wraps
+    for (int i = 0; i < 2 * DESCENDANTS_SLOTS; i++) {
+        run = g_descendants.slots[i & (DESCENDANTS_SLOTS - 1)] == DESCENDANTS_EMPTY ? 0 : run + 1;
+        longest = run > longest ? run : longest;
+    }
+    return longest;
+}
+
+static void* test_reader(void* arg) {
+    (void)arg;
+    while (__atomic_load_n(&test_running, __ATOMIC_RELAXED)) {
+        for (int pid = 1; pid <= TEST_KEPT; pid++) {
+            if (!descendants_contains(pid)) {
+                __atomic_add_fetch(&test_missed, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    return NULL;
+}
+
+int main() {
+    pthread_t reader;
+    int pid = 100000;
+
+    for (int i = 1; i <= TEST_KEPT; i++) {
+        descendants_add(i);
+    }
+    REQUIRE(pthread_create(&reader, NULL, test_reader, NULL) == 0);
+
+    // Like a build: PIDs grow, each process lives while TEST_CHURN newer ones start
+    for (int i = 0; i < TEST_FORKS; i++) {
+        descendants_add(pid + i);
+        if (i >= TEST_CHURN) {
+            descendants_remove(pid + i - TEST_CHURN);
+        }
+        if (i % 100000 == 0) {
+            CHECK(g_descendants.count + g_descendants.tombstones <= DESCENDANTS_SLOTS / 4 * 3);
+        }
+    }
+    __atomic_store_n(&test_running, 0, __ATOMIC_RELAXED);
+    pthread_join(reader, NULL);
+
+    CHECK(test_missed == 0);
+    CHECK(g_descendants.count == TEST_KEPT + TEST_CHURN);
+    CHECK(g_descendants.count + g_descendants.tombstones <= DESCENDANTS_SLOTS / 4 * 3);
+    CHECK(test_longest_chain() < DESCENDANTS_SLOTS / 4 * 3);
+    CHECK(!g_descendants.full_warned);
+    for (int i = 1; i <= TEST_KEPT; i++) {
+        CHECK(descendants_contains(i));
+    }
+    CHECK(descendants_contains(pid + TEST_FORKS - 1));
+    CHECK(!descendants_contains(pid + TEST_FORKS - TEST_CHURN - 1));
+    CHECK(!descendants_contains(pid));
+    CHECK(!descendants_contains(pid + TEST_FORKS));
+    return test_done("descendants");
+}
@@ -0,0 +1,107 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../src/utils/wrappers.h"
+#include "../src/utils/logindex.h"
+#include "test.h"
+
+/*
+ * The --index blocks against build/filemon-query: when a block cannot be written, the records it
+ * held are still found, by scanning the log between the blocks around it. filemon keys the blocks
+ * with hash_string() and readers look them up with filemon_index_hash(), they must agree.
+ */
+
+#define TEST_BLOCKS 3
+#define TEST_RECORDS 100                   // Per block
+#define TEST_TIME_NS 1792404000000000000ULL  // 2026-10-19T10:00:00Z
+
+static char test_log[] = "/tmp/filemon-test-index-XXXXXX";
+
+// Writes the log and indexes it, block 1 fails to make it to the index
+static void test_write(int fd) {
+    logindex_entry_t entry;
+    char line[256];
+    uint64_t offset = 0;
+
+    for (int block = 0; block < TEST_BLOCKS; block++) {
+        for (int i = 0; i < TEST_RECORDS; i++) {
+            char path[32];
+            snprintf(path, sizeof(path), "/srv/%d", i % 10);
+            int len = snprintf(line, sizeof(line),
+                               "{\"time\":\"2026-10-19T10:00:%02d.%03d+00:00\",\"group\":\"read_write_execute\",\"pid\":%d,"
+                               "\"comm\":\"t\",\"path\":\"%s\",\"flags\":\"MODIFY\"}\n", block, i, 1000 + block, path);
+            REQUIRE(write(fd, line, len) == len);
+            entry = (logindex_entry_t){
+                .offset = 0,
+                .length = len,
+                .pid = 1000 + block,
+                .time_ns = TEST_TIME_NS + block * 1000000000ULL + i * 1000000ULL,
+                .path = hash_string(path),
+                .process = hash_string("t"),
+            };
+            logindex_add(&entry, 1, offset, len);
+            offset += len;
+        }
+        if (block == 1) {
+            // A write that fails, as on a full disk
+            int good = g_logindex.fd;
+            g_logindex.fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            REQUIRE(g_logindex.fd != -1);
+            logindex_flush();
+            close(g_logindex.fd);
+            g_logindex.fd = good;
+            CHECK(g_logindex.write_errors == 1 && g_logindex.count == 0);
+        } else {
+            logindex_flush();
+        }
+    }
+    logindex_stop();
+    CHECK(g_logindex.blocks_written == TEST_BLOCKS - 1);
+}
+
+// Lines printed by filemon-query with the arguments
+static int test_query(const char* arguments) {
+    char command[PATH_MAX + 256], line[512];
+    int lines = 0;
+
+    snprintf(command, sizeof(command), "build/filemon-query %s %s", arguments, test_log);
+    FILE* out = popen(command, "r");
+    REQUIRE(out != NULL);
+    while (fgets(line, sizeof(line), out) != NULL) {
+        lines++;
+    }
+    CHECK(pclose(out) == 0);
+    return lines;
+}
+
+int main() {
+    char index[PATH_MAX];
+
+    const char* keys[] = { "", "/", "/srv/data/\xff\xfe name", "systemd-journald" };
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        CHECK(hash_string(keys[i]) == filemon_index_hash(keys[i]));
+        CHECK(hash_bytes(keys[i], strlen(keys[i])) == hash_string(keys[i]));
+    }
+
+    int fd = mkstemp(test_log);
+    REQUIRE(fd != -1);
+    logindex_init(test_log, FILEMON_INDEX_JSONL, 0);
+    test_write(fd);
+    close(fd);
+
+    CHECK(test_query("-p /srv/3") == TEST_BLOCKS * TEST_RECORDS / 10);
+    CHECK(test_query("-P 1001") == TEST_RECORDS);
+    CHECK(test_query("-P 1002") == TEST_RECORDS);
+    CHECK(test_query("-P 1001 -n 5") == 5);
+    CHECK(test_query("-c t") == TEST_BLOCKS * TEST_RECORDS);
+
+    snprintf(index, sizeof(index), "%s" FILEMON_INDEX_SUFFIX, test_log);
+    unlink(index);
+    unlink(test_log);
+    return test_done("logindex");
+}
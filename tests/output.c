@@ -0,0 +1,105 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/utils/output.h"
+#include "test.h"
+
+/*
+ * The --format escaping: JSON strings are RFC 8259 with any byte that is not valid UTF-8 written as
+ * \u00XX, CSV fields are quoted with the quotes doubled, and whole records come out in the
+ * documented field order.
+ */
+
+static char test_buf[4096];
+
+static const char* test_json(const char* str) {
+    *out_json_string(test_buf, str) = '\0';
+    return test_buf;
+}
+
+static const char* test_csv(const char* str) {
+    *out_csv_string(test_buf, str) = '\0';
+    return test_buf;
+}
+
+static const char* test_record(output_format_t format, const event_t* event) {
+    struct timespec now = { .tv_sec = 1792404000, .tv_nsec = 123456789 };  // 2026-10-19T10:00:00Z
+    g_output.format = format;
+    *output_serialize(test_buf, event, &now, NULL, NULL) = '\0';
+    return test_buf;
+}
+
+static void test_json_escaping() {
+    CHECK(strcmp(test_json(""), "\"\"") == 0);
+    CHECK(strcmp(test_json("/srv/data/file.txt"), "\"/srv/data/file.txt\"") == 0);
+    CHECK(strcmp(test_json("a\"b\\c"), "\"a\\\"b\\\\c\"") == 0);
+    CHECK(strcmp(test_json("\n\r\t\b\f"), "\"\\n\\r\\t\\b\\f\"") == 0);
+    CHECK(strcmp(test_json("\x01\x1f\x7f"), "\"\\u0001\\u001f\x7f\"") == 0);
+
+    // Valid UTF-8 of every length is copied as is
+    CHECK(strcmp(test_json("caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x93\x81"), "\"caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x93\x81\"") == 0);
+    // Latin-1, a stray continuation byte, and bytes that never occur in UTF-8
+    CHECK(strcmp(test_json("caf\xe9"), "\"caf\\u00e9\"") == 0);
+    CHECK(strcmp(test_json("\x80x"), "\"\\u0080x\"") == 0);
+    CHECK(strcmp(test_json("\xfe\xff"), "\"\\u00fe\\u00ff\"") == 0);
+    // Overlong encodings, a surrogate, and beyond U+10FFFF
+    CHECK(strcmp(test_json("\xc0\xaf"), "\"\\u00c0\\u00af\"") == 0);
+    CHECK(strcmp(test_json("\xe0\x80\xaf"), "\"\\u00e0\\u0080\\u00af\"") == 0);
+    CHECK(strcmp(test_json("\xed\xa0\x80"), "\"\\u00ed\\u00a0\\u0080\"") == 0);
+    CHECK(strcmp(test_json("\xf4\x90\x80\x80"), "\"\\u00f4\\u0090\\u0080\\u0080\"") == 0);
+    // A sequence cut short by the end of the string or by another character
+    CHECK(strcmp(test_json("a\xe2\x82"), "\"a\\u00e2\\u0082\"") == 0);
+    CHECK(strcmp(test_json("\xc3\""), "\"\\u00c3\\\"\"") == 0);
+}
+
+static void test_csv_quoting() {
+    CHECK(strcmp(test_csv(""), "\"\"") == 0);
+    CHECK(strcmp(test_csv("plain"), "\"plain\"") == 0);
+    CHECK(strcmp(test_csv("a,b\nc"), "\"a,b\nc\"") == 0);
+    CHECK(strcmp(test_csv("\"quoted\""), "\"\"\"quoted\"\"\"") == 0);
+    CHECK(strcmp(test_csv("say \"\"hi\""), "\"say \"\"\"\"hi\"\"\"") == 0);
+    // Bytes are kept, CSV has no escapes
+    CHECK(strcmp(test_csv("caf\xe9\t"), "\"caf\xe9\t\"") == 0);
+}
+
+static void test_records() {
+    event_t event = {
+        .group = GROUP_CREATE_DELETE_MOVE,
+        .pid = 4321,
+        .mask = FAN_MOVED_TO,
+        .comm = "mv \"x\"",
+        .path = "/srv/new,\xff",
+        .old_path = "/srv/old\n",
+    };
+
+    CHECK(strcmp(test_record(OUTPUT_JSONL, &event),
+                 "{\"time\":\"2026-10-19T10:00:00.123+00:00\",\"group\":\"create_delete_move\",\"pid\":4321,"
+                 "\"comm\":\"mv \\\"x\\\"\",\"flags\":[\"FAN_MOVED_TO\"],\"path\":\"/srv/new,\\u00ff\","
+                 "\"old_path\":\"/srv/old\\n\"}\n") == 0);
+    CHECK(strcmp(test_record(OUTPUT_CSV, &event),
+                 "2026-10-19T10:00:00.123+00:00,create_delete_move,4321,\"mv \"\"x\"\"\",\"FAN_MOVED_TO\","
+                 "\"/srv/new,\xff\",\"/srv/old\n\"\n") == 0);
+
+    // No old_path: the JSON field is left out, the CSV column is empty
+    event.group = GROUP_READ_WRITE_EXECUTE;
+    event.mask = FAN_MODIFY | FAN_CLOSE_WRITE;
+    event.old_path = NULL;
+    CHECK(strstr(test_record(OUTPUT_JSONL, &event), "old_path") == NULL);
+    CHECK(strstr(test_buf, "\"group\":\"read_write_execute\"") != NULL);
+    CHECK(strstr(test_buf, "\"flags\":[\"FAN_MODIFY\",\"FAN_CLOSE_WRITE\"]") != NULL);
+    CHECK(strcmp(test_record(OUTPUT_CSV, &event),
+                 "2026-10-19T10:00:00.123+00:00,read_write_execute,4321,\"mv \"\"x\"\"\","
+                 "\"FAN_MODIFY|FAN_CLOSE_WRITE\",\"/srv/new,\xff\",\n") == 0);
+}
+
+int main() {
+    setenv("TZ", "UTC", 1);
+    tzset();
+    test_json_escaping();
+    test_csv_quoting();
+    test_records();
+    return test_done("output");
+}
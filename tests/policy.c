@@ -0,0 +1,155 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "../src/utils/policy.h"
+#include "test.h"
+
+/*
+ * The decisions of --policy: the first rule that matches wins, for the events it lists, with its
+ * conditions negated by !; the default action when none does; the on-timeout action, not cached,
+ * when the budget runs out. And the decision cache: a process that execs another binary, under the
+ * same name, must be judged by the new executable rather than by the cached decision of the old one.
+ */
+
+static char test_self[PATH_MAX];
+
+// Replaces the policy with the lines given
+static void test_load(const char* lines, int budget_us) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/filemon-test-policy-%d", getpid());
+    FILE* file = fopen(path, "w");
+    REQUIRE(file != NULL);
+    fputs(lines, file);
+    fclose(file);
+    memset(&g_policy, 0, sizeof(g_policy));
+    policy_init(path, budget_us);
+    unlink(path);
+}
+
+static int test_decide(int pid, const char* comm, const char* path, uint64_t mask, policy_decision_t* decision) {
+    return policy_decide(pid, comm, path, 0, mask, decision);
+}
+
+static void test_rules(int child) {
+    policy_decision_t decision;
+
+    test_load("# Rules are tried in order\n"
+              "deny   open        ^/data/secret/  !process=reader\n"
+              "audit  exec        ^/data/bin/\n"
+              "deny   access      ^/data/log/\n"
+              "allow  open,access ^/data/secret/public/\n"
+              "allow  all         ^/data/\n"
+              "default deny\n"
+              "on-timeout allow\n", POLICY_BUDGET_MAX);
+    REQUIRE(g_policy.enabled && g_policy.count == 5);
+
+    // First match, and the negated condition
+    CHECK(test_decide(child, "other", "/data/secret/key", FAN_OPEN_PERM, &decision) == POLICY_DENY && decision.rule == 2);
+    CHECK(test_decide(child, "reader", "/data/secret/key", FAN_OPEN_PERM, &decision) == POLICY_ALLOW && decision.rule == 6);
+    CHECK(test_decide(child, "other", "/data/secret/public/a", FAN_OPEN_PERM, &decision) == POLICY_DENY && decision.rule == 2);
+    CHECK(test_decide(child, "reader", "/data/secret/public/a", FAN_OPEN_PERM, &decision) == POLICY_ALLOW && decision.rule == 5);
+
+    // Each rule only answers the events it lists
+    CHECK(test_decide(child, "other", "/data/secret/key", FAN_ACCESS_PERM, &decision) == POLICY_ALLOW && decision.rule == 6);
+    CHECK(test_decide(child, "other", "/data/log/app", FAN_ACCESS_PERM, &decision) == POLICY_DENY && decision.rule == 4);
+    CHECK(test_decide(child, "other", "/data/log/app", FAN_OPEN_PERM, &decision) == POLICY_ALLOW && decision.rule == 6);
+    CHECK(test_decide(child, "other", "/data/bin/tool", FAN_OPEN_PERM, &decision) == POLICY_ALLOW && decision.rule == 6);
+    #ifdef FAN_OPEN_EXEC_PERM
+    CHECK(test_decide(child, "other", "/data/bin/tool", FAN_OPEN_EXEC_PERM, &decision) == POLICY_AUDIT && decision.rule == 3);
+    #endif
+
+    // No rule matches
+    CHECK(test_decide(child, "other", "/home/user/file", FAN_OPEN_PERM, &decision) == POLICY_DENY);
+    CHECK(decision.rule == 0 && !decision.timed_out);
+
+    // Out of budget before the first rule, and the answer is not remembered
+    uint64_t timeouts = metrics_sum(METRIC_POLICY_TIMEOUTS);
+    uint64_t misses = metrics_sum(METRIC_POLICY_CACHE_MISSES);
+    g_policy.budget_ns = 0;
+    CHECK(test_decide(child, "other", "/data/secret/other", FAN_OPEN_PERM, &decision) == POLICY_ALLOW);
+    CHECK(decision.timed_out && decision.rule == 0);
+    CHECK(metrics_sum(METRIC_POLICY_TIMEOUTS) == timeouts + 1);
+    // A decision made in time is still answered from the cache
+    CHECK(test_decide(child, "other", "/data/secret/key", FAN_OPEN_PERM, &decision) == POLICY_DENY && !decision.timed_out);
+    g_policy.budget_ns = POLICY_BUDGET_MAX * 1000ULL;
+    CHECK(test_decide(child, "other", "/data/secret/other", FAN_OPEN_PERM, &decision) == POLICY_DENY && decision.rule == 2);
+    CHECK(metrics_sum(METRIC_POLICY_CACHE_MISSES) == misses + 2);
+
+    // on-timeout deny
+    test_load("allow all *\non-timeout deny\n", 1);
+    g_policy.budget_ns = 0;
+    CHECK(test_decide(child, "other", "/data/x", FAN_OPEN_PERM, &decision) == POLICY_DENY && decision.timed_out);
+}
+
+static int test_exe_is(int pid, const char* exe) {
+    char link[32], target[PATH_MAX];
+    snprintf(link, sizeof(link), "/proc/%d/exe", pid);
+    ssize_t len = readlink(link, target, sizeof(target) - 1);
+    if (len <= 0) {
+        return 0;
+    }
+    target[len] = '\0';
+    return strcmp(target, exe) == 0;
+}
+
+int main() {
+    char policy[PATH_MAX + 128];
+    int ready[2];
+    policy_decision_t decision;
+
+    ssize_t len = readlink("/proc/self/exe", test_self, sizeof(test_self) - 1);
+    REQUIRE(len > 0);
+    test_self[len] = '\0';
+
+    // A child of this binary that execs sleep when told to
+    REQUIRE(pipe(ready) == 0);
+    pid_t child = fork();
+    REQUIRE(child != -1);
+    if (child == 0) {
+        char go;
+        close(ready[1]);
+        if (read(ready[0], &go, 1) == 1) {
+            execl("/bin/sleep", "sleep", "10", (char*)NULL);
+        }
+        _exit(EXIT_FAILURE);
+    }
+    close(ready[0]);
+
+    test_rules(child);
+
+    snprintf(policy, sizeof(policy), "# Only this test binary may open the secret\n"
+             "deny open ^/etc/secret$ !exe=%s\n"
+             "audit exec ^/tmp/\n", test_self);
+    test_load(policy, POLICY_BUDGET_MAX);
+    CHECK(policy_decide(child, "agent", "/etc/secret", 0, FAN_OPEN_PERM, &decision) == POLICY_ALLOW);
+    CHECK(decision.rule == 0);
+    uint64_t hits = metrics_sum(METRIC_POLICY_CACHE_HITS);
+    CHECK(policy_decide(child, "agent", "/etc/secret", 0, FAN_OPEN_PERM, &decision) == POLICY_ALLOW);
+    CHECK(metrics_sum(METRIC_POLICY_CACHE_HITS) == hits + 1);
+    CHECK(policy_decide(child, "agent", "/etc/passwd", 0, FAN_OPEN_PERM, &decision) == POLICY_ALLOW);
+
+    // Same PID and same name, another executable
+    REQUIRE(write(ready[1], "x", 1) == 1);
+    for (int i = 0; i < 200 && test_exe_is(child, test_self); i++) {
+        usleep(10000);
+    }
+    REQUIRE(!test_exe_is(child, test_self));
+    CHECK(policy_decide(child, "agent", "/etc/secret", 0, FAN_OPEN_PERM, &decision) == POLICY_DENY);
+    CHECK(decision.rule == 2);
+    CHECK(policy_decide(child, "agent", "/etc/secret", 0, FAN_OPEN_PERM, &decision) == POLICY_DENY);
+    CHECK(policy_decide(child, "agent", "/tmp/x", 0, FAN_OPEN_PERM, &decision) == POLICY_ALLOW);
+
+    // This process itself is always allowed, whatever the rules
+    CHECK(policy_decide(getpid(), "agent", "/etc/secret", 0, FAN_OPEN_PERM, &decision) == POLICY_ALLOW);
+
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+    close(ready[1]);
+    return test_done("policy");
+}
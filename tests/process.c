@@ -0,0 +1,63 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "../src/utils/process.h"
+#include "test.h"
+
+/*
+ * The --lineage process table sweep: exited processes go, live ones stay, and a single call never
+ * checks more than PROCTABLE_SWEEP_BATCH entries.
+ */
+
+#define TEST_MAX 1000
+#define TEST_GONE 700
+
+static void test_observe(int pid) {
+    proc_identity_t identity = { .pid = pid, .ppid = 1 };
+    snprintf(identity.comm, sizeof(identity.comm), "p%d", pid);
+    proctable_observe(&identity, 0);
+}
+
+int main() {
+    char path[32];
+    int gone = 0;
+
+    proctable_init(TEST_MAX);
+    test_observe(getpid());
+    test_observe(getppid());
+    // High PIDs that are not running
+    for (int pid = 4194000; gone < TEST_GONE; pid--) {
+        snprintf(path, sizeof(path), "/proc/%d", pid);
+        if (access(path, F_OK) == -1) {
+            test_observe(pid);
+            gone++;
+        }
+    }
+    REQUIRE(g_proctable.count == TEST_GONE + 2);
+
+    // Every call makes progress, by at most a batch
+    int calls = 0;
+    do {
+        int before = g_proctable.count;
+        proctable_sweep();
+        calls++;
+        CHECK(before - g_proctable.count <= PROCTABLE_SWEEP_BATCH);
+    } while (g_proctable.sweep_next < g_proctable.max && calls < TEST_MAX);
+    CHECK(calls == (TEST_GONE + 2 + PROCTABLE_SWEEP_BATCH - 1) / PROCTABLE_SWEEP_BATCH);
+    CHECK(g_proctable.count == 2);
+
+    proc_entry_t entry;
+    CHECK(proctable_lookup(getpid(), &entry) && entry.exe[0] == '/');
+    CHECK(proctable_lookup(getppid(), &entry));
+    CHECK(!proctable_lookup(4194000, &entry));
+
+    // The next sweep waits for PROCTABLE_SWEEP_NS
+    test_observe(4194000 - 1);
+    proctable_sweep();
+    CHECK(g_proctable.count == 3);
+    return test_done("process");
+}
@@ -0,0 +1,119 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "../src/utils/ring.h"
+#include "test.h"
+
+/*
+ * The --ring producer and the include/filemon_ring.h consumer across wraps of a 1MB ring: pads
+ * shorter than a record, records of odd sizes, and a consumer that is lapped.
+ */
+
+#define TEST_RING_CAPACITY (1024 * 1024)
+
+static char test_comm[] = "t";
+
+static void test_publish(const char* path) {
+    event_t event = {
+        .group = GROUP_CREATE_DELETE_MOVE,
+        .pid = 4242,
+        .mask = FAN_CREATE,
+        .comm = test_comm,
+        .path = path,
+    };
+    ring_publish(&event);
+}
+
+// Reads what is there, checking that sequence numbers follow each other. Returns the records read.
+static uint64_t test_drain(filemon_ring_consumer_t* consumer, uint64_t* next_seq, uint64_t limit) {
+    const filemon_record_t* record;
+    uint64_t read = 0;
+
+    while (read <= limit && (record = filemon_ring_next(consumer)) != NULL) {
+        uint64_t seq = record->seq;
+        CHECK(record->type == FILEMON_RECORD_EVENT);
+        REQUIRE(filemon_ring_done(consumer));
+        if (*next_seq != 0) {
+            // A duplicate or a step back means the consumer moved backwards
+            REQUIRE(seq >= *next_seq);
+        }
+        *next_seq = seq + 1;
+        read++;
+    }
+    return read;
+}
+
+// Records of 56 bytes leave a 32-byte pad at the first wrap, shorter than a record header
+static void test_short_pad() {
+    filemon_ring_consumer_t consumer;
+    uint64_t next_seq = 0, read = 0, published = 0;
+
+    REQUIRE(filemon_ring_open(&consumer, g_ring.name, "test") == 0);
+    while (published < 3 * TEST_RING_CAPACITY / 56) {
+        test_publish("/a/b");
+        published++;
+        read += test_drain(&consumer, &next_seq, 1);
+    }
+    CHECK(read == published);
+    CHECK(consumer.lost == 0);
+    CHECK(next_seq == g_ring.seq + 1);
+    filemon_ring_close(&consumer);
+}
+
+// Every size from 56 to 304 bytes, so the pads at the wraps take many sizes
+static void test_odd_sizes() {
+    filemon_ring_consumer_t consumer;
+    uint64_t next_seq = 0, read = 0, published = 0;
+    char path[256];
+
+    REQUIRE(filemon_ring_open(&consumer, g_ring.name, "test") == 0);
+    for (int i = 0; published < 4 * TEST_RING_CAPACITY / 150; i++) {
+        int len = 4 + (i * 7) % 251;
+        memset(path, 'p', len);
+        path[0] = '/';
+        path[len] = '\0';
+        test_publish(path);
+        published++;
+        read += test_drain(&consumer, &next_seq, 1);
+    }
+    CHECK(read == published);
+    CHECK(consumer.lost == 0);
+    filemon_ring_close(&consumer);
+}
+
+// A consumer three rings behind skips to the tail once and counts what it lost
+static void test_lapped() {
+    filemon_ring_consumer_t consumer;
+    uint64_t next_seq = 0, published = 0, read;
+
+    REQUIRE(filemon_ring_open(&consumer, g_ring.name, "test") == 0);
+    uint64_t first = g_ring.seq + 1;
+    while (published < 3 * TEST_RING_CAPACITY / 56) {
+        test_publish("/a/b/c");
+        published++;
+    }
+    read = test_drain(&consumer, &next_seq, published);
+    // The records from the tail on are read without gaps, the ones before it are gone
+    CHECK(read > 0 && read < published);
+    CHECK(next_seq == g_ring.seq + 1);
+    CHECK(next_seq - read > first);
+    CHECK(consumer.lost == 0);
+    CHECK(filemon_ring_next(&consumer) == NULL);
+    filemon_ring_close(&consumer);
+}
+
+int main() {
+    char name[64];
+
+    snprintf(name, sizeof(name), "filemon-test-ring-%d", getpid());
+    ring_init(name, TEST_RING_CAPACITY >> 20);
+    test_short_pad();
+    test_odd_sizes();
+    test_lapped();
+    ring_stop();
+    return test_done("ring");
+}
@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "../src/utils/rules.h"
+#include "test.h"
+
+/*
+ * The --filter-config parser and reloads: the line syntax and its errors, repeated keys, the rules
+ * that come out of it, cgroup verdicts that follow the version in use, and a reload that only
+ * publishes a new version when the file changed, keeping the rules in use when it does not parse.
+ */
+
+static char test_config[] = "/tmp/filemon-test-rules-XXXXXX";
+static char test_cgroup[CGROUP_PATH_LEN];
+
+// rules_parse() on a copy of text, the error is left in error
+static rule_set_t* test_parse(const char* text, uint64_t version, char* error) {
+    char* copy = strdup(text);
+    REQUIRE(copy != NULL);
+    error[0] = '\0';
+    rule_set_t* rules = rules_parse(copy, version, error, 256);
+    free(copy);
+    return rules;
+}
+
+static void test_free(rule_set_t* rules) {
+    if (rules != NULL) {
+        free_filters(&rules->filters);
+        free(rules);
+    }
+}
+
+static void test_syntax() {
+    char error[256];
+    rule_set_t* rules;
+
+    rules = test_parse("", 1, error);
+    CHECK(rules != NULL && rules->version == 1);
+    CHECK(rules->filters.exclude_pattern[0] == '\0' && rules->filters.exclude_process[0][0] == '\0');
+    CHECK(rules->cgroups.include_count == 0 && rules->cgroups.exclude_count == 0);
+    test_free(rules);
+
+    // Comments, blank lines, CRLF and extra blanks, repeated keys add up
+    rules = test_parse("# filemon rules\n"
+                       "\n"
+                       "   \t\n"
+                       "  exclude-process\tupdatedb mlocate  \r\n"
+                       "exclude-process   rsync\n"
+                       "exclude-pattern \\.swp$\n"
+                       "exclude-pattern ^/srv/tmp/\n"
+                       "exclude-pids 10 20\n"
+                       "exclude-cgroup /system.slice/backup.service/ /user.slice", 7, error);
+    REQUIRE(rules != NULL);
+    CHECK(rules->version == 7);
+    CHECK(strcmp(rules->filters.exclude_process[0], "updatedb") == 0);
+    CHECK(strcmp(rules->filters.exclude_process[1], "mlocate") == 0);
+    CHECK(strcmp(rules->filters.exclude_process[2], "rsync") == 0);
+    CHECK(rules->filters.exclude_process[3][0] == '\0');
+    CHECK(strcmp(rules->filters.exclude_pattern, "(\\.swp$)|(^/srv/tmp/)") == 0);
+    CHECK(!pattern_filter_pass(&rules->filters, "/srv/data/.notes.swp"));
+    CHECK(!pattern_filter_pass(&rules->filters, "/srv/tmp/file"));
+    CHECK(pattern_filter_pass(&rules->filters, "/srv/data/notes"));
+    CHECK(apply_root_filters(&rules->filters, 20, "bash") == FILTER_PID);
+    CHECK(apply_root_filters(&rules->filters, 30, "rsync") == FILTER_PROCESS);
+    CHECK(apply_root_filters(&rules->filters, 30, "bash") == FILTER_PASS);
+    CHECK(rules->cgroups.exclude_count == 2);
+    CHECK(strcmp(rules->cgroups.exclude[0], "/system.slice/backup.service") == 0);
+    CHECK(strcmp(rules->cgroups.exclude[1], "/user.slice") == 0);
+    test_free(rules);
+
+    CHECK(test_parse("# x\nexclude-processes a\n", 1, error) == NULL);
+    CHECK(strcmp(error, "line 2: Unknown option \"exclude-processes\".") == 0);
+    CHECK(test_parse("include-pattern   \n", 1, error) == NULL);
+    CHECK(strcmp(error, "line 1: include-pattern needs a value.") == 0);
+    CHECK(test_parse("include-process a\nexclude-process b\n", 1, error) == NULL);
+    CHECK(strcmp(error, "include-process and exclude-process cannot be used at the same time.") == 0);
+    CHECK(test_parse("include-cgroup /a\nexclude-cgroup /b\n", 1, error) == NULL);
+    CHECK(strcmp(error, "include-cgroup and exclude-cgroup cannot be used at the same time.") == 0);
+    CHECK(test_parse("include-pids 1 x\n", 1, error) == NULL);
+    CHECK(strcmp(error, "-I option: 'x' is not an integer.") == 0);
+    CHECK(test_parse("exclude-pattern ([a-\n", 1, error) == NULL);
+    CHECK(error[0] != '\0');
+
+    char text[CGROUP_FILTER_MAX * 8 + 32] = "include-cgroup";
+    for (int i = 0; i <= CGROUP_FILTER_MAX; i++) {
+        sprintf(text + strlen(text), " /c%d", i);
+    }
+    CHECK(test_parse(text, 1, error) == NULL);
+    CHECK(strstr(error, "include-cgroup has more than") == error);
+}
+
+// The cgroup verdicts are cached per version of the rules
+static void test_cgroups() {
+    char error[256];
+    char text[CGROUP_PATH_LEN + 32];
+    const char* comm = "test_rules";
+
+    rule_set_t* rules = test_parse("include-cgroup /", 1, error);
+    REQUIRE(rules != NULL);
+    CHECK(cgroup_rules_allowed(getpid(), comm, &rules->cgroups));
+    test_free(rules);
+
+    snprintf(text, sizeof(text), "exclude-cgroup %s", test_cgroup);
+    rules = test_parse(text, 2, error);
+    REQUIRE(rules != NULL);
+    CHECK(!cgroup_rules_allowed(getpid(), comm, &rules->cgroups));
+    test_free(rules);
+
+    rules = test_parse("exclude-cgroup /filemon-test-none", 3, error);
+    REQUIRE(rules != NULL);
+    CHECK(cgroup_rules_allowed(getpid(), comm, &rules->cgroups));
+    test_free(rules);
+
+    rules = test_parse("include-cgroup /filemon-test-none", 4, error);
+    REQUIRE(rules != NULL);
+    CHECK(!cgroup_rules_allowed(getpid(), comm, &rules->cgroups));
+    test_free(rules);
+}
+
+static void test_write(const char* text) {
+    FILE* file = fopen(test_config, "w");
+    REQUIRE(file != NULL);
+    fputs(text, file);
+    fclose(file);
+}
+
+static void test_reload() {
+    monitor_box_t* m_box = calloc(1, sizeof(monitor_box_t));
+    char error[256];
+
+    REQUIRE(m_box != NULL);
+    pthread_mutex_init(&m_box->watch_lock, NULL);
+    m_box->watch = watch_set_build(NULL, 0, NULL);
+    REQUIRE(m_box->watch != NULL);
+    g_rules.m_box = m_box;
+    strcpy(g_rules.path, test_config);
+
+    test_write("exclude-process updatedb\n");
+    CHECK(rules_reload(0, error, sizeof(error)) == 1);
+    CHECK(m_box->watch->rules->version == 1);
+    CHECK(strcmp(m_box->watch->rules->filters.exclude_process[0], "updatedb") == 0);
+
+    // Unchanged, the rules in use stay
+    watch_set_t* watch = m_box->watch;
+    CHECK(rules_reload(0, error, sizeof(error)) == 1);
+    CHECK(m_box->watch == watch);
+
+    test_write("exclude-process rsync\n");
+    CHECK(rules_reload(0, error, sizeof(error)) == 2);
+    CHECK(m_box->watch->rules->version == 2);
+    CHECK(strcmp(m_box->watch->rules->filters.exclude_process[0], "rsync") == 0);
+
+    // A file that does not parse keeps version 2, and is tried again when asked
+    test_write("exclude-process rsync\ninclude-process cp\n");
+    CHECK(rules_reload(0, error, sizeof(error)) == 0);
+    CHECK(strcmp(error, "include-process and exclude-process cannot be used at the same time.") == 0);
+    CHECK(g_rules.version == 2 && m_box->watch->rules->version == 2);
+    CHECK(rules_reload(0, error, sizeof(error)) == 0);
+
+    // A forced reload publishes the same contents again
+    test_write("exclude-process rsync\n");
+    CHECK(rules_reload(0, error, sizeof(error)) == 2);
+    CHECK(rules_reload(1, error, sizeof(error)) == 3);
+    CHECK(m_box->watch->rules->version == 3);
+
+    unlink(test_config);
+    CHECK(rules_reload(1, error, sizeof(error)) == 0);
+    CHECK(g_rules.version == 3);
+}
+
+int main() {
+    // The reload errors are expected
+    FILE* quiet = fopen("/dev/null", "w");
+    REQUIRE(quiet != NULL);
+    logger_console(quiet);
+
+    int fd = mkstemp(test_config);
+    REQUIRE(fd != -1);
+    close(fd);
+    REQUIRE(read_cgroup_path(getpid(), test_cgroup, sizeof(test_cgroup)));
+
+    test_syntax();
+    test_cgroups();
+    test_reload();
+    return test_done("rules");
+}
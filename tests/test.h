@@ -0,0 +1,34 @@
+#ifndef FILEMON_TEST_H
+#define FILEMON_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Checks for the behavior tests, one program per module in tests/, run by make test. A failed
+ * check is reported with its line and the program exits 1 at test_done().
+ */
+
+static int test_failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            test_failures++; \
+        } \
+    } while (0)
+
+// Stops at the first failure of a check that later checks depend on
+#define REQUIRE(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+static inline int test_done(const char* name) {
+    printf("%-28s %s\n", name, test_failures ? "FAILED" : "ok");
+    return test_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#endif
@@ -0,0 +1,138 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/utils/watchspec.h"
+#include "../src/utils/pathtrie.h"
+#include "test.h"
+
+/*
+ * The "DIRECTORY [FILTER OPTIONS]" specs of -W and the control socket: argument splitting with
+ * quotes, the filter options and their conflicts, and the watch root bit mask of the path trie.
+ */
+
+static void test_split() {
+    char* argv[4];
+    char text[128];
+
+    strcpy(text, "  /srv/a\t-i  x ");
+    CHECK(split_arguments(text, argv, 4) == 3);
+    CHECK(strcmp(argv[0], "/srv/a") == 0 && strcmp(argv[1], "-i") == 0 && strcmp(argv[2], "x") == 0);
+
+    // Quotes keep spaces, are removed, and can be next to other characters
+    strcpy(text, "'/srv/my dir' -e \"\\.swp$ tmp\" a'b c'd");
+    CHECK(split_arguments(text, argv, 4) == 4);
+    CHECK(strcmp(argv[0], "/srv/my dir") == 0);
+    CHECK(strcmp(argv[2], "\\.swp$ tmp") == 0);
+    CHECK(strcmp(argv[3], "ab cd") == 0);
+
+    strcpy(text, "'' \"it's\"");
+    CHECK(split_arguments(text, argv, 4) == 2);
+    CHECK(argv[0][0] == '\0' && strcmp(argv[1], "it's") == 0);
+
+    strcpy(text, "   ");
+    CHECK(split_arguments(text, argv, 4) == 0);
+    strcpy(text, "/srv/a -i 'x");
+    CHECK(split_arguments(text, argv, 4) == -1);
+    strcpy(text, "a b c d e");
+    CHECK(split_arguments(text, argv, 4) == -1);
+}
+
+// parse_watch_root() on a copy of spec, the error is left in error
+static int test_parse(const char* spec, filter_options_t* options, char** directory, char* error) {
+    static char text[4][256];
+    static int next = 0;
+    char* copy = text[next++ % 4];
+
+    snprintf(copy, sizeof(text[0]), "%s", spec);
+    error[0] = '\0';
+    return parse_watch_root(copy, options, directory, error, 256);
+}
+
+static void test_watch_root() {
+    filter_options_t options;
+    char* directory;
+    char error[256];
+
+    CHECK(test_parse("/srv/data", &options, &directory, error));
+    CHECK(strcmp(directory, "/srv/data") == 0 && options.include_pattern == NULL && options.exclude_pids[0] == 0);
+
+    CHECK(test_parse("'/srv/my data' -e '\\.swp$' -X 'updatedb mlocate' -I \"10 20\"", &options, &directory, error));
+    CHECK(strcmp(directory, "/srv/my data") == 0);
+    CHECK(strcmp(options.exclude_pattern, "\\.swp$") == 0);
+    CHECK(strcmp(options.exclude_process[0], "updatedb") == 0 && strcmp(options.exclude_process[1], "mlocate") == 0);
+    CHECK(options.exclude_process[2] == NULL);
+    CHECK(options.include_pids[0] == 10 && options.include_pids[1] == 20 && options.include_pids[2] == 0);
+
+    // Options may come before the directory
+    CHECK(test_parse("-N nginx /var/www", &options, &directory, error));
+    CHECK(strcmp(directory, "/var/www") == 0 && strcmp(options.include_process[0], "nginx") == 0);
+
+    CHECK(!test_parse("", &options, &directory, error));
+    CHECK(strcmp(error, "Expected \"DIRECTORY [FILTER OPTIONS]\".") == 0);
+    CHECK(!test_parse("/srv/a /srv/b", &options, &directory, error));
+    CHECK(strcmp(error, "Expected \"DIRECTORY [FILTER OPTIONS]\".") == 0);
+    CHECK(!test_parse("/srv/a -i 'x", &options, &directory, error));
+    CHECK(!test_parse("/srv/a -z x", &options, &directory, error));
+    CHECK(strcmp(error, "-z option: Unknown filter option.") == 0);
+    CHECK(!test_parse("/srv/a -i", &options, &directory, error));
+    CHECK(strcmp(error, "-i option: Missing argument.") == 0);
+    CHECK(!test_parse("/srv/a -I 10 -E 20", &options, &directory, error));
+    CHECK(strcmp(error, "-E option: Cannot be used with -I option at the same time.") == 0);
+    CHECK(!test_parse("/srv/a -i a -e b", &options, &directory, error));
+    CHECK(strcmp(error, "-e option: Cannot be used with -i option at the same time.") == 0);
+    CHECK(!test_parse("/srv/a -N a -N b", &options, &directory, error));
+    CHECK(strcmp(error, "-N option: Cannot be used more than once.") == 0);
+    CHECK(!test_parse("/srv/a -E 1x", &options, &directory, error));
+    CHECK(strcmp(error, "-E option: '1x' is not an integer.") == 0);
+}
+
+static void test_trie() {
+    static path_trie_t trie;
+
+    path_trie_init(&trie);
+    CHECK(path_trie_match(&trie, "/srv/a") == 0);
+    REQUIRE(path_trie_insert(&trie, "/srv/a", 0));
+    REQUIRE(path_trie_insert(&trie, "/srv/a/b/", 1));
+    REQUIRE(path_trie_insert(&trie, "//srv//c", 2));
+    REQUIRE(path_trie_insert(&trie, "/srv/a", 3));
+    REQUIRE(path_trie_insert(&trie, "/srv/ab", PATH_TRIE_ROOTS_MAX - 1));
+
+    CHECK(path_trie_match(&trie, "/srv/a") == (1ULL << 0 | 1ULL << 3));
+    CHECK(path_trie_match(&trie, "/srv/a/file") == (1ULL << 0 | 1ULL << 3));
+    CHECK(path_trie_match(&trie, "/srv/a/b/c/file") == (1ULL << 0 | 1ULL << 1 | 1ULL << 3));
+    CHECK(path_trie_match(&trie, "/srv/c/file") == 1ULL << 2);
+    // Components match whole, not as string prefixes
+    CHECK(path_trie_match(&trie, "/srv/ab/file") == 1ULL << (PATH_TRIE_ROOTS_MAX - 1));
+    CHECK(path_trie_match(&trie, "/srv/abc") == 0);
+    CHECK(path_trie_match(&trie, "/srv") == 0);
+    CHECK(path_trie_match(&trie, "/other") == 0);
+
+    // "/" is in every path
+    REQUIRE(path_trie_insert(&trie, "/", 4));
+    CHECK(path_trie_match(&trie, "/other") == 1ULL << 4);
+    CHECK(path_trie_match(&trie, "/srv/c") == (1ULL << 2 | 1ULL << 4));
+
+    path_trie_free(&trie);
+    CHECK(trie.count == 1 && path_trie_match(&trie, "/srv/a") == 0);
+
+    // A full trie refuses new nodes, but not roots on the nodes it has
+    char path[64];
+    int inserted = 1;
+    for (int i = 0; inserted && i < PATH_TRIE_NODES_MAX; i++) {
+        snprintf(path, sizeof(path), "/d%d", i);
+        inserted = path_trie_insert(&trie, path, 0);
+    }
+    CHECK(!inserted && trie.count == PATH_TRIE_NODES_MAX);
+    CHECK(path_trie_insert(&trie, "/d0", 1));
+    CHECK(path_trie_match(&trie, "/d0/x") == (1ULL << 0 | 1ULL << 1));
+    path_trie_free(&trie);
+}
+
+int main() {
+    test_split();
+    test_watch_root();
+    test_trie();
+    return test_done("watchspec");
+}
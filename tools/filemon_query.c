@@ -0,0 +1,500 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <limits.h>
+
+#include <filemon_index.h>
+
+/*
+ * Finds records in the logs of filemon (filemon --format jsonl|csv -o OUTPUT --index).
+ *   make filemon-query
+ *   build/filemon-query [-p PATH] [-P PID] [-c PROCESS] [-f FROM] [-t TO] [-n MAX] [-v] LOG...
+ * Prints the records of LOG that match all the given conditions, as they are in the log. PATH
+ * matches the path or the old path of a rename. FROM and TO are local time, as YYYY-MM-DD,
+ * YYYY-MM-DDTHH:MM[:SS], now, or relative to now like -90s, -30m, -6h, -7d; the range includes
+ * FROM and excludes TO. With LOG.fmi, the blocks outside the time range are skipped and only the
+ * records of the key are read; the records after the last block, those between two blocks when
+ * filemon could not write a block, and a log without an index, are scanned.
+ */
+
+#define QUERY_READ_SIZE (64 * 1024)    // Read ahead of an indexed record, neighbours often match too
+#define QUERY_SCAN_SIZE (1024 * 1024)
+#define QUERY_FIELD_MAX 8192
+
+typedef struct {
+    const char* path;
+    uint64_t path_hash;
+    int pid;                       // -1 for any
+    const char* process;
+    uint64_t process_hash;
+    int64_t from_ns;
+    int64_t to_ns;
+    long max;                      // 0 for no limit
+} query_t;
+
+// The fields of a record that a query checks
+typedef struct {
+    int64_t time_ns;
+    int pid;
+    char comm[QUERY_FIELD_MAX];
+    char path[QUERY_FIELD_MAX];
+    char old_path[QUERY_FIELD_MAX];
+} record_t;
+
+typedef struct {
+    int fd;
+    char* data;
+    uint64_t offset;               // Of data in the log
+    size_t len;
+} window_t;
+
+typedef struct {
+    unsigned long logs, blocks, skipped, indexed, unindexed, matches;
+    uint64_t bytes_read, bytes_scanned;
+} query_stats_t;
+
+static query_stats_t stats;
+static record_t record;
+
+/**
+ * @brief Parses a time of the command line.
+ *
+ * @return int64_t Nanoseconds since the epoch, or -1 if it is not a time.
+ */
+static int64_t parse_time(const char* text, time_t now) {
+    struct tm tm;
+    char unit;
+    long value;
+    int consumed;
+
+    if (strcmp(text, "now") == 0) {
+        return (int64_t)now * 1000000000LL;
+    }
+    if (sscanf(text, "-%ld%c%n", &value, &unit, &consumed) == 2 && text[consumed] == '\0' && value >= 0) {
+        switch (unit) {
+            case 's': return (int64_t)(now - value) * 1000000000LL;
+            case 'm': return (int64_t)(now - value * 60) * 1000000000LL;
+            case 'h': return (int64_t)(now - value * 3600) * 1000000000LL;
+            case 'd': return (int64_t)(now - value * 86400) * 1000000000LL;
+            default: return -1;
+        }
+    }
+    memset(&tm, 0, sizeof(tm));
+    const char* end = strptime(text, "%Y-%m-%d", &tm);
+    if (end != NULL && *end == 'T') {
+        const char* minutes = strptime(end + 1, "%H:%M", &tm);
+        end = minutes && *minutes == ':' ? strptime(minutes + 1, "%S", &tm) : minutes;
+    }
+    if (end == NULL || *end != '\0') {
+        return -1;
+    }
+    tm.tm_isdst = -1;
+    return (int64_t)mktime(&tm) * 1000000000LL;
+}
+
+// RFC 3339 with milliseconds and offset, as filemon writes it
+static int64_t parse_record_time(const char* p, const char* end) {
+    char text[40];
+    struct tm tm;
+    int ms, offset_hours, offset_minutes;
+    char sign;
+
+    // The log is not NUL terminated, and sscanf() would look for the end of the whole buffer
+    size_t len = end - p < (long)sizeof(text) - 1 ? (size_t)(end - p) : sizeof(text) - 1;
+    memcpy(text, p, len);
+    text[len] = '\0';
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(text, "%4d-%2d-%2dT%2d:%2d:%2d.%3d%c%2d:%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min,
+               &tm.tm_sec, &ms, &sign, &offset_hours, &offset_minutes) != 10) {
+        return -1;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    int64_t seconds = timegm(&tm) - (sign == '-' ? -1 : 1) * (offset_hours * 3600 + offset_minutes * 60);
+    return seconds * 1000000000LL + ms * 1000000LL;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Copies the JSON string starting at the quote p, returns the end of the string or NULL
+static const char* json_string(const char* p, const char* end, char* out) {
+    size_t len = 0;
+
+    if (p >= end || *p++ != '"') {
+        return NULL;
+    }
+    while (p < end && *p != '"') {
+        char c = *p++;
+        if (c == '\\' && p < end) {
+            c = *p++;
+            switch (c) {
+                case 'n': c = '\n'; break;
+                case 'r': c = '\r'; break;
+                case 't': c = '\t'; break;
+                case 'b': c = '\b'; break;
+                case 'f': c = '\f'; break;
+                case 'u': {
+                    // filemon only escapes single bytes, \u00XX
+                    if (end - p < 4 || hex_value(p[0]) < 0 || hex_value(p[1]) < 0 || hex_value(p[2]) < 0 || hex_value(p[3]) < 0) {
+                        return NULL;
+                    }
+                    int value = hex_value(p[0]) << 12 | hex_value(p[1]) << 8 | hex_value(p[2]) << 4 | hex_value(p[3]);
+                    c = value <= 0xff ? (char)value : '?';
+                    p += 4;
+                    break;
+                }
+                default: break;
+            }
+        }
+        if (len < QUERY_FIELD_MAX - 1) {
+            out[len++] = c;
+        }
+    }
+    out[len] = '\0';
+    return p < end ? p + 1 : NULL;
+}
+
+// Finds a key of the JSON object, a quote never appears unescaped inside a string
+static const char* json_field(const char* p, const char* end, const char* key) {
+    const char* found = memmem(p, end - p, key, strlen(key));
+    return found ? found + strlen(key) : NULL;
+}
+
+static int parse_jsonl(const char* line, const char* end, record_t* out) {
+    const char* p;
+
+    if ((p = json_field(line, end, "{\"time\":\"")) == NULL || (out->time_ns = parse_record_time(p, end)) == -1) {
+        return 0;
+    }
+    if ((p = json_field(p, end, ",\"pid\":")) == NULL) {
+        return 0;
+    }
+    out->pid = atoi(p);
+    if ((p = json_field(p, end, ",\"comm\":")) == NULL || (p = json_string(p, end, out->comm)) == NULL) {
+        return 0;
+    }
+    if ((p = json_field(p, end, ",\"path\":")) == NULL || (p = json_string(p, end, out->path)) == NULL) {
+        return 0;
+    }
+    out->old_path[0] = '\0';
+    if (end - p > 12 && memcmp(p, ",\"old_path\":", 12) == 0 && json_string(p + 12, end, out->old_path) == NULL) {
+        return 0;
+    }
+    return 1;
+}
+
+// Copies the CSV field at p, returns the start of the next field or NULL
+static const char* csv_field(const char* p, const char* end, char* out) {
+    size_t len = 0;
+
+    if (p < end && *p == '"') {
+        p++;
+        while (p < end && !(*p == '"' && (p + 1 == end || p[1] != '"'))) {
+            if (*p == '"') {
+                p++;
+            }
+            if (len < QUERY_FIELD_MAX - 1) {
+                out[len++] = *p;
+            }
+            p++;
+        }
+        if (p == end) {
+            return NULL;
+        }
+        p++;
+    } else {
+        while (p < end && *p != ',' && *p != '\n') {
+            if (len < QUERY_FIELD_MAX - 1) {
+                out[len++] = *p;
+            }
+            p++;
+        }
+    }
+    out[len] = '\0';
+    return p < end && *p == ',' ? p + 1 : (p < end ? p : NULL);
+}
+
+// time,group,pid,comm,flags,path,old_path[,...]
+static int parse_csv(const char* line, const char* end, record_t* out) {
+    char field[64];
+    const char* p = line;
+
+    if ((out->time_ns = parse_record_time(p, end)) == -1) {
+        return 0;
+    }
+    if ((p = memchr(p, ',', end - p)) == NULL || (p = memchr(p + 1, ',', end - p - 1)) == NULL) {
+        return 0;
+    }
+    out->pid = atoi(p + 1);
+    if ((p = memchr(p + 1, ',', end - p - 1)) == NULL) {
+        return 0;
+    }
+    if ((p = csv_field(p + 1, end, out->comm)) == NULL || (p = csv_field(p, end, field)) == NULL ||
+        (p = csv_field(p, end, out->path)) == NULL) {
+        return 0;
+    }
+    out->old_path[0] = '\0';
+    if (*p != '\n' && csv_field(p, end, out->old_path) == NULL) {
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Checks a record against the query and prints it when it matches.
+ *
+ * @return int 0 once the query has all the matches it wants.
+ */
+static int query_line(const query_t* query, int format, const char* line, size_t length, int check_time) {
+    const char* end = line + length;
+    int parsed = format == FILEMON_INDEX_CSV ? parse_csv(line, end, &record) : parse_jsonl(line, end, &record);
+
+    if (!parsed) {
+        return 1;
+    }
+    if (check_time && (record.time_ns < query->from_ns || record.time_ns >= query->to_ns)) {
+        return 1;
+    }
+    if ((query->pid != -1 && record.pid != query->pid) ||
+        (query->process && strcmp(record.comm, query->process) != 0) ||
+        (query->path && strcmp(record.path, query->path) != 0 && strcmp(record.old_path, query->path) != 0)) {
+        return 1;
+    }
+    fwrite(line, 1, length, stdout);
+    stats.matches++;
+    return query->max == 0 || stats.matches < (unsigned long)query->max;
+}
+
+// A record of the log, through a window of QUERY_READ_SIZE bytes that is moved forward on a miss
+static const char* window_get(window_t* window, uint64_t offset, size_t length) {
+    if (offset < window->offset || offset + length > window->offset + window->len) {
+        size_t size = length > QUERY_READ_SIZE ? length : QUERY_READ_SIZE;
+        char* data = realloc(window->data, size);
+        if (data == NULL) {
+            return NULL;
+        }
+        window->data = data;
+        ssize_t ret = pread(window->fd, window->data, size, offset);
+        window->offset = offset;
+        window->len = ret > 0 ? ret : 0;
+        stats.bytes_read += window->len;
+        if (window->len < length) {
+            return NULL;
+        }
+    }
+    return window->data + (offset - window->offset);
+}
+
+/**
+ * @brief Reads the log line by line from an offset up to another one, or to its end.
+ *
+ * @return int 0 once the query has all the matches it wants.
+ */
+static int scan_log(const query_t* query, int fd, int format, uint64_t offset, uint64_t end) {
+    char* buffer = malloc(QUERY_SCAN_SIZE);
+    size_t len = 0;
+    int more = 1;
+
+    if (buffer == NULL) {
+        return 1;
+    }
+    while (more && offset + len < end) {
+        size_t size = end - offset - len < QUERY_SCAN_SIZE - len ? end - offset - len : QUERY_SCAN_SIZE - len;
+        ssize_t ret = pread(fd, buffer + len, size, offset + len);
+        if (ret <= 0) {
+            break;
+        }
+        len += ret;
+        stats.bytes_scanned += ret;
+        char* line = buffer;
+        char* newline;
+        while (more && (newline = memchr(line, '\n', buffer + len - line)) != NULL) {
+            // The CSV header, when the log has no index to skip it
+            if (!(offset == 0 && line == buffer && strncmp(line, "time,", 5) == 0)) {
+                stats.unindexed++;
+                more = query_line(query, format, line, newline + 1 - line, 1);
+            }
+            line = newline + 1;
+        }
+        if (line == buffer) {
+            // A line longer than the buffer, filemon does not write those
+            break;
+        }
+        offset += line - buffer;
+        len = buffer + len - line;
+        memmove(buffer, line, len);
+    }
+    free(buffer);
+    return more;
+}
+
+/**
+ * @brief Runs the query on one log.
+ *
+ * @return int 0 once the query has all the matches it wants.
+ */
+static int query_log(const query_t* query, const char* log, int verbose) {
+    char index_path[PATH_MAX + 8];
+    filemon_index_t index;
+    const filemon_index_block_t* block;
+    window_t window = { .fd = -1 };
+    uint64_t scan_from = 0;
+    int format = 0;
+    int more = 1;
+    char first;
+
+    window.fd = open(log, O_RDONLY | O_CLOEXEC);
+    if (window.fd == -1) {
+        perror(log);
+        return 1;
+    }
+    stats.logs++;
+    snprintf(index_path, sizeof(index_path), "%s" FILEMON_INDEX_SUFFIX, log);
+    if (filemon_index_open(&index, index_path) == 0) {
+        format = index.file->format;
+        scan_from = index.file->data_offset;
+        while (more && (block = filemon_index_next(&index)) != NULL) {
+            const filemon_index_record_t* records = filemon_index_records(block);
+            const uint32_t* postings = NULL;
+            uint32_t count = block->records;
+
+            // The records of a block filemon could not write to the index, scanned in log order
+            if (block->first_offset > scan_from) {
+                if (verbose) {
+                    fprintf(stderr, "%s: %lu bytes of the log are not indexed, scanning them\n", index_path,
+                            (unsigned long)(block->first_offset - scan_from));
+                }
+                more = scan_log(query, window.fd, format, scan_from, block->first_offset);
+                if (!more) {
+                    break;
+                }
+            }
+            scan_from = block->end_offset;
+            if ((int64_t)block->last_ns < query->from_ns || (int64_t)block->first_ns >= query->to_ns) {
+                stats.skipped++;
+                continue;
+            }
+            stats.blocks++;
+            // The key with the fewest records, the other conditions are checked on the records
+            int keyed = 0;
+            for (int kind = 0; kind < FILEMON_INDEX_KINDS; kind++) {
+                uint32_t key_count;
+                uint64_t key = kind == FILEMON_INDEX_PATHS ? query->path_hash :
+                               kind == FILEMON_INDEX_PIDS ? (uint32_t)query->pid : query->process_hash;
+                if ((kind == FILEMON_INDEX_PATHS && !query->path) || (kind == FILEMON_INDEX_PIDS && query->pid == -1) ||
+                    (kind == FILEMON_INDEX_PROCESSES && !query->process)) {
+                    continue;
+                }
+                const uint32_t* key_postings = filemon_index_find(block, kind, key, &key_count);
+                if (!keyed || key_count < count) {
+                    postings = key_postings;
+                    count = key_count;
+                }
+                keyed = 1;
+            }
+            for (uint32_t i = 0; more && i < count; i++) {
+                uint32_t number = keyed ? postings[i] : i;
+                if (number >= block->records) {
+                    break;
+                }
+                const filemon_index_record_t* entry = &records[number];
+                int64_t time_ns = block->first_ns + entry->time_ms * 1000000LL;
+                // Times are kept to the millisecond, the record decides at the edges of the range
+                if (time_ns + 1000000LL <= query->from_ns || time_ns >= query->to_ns) {
+                    continue;
+                }
+                const char* line = window_get(&window, entry->offset, entry->length);
+                if (line == NULL) {
+                    continue;
+                }
+                stats.indexed++;
+                more = query_line(query, format, line, entry->length, 1);
+            }
+        }
+        if (verbose && more && index.offset < index.size) {
+            fprintf(stderr, "%s: index ends in a damaged block, scanning the log from there\n", index_path);
+        }
+        filemon_index_close(&index);
+    } else {
+        if (errno != ENOENT) {
+            fprintf(stderr, "%s: %s\n", index_path, errno == EPROTO ? "not an index of this version" : strerror(errno));
+        } else if (verbose) {
+            fprintf(stderr, "%s: no index, scanning the whole log\n", log);
+        }
+        format = pread(window.fd, &first, 1, 0) == 1 && first == '{' ? FILEMON_INDEX_JSONL : FILEMON_INDEX_CSV;
+    }
+    if (more) {
+        more = scan_log(query, window.fd, format, scan_from, UINT64_MAX);
+    }
+    free(window.data);
+    close(window.fd);
+    return more;
+}
+
+int main(int argc, char* argv[]) {
+    query_t query = { .pid = -1, .from_ns = 0, .to_ns = INT64_MAX };
+    time_t now = time(NULL);
+    int verbose = 0;
+    struct timespec start, end;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:P:c:f:t:n:v")) != -1) {
+        switch (opt) {
+            case 'p':
+                query.path = optarg;
+                query.path_hash = filemon_index_hash(optarg);
+                break;
+            case 'P':
+                query.pid = atoi(optarg);
+                break;
+            case 'c':
+                query.process = optarg;
+                query.process_hash = filemon_index_hash(optarg);
+                break;
+            case 'f':
+            case 't': {
+                int64_t time_ns = parse_time(optarg, now);
+                if (time_ns < 0) {
+                    fprintf(stderr, "-%c: '%s' is not YYYY-MM-DD, YYYY-MM-DDTHH:MM[:SS], now or -N[s|m|h|d]\n", opt, optarg);
+                    return EXIT_FAILURE;
+                }
+                *(opt == 'f' ? &query.from_ns : &query.to_ns) = time_ns;
+                break;
+            }
+            case 'n':
+                query.max = atol(optarg);
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                optind = argc + 1;
+                break;
+        }
+    }
+    if (optind >= argc || query.max < 0) {
+        fprintf(stderr, "Usage: %s [-p PATH] [-P PID] [-c PROCESS] [-f FROM] [-t TO] [-n MAX] [-v] LOG...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = optind; i < argc && query_log(&query, argv[i], verbose); i++);
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (verbose) {
+        fprintf(stderr, "%lu matches in %.1fms: %lu logs, %lu blocks read, %lu skipped by time, %lu indexed records read (%lu bytes), "
+                "%lu records scanned (%lu bytes)\n",
+                stats.matches, (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6, stats.logs, stats.blocks,
+                stats.skipped, stats.indexed, (unsigned long)stats.bytes_read, stats.unindexed, (unsigned long)stats.bytes_scanned);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,347 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <limits.h>
+
+#include <filemon_rollup.h>
+
+/*
+ * Sums the per-minute rollups of filemon (filemon --rollup DIR) over a time range.
+ *   make filemon-rollup
+ *   build/filemon-rollup [-f FROM] [-t TO] [-g GROUPS] [-d DIRECTORY] [-p PROCESS] [-T TYPE] [-n ROWS] [-v] DIR
+ * FROM and TO are UTC, as YYYY-MM-DD, YYYY-MM-DDTHH:MM, now, or relative to now like -30m, -6h, -7d.
+ * The range includes FROM and excludes TO, by default it is the last 24 hours. GROUPS is a comma
+ * separated list of directory, process, type, minute, hour and day. Only the day files of the
+ * range are opened, and only the blocks of minutes in the range are read.
+ */
+
+#define ROLLUP_ROWS_DEFAULT 20
+
+typedef enum {
+    GROUP_DIRECTORY,
+    GROUP_PROCESS,
+    GROUP_TYPE,
+    GROUP_MINUTE,
+    GROUP_HOUR,
+    GROUP_DAY,
+    GROUPS_MAX
+} group_t;
+
+static const char* const group_names[GROUPS_MAX] = {
+    [GROUP_DIRECTORY] = "directory",
+    [GROUP_PROCESS] = "process",
+    [GROUP_TYPE] = "type",
+    [GROUP_MINUTE] = "minute",
+    [GROUP_HOUR] = "hour",
+    [GROUP_DAY] = "day",
+};
+
+typedef struct {
+    char* key;                     // Group values separated by '\t'
+    uint64_t count;
+} row_t;
+
+typedef struct {
+    row_t* rows;
+    size_t count;
+    size_t capacity;               // A power of two
+} rows_t;
+
+static uint64_t hash_key(const char* key) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    while (*key) {
+        hash ^= (unsigned char)*key++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static int rows_add(rows_t* rows, const char* key, uint64_t count) {
+    if (rows->count * 2 >= rows->capacity) {
+        rows_t grown = { .capacity = rows->capacity ? rows->capacity * 2 : 1024 };
+        grown.rows = calloc(grown.capacity, sizeof(row_t));
+        if (grown.rows == NULL) {
+            return 0;
+        }
+        for (size_t i = 0; i < rows->capacity; i++) {
+            if (rows->rows[i].key != NULL) {
+                size_t slot = hash_key(rows->rows[i].key) & (grown.capacity - 1);
+                while (grown.rows[slot].key != NULL) {
+                    slot = (slot + 1) & (grown.capacity - 1);
+                }
+                grown.rows[slot] = rows->rows[i];
+            }
+        }
+        grown.count = rows->count;
+        free(rows->rows);
+        *rows = grown;
+    }
+    size_t slot = hash_key(key) & (rows->capacity - 1);
+    while (rows->rows[slot].key != NULL) {
+        if (strcmp(rows->rows[slot].key, key) == 0) {
+            rows->rows[slot].count += count;
+            return 1;
+        }
+        slot = (slot + 1) & (rows->capacity - 1);
+    }
+    rows->rows[slot].key = strdup(key);
+    rows->rows[slot].count = count;
+    rows->count++;
+    return rows->rows[slot].key != NULL;
+}
+
+static int by_count(const void* a, const void* b) {
+    const row_t* x = (const row_t*)a;
+    const row_t* y = (const row_t*)b;
+    if (x->count != y->count) {
+        return x->count < y->count ? 1 : -1;
+    }
+    return strcmp(x->key, y->key);
+}
+
+static int by_key(const void* a, const void* b) {
+    return strcmp(((const row_t*)a)->key, ((const row_t*)b)->key);
+}
+
+/**
+ * @brief Parses a time of the command line.
+ *
+ * @return int64_t Minutes since the epoch, or -1 if it is not a time.
+ */
+static int64_t parse_minute(const char* text, int64_t now) {
+    struct tm tm;
+    char unit;
+    long value;
+    int consumed;
+
+    if (strcmp(text, "now") == 0) {
+        return now;
+    }
+    if (sscanf(text, "-%ld%c%n", &value, &unit, &consumed) == 2 && text[consumed] == '\0' && value >= 0) {
+        switch (unit) {
+            case 'm': return now - value;
+            case 'h': return now - value * 60;
+            case 'd': return now - value * 1440;
+            default: return -1;
+        }
+    }
+    memset(&tm, 0, sizeof(tm));
+    const char* end = strptime(text, "%Y-%m-%d", &tm);
+    if (end != NULL && *end == 'T') {
+        end = strptime(end + 1, "%H:%M", &tm);
+    }
+    if (end == NULL || *end != '\0') {
+        return -1;
+    }
+    return timegm(&tm) / 60;
+}
+
+static void format_minute(int64_t minute, const char* format, char* out, size_t size) {
+    time_t seconds = minute * 60;
+    struct tm tm;
+    gmtime_r(&seconds, &tm);
+    strftime(out, size, format, &tm);
+}
+
+int main(int argc, char* argv[]) {
+    int64_t now = time(NULL) / 60;
+    int64_t from = now - 1440;
+    int64_t to = now + 1;
+    group_t groups[GROUPS_MAX];
+    int group_count = 0;
+    int time_grouped = 0;
+    const char* directory_prefix = NULL;
+    const char* process = NULL;
+    int type = -1;
+    int rows_max = ROLLUP_ROWS_DEFAULT;
+    int verbose = 0;
+    rows_t rows = { 0 };
+    uint64_t total = 0;
+    unsigned long files = 0, blocks = 0, skipped = 0;
+    char group_list[256] = "directory";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:t:g:d:p:T:n:v")) != -1) {
+        switch (opt) {
+            case 'f':
+            case 't': {
+                int64_t minute = parse_minute(optarg, now);
+                if (minute < 0) {
+                    fprintf(stderr, "-%c: '%s' is not YYYY-MM-DD, YYYY-MM-DDTHH:MM, now or -N[m|h|d]\n", opt, optarg);
+                    return EXIT_FAILURE;
+                }
+                *(opt == 'f' ? &from : &to) = minute;
+                break;
+            }
+            case 'g':
+                snprintf(group_list, sizeof(group_list), "%s", optarg);
+                break;
+            case 'd':
+                directory_prefix = optarg;
+                break;
+            case 'p':
+                process = optarg;
+                break;
+            case 'T':
+                for (int i = 0; i < 64; i++) {
+                    const char* name = filemon_rollup_type_name(i);
+                    if (name && (strcasecmp(optarg, name) == 0 || strcasecmp(optarg, name + strlen("FAN_")) == 0)) {
+                        type = i;
+                    }
+                }
+                if (type == -1) {
+                    fprintf(stderr, "-T: '%s' is not an event type like FAN_OPEN\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'n':
+                rows_max = atoi(optarg);
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                optind = argc + 1;
+                break;
+        }
+    }
+    if (optind != argc - 1 || rows_max < 0) {
+        fprintf(stderr, "Usage: %s [-f FROM] [-t TO] [-g GROUPS] [-d DIRECTORY] [-p PROCESS] [-T TYPE] [-n ROWS] [-v] DIR\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    for (char* name = strtok(group_list, ","); name != NULL; name = strtok(NULL, ",")) {
+        int found = -1;
+        for (int i = 0; i < GROUPS_MAX; i++) {
+            if (strcmp(name, group_names[i]) == 0) {
+                found = i;
+            }
+        }
+        if (found == -1 || group_count == GROUPS_MAX) {
+            fprintf(stderr, "-g: '%s' is not one of directory, process, type, minute, hour, day\n", name);
+            return EXIT_FAILURE;
+        }
+        groups[group_count++] = found;
+        time_grouped |= found >= GROUP_MINUTE;
+    }
+
+    // One file per day of the range, a missing day had no events or no filemon
+    for (int64_t day = from / 1440; day <= (to - 1) / 1440; day++) {
+        filemon_rollup_segment_t segment;
+        const filemon_rollup_block_t* block;
+        char path[PATH_MAX];
+        char date[16];
+
+        format_minute(day * 1440, "%Y-%m-%d", date, sizeof(date));
+        snprintf(path, sizeof(path), "%s/%s" FILEMON_ROLLUP_SUFFIX, argv[optind], date);
+        if (filemon_rollup_open(&segment, path) == -1) {
+            if (errno != ENOENT) {
+                perror(path);
+            }
+            continue;
+        }
+        files++;
+        while ((block = filemon_rollup_next(&segment)) != NULL) {
+            int64_t minute = day * 1440 + block->minute;
+            if (minute < from || minute >= to) {
+                skipped++;
+                continue;
+            }
+            blocks++;
+            const filemon_rollup_record_t* records = filemon_rollup_records(block);
+            for (uint32_t i = 0; i < block->count; i++) {
+                const filemon_rollup_record_t* record = &records[i];
+                const char* directory = filemon_rollup_string(&segment, record->directory);
+                const char* comm = filemon_rollup_string(&segment, record->process);
+                char key[PATH_MAX + 256];
+                size_t len = 0;
+
+                if (type != -1 && record->type != type) {
+                    continue;
+                }
+                if (process && strcmp(comm, process) != 0) {
+                    continue;
+                }
+                if (directory_prefix && strncmp(directory, directory_prefix, strlen(directory_prefix)) != 0) {
+                    continue;
+                }
+                total += record->count;
+                key[0] = '\0';
+                for (int g = 0; g < group_count; g++) {
+                    char value[64];
+                    const char* text = value;
+                    switch (groups[g]) {
+                        case GROUP_DIRECTORY:
+                            text = directory;
+                            break;
+                        case GROUP_PROCESS:
+                            text = comm;
+                            break;
+                        case GROUP_TYPE:
+                            text = filemon_rollup_type_name(record->type);
+                            if (text == NULL) {
+                                snprintf(value, sizeof(value), "bit %d", record->type);
+                                text = value;
+                            }
+                            break;
+                        case GROUP_MINUTE:
+                            format_minute(minute, "%Y-%m-%d %H:%M", value, sizeof(value));
+                            break;
+                        case GROUP_HOUR:
+                            format_minute(minute, "%Y-%m-%d %H:00", value, sizeof(value));
+                            break;
+                        default:
+                            format_minute(minute, "%Y-%m-%d", value, sizeof(value));
+                            break;
+                    }
+                    len += snprintf(key + len, len < sizeof(key) ? sizeof(key) - len : 0, "%s%s", g ? "\t" : "", text);
+                }
+                if (!rows_add(&rows, key, record->count)) {
+                    fprintf(stderr, "Out of memory\n");
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+        filemon_rollup_close(&segment);
+    }
+
+    // Compact the table to the rows in use and sort them
+    size_t count = 0;
+    for (size_t i = 0; i < rows.capacity; i++) {
+        if (rows.rows[i].key != NULL) {
+            rows.rows[count++] = rows.rows[i];
+        }
+    }
+    qsort(rows.rows, count, sizeof(row_t), time_grouped ? by_key : by_count);
+    printf("%14s", "EVENTS");
+    for (int g = 0; g < group_count; g++) {
+        printf("  %s", group_names[groups[g]]);
+    }
+    printf("\n");
+    for (size_t i = 0; i < count && (rows_max == 0 || i < (size_t)rows_max); i++) {
+        printf("%14lu  ", (unsigned long)rows.rows[i].count);
+        for (const char* p = rows.rows[i].key; *p; p++) {
+            if (*p == '\t') {
+                fputs("  ", stdout);
+            } else {
+                putchar(*p);
+            }
+        }
+        printf("\n");
+    }
+    if (rows_max != 0 && count > (size_t)rows_max) {
+        printf("%14s  (%lu more rows, -n 0 shows all)\n", "...", (unsigned long)(count - rows_max));
+    }
+    printf("%14lu  total\n", (unsigned long)total);
+    if (verbose) {
+        char first[32], last[32];
+        format_minute(from, "%Y-%m-%d %H:%M", first, sizeof(first));
+        format_minute(to, "%Y-%m-%d %H:%M", last, sizeof(last));
+        fprintf(stderr, "%s to %s UTC: %lu day files, %lu minutes read, %lu minutes skipped\n", first, last, files, blocks, skipped);
+    }
+    return EXIT_SUCCESS;
+}
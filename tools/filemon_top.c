@@ -0,0 +1,249 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include <filemon_stats.h>
+
+/*
+ * top for files, reads the statistics table of filemon (filemon --stats NAME).
+ *   make filemon-top
+ *   build/filemon-top [-n ROWS] [-d SECONDS] [-s rate|total] [-c COUNT] NAME
+ * Shows the busiest paths and processes, by events per second since the previous refresh or by
+ * events since filemon started. The table is only read, filemon is never signalled or slowed.
+ */
+
+#define TOP_ROWS_DEFAULT 15
+
+typedef struct {
+    const filemon_stats_entry_t* entry;
+    double rate;
+} top_row_t;
+
+typedef struct {
+    filemon_stats_entry_t* entries;
+    uint64_t* previous_hash;       // Of each entry at the previous refresh, to compute rates
+    uint64_t* previous_events;
+    top_row_t* rows;
+    uint32_t capacity;
+} top_table_t;
+
+static volatile sig_atomic_t running = 1;
+static int sort_by_total = 0;
+
+static void stop(int signum) {
+    (void)signum;
+    running = 0;
+}
+
+static int compare_rows(const void* a, const void* b) {
+    const top_row_t* x = (const top_row_t*)a;
+    const top_row_t* y = (const top_row_t*)b;
+    if (!sort_by_total && x->rate != y->rate) {
+        return x->rate < y->rate ? 1 : -1;
+    }
+    if (x->entry->events != y->entry->events) {
+        return x->entry->events < y->entry->events ? 1 : -1;
+    }
+    return x->entry->last_ns < y->entry->last_ns ? 1 : -1;
+}
+
+// The three biggest counters, e.g. "open 12 access 40 close_nowrite 12"
+static void format_counters(const filemon_stats_entry_t* entry, char* out, size_t size) {
+    int used[FILEMON_STATS_COUNTERS] = { 0 };
+    size_t len = 0;
+
+    out[0] = '\0';
+    for (int shown = 0; shown < 3; shown++) {
+        int best = -1;
+        for (int i = 0; i < FILEMON_STATS_COUNTERS; i++) {
+            if (!used[i] && entry->counters[i] && (best == -1 || entry->counters[i] > entry->counters[best])) {
+                best = i;
+            }
+        }
+        if (best == -1) {
+            break;
+        }
+        used[best] = 1;
+        len += snprintf(out + len, size - len, "%s%s %lu", len ? " " : "", filemon_stat_names[best], (unsigned long)entry->counters[best]);
+        if (len >= size) {
+            break;
+        }
+    }
+}
+
+static void format_age(uint64_t then_ns, uint64_t now_ns, char* out, size_t size) {
+    double seconds = now_ns > then_ns ? (now_ns - then_ns) / 1e9 : 0;
+    if (seconds < 60) {
+        snprintf(out, size, "%.1fs", seconds);
+    } else if (seconds < 3600) {
+        snprintf(out, size, "%.0fm", seconds / 60);
+    } else {
+        snprintf(out, size, "%.0fh", seconds / 3600);
+    }
+}
+
+static top_table_t* top_table_new(uint32_t capacity) {
+    top_table_t* table = calloc(1, sizeof(top_table_t));
+    if (table == NULL) {
+        return NULL;
+    }
+    table->capacity = capacity;
+    table->entries = malloc(sizeof(filemon_stats_entry_t) * capacity);
+    table->previous_hash = calloc(capacity, sizeof(uint64_t));
+    table->previous_events = calloc(capacity, sizeof(uint64_t));
+    table->rows = malloc(sizeof(top_row_t) * capacity);
+    if (table->entries == NULL || table->previous_hash == NULL || table->previous_events == NULL || table->rows == NULL) {
+        return NULL;
+    }
+    return table;
+}
+
+/**
+ * @brief Copies a table and sorts the entries in use.
+ *
+ * @return int Number of rows.
+ */
+static int top_table_refresh(filemon_stats_reader_t* reader, filemon_stats_table_t which, top_table_t* table, double elapsed, int first) {
+    int count = 0;
+
+    for (uint32_t i = 0; i < table->capacity; i++) {
+        filemon_stats_entry_t* entry = &table->entries[i];
+        if (!filemon_stats_read(reader, which, i, entry)) {
+            table->previous_hash[i] = 0;
+            continue;
+        }
+        top_row_t* row = &table->rows[count++];
+        row->entry = entry;
+        if (first) {
+            row->rate = 0;
+        } else if (table->previous_hash[i] == entry->hash && entry->events >= table->previous_events[i]) {
+            row->rate = (entry->events - table->previous_events[i]) / elapsed;
+        } else {
+            // A new key since the previous refresh
+            row->rate = entry->events / elapsed;
+        }
+        table->previous_hash[i] = entry->hash;
+        table->previous_events[i] = entry->events;
+    }
+    qsort(table->rows, count, sizeof(top_row_t), compare_rows);
+    return count;
+}
+
+static void print_rows(top_table_t* table, int count, int rows, int processes, uint64_t now_ns) {
+    char counters[128];
+    char age[16];
+
+    if (processes) {
+        printf("%10s %12s %7s %8s  %-16s %s\n", "EVENTS/S", "EVENTS", "LAST", "PID", "COMM", "TOP EVENTS");
+    } else {
+        printf("%10s %12s %7s  %-44s %s\n", "EVENTS/S", "EVENTS", "LAST", "TOP EVENTS", "PATH");
+    }
+    for (int i = 0; i < count && i < rows; i++) {
+        const filemon_stats_entry_t* entry = table->rows[i].entry;
+        format_counters(entry, counters, sizeof(counters));
+        format_age(entry->last_ns, now_ns, age, sizeof(age));
+        if (processes) {
+            printf("%10.1f %12lu %7s %8d  %-16s %s\n", table->rows[i].rate, (unsigned long)entry->events, age, entry->pid, entry->name, counters);
+        } else {
+            printf("%10.1f %12lu %7s  %-44s %s%s\n", table->rows[i].rate, (unsigned long)entry->events, age, counters,
+                   entry->flags & FILEMON_STATS_TRUNCATED ? "..." : "", entry->name);
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    filemon_stats_reader_t reader;
+    filemon_stats_totals_t totals;
+    top_table_t* tables[FILEMON_STATS_TABLES];
+    uint64_t previous_events = 0;
+    struct timespec previous, now;
+    int rows = TOP_ROWS_DEFAULT;
+    double interval = 1.0;
+    int iterations = -1;
+    int tty = isatty(STDOUT_FILENO);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:d:s:c:")) != -1) {
+        switch (opt) {
+            case 'n':
+                rows = atoi(optarg);
+                break;
+            case 'd':
+                interval = atof(optarg);
+                break;
+            case 's':
+                sort_by_total = strcmp(optarg, "total") == 0;
+                if (!sort_by_total && strcmp(optarg, "rate") != 0) {
+                    optind = argc + 1;
+                }
+                break;
+            case 'c':
+                iterations = atoi(optarg);
+                break;
+            default:
+                optind = argc + 1;
+                break;
+        }
+    }
+    if (optind != argc - 1 || rows <= 0 || interval <= 0) {
+        fprintf(stderr, "Usage: %s [-n ROWS] [-d SECONDS] [-s rate|total] [-c COUNT] NAME\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (filemon_stats_open(&reader, argv[optind]) == -1) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < FILEMON_STATS_TABLES; i++) {
+        tables[i] = top_table_new(reader.header->capacity[i]);
+        if (tables[i] == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            return EXIT_FAILURE;
+        }
+    }
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    clock_gettime(CLOCK_MONOTONIC, &previous);
+    for (int first = 1; running && iterations != 0; first = 0) {
+        struct timespec realtime;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        clock_gettime(CLOCK_REALTIME, &realtime);
+        double elapsed = now.tv_sec - previous.tv_sec + (now.tv_nsec - previous.tv_nsec) / 1e9;
+        uint64_t now_ns = (uint64_t)realtime.tv_sec * 1000000000ULL + realtime.tv_nsec;
+        int counts[FILEMON_STATS_TABLES];
+
+        filemon_stats_read_totals(&reader, &totals);
+        for (int i = 0; i < FILEMON_STATS_TABLES; i++) {
+            counts[i] = top_table_refresh(&reader, i, tables[i], elapsed > 0 ? elapsed : 1, first);
+        }
+        if (tty) {
+            printf("\033[H\033[J");
+        }
+        printf("filemon-top %s - pid %u - %lu events (%.1f/s) - paths %d/%u, %lu evicted - processes %d/%u, %lu evicted\n\n",
+               argv[optind], reader.header->producer_pid, (unsigned long)totals.events,
+               first ? 0.0 : (totals.events - previous_events) / elapsed,
+               counts[FILEMON_STATS_PATHS], reader.header->capacity[FILEMON_STATS_PATHS], (unsigned long)totals.evictions[FILEMON_STATS_PATHS],
+               counts[FILEMON_STATS_PROCESSES], reader.header->capacity[FILEMON_STATS_PROCESSES], (unsigned long)totals.evictions[FILEMON_STATS_PROCESSES]);
+        print_rows(tables[FILEMON_STATS_PATHS], counts[FILEMON_STATS_PATHS], rows, 0, now_ns);
+        printf("\n");
+        print_rows(tables[FILEMON_STATS_PROCESSES], counts[FILEMON_STATS_PROCESSES], rows, 1, now_ns);
+        printf("\n");
+        fflush(stdout);
+        previous = now;
+        previous_events = totals.events;
+        if (iterations > 0) {
+            iterations--;
+        }
+        if (running && iterations != 0) {
+            struct timespec ts = { .tv_sec = (time_t)interval, .tv_nsec = (long)((interval - (time_t)interval) * 1e9) };
+            nanosleep(&ts, NULL);
+        }
+    }
+    filemon_stats_close(&reader);
+    return EXIT_SUCCESS;
+}